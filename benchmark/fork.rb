@@ -0,0 +1,94 @@
+# frozen_string_literal: true
+
+#
+# Measures the memory used by forked workers that classify files, when each
+# worker loads the database on its own, when the master process loads it
+# before forking using Magic.preload!, and when the master process maps a
+# compiled database using Magic::Database.
+#
+# The proportional set size (PSS) divides shared pages between the processes
+# sharing them, thus its sum is the memory the workers really use, whereas
+# the private memory is what is not shared with any other process.
+#
+# Linux only, as it reads /proc/PID/smaps_rollup.
+#
+# Usage:
+#
+#    ruby -Ilib benchmark/fork.rb [WORKERS]
+#
+
+require 'magic'
+
+abort 'This benchmark requires /proc/self/smaps_rollup' unless File.exist?('/proc/self/smaps_rollup')
+
+workers = Integer(ARGV.shift || 4)
+paths = Dir[File.join(__dir__, '..', 'test', 'fixtures', '*')].select {|path| File.file?(path) }
+
+def memory(pid)
+  File.foreach("/proc/#{pid}/smaps_rollup").each_with_object(Hash.new(0)) do |line, memory|
+    name, value = line.split
+    memory[name.delete(':')] = value.to_i if value =~ /\A\d+\z/
+  end
+end
+
+def master(workers, paths, &setup)
+  reader, writer = IO.pipe
+
+  pid = fork do
+    reader.close
+    $stdout.reopen(File::NULL)
+
+    setup&.call
+
+    ready, release = IO.pipe
+    done, wait = IO.pipe
+
+    children = Array.new(workers) do
+      fork do
+        ready.close
+        wait.close
+
+        100.times { paths.each {|path| Magic.file(path, Magic::MIME_TYPE) } }
+
+        release.write('.')
+        done.read
+        exit!(0)
+      end
+    end
+
+    release.close
+    done.close
+    ready.read(workers)
+
+    usage = children.map {|child| memory(child) }
+    Marshal.dump(usage, writer)
+
+    wait.close
+    children.each {|child| Process.wait(child) }
+    exit!(0)
+  end
+
+  writer.close
+  usage = Marshal.load(reader)
+  Process.wait(pid)
+
+  usage
+end
+
+modes = {
+  'no preload' => nil,
+  'Magic.preload!' => -> { Magic.preload!(Magic::MIME_TYPE) },
+  'Magic::Database' => -> { Magic.preload!(Magic::MIME_TYPE, database: Magic::Database.open) }
+}
+
+puts format('%-16s %8s %14s %14s %14s', 'mode', 'workers', 'RSS (KiB)', 'PSS (KiB)', 'private (KiB)')
+
+modes.each do |name, setup|
+  usage = master(workers, paths, &setup)
+
+  rss = usage.sum {|memory| memory['Rss'] }
+  pss = usage.sum {|memory| memory['Pss'] }
+  private = usage.sum {|memory| memory['Private_Clean'] + memory['Private_Dirty'] }
+
+  puts format('%-16s %8d %14d %14d %14d', name, workers, rss, pss, private)
+end
@@ -0,0 +1,48 @@
+# frozen_string_literal: true
+
+#
+# Measures the per-call overhead of methods that do little more than take
+# the lock of a Magic object, and of a small Magic#buffer query, both when
+# only one thread uses the object and when several threads contend for it.
+#
+# Usage:
+#
+#    ruby -Ilib benchmark/lock.rb [CALLS]
+#
+
+require 'benchmark'
+require 'magic'
+
+calls = Integer(ARGV.shift || 200_000)
+
+magic = Magic.new
+magic.flags = Magic::MIME_TYPE
+
+buffer = "\x89PNG\r\n\x1a\n".b
+
+benchmarks = {
+  'flags' => -> { magic.flags },
+  'get_parameter' => -> { magic.get_parameter(Magic::PARAM_BYTES_MAX) },
+  'buffer' => -> { magic.buffer(buffer) }
+}
+
+def run(threads, calls, &block)
+  per_thread = calls / threads
+
+  Benchmark.realtime do
+    Array.new(threads) do
+      Thread.new { per_thread.times(&block) }
+    end.each(&:join)
+  end
+end
+
+puts format('%-16s %8s %14s', 'method', 'threads', 'ns/call')
+
+benchmarks.each do |name, function|
+  [1, 4].each do |threads|
+    n = name == 'buffer' ? calls / 100 : calls
+    elapsed = run(threads, n) { function.call }
+
+    puts format('%-16s %8d %14.1f', name, threads, elapsed / n * 1e9)
+  end
+end
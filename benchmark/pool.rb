@@ -0,0 +1,49 @@
+# frozen_string_literal: true
+
+#
+# Compares how the throughput of Magic#file and Magic::Pool#file scales with
+# the number of threads issuing queries at the same time.
+#
+# Usage:
+#
+#    ruby -Ilib benchmark/pool.rb [QUERIES] [FILE, ...]
+#
+
+require 'benchmark'
+require 'etc'
+require 'magic'
+
+queries = Integer(ARGV.shift || 2000)
+
+files = ARGV.empty? ? Dir[File.join(__dir__, '..', 'test', 'fixtures', '*')] : ARGV
+files = files.select { |f| File.file?(f) }
+
+threads = [1, 2, 4, 8, 16].select { |n| n <= [Etc.nprocessors * 2, 2].max }
+
+def run(threads, queries, files)
+  per_thread = queries / threads
+
+  Benchmark.realtime do
+    Array.new(threads) do |i|
+      Thread.new do
+        per_thread.times { |n| yield files[(i + n) % files.size] }
+      end
+    end.each(&:join)
+  end
+end
+
+magic = Magic.new
+magic.flags = Magic::MIME
+
+puts format('%-8s %16s %16s %8s', 'threads', 'Magic (q/s)', 'Pool (q/s)', 'speedup')
+
+threads.each do |n|
+  pool = Magic::Pool.new(n, Magic::MIME)
+
+  single = queries / run(n, queries, files) { |path| magic.file(path) }
+  pooled = queries / run(n, queries, files) { |path| pool.file(path) }
+
+  puts format('%-8d %16.0f %16.0f %7.2fx', n, single, pooled, pooled / single)
+ensure
+  pool&.close
+end
@@ -0,0 +1,66 @@
+# frozen_string_literal: true
+
+#
+# Measures the time per call of Magic#file and Magic#buffer with and
+# without progressive classification, on a corpus of large files, most of
+# which are recognised from their first few bytes, together with a disk
+# image recognised only further on, and random data and text, for which
+# the result stays generic. Reports, for each file, how many leading bytes
+# were looked at for the result, and whether it differs.
+#
+# Usage:
+#
+#    ruby -Ilib benchmark/progressive.rb [ROUNDS]
+#
+
+require 'benchmark'
+require 'tmpdir'
+require 'zlib'
+require 'magic'
+
+rounds = Integer(ARGV.shift || 10)
+
+root = File.expand_path('..', __dir__)
+random = Random.new(42)
+size = 8 * 1024 * 1024
+
+corpus = {
+  'image.png' => File.binread(File.join(root, 'test', 'fixtures', 'ruby.png')) + random.bytes(size),
+  'image.jpg' => File.binread(File.join(root, 'test', 'fixtures', 'ruby.jpg')) + random.bytes(size),
+  'archive.gz' => Zlib.gzip(random.bytes(size)),
+  'ruby' => File.binread(RbConfig.ruby),
+  'disk.iso' => "\0".b * 32_769 + 'CD001'.b + "\0".b * size,
+  'random.bin' => random.bytes(size),
+  'text.txt' => File.read(File.join(root, 'README.md')) * (size / 16_384)
+}
+
+Dir.mktmpdir do |directory|
+  paths = corpus.map do |name, data|
+    File.join(directory, name).tap {|path| File.binwrite(path, data) }
+  end
+
+  buffers = paths.map {|path| File.binread(path) }
+
+  puts format('%-8s %-12s %14s %14s %8s  %s', 'method', 'file', 'off (us/call)', 'on (us/call)', 'bytes', 'result')
+
+  { 'file' => paths, 'buffer' => buffers }.each do |method, inputs|
+    inputs.each_with_index do |input, index|
+      results = []
+      tier = nil
+
+      times = [false, true].map do |progressive|
+        magic = Magic.new
+        magic.progressive = progressive
+
+        results << magic.public_send(method, input)
+        tier = magic.progressive_stats.key(1)
+
+        Benchmark.realtime { rounds.times { magic.public_send(method, input) } } / rounds * 1e6
+      end
+
+      result = results.uniq.size == 1 ? 'same' : format('%p instead of %p', results.last, results.first)
+
+      puts format('%-8s %-12s %14.2f %14.2f %8s  %s', method, File.basename(paths[index]), *times, tier, result)
+    end
+  end
+end
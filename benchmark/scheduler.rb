@@ -0,0 +1,49 @@
+# frozen_string_literal: true
+
+#
+# Measures the time per call of Magic#file and Magic#buffer from a blocking
+# fiber, and from a non-blocking fiber with a Fiber scheduler set, in which
+# case every call is run in a new thread, so that other fibers can run in
+# the meantime. The difference is the cost of creating and joining the
+# thread.
+#
+# Usage:
+#
+#    ruby -Ilib benchmark/scheduler.rb [CALLS]
+#
+
+require 'benchmark'
+require 'magic'
+
+require_relative '../test/helpers/fiber_scheduler'
+
+calls = Integer(ARGV.shift || 2_000)
+
+root = File.expand_path('..', __dir__)
+path = File.join(root, 'test', 'fixtures', 'ruby.png')
+buffer = File.binread(path)
+
+magic = Magic.new
+magic.flags = Magic::MIME_TYPE
+
+benchmarks = {
+  'file' => -> { magic.file(path) },
+  'buffer' => -> { magic.buffer(buffer) }
+}
+
+puts format('%-8s %16s %16s', 'method', 'blocking (us)', 'scheduler (us)')
+
+benchmarks.each do |name, function|
+  blocking = Benchmark.realtime { calls.times { function.call } }
+
+  scheduler = 0
+  Thread.new do
+    Fiber.set_scheduler(MagicTestFiberScheduler.new)
+
+    Fiber.schedule do
+      scheduler = Benchmark.realtime { calls.times { function.call } }
+    end
+  end.join
+
+  puts format('%-8s %16.2f %16.2f', name, blocking / calls * 1e6, scheduler / calls * 1e6)
+end
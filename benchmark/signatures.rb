@@ -0,0 +1,106 @@
+# frozen_string_literal: true
+
+#
+# Measures how many MIME type queries the fast path of Magic#file and
+# Magic#buffer answers from its table of signatures, and the time per call
+# with and without it, on a corpus made mostly of the common formats that
+# the fast path recognises, mixed with text, source code, binaries and an
+# Office document, which it leaves to the Magic library, followed by the
+# time per call for each file of the corpus.
+#
+# Usage:
+#
+#    ruby -Ilib benchmark/signatures.rb [ROUNDS]
+#
+
+require 'benchmark'
+require 'fileutils'
+require 'tmpdir'
+require 'zlib'
+require 'magic'
+
+rounds = Integer(ARGV.shift || 200)
+
+root = File.expand_path('..', __dir__)
+fixtures = File.join(root, 'test', 'fixtures')
+
+def zip(entries)
+  entries.map do |name, data|
+    [0x04034b50, 10, 0, 0, 0, 0, Zlib.crc32(data), data.bytesize, data.bytesize, name.bytesize, 0]
+      .pack('VvvvvvVVVvv') + name.b + data.b
+  end.join
+end
+
+def mp4(brand)
+  box = ->(type, data) { [data.bytesize + 8].pack('N') + type + data }
+  box.call('ftyp', brand + "\0\0\2\0" + 'isomiso2avc1mp41') + box.call('free', '') + box.call('mdat', "\0" * 4096)
+end
+
+corpus = {
+  'ruby.png' => File.binread(File.join(fixtures, 'ruby.png')),
+  'ruby.jpg' => File.binread(File.join(fixtures, 'ruby.jpg')),
+  'image.gif' => "GIF89a\x10\x00\x10\x00\x80\x00\x00".b + "\0" * 1024,
+  'image.webp' => "RIFF\x00\x10\x00\x00WEBPVP8 \xf4\x0f\x00\x00".b + "\0" * 4096,
+  'document.pdf' => "%PDF-1.7\n%\xe2\xe3\xcf\xd3\n1 0 obj\n<< /Type /Catalog >>\nendobj\n".b + "\0" * 4096,
+  'archive.zip' => zip('README.md' => File.read(File.join(root, 'README.md'))),
+  'archive.gz' => Zlib.gzip(File.read(File.join(root, 'CHANGELOG.md'))),
+  'movie.mp4' => mp4('isom'),
+  'README.md' => File.read(File.join(root, 'README.md')),
+  'magic.rb' => File.read(File.join(root, 'lib', 'magic.rb')),
+  'magic.so' => File.binread(File.join(root, 'lib', 'magic', 'magic.so')),
+  'document.docx' => zip('[Content_Types].xml' => '<Types/>', 'word/document.xml' => '<w:document/>')
+}
+
+# Roughly four in five requests are of the common formats.
+weights = Hash.new(1).merge('ruby.png' => 6, 'ruby.jpg' => 6, 'document.pdf' => 2, 'archive.zip' => 2)
+
+Dir.mktmpdir do |directory|
+  paths = corpus.flat_map do |name, data|
+    path = File.join(directory, name)
+    File.binwrite(path, data)
+    [path] * weights[name]
+  end
+
+  buffers = paths.map {|path| File.binread(path) }
+
+  puts format('%-8s %-10s %12s %10s', 'method', 'fast path', 'us/call', 'hit rate')
+
+  { 'file' => paths, 'buffer' => buffers }.each do |method, inputs|
+    [false, true].each do |fast_path|
+      magic = Magic.new
+      magic.flags = Magic::MIME_TYPE
+      magic.fast_path = fast_path
+
+      inputs.each {|input| magic.public_send(method, input) }
+
+      elapsed = Benchmark.realtime do
+        rounds.times { inputs.each {|input| magic.public_send(method, input) } }
+      end
+
+      stats = magic.fast_path_stats
+      total = stats[:hits] + stats[:misses]
+      rate = total.zero? ? '-' : format('%.1f%%', stats[:hits] * 100.0 / total)
+
+      puts format('%-8s %-10s %12.2f %10s', method, fast_path ? 'on' : 'off',
+                  elapsed / (rounds * inputs.size) * 1e6, rate)
+    end
+  end
+
+  puts
+  puts format('%-16s %14s %14s', 'file', 'off (us/call)', 'on (us/call)')
+
+  corpus.each_key do |name|
+    path = File.join(directory, name)
+
+    times = [false, true].map do |fast_path|
+      magic = Magic.new
+      magic.flags = Magic::MIME_TYPE
+      magic.fast_path = fast_path
+      magic.file(path)
+
+      Benchmark.realtime { rounds.times { magic.file(path) } } / rounds * 1e6
+    end
+
+    puts format('%-16s %14.2f %14.2f', name, *times)
+  end
+end
@@ -0,0 +1,68 @@
+# frozen_string_literal: true
+
+#
+# Measures the time per call of Magic#file and Magic#buffer with and
+# without the text and binary triage, for binary data and for text, with
+# the flags set to ask for a description, the MIME type, or the MIME
+# encoding only. The results are the same either way, which is checked.
+#
+# Usage:
+#
+#    ruby -Ilib benchmark/triage.rb [ROUNDS]
+#
+
+require 'benchmark'
+require 'magic'
+
+rounds = Integer(ARGV.shift || 50)
+
+root = File.expand_path('..', __dir__)
+
+corpus = {
+  'binary' => [
+    File.join(root, 'lib', 'magic', 'magic.so'),
+    File.join(root, 'test', 'fixtures', 'ruby.png'),
+    File.join(root, 'test', 'fixtures', 'ruby.jpg'),
+    RbConfig.ruby
+  ],
+  'text' => [
+    File.join(root, 'README.md'),
+    File.join(root, 'CHANGELOG.md'),
+    File.join(root, 'lib', 'magic.rb'),
+    File.join(root, 'ext', 'magic', 'ruby-magic.c')
+  ]
+}
+
+flags = {
+  'NONE' => Magic::NONE,
+  'MIME_TYPE' => Magic::MIME_TYPE,
+  'MIME_ENCODING' => Magic::MIME_ENCODING
+}
+
+puts format('%-8s %-8s %-14s %14s %14s', 'method', 'data', 'flags', 'off (us/call)', 'on (us/call)')
+
+%w[file buffer].each do |method|
+  corpus.each do |kind, paths|
+    inputs = method == 'file' ? paths : paths.map {|path| File.binread(path) }
+
+    flags.each do |name, value|
+      results = []
+
+      times = [false, true].map do |triage|
+        magic = Magic.new
+        magic.flags = value
+        magic.triage = triage
+
+        results << inputs.map {|input| magic.public_send(method, input) }
+
+        Benchmark.realtime do
+          rounds.times { inputs.each {|input| magic.public_send(method, input) } }
+        end / (rounds * inputs.size) * 1e6
+      end
+
+      abort "The results differ for #{method} of #{kind} with #{name}" unless results.uniq.size == 1
+
+      puts format('%-8s %-8s %-14s %14.2f %14.2f', method, kind, name, *times)
+    end
+  end
+end
@@ -0,0 +1,51 @@
+# frozen_string_literal: true
+
+#
+# Measures the time per call of Magic#file for a cached result, with the
+# cache checked using stat(2) and with the directory watched using
+# Magic#watch instead, where every call still reads the pending inotify(7)
+# events, if any, but does not look at the file. The results are the same
+# either way, which is checked.
+#
+# Usage:
+#
+#    ruby -Ilib benchmark/watch.rb [FILES] [ROUNDS]
+#
+
+require 'benchmark'
+require 'fileutils'
+require 'tmpdir'
+require 'magic'
+
+files = Integer(ARGV.shift || 256)
+rounds = Integer(ARGV.shift || 200)
+
+root = File.expand_path('..', __dir__)
+
+Dir.mktmpdir do |directory|
+  paths = Array.new(files) do |i|
+    File.join(directory, "file#{i}").tap do |path|
+      FileUtils.cp(File.join(root, 'README.md'), path)
+    end
+  end
+
+  results = []
+
+  puts format('%-8s %14s', 'cache', 'time (us/call)')
+
+  %w[stat watch].each do |kind|
+    magic = Magic.new
+    magic.cache_size = files * 2
+    magic.watch(directory) if kind == 'watch'
+
+    results << paths.map {|path| magic.file(path) }
+
+    time = Benchmark.realtime do
+      rounds.times { paths.each {|path| magic.file(path) } }
+    end / (rounds * files) * 1e6
+
+    puts format('%-8s %14.2f', kind, time)
+  end
+
+  abort 'The results differ' unless results.uniq.size == 1
+end
@@ -0,0 +1,738 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "cache.h"
+
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#define MAGIC_SHARED_CACHE_SIGNATURE "RBMAGIC"
+#define MAGIC_SHARED_CACHE_VERSION 1
+
+static size_t magic_cache_hash(const magic_cache_key_t *key);
+static int magic_cache_equal(const magic_cache_key_t *a,
+			     const magic_cache_key_t *b);
+static void magic_cache_unlink(magic_cache_t *cache,
+			       magic_cache_entry_t *entry);
+static void magic_cache_push(magic_cache_t *cache, magic_cache_entry_t *entry);
+
+#if defined(MAGIC_ATOMIC_CAS)
+static int magic_shared_cache_init(int fd, size_t slots, size_t *count);
+static int magic_shared_cache_read(magic_shared_cache_slot_t *slot,
+				   magic_shared_cache_slot_t *copy);
+static int magic_shared_cache_match(const magic_shared_cache_slot_t *slot,
+				    const magic_cache_key_t *key);
+static magic_shared_cache_slot_t *magic_shared_cache_slot(magic_shared_cache_t *cache,
+							  const magic_cache_key_t *key,
+							  size_t way);
+#endif /* MAGIC_ATOMIC_CAS */
+
+magic_cache_t *
+magic_cache_new(size_t capacity)
+{
+	size_t count = 1;
+	magic_cache_t *cache;
+
+	if (capacity == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/*
+	 * Keep the number of buckets a power of two no smaller than the
+	 * capacity, so that chains stay short even when the cache is full.
+	 */
+	while (count < capacity)
+		count <<= 1;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	cache->buckets = calloc(count, sizeof(magic_cache_entry_t *));
+	if (!cache->buckets) {
+		free(cache);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	cache->buckets_count = count;
+	cache->capacity = capacity;
+
+	return cache;
+}
+
+void
+magic_cache_free(magic_cache_t *cache)
+{
+	magic_cache_entry_t *entry;
+
+	if (!cache)
+		return;
+
+	while ((entry = cache->head)) {
+		cache->head = entry->next;
+		free(entry->path);
+		free(entry->result);
+		free(entry);
+	}
+
+	free(cache->buckets);
+	free(cache);
+}
+
+/*
+ * Fills in the key for the given path, using the same metadata that would
+ * change if the file were to be modified or replaced. Returns -1 when the
+ * result for the path cannot be cached, such as e.g., when it does not
+ * exist or is not a regular file, in which case it has to be classified
+ * by the Magic library every time.
+ */
+int
+magic_cache_key(magic_cache_key_t *key, const char *path, int flags,
+		unsigned long generation)
+{
+	int rv;
+	struct stat st;
+
+#if defined(HAVE_FSTATAT)
+	rv = fstatat(AT_FDCWD, path, &st,
+		     (flags & MAGIC_SYMLINK) ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+	if (flags & MAGIC_SYMLINK)
+		rv = stat(path, &st);
+	else
+		rv = lstat(path, &st);
+#endif
+	if (rv < 0 || !S_ISREG(st.st_mode))
+		return -1;
+
+	*key = (magic_cache_key_t) {
+		.dev        = st.st_dev,
+		.ino        = st.st_ino,
+		.size       = st.st_size,
+		.mtime      = st.st_mtime,
+		.generation = generation,
+		.flags      = flags,
+	};
+
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+
+	return 0;
+}
+
+/*
+ * Fills in the key for a buffer, given the digest of its contents. Two
+ * buffers of the same size and digest are assumed to have the same result.
+ */
+void
+magic_cache_key_buffer(magic_cache_key_t *key, size_t digest, size_t size,
+		       int flags, unsigned long generation)
+{
+	*key = (magic_cache_key_t) {
+		.size       = (off_t)size,
+		.digest     = digest,
+		.generation = generation,
+		.flags      = flags,
+	};
+}
+
+/*
+ * Fills in the key for the given path, without looking at the file at all,
+ * thus the caller has to ensure that the version changes whenever the file
+ * might have changed. The key refers to the path, which has to stay valid
+ * for as long as the key is used.
+ */
+void
+magic_cache_key_path(magic_cache_key_t *key, const char *path,
+		     unsigned long version, int flags, unsigned long generation)
+{
+	size_t length = strlen(path);
+
+	*key = (magic_cache_key_t) {
+		.path       = path,
+		.size       = (off_t)length,
+		.mtime      = (time_t)version,
+		.digest     = magic_cache_digest(MAGIC_CACHE_DIGEST_INIT,
+						 path, length),
+		.generation = generation,
+		.flags      = flags,
+	};
+}
+
+/*
+ * Returns the result stored for the key and marks it as the most recently
+ * used one, or NULL when there is none. The result stays valid only until
+ * the next call to magic_cache_store or magic_cache_free.
+ */
+const char *
+magic_cache_lookup(magic_cache_t *cache, const magic_cache_key_t *key)
+{
+	size_t hash;
+	magic_cache_entry_t *entry;
+
+	assert(cache != NULL &&
+	       "Must be a valid pointer to `magic_cache_t' type");
+
+	hash = magic_cache_hash(key);
+
+	entry = cache->buckets[hash & (cache->buckets_count - 1)];
+	for (; entry; entry = entry->chain) {
+		if (entry->hash == hash && magic_cache_equal(&entry->key, key))
+			break;
+	}
+
+	if (!entry) {
+		cache->misses++;
+		return NULL;
+	}
+
+	cache->hits++;
+
+	magic_cache_unlink(cache, entry);
+	magic_cache_push(cache, entry);
+
+	return entry->result;
+}
+
+/*
+ * Copies the result into the cache, evicting the least recently used
+ * entry when the cache is full. The key must not be already present. The
+ * copies are made first, thus the cache is left as it was on failure.
+ */
+int
+magic_cache_store(magic_cache_t *cache, const magic_cache_key_t *key,
+		  const char *result)
+{
+	char *path = NULL;
+	char *copy = NULL;
+	magic_cache_entry_t *entry;
+
+	assert(cache != NULL &&
+	       "Must be a valid pointer to `magic_cache_t' type");
+
+	if (key->path) {
+		path = strdup(key->path);
+		if (!path)
+			goto error;
+	}
+
+	copy = strdup(result);
+	if (!copy)
+		goto error;
+
+	if (cache->count >= cache->capacity) {
+		entry = cache->tail;
+		magic_cache_unlink(cache, entry);
+		free(entry->path);
+		free(entry->result);
+	} else {
+		entry = malloc(sizeof(*entry));
+		if (!entry)
+			goto error;
+		cache->count++;
+	}
+
+	entry->path = path;
+	entry->result = copy;
+
+	entry->key = *key;
+	entry->key.path = entry->path;
+	entry->hash = magic_cache_hash(key);
+
+	magic_cache_push(cache, entry);
+
+	return 0;
+error:
+	free(path);
+	free(copy);
+
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+ * Returns the FNV-1a hash of the data, continuing from the given digest,
+ * which should be MAGIC_CACHE_DIGEST_INIT for the first call. Unlike the
+ * hashes used by Ruby, it does not depend on a per-process seed, thus the
+ * same data yields the same digest in every process.
+ */
+size_t
+magic_cache_digest(size_t digest, const void *data, size_t size)
+{
+	uint64_t hash = (uint64_t)digest;
+	const unsigned char *bytes = data;
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return (size_t)hash;
+}
+
+#if defined(MAGIC_ATOMIC_CAS)
+/*
+ * Maps the shared cache stored in the file at the given path, creating
+ * the file with the given number of slots if it does not exist yet. An
+ * existing file keeps its number of slots.
+ *
+ * The file is a fixed-size table of slots, each of which is guarded by
+ * a sequence number that is odd while the slot is being written. Readers
+ * never wait, and treat a slot being written as a miss. Writers skip a
+ * slot that a different writer holds, thus a result is sometimes not
+ * stored, which is harmless for a cache.
+ */
+magic_shared_cache_t *
+magic_shared_cache_open(const char *path, size_t slots)
+{
+	int fd;
+	int local_errno;
+	size_t count;
+	magic_shared_cache_t *cache;
+
+	if (slots == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	cache->path = strdup(path);
+	if (!cache->path) {
+		free(cache);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+#if defined(HAVE_O_CLOEXEC)
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+#else
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+#endif
+	if (fd < 0) {
+		local_errno = errno;
+		goto error;
+	}
+
+	if (magic_shared_cache_init(fd, slots, &count) < 0) {
+		local_errno = errno;
+		close(fd);
+		goto error;
+	}
+
+	cache->count = count;
+	cache->length = sizeof(magic_shared_cache_header_t) +
+			count * sizeof(magic_shared_cache_slot_t);
+
+	cache->map = mmap(NULL, cache->length, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	local_errno = errno;
+
+	close(fd);
+
+	if (cache->map == MAP_FAILED)
+		goto error;
+
+	cache->slots = (magic_shared_cache_slot_t *)
+		((char *)cache->map + sizeof(magic_shared_cache_header_t));
+
+	return cache;
+error:
+	free(cache->path);
+	free(cache);
+
+	errno = local_errno;
+	return NULL;
+}
+
+void
+magic_shared_cache_close(magic_shared_cache_t *cache)
+{
+	if (!cache)
+		return;
+
+	if (cache->map)
+		munmap(cache->map, cache->length);
+
+	free(cache->path);
+	free(cache);
+}
+
+/*
+ * Returns the result stored for the key, copied into a buffer that stays
+ * valid until the next lookup, or NULL when there is none. The generation
+ * of the key is ignored, as it means nothing to a different process, thus
+ * the digest has to identify the database instead.
+ */
+const char *
+magic_shared_cache_lookup(magic_shared_cache_t *cache,
+			  const magic_cache_key_t *key)
+{
+	magic_shared_cache_slot_t copy;
+	magic_shared_cache_slot_t *slot;
+
+	assert(cache != NULL &&
+	       "Must be a valid pointer to `magic_shared_cache_t' type");
+
+	for (size_t way = 0; way < MAGIC_SHARED_CACHE_WAYS; way++) {
+		slot = magic_shared_cache_slot(cache, key, way);
+
+		if (magic_shared_cache_read(slot, &copy) < 0)
+			continue;
+
+		if (copy.length == 0 || !magic_shared_cache_match(&copy, key))
+			continue;
+
+		memcpy(cache->result, copy.result, copy.length);
+		cache->result[copy.length] = '\0';
+
+		cache->hits++;
+		return cache->result;
+	}
+
+	cache->misses++;
+	return NULL;
+}
+
+int
+magic_shared_cache_store(magic_shared_cache_t *cache,
+			 const magic_cache_key_t *key, const char *result)
+{
+	uint32_t sequence;
+	size_t length;
+	magic_shared_cache_slot_t *slot;
+	magic_shared_cache_slot_t *victim = NULL;
+
+	assert(cache != NULL &&
+	       "Must be a valid pointer to `magic_shared_cache_t' type");
+
+	length = strlen(result);
+	if (length == 0 || length >= MAGIC_SHARED_CACHE_RESULT_MAX) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	/*
+	 * Prefer an empty slot, and otherwise evict the one selected by the
+	 * key itself, so that different processes agree on which one it is.
+	 */
+	for (size_t way = 0; way < MAGIC_SHARED_CACHE_WAYS; way++) {
+		slot = magic_shared_cache_slot(cache, key, way);
+		if (MAGIC_ATOMIC_LOAD(&slot->length) == 0) {
+			victim = slot;
+			break;
+		}
+	}
+
+	if (!victim)
+		victim = magic_shared_cache_slot(cache, key,
+						 (key->ino ^ key->digest) %
+						 MAGIC_SHARED_CACHE_WAYS);
+
+	sequence = MAGIC_ATOMIC_LOAD(&victim->sequence);
+	if ((sequence & 1) ||
+	    !MAGIC_ATOMIC_CAS(&victim->sequence, &sequence, sequence + 1)) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	victim->flags = key->flags;
+	victim->dev = (uint64_t)key->dev;
+	victim->ino = (uint64_t)key->ino;
+	victim->size = (uint64_t)key->size;
+	victim->mtime = (int64_t)key->mtime;
+	victim->mtime_nsec = (int64_t)key->mtime_nsec;
+	victim->digest = (uint64_t)key->digest;
+
+	memcpy(victim->result, result, length);
+	MAGIC_ATOMIC_STORE(&victim->length, (uint32_t)length);
+
+	MAGIC_ATOMIC_STORE(&victim->sequence, sequence + 2);
+
+	return 0;
+}
+
+/*
+ * Returns the number of slots in use, by all the processes sharing the
+ * cache.
+ */
+size_t
+magic_shared_cache_used(magic_shared_cache_t *cache)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < cache->count; i++) {
+		if (MAGIC_ATOMIC_LOAD(&cache->slots[i].length) > 0)
+			count++;
+	}
+
+	return count;
+}
+
+/*
+ * Creates the header of a new file, or validates the header of an existing
+ * one, while holding an exclusive lock on the file, so that processes that
+ * open the same file at the same time do not race to initialize it.
+ */
+static int
+magic_shared_cache_init(int fd, size_t slots, size_t *count)
+{
+	int rv = -1;
+	int local_errno = EINVAL;
+	struct stat st;
+	magic_shared_cache_header_t header;
+
+	if (flock(fd, LOCK_EX) < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0) {
+		local_errno = errno;
+		goto out;
+	}
+
+	if (st.st_size == 0) {
+		header = (magic_shared_cache_header_t) {
+			.version   = MAGIC_SHARED_CACHE_VERSION,
+			.slot_size = sizeof(magic_shared_cache_slot_t),
+			.slots     = slots,
+		};
+		memcpy(header.signature, MAGIC_SHARED_CACHE_SIGNATURE,
+		       sizeof(header.signature));
+
+		if (ftruncate(fd, (off_t)(sizeof(header) +
+					  slots * sizeof(magic_shared_cache_slot_t))) < 0 ||
+		    pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+			local_errno = errno;
+			goto out;
+		}
+	} else {
+		if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+			goto out;
+
+		if (memcmp(header.signature, MAGIC_SHARED_CACHE_SIGNATURE,
+			   sizeof(header.signature)) != 0 ||
+		    header.version != MAGIC_SHARED_CACHE_VERSION ||
+		    header.slot_size != sizeof(magic_shared_cache_slot_t) ||
+		    header.slots == 0 ||
+		    (uint64_t)st.st_size < sizeof(header) +
+			    header.slots * sizeof(magic_shared_cache_slot_t))
+			goto out;
+	}
+
+	*count = (size_t)header.slots;
+	rv = 0;
+out:
+	flock(fd, LOCK_UN);
+
+	if (rv < 0)
+		errno = local_errno;
+
+	return rv;
+}
+
+/*
+ * Copies the slot, returning -1 when it was being written at the same time,
+ * in which case the copy might be inconsistent.
+ */
+static int
+magic_shared_cache_read(magic_shared_cache_slot_t *slot,
+			magic_shared_cache_slot_t *copy)
+{
+	uint32_t sequence;
+
+	sequence = MAGIC_ATOMIC_LOAD(&slot->sequence);
+	if (sequence & 1)
+		return -1;
+
+	memcpy(copy, slot, sizeof(*copy));
+	MAGIC_ATOMIC_FENCE();
+
+	if (MAGIC_ATOMIC_LOAD(&slot->sequence) != sequence)
+		return -1;
+
+	if (copy->length >= MAGIC_SHARED_CACHE_RESULT_MAX)
+		return -1;
+
+	return 0;
+}
+
+static int
+magic_shared_cache_match(const magic_shared_cache_slot_t *slot,
+			 const magic_cache_key_t *key)
+{
+	return slot->ino == (uint64_t)key->ino &&
+	       slot->dev == (uint64_t)key->dev &&
+	       slot->size == (uint64_t)key->size &&
+	       slot->mtime == (int64_t)key->mtime &&
+	       slot->mtime_nsec == (int64_t)key->mtime_nsec &&
+	       slot->digest == (uint64_t)key->digest &&
+	       slot->flags == key->flags;
+}
+
+static magic_shared_cache_slot_t *
+magic_shared_cache_slot(magic_shared_cache_t *cache,
+			const magic_cache_key_t *key, size_t way)
+{
+	size_t hash;
+	magic_cache_key_t shared = *key;
+
+	shared.generation = 0;
+	hash = magic_cache_hash(&shared);
+
+	return &cache->slots[(hash + way) % cache->count];
+}
+#else
+magic_shared_cache_t *
+magic_shared_cache_open(const char *path, size_t slots)
+{
+	UNUSED(path);
+	UNUSED(slots);
+
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+magic_shared_cache_close(magic_shared_cache_t *cache)
+{
+	UNUSED(cache);
+}
+
+const char *
+magic_shared_cache_lookup(magic_shared_cache_t *cache,
+			  const magic_cache_key_t *key)
+{
+	UNUSED(cache);
+	UNUSED(key);
+
+	return NULL;
+}
+
+int
+magic_shared_cache_store(magic_shared_cache_t *cache,
+			 const magic_cache_key_t *key, const char *result)
+{
+	UNUSED(cache);
+	UNUSED(key);
+	UNUSED(result);
+
+	errno = ENOSYS;
+	return -1;
+}
+
+size_t
+magic_shared_cache_used(magic_shared_cache_t *cache)
+{
+	UNUSED(cache);
+
+	return 0;
+}
+#endif /* MAGIC_ATOMIC_CAS */
+
+/*
+ * Uses the FNV-1a hash over the fields of the key, rather than its bytes,
+ * as the structure can contain padding.
+ */
+static size_t
+magic_cache_hash(const magic_cache_key_t *key)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	const uint64_t fields[] = {
+		(uint64_t)key->dev,
+		(uint64_t)key->ino,
+		(uint64_t)key->size,
+		(uint64_t)key->mtime,
+		(uint64_t)key->mtime_nsec,
+		(uint64_t)key->digest,
+		(uint64_t)key->generation,
+		(uint64_t)key->flags,
+	};
+
+	for (int i = 0; i < ARRAY_SIZE(fields); i++) {
+		for (int j = 0; j < 64; j += 8) {
+			hash ^= (fields[i] >> j) & 0xff;
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	return (size_t)hash;
+}
+
+static int
+magic_cache_equal(const magic_cache_key_t *a, const magic_cache_key_t *b)
+{
+	if (a->path || b->path) {
+		if (!a->path || !b->path || strcmp(a->path, b->path) != 0)
+			return 0;
+	}
+
+	return a->ino == b->ino &&
+	       a->dev == b->dev &&
+	       a->size == b->size &&
+	       a->mtime == b->mtime &&
+	       a->mtime_nsec == b->mtime_nsec &&
+	       a->digest == b->digest &&
+	       a->generation == b->generation &&
+	       a->flags == b->flags;
+}
+
+/*
+ * Removes the entry from both its bucket and the list of entries ordered
+ * from the most to the least recently used.
+ */
+static void
+magic_cache_unlink(magic_cache_t *cache, magic_cache_entry_t *entry)
+{
+	magic_cache_entry_t **link;
+
+	link = &cache->buckets[entry->hash & (cache->buckets_count - 1)];
+	while (*link != entry)
+		link = &(*link)->chain;
+
+	*link = entry->chain;
+
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
+}
+
+static void
+magic_cache_push(magic_cache_t *cache, magic_cache_entry_t *entry)
+{
+	magic_cache_entry_t **bucket;
+
+	bucket = &cache->buckets[entry->hash & (cache->buckets_count - 1)];
+
+	entry->chain = *bucket;
+	*bucket = entry;
+
+	entry->prev = NULL;
+	entry->next = cache->head;
+
+	if (cache->head)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+
+	cache->head = entry;
+}
+
+#if defined(__cplusplus)
+}
+#endif
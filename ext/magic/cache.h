@@ -0,0 +1,121 @@
+#if !defined(_CACHE_H)
+#define _CACHE_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+
+#include <stdint.h>
+
+#define MAGIC_CACHE_DIGEST_INIT 14695981039346656037ULL
+
+#define MAGIC_SHARED_CACHE_SLOTS 16384
+#define MAGIC_SHARED_CACHE_RESULT_MAX 192
+#define MAGIC_SHARED_CACHE_WAYS 4
+
+typedef struct magic_cache_key {
+	const char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;
+	size_t digest;
+	unsigned long generation;
+	int flags;
+} magic_cache_key_t;
+
+typedef struct magic_cache_entry {
+	struct magic_cache_entry *chain;
+	struct magic_cache_entry *prev;
+	struct magic_cache_entry *next;
+	magic_cache_key_t key;
+	size_t hash;
+	char *path;
+	char *result;
+} magic_cache_entry_t;
+
+typedef struct magic_cache {
+	magic_cache_entry_t **buckets;
+	magic_cache_entry_t *head;
+	magic_cache_entry_t *tail;
+	size_t buckets_count;
+	size_t capacity;
+	size_t count;
+	size_t hits;
+	size_t misses;
+} magic_cache_t;
+
+/*
+ * The layout of the shared cache file. All the fields have fixed sizes, so
+ * that processes built for the same architecture can share the file.
+ */
+typedef struct magic_shared_cache_header {
+	char signature[8];
+	uint32_t version;
+	uint32_t slot_size;
+	uint64_t slots;
+} magic_shared_cache_header_t;
+
+typedef struct magic_shared_cache_slot {
+	uint32_t sequence;
+	uint32_t length;
+	int32_t flags;
+	uint32_t reserved;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+	uint64_t digest;
+	char result[MAGIC_SHARED_CACHE_RESULT_MAX];
+} magic_shared_cache_slot_t;
+
+typedef struct magic_shared_cache {
+	magic_shared_cache_slot_t *slots;
+	void *map;
+	size_t length;
+	size_t count;
+	size_t hits;
+	size_t misses;
+	char *path;
+	char result[MAGIC_SHARED_CACHE_RESULT_MAX];
+} magic_shared_cache_t;
+
+extern magic_cache_t *magic_cache_new(size_t capacity);
+extern void magic_cache_free(magic_cache_t *cache);
+
+extern int magic_cache_key(magic_cache_key_t *key, const char *path,
+			   int flags, unsigned long generation);
+extern void magic_cache_key_buffer(magic_cache_key_t *key, size_t digest,
+				   size_t size, int flags,
+				   unsigned long generation);
+extern void magic_cache_key_path(magic_cache_key_t *key, const char *path,
+				 unsigned long version, int flags,
+				 unsigned long generation);
+
+extern const char *magic_cache_lookup(magic_cache_t *cache,
+				      const magic_cache_key_t *key);
+extern int magic_cache_store(magic_cache_t *cache,
+			     const magic_cache_key_t *key, const char *result);
+
+extern size_t magic_cache_digest(size_t digest, const void *data, size_t size);
+
+extern magic_shared_cache_t *magic_shared_cache_open(const char *path,
+						     size_t slots);
+extern void magic_shared_cache_close(magic_shared_cache_t *cache);
+
+extern const char *magic_shared_cache_lookup(magic_shared_cache_t *cache,
+					     const magic_cache_key_t *key);
+extern int magic_shared_cache_store(magic_shared_cache_t *cache,
+				    const magic_cache_key_t *key,
+				    const char *result);
+extern size_t magic_shared_cache_used(magic_shared_cache_t *cache);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _CACHE_H */
@@ -31,6 +31,16 @@ extern "C" {
 
 #include <ruby.h>
 #include <ruby/version.h>
+#include <ruby/util.h>
+#include <ruby/encoding.h>
+
+#if defined(HAVE_RUBY_RACTOR_H)
+# include <ruby/ractor.h>
+#endif /* HAVE_RUBY_RACTOR_H */
+
+#if defined(HAVE_RUBY_FIBER_SCHEDULER_H)
+# include <ruby/fiber/scheduler.h>
+#endif /* HAVE_RUBY_FIBER_SCHEDULER_H */
 
 #if defined(HAVE_RUBY_IO_H)
 # include <ruby/io.h>
@@ -136,6 +146,30 @@ extern "C" {
 # define FPTR_TO_FD(p) (fileno(GetReadFile(p)))
 #endif /* GetReadFile */
 
+#if defined(__GNUC__) || defined(__clang__)
+# define MAGIC_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+# define MAGIC_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+# define MAGIC_ATOMIC_FETCH_OR(p, v) __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+# define MAGIC_ATOMIC_FETCH_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+# define MAGIC_ATOMIC_CAS(p, e, v) \
+	__atomic_compare_exchange_n((p), (e), (v), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+# define MAGIC_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+# define MAGIC_ATOMIC_LOAD(p) (*(p))
+# define MAGIC_ATOMIC_STORE(p, v) (*(p) = (v))
+static inline int
+magic_atomic_fetch_or(volatile int *p, int v)
+{
+	int old = *p;
+
+	*p |= v;
+
+	return old;
+}
+# define MAGIC_ATOMIC_FETCH_OR(p, v) magic_atomic_fetch_or((p), (v))
+# define MAGIC_ATOMIC_FETCH_ADD(p, v) ((*(p) += (v)) - (v))
+#endif /* defined(__GNUC__) || defined(__clang__) */
+
 #define NOGVL_FUNCTION (VALUE(*)(void *))
 
 #if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) && \
@@ -143,9 +177,13 @@ extern "C" {
 # include <ruby/thread.h>
 # define NOGVL(f, d) \
 	rb_thread_call_without_gvl((f), (d), RUBY_UBF_IO, NULL)
+# define NOGVL_UBF(f, d, u, a) \
+	rb_thread_call_without_gvl((f), (d), (u), (a))
 #elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
 # define NOGVL(f, d) \
 	rb_thread_blocking_region(NOGVL_FUNCTION(f), (d), RUBY_UBF_IO, NULL)
+# define NOGVL_UBF(f, d, u, a) \
+	rb_thread_blocking_region(NOGVL_FUNCTION(f), (d), (u), (a))
 #else
 # include <rubysig.h>
 static inline VALUE
@@ -161,6 +199,8 @@ fake_blocking_region(VALUE (*f)(ANYARGS), void *data)
 }
 # define NOGVL(f, d) \
 	fake_blocking_region(NOGVL_FUNCTION(f), (d))
+# define NOGVL_UBF(f, d, u, a) \
+	fake_blocking_region(NOGVL_FUNCTION(f), (d))
 #endif /*
 	* HAVE_RB_THREAD_CALL_WITHOUT_GVL
 	* HAVE_RUBY_THREAD_H
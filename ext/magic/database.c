@@ -0,0 +1,384 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "database.h"
+#include "cache.h"
+
+#include <sys/mman.h>
+
+/*
+ * Databases are mapped at most once per process, and every _Magic_ object
+ * attached to a database refers directly to the mapped memory. A mapping
+ * is counted for every reference to it, and is unmapped once the last one
+ * is released. A new mapping is only made when the file has changed, and
+ * the file is kept open, so that a change made to it in place is noticed.
+ */
+static pthread_mutex_t magic_database_mutex = PTHREAD_MUTEX_INITIALIZER;
+static magic_database_t *magic_database_list;
+static size_t magic_database_list_count;
+
+#if defined(MAGIC_EMBEDDED_DATABASE)
+# if defined(__APPLE__)
+#  define MAGIC_EMBEDDED_SECTION ".const"
+#  define MAGIC_EMBEDDED_SYMBOL(s) "_" s
+# else
+#  define MAGIC_EMBEDDED_SECTION ".section .rodata"
+#  define MAGIC_EMBEDDED_SYMBOL(s) s
+# endif
+
+/*
+ * The compiled database chosen when the extension was built is linked in
+ * as read-only data, thus it is loaded without any file I/O, and its pages
+ * are shared through the page cache by every process using the extension.
+ * It is aligned as the Magic library expects a database in memory to be.
+ */
+__asm__(
+	MAGIC_EMBEDDED_SECTION "\n"
+	".balign 16\n"
+	MAGIC_EMBEDDED_SYMBOL("magic_embedded_database_start") ":\n"
+	".incbin \"" MAGIC_EMBEDDED_DATABASE "\"\n"
+	MAGIC_EMBEDDED_SYMBOL("magic_embedded_database_end") ":\n"
+	".text\n"
+);
+
+extern const char magic_embedded_database_start[];
+extern const char magic_embedded_database_end[];
+
+static magic_database_t magic_database_embedded_database;
+#endif /* MAGIC_EMBEDDED_DATABASE */
+
+static int
+magic_database_equal(const magic_database_t *database, const char *path,
+		     const struct stat *st)
+{
+	if (database->dev != st->st_dev || database->ino != st->st_ino)
+		return 0;
+
+	if (database->size != (size_t)st->st_size ||
+	    database->mtime != st->st_mtime)
+		return 0;
+
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+	if (database->mtime_nsec != st->st_mtim.tv_nsec)
+		return 0;
+#endif
+
+	return strcmp(database->path, path) == 0;
+}
+
+static void
+magic_database_unmap(magic_database_t *database)
+{
+	munmap(database->base, database->size);
+	close(database->fd);
+
+	free(database->path);
+	free(database);
+}
+
+static magic_database_t *
+magic_database_map(int fd, char *path, const struct stat *st)
+{
+	uint32_t magicno;
+	size_t digest;
+	void *base;
+	magic_database_t *database;
+
+	base = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	/*
+	 * The Magic library swaps the byte order of a database compiled on a
+	 * different architecture in place, which a read-only mapping shared
+	 * by many objects cannot allow, thus only native databases are used.
+	 */
+	memcpy(&magicno, base, sizeof(magicno));
+	if (magicno != MAGIC_DATABASE_MAGICNO) {
+		munmap(base, (size_t)st->st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	database = calloc(1, sizeof(*database));
+	if (!database) {
+		munmap(base, (size_t)st->st_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	*database = (magic_database_t) {
+		.path  = path,
+		.base  = base,
+		.size  = (size_t)st->st_size,
+		.references = 1,
+		.fd    = fd,
+		.dev   = st->st_dev,
+		.ino   = st->st_ino,
+		.mtime = st->st_mtime,
+	};
+
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+	database->mtime_nsec = st->st_mtim.tv_nsec;
+#endif
+
+	digest = magic_cache_digest(MAGIC_CACHE_DIGEST_INIT, path,
+				    strlen(path));
+	digest = magic_cache_digest(digest, &database->dev,
+				    sizeof(database->dev));
+	digest = magic_cache_digest(digest, &database->ino,
+				    sizeof(database->ino));
+	digest = magic_cache_digest(digest, &database->size,
+				    sizeof(database->size));
+	digest = magic_cache_digest(digest, &database->mtime,
+				    sizeof(database->mtime));
+	database->digest = magic_cache_digest(digest, &database->mtime_nsec,
+					      sizeof(database->mtime_nsec));
+
+	return database;
+}
+
+/*
+ * Returns the mapping of the compiled database at the given path, mapping
+ * the file if it has not been mapped yet, or has changed since. Returns
+ * NULL and sets errno when the file cannot be mapped, or is not a compiled
+ * database in the byte order of this machine. The reference returned has
+ * to be released using magic_database_release.
+ */
+magic_database_t *
+magic_database_open(const char *path)
+{
+	int fd;
+	int local_errno;
+	char *real;
+	struct stat st;
+	magic_database_t *database;
+
+	real = realpath(path, NULL);
+	if (!real)
+		return NULL;
+
+#if defined(HAVE_O_CLOEXEC)
+	fd = open(real, O_RDONLY | O_CLOEXEC);
+#else
+	fd = open(real, O_RDONLY);
+#endif
+	if (fd < 0) {
+		local_errno = errno;
+		goto error;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		local_errno = errno;
+		close(fd);
+		goto error;
+	}
+
+	if (!S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(uint32_t)) {
+		local_errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+		close(fd);
+		goto error;
+	}
+
+	pthread_mutex_lock(&magic_database_mutex);
+
+	for (database = magic_database_list; database; database = database->next) {
+		if (magic_database_equal(database, real, &st))
+			break;
+	}
+
+	if (database) {
+		database->references++;
+		free(real);
+		real = NULL;
+	} else {
+		database = magic_database_map(fd, real, &st);
+		if (database) {
+			database->next = magic_database_list;
+			magic_database_list = database;
+			magic_database_list_count++;
+			fd = -1;
+		}
+	}
+
+	local_errno = errno;
+
+	pthread_mutex_unlock(&magic_database_mutex);
+
+	if (fd >= 0)
+		close(fd);
+
+	if (!database) {
+		errno = local_errno;
+		free(real);
+		return NULL;
+	}
+
+	return database;
+error:
+	free(real);
+
+	errno = local_errno;
+	return NULL;
+}
+
+/*
+ * Returns the database linked into the extension, or NULL if there is none,
+ * or when it is not a compiled database in the byte order of this machine,
+ * which can only happen when cross-compiling.
+ */
+magic_database_t *
+magic_database_embedded(void)
+{
+#if defined(MAGIC_EMBEDDED_DATABASE)
+	uint32_t magicno;
+	size_t size, digest;
+	magic_database_t *database = &magic_database_embedded_database;
+
+	size = (size_t)(magic_embedded_database_end -
+			magic_embedded_database_start);
+	if (size < sizeof(magicno))
+		return NULL;
+
+	memcpy(&magicno, magic_embedded_database_start, sizeof(magicno));
+	if (magicno != MAGIC_DATABASE_MAGICNO)
+		return NULL;
+
+	pthread_mutex_lock(&magic_database_mutex);
+
+	if (!database->base) {
+		digest = magic_cache_digest(MAGIC_CACHE_DIGEST_INIT,
+					    MAGIC_EMBEDDED_DATABASE_DIGEST,
+					    strlen(MAGIC_EMBEDDED_DATABASE_DIGEST));
+
+		*database = (magic_database_t) {
+			.base   = (void *)(uintptr_t)magic_embedded_database_start,
+			.size   = size,
+			.digest = magic_cache_digest(digest, &size, sizeof(size)),
+		};
+	}
+
+	pthread_mutex_unlock(&magic_database_mutex);
+
+	return database;
+#else
+	return NULL;
+#endif /* MAGIC_EMBEDDED_DATABASE */
+}
+
+/*
+ * Returns the database mapped, or linked in, at the given address, if any.
+ */
+magic_database_t *
+magic_database_find(const void *base, size_t size)
+{
+	magic_database_t *database;
+
+#if defined(MAGIC_EMBEDDED_DATABASE)
+	database = &magic_database_embedded_database;
+	if (database->base == base && database->size == size)
+		return database;
+#endif /* MAGIC_EMBEDDED_DATABASE */
+
+	pthread_mutex_lock(&magic_database_mutex);
+
+	for (database = magic_database_list; database; database = database->next) {
+		if (database->base == base && database->size == size)
+			break;
+	}
+
+	pthread_mutex_unlock(&magic_database_mutex);
+
+	return database;
+}
+
+/*
+ * Releases a reference returned by magic_database_open, and unmaps the
+ * database once no reference to it is left. The database linked into the
+ * extension is never released.
+ */
+void
+magic_database_release(magic_database_t *database)
+{
+	magic_database_t **link;
+
+	if (!database || !database->path)
+		return;
+
+	pthread_mutex_lock(&magic_database_mutex);
+
+	if (--database->references > 0) {
+		pthread_mutex_unlock(&magic_database_mutex);
+		return;
+	}
+
+	for (link = &magic_database_list; *link; link = &(*link)->next) {
+		if (*link == database) {
+			*link = database->next;
+			magic_database_list_count--;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&magic_database_mutex);
+
+	magic_database_unmap(database);
+}
+
+/*
+ * Returns whether the mapped file has been changed in place since it was
+ * mapped, in which case its pages might not hold the database any more, or
+ * be past the end of the file, and reading them would raise SIGBUS. A file
+ * that was replaced by renaming another file over it is not changed, as
+ * the mapping still refers to the file it was made from.
+ */
+int
+magic_database_changed(magic_database_t *database)
+{
+	struct stat st;
+
+	if (!database->path)
+		return 0;
+
+	if (fstat(database->fd, &st) < 0)
+		return 1;
+
+	if (database->size != (size_t)st.st_size ||
+	    database->mtime != st.st_mtime)
+		return 1;
+
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+	if (database->mtime_nsec != st.st_mtim.tv_nsec)
+		return 1;
+#endif
+
+	return 0;
+}
+
+size_t
+magic_database_count(void)
+{
+	size_t count;
+
+	pthread_mutex_lock(&magic_database_mutex);
+	count = magic_database_list_count;
+	pthread_mutex_unlock(&magic_database_mutex);
+
+	return count;
+}
+
+/*
+ * Only the thread that called fork() exists in the child process, thus the
+ * lock could be held by a thread that is gone. The mappings themselves, and
+ * the files kept open, are inherited, and stay valid in the child.
+ */
+void
+magic_database_atfork_child(void)
+{
+	pthread_mutex_init(&magic_database_mutex, NULL);
+}
+
+#if defined(__cplusplus)
+}
+#endif
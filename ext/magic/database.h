@@ -0,0 +1,41 @@
+#if !defined(_DATABASE_H)
+#define _DATABASE_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+
+#include <pthread.h>
+
+#define MAGIC_DATABASE_MAGICNO 0xF11E041CU
+
+typedef struct magic_database {
+	struct magic_database *next;
+	char *path;
+	void *base;
+	size_t size;
+	size_t references;
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	long mtime_nsec;
+	size_t digest;
+} magic_database_t;
+
+extern magic_database_t *magic_database_open(const char *path);
+extern magic_database_t *magic_database_embedded(void);
+extern magic_database_t *magic_database_find(const void *base, size_t size);
+extern void magic_database_release(magic_database_t *database);
+extern int magic_database_changed(magic_database_t *database);
+extern size_t magic_database_count(void);
+
+extern void magic_database_atfork_child(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _DATABASE_H */
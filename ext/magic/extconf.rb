@@ -26,6 +26,11 @@
       --disable-clean
           Do not clean out intermediate files after successful build.
 
+      --with-embedded-database[=FILE]
+          Link the compiled Magic database FILE into the extension as read-only data, and load it by
+          default instead of reading a database from a file. Without FILE, the compiled database of
+          libmagic(3) the extension is built against is used.
+
     Flags only used when building and using the packaged libraries:
 
       --disable-static
@@ -197,6 +202,36 @@ def config_system_libraries?
   end
 end
 
+#
+# Returns the compiled database to link into the extension, which is either
+# the given file, or the database of the Magic library the extension is built
+# against. Only a database in the byte order of this machine can be used, as
+# the Magic library would otherwise have to change it in place.
+#
+def embedded_database(file, libmagic_path = nil)
+  candidates = if file.is_a?(String)
+    [file]
+  elsif libmagic_path
+    [File.join(libmagic_path, 'share', 'misc', 'magic.mgc')]
+  else
+    paths = begin
+      xpopen(%w[file --version], err: File::NULL, &:read).to_s[/magic file from (.+)$/, 1].to_s.split(':')
+    rescue SystemCallError
+      []
+    end
+
+    (paths + %w[/usr/share/misc/magic /usr/share/file/magic /usr/local/share/misc/magic]).map do |path|
+      path.end_with?('.mgc') ? path : "#{path}.mgc"
+    end
+  end
+
+  path = candidates.find do |candidate|
+    File.file?(candidate) && File.binread(candidate, 4)&.unpack1('L') == 0xF11E041C
+  end
+
+  path && File.realpath(path)
+end
+
 def darwin?
   RbConfig::CONFIG['target_os'] =~ /darwin/
 end
@@ -273,6 +308,8 @@ def do_clean
   $CPPFLAGS += " -DMAGIC_CUSTOM_CHECK_TYPE"
 end
 
+libmagic_path = nil
+
 if config_system_libraries?
   message "Building ruby-magic using system libraries.\n"
 
@@ -297,6 +334,8 @@ def do_clean
     }]
   end
 
+  libmagic_path = libmagic_recipe.path
+
   $LIBPATH = [File.join(libmagic_recipe.path, 'lib')]
   $CFLAGS << " -I#{File.join(libmagic_recipe.path, 'include')} "
   $LDFLAGS += " -Wl,-rpath,#{libmagic_recipe.path}/lib"
@@ -332,6 +371,23 @@ def do_clean
   end
 end
 
+if (file = with_config('embedded-database'))
+  if config_cross_build? || windows?
+    message "Embedding the Magic database is not supported on this platform.\n"
+  elsif (path = embedded_database(file, libmagic_path))
+    require 'digest'
+
+    abort "\nThe path of the Magic database to embed cannot contain quotes: #{path}\n" if path =~ /["'\\]/
+
+    message "Embedding the Magic database from #{path}.\n"
+
+    $defs.push(%(-DMAGIC_EMBEDDED_DATABASE='"#{path}"'))
+    $defs.push(%(-DMAGIC_EMBEDDED_DATABASE_DIGEST='"#{Digest::SHA256.file(path).hexdigest[0, 16]}"'))
+  else
+    abort "\nCould not find a compiled Magic database to embed#{file.is_a?(String) ? " at #{file}" : ''}.\n"
+  end
+end
+
 $CFLAGS += ' -std=c99'
 
 if RbConfig::CONFIG['CC'] =~ /gcc/
@@ -403,6 +459,12 @@ def do_clean
 have_func('rb_thread_call_without_gvl')
 have_func('rb_thread_blocking_region')
 have_func('rb_gc_mark_movable')
+have_header('ruby/ractor.h')
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_func('rb_ractor_local_storage_value_newkey', 'ruby.h')
+have_header('ruby/fiber/scheduler.h')
+have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+have_func('rb_enc_interned_str', 'ruby/encoding.h')
 
 unless have_header('magic.h')
   abort "\n" + (<<-EOS).gsub(/^[ ]{,3}/, '') + "\n"
@@ -454,10 +516,18 @@ def do_clean
 
 have_func('magic_getflags')
 
+unless have_header('pthread.h')
+  abort "\n" + (<<-EOS).gsub(/^[ ]{,3}/, '') + "\n"
+    Your platform does not appear to provide POSIX threads (pthread.h),
+    which are required to build Ruby Magic.
+  EOS
+end
+
 %w[
   utime.h
   sys/types.h
   sys/time.h
+  sys/inotify.h
 ].each do |h|
   have_header(h)
 end
@@ -465,10 +535,36 @@ def do_clean
 %w[
   utime
   utimes
+  fstatat
+  inotify_init1
+  unshare
 ].each do |f|
   have_func(f)
 end
 
+have_struct_member('struct stat', 'st_mtim', 'sys/stat.h')
+
+# The text and binary triage uses AVX2 when the processor supports it.
+avx2 = checking_for(checking_message('AVX2')) do
+  try_link(<<~SRC)
+    #include <immintrin.h>
+
+    __attribute__((target("avx2")))
+    static int test(const void *p)
+    {
+      return _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)p));
+    }
+
+    int main(void)
+    {
+      char buffer[32] = { 0 };
+      return __builtin_cpu_supports("avx2") ? test(buffer) : 0;
+    }
+  SRC
+end
+
+$defs.push('-DHAVE_AVX2') if avx2
+
 create_header
 create_makefile('magic/magic')
 
@@ -10,6 +10,18 @@ static int safe_close(int fd);
 static int safe_cloexec(int fd);
 static int override_error_output(void *data);
 static int restore_error_output(void *data);
+static void suppress_error_output(void);
+static void resume_error_output(void);
+
+/*
+ * The standard error is process-wide, thus it is redirected only once for
+ * every concurrent caller that needs it suppressed, and restored when the
+ * last of them is done. Only the functions that parse a Magic database are
+ * ever noisy, so queries never touch it.
+ */
+static pthread_mutex_t error_output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static save_t error_output_save;
+static size_t error_output_users;
 
 static inline int
 check_fd(int fd)
@@ -185,6 +197,54 @@ error:
 	return -1;
 }
 
+static void
+suppress_error_output(void)
+{
+	int local_errno = errno;
+
+	pthread_mutex_lock(&error_output_mutex);
+
+	if (error_output_users++ == 0)
+		override_error_output(&error_output_save);
+
+	pthread_mutex_unlock(&error_output_mutex);
+
+	errno = local_errno;
+}
+
+static void
+resume_error_output(void)
+{
+	int local_errno = errno;
+
+	pthread_mutex_lock(&error_output_mutex);
+
+	assert(error_output_users > 0 &&
+	       "Error output resumed more times than suppressed");
+
+	if (--error_output_users == 0)
+		restore_error_output(&error_output_save);
+
+	pthread_mutex_unlock(&error_output_mutex);
+
+	errno = local_errno;
+}
+
+/*
+ * Called in the child after fork(), where the threads that had the error
+ * output suppressed no longer exist and would never restore it.
+ */
+void
+magic_error_output_atfork_child(void)
+{
+	pthread_mutex_init(&error_output_mutex, NULL);
+
+	if (error_output_users > 0) {
+		error_output_users = 0;
+		restore_error_output(&error_output_save);
+	}
+}
+
 inline magic_t
 magic_open_wrapper(int flags)
 {
@@ -325,7 +385,8 @@ magic_file_wrapper(magic_t magic, const char *filename, int flags)
 {
 	const char *cstring;
 
-	MAGIC_FUNCTION(magic_file, cstring, flags, magic, filename);
+	UNUSED(flags);
+	cstring = magic_file(magic, filename);
 
 	return cstring;
 }
@@ -335,7 +396,8 @@ magic_buffer_wrapper(magic_t magic, const void *buffer, size_t size, int flags)
 {
 	const char *cstring;
 
-	MAGIC_FUNCTION(magic_buffer, cstring, flags, magic, buffer, size);
+	UNUSED(flags);
+	cstring = magic_buffer(magic, buffer, size);
 
 	return cstring;
 }
@@ -351,7 +413,9 @@ magic_descriptor_wrapper(magic_t magic, int fd, int flags)
 		goto error;
 	}
 
-	MAGIC_FUNCTION(magic_descriptor, cstring, flags, magic, fd);
+	UNUSED(flags);
+	cstring = magic_descriptor(magic, fd);
+
 	return cstring;
 
 error:
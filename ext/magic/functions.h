@@ -7,16 +7,17 @@ extern "C" {
 
 #include "common.h"
 
-#define MAGIC_FUNCTION(f, r, x, ...)			 \
-	do {						 \
-		if ((x) & (MAGIC_DEBUG | MAGIC_CHECK))   \
-			r = f(__VA_ARGS__);		 \
-		else {					 \
-			save_t __##f;			 \
-			override_error_output(&(__##f)); \
-			r = f(__VA_ARGS__);		 \
-			restore_error_output(&(__##f));  \
-		}					 \
+#include <pthread.h>
+
+#define MAGIC_FUNCTION(f, r, x, ...)		       \
+	do {					       \
+		if ((x) & (MAGIC_DEBUG | MAGIC_CHECK)) \
+			r = f(__VA_ARGS__);	       \
+		else {				       \
+			suppress_error_output();       \
+			r = f(__VA_ARGS__);	       \
+			resume_error_output();	       \
+		}				       \
 	} while (0)
 
 typedef struct file_data {
@@ -66,6 +67,8 @@ extern const char *magic_descriptor_wrapper(magic_t magic, int fd,
 
 extern int magic_version_wrapper(void);
 
+extern void magic_error_output_atfork_child(void);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,516 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "pool.h"
+#include "functions.h"
+
+typedef struct magic_pool_batch {
+	magic_pool_t *pool;
+	const char **paths;
+	magic_pool_result_t *results;
+	size_t count;
+	size_t *next;
+	volatile int *cancel;
+} magic_pool_batch_t;
+
+typedef struct magic_pool_worker {
+	magic_pool_batch_t *batch;
+	magic_t cookie;
+	pthread_t thread;
+	unsigned int started:1;
+} magic_pool_worker_t;
+
+static void *magic_pool_worker(void *data);
+
+magic_pool_t *
+magic_pool_new(size_t size, int flags)
+{
+	int local_errno;
+	magic_pool_t *pool;
+
+	if (size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pool->cookies = calloc(size, sizeof(magic_t));
+	pool->free = calloc(size, sizeof(magic_t));
+	if (!pool->cookies || !pool->free) {
+		local_errno = ENOMEM;
+		goto error;
+	}
+
+	pool->size = size;
+	pool->flags = flags;
+
+	for (size_t i = 0; i < size; i++) {
+		pool->cookies[i] = magic_open_wrapper(flags);
+		if (!pool->cookies[i]) {
+			local_errno = ENOMEM;
+			goto error;
+		}
+
+		pool->free[pool->count++] = pool->cookies[i];
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->available, NULL);
+
+	return pool;
+error:
+	if (pool->cookies) {
+		for (size_t i = 0; i < size; i++) {
+			if (pool->cookies[i])
+				magic_close_wrapper(pool->cookies[i]);
+		}
+	}
+
+	free(pool->cookies);
+	free(pool->free);
+	free(pool);
+
+	errno = local_errno;
+	return NULL;
+}
+
+void
+magic_pool_free(magic_pool_t *pool)
+{
+	if (!pool)
+		return;
+
+	for (size_t i = 0; i < pool->size; i++) {
+		if (pool->cookies[i])
+			magic_close_wrapper(pool->cookies[i]);
+	}
+
+	pthread_cond_destroy(&pool->available);
+	pthread_mutex_destroy(&pool->mutex);
+
+	free(pool->cookies);
+	free(pool->free);
+	free(pool);
+}
+
+/*
+ * Closes every cookie of a drained pool (see magic_pool_drain), while the
+ * pool itself is kept, so that anyone still holding on to it finds it
+ * closed rather than released, until magic_pool_free is called.
+ */
+void
+magic_pool_close(magic_pool_t *pool)
+{
+	assert(pool != NULL &&
+	       "Must be a valid pointer to `magic_pool_t' type");
+
+	pthread_mutex_lock(&pool->mutex);
+
+	assert(pool->closed &&
+	       "Pool closed without having been drained");
+
+	for (size_t i = 0; i < pool->size; i++) {
+		if (pool->cookies[i])
+			magic_close_wrapper(pool->cookies[i]);
+
+		pool->cookies[i] = NULL;
+	}
+
+	pool->count = 0;
+
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+int
+magic_pool_closed_p(magic_pool_t *pool)
+{
+	int closed;
+
+	pthread_mutex_lock(&pool->mutex);
+	closed = pool->closed;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return closed;
+}
+
+/*
+ * Every cookie is loaded separately, as the Magic library keeps the parsed
+ * database per cookie. Compiled databases are mapped into memory by the
+ * library, thus the pages are shared between cookies either way.
+ *
+ * Must be called when no cookies are checked out.
+ */
+int
+magic_pool_load(magic_pool_t *pool, const char *magic_file)
+{
+	int rv = 0;
+
+	assert(pool != NULL &&
+	       "Must be a valid pointer to `magic_pool_t' type");
+
+	for (size_t i = 0; i < pool->size; i++) {
+		rv = magic_load_wrapper(pool->cookies[i], magic_file,
+					pool->flags);
+		if (rv < 0) {
+			/*
+			 * Move the failed cookie to the front, so that the
+			 * caller can retrieve the error message from it.
+			 */
+			magic_t cookie = pool->cookies[0];
+			pool->cookies[0] = pool->cookies[i];
+			pool->cookies[i] = cookie;
+			break;
+		}
+	}
+
+	return rv;
+}
+
+int
+magic_pool_load_buffers(magic_pool_t *pool, void **buffers, size_t *sizes,
+			size_t count)
+{
+	int rv = 0;
+
+	assert(pool != NULL &&
+	       "Must be a valid pointer to `magic_pool_t' type");
+
+	for (size_t i = 0; i < pool->size; i++) {
+		rv = magic_load_buffers_wrapper(pool->cookies[i], buffers,
+						sizes, count, pool->flags);
+		if (rv < 0) {
+			magic_t cookie = pool->cookies[0];
+			pool->cookies[0] = pool->cookies[i];
+			pool->cookies[i] = cookie;
+			break;
+		}
+	}
+
+	return rv;
+}
+
+int
+magic_pool_setparam(magic_pool_t *pool, int parameter, const void *value)
+{
+	int rv = 0;
+
+	assert(pool != NULL &&
+	       "Must be a valid pointer to `magic_pool_t' type");
+
+	for (size_t i = 0; i < pool->size; i++) {
+		rv = magic_setparam_wrapper(pool->cookies[i], parameter, value);
+		if (rv < 0)
+			break;
+	}
+
+	return rv;
+}
+
+/*
+ * Registers the calling thread as a user of the pool. Every successful
+ * call has to be paired with magic_pool_leave, and the pool cannot be
+ * released while it has users (see magic_pool_drain).
+ */
+int
+magic_pool_enter(magic_pool_t *pool)
+{
+	int rv = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->closed) {
+		errno = EBADF;
+		rv = -1;
+	} else
+		pool->users++;
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return rv;
+}
+
+void
+magic_pool_leave(magic_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+
+	assert(pool->users > 0 &&
+	       "Pool left more times than entered");
+
+	pool->users--;
+	pthread_cond_broadcast(&pool->available);
+
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Blocks until a cookie becomes available, the pool is closed, or the
+ * cancel flag is set (see magic_pool_wakeup). Returns NULL and sets errno
+ * when no cookie could be checked out.
+ */
+magic_t
+magic_pool_checkout(magic_pool_t *pool, volatile int *cancel)
+{
+	magic_t cookie = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (!pool->count && !pool->closed && !(cancel && *cancel))
+		pthread_cond_wait(&pool->available, &pool->mutex);
+
+	if (pool->closed)
+		errno = EBADF;
+	else if (pool->count)
+		cookie = pool->free[--pool->count];
+	else
+		errno = EINTR;
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return cookie;
+}
+
+void
+magic_pool_checkin(magic_pool_t *pool, magic_t cookie)
+{
+	pthread_mutex_lock(&pool->mutex);
+
+	assert(pool->count < pool->size &&
+	       "Cookie checked in more than once");
+
+	pool->free[pool->count++] = cookie;
+	pthread_cond_broadcast(&pool->available);
+
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void
+magic_pool_wakeup(magic_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pthread_cond_broadcast(&pool->available);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Marks the pool as closed and waits until every other user has left it.
+ * The caller has to be a user of the pool (see magic_pool_enter) and stays
+ * its only user afterwards, thus it can safely close the cookies of the
+ * pool (see magic_pool_close).
+ *
+ * Returns 1 when a different user is already closing the pool, in which
+ * case the caller has been removed from the pool's users, or -1 with errno
+ * set when the wait has been cancelled.
+ */
+int
+magic_pool_drain(magic_pool_t *pool, volatile int *cancel)
+{
+	int rv = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->closed) {
+		pool->users--;
+		pthread_cond_broadcast(&pool->available);
+		pthread_mutex_unlock(&pool->mutex);
+		return 1;
+	}
+
+	pool->closed = 1;
+	pthread_cond_broadcast(&pool->available);
+
+	while (pool->users > 1 && !(cancel && *cancel))
+		pthread_cond_wait(&pool->available, &pool->mutex);
+
+	if (pool->users > 1) {
+		errno = EINTR;
+		rv = -1;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return rv;
+}
+
+/*
+ * Resets the pool in a child process, where the threads that had cookies
+ * checked out, or were waiting for one, do not exist anymore, and might
+ * have left the lock of the pool held. Every cookie becomes available.
+ */
+void
+magic_pool_atfork_child(magic_pool_t *pool)
+{
+	assert(pool != NULL &&
+	       "Must be a valid pointer to `magic_pool_t' type");
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->available, NULL);
+
+	pool->users = 0;
+	pool->count = 0;
+
+	if (pool->closed)
+		return;
+
+	for (size_t i = 0; i < pool->size; i++)
+		pool->free[pool->count++] = pool->cookies[i];
+}
+
+/*
+ * Runs magic_file() for each of the paths, fanning them out to the given
+ * number of native threads, each using a different cookie of the pool. The
+ * calling thread works as one of them. Results are stored at the index of
+ * the path they belong to, and both the result and the error message are
+ * copied, thus must be released using magic_pool_results_free.
+ *
+ * The index of the next path to process is kept in the location pointed to
+ * by next, so that the batch can be resumed after having been cancelled.
+ *
+ * Must be called when no cookies are checked out.
+ */
+int
+magic_pool_files(magic_pool_t *pool, size_t threads, const char **paths,
+		 magic_pool_result_t *results, size_t count, size_t *next,
+		 volatile int *cancel)
+{
+	magic_pool_batch_t batch;
+	magic_pool_worker_t *workers;
+
+	assert(pool != NULL &&
+	       "Must be a valid pointer to `magic_pool_t' type");
+
+	if (threads > pool->size)
+		threads = pool->size;
+
+	if (threads > count - *next)
+		threads = count - *next;
+
+	if (threads < 1)
+		return 0;
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	batch = (magic_pool_batch_t) {
+		.pool    = pool,
+		.paths   = paths,
+		.results = results,
+		.count   = count,
+		.next    = next,
+		.cancel  = cancel,
+	};
+
+	for (size_t i = 0; i < threads; i++) {
+		workers[i].batch = &batch;
+		workers[i].cookie = pool->cookies[i];
+	}
+
+	/*
+	 * Failing to start a thread is not fatal, as the remaining workers,
+	 * including the calling thread, will process its share of the paths.
+	 */
+	for (size_t i = 1; i < threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL,
+				   magic_pool_worker, &workers[i]) == 0)
+			workers[i].started = 1;
+	}
+
+	magic_pool_worker(&workers[0]);
+
+	for (size_t i = 1; i < threads; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	}
+
+	free(workers);
+
+	if (*next < count) {
+		errno = EINTR;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+magic_pool_results_free(magic_pool_result_t *results, size_t count)
+{
+	if (!results)
+		return;
+
+	for (size_t i = 0; i < count; i++) {
+		free(results[i].result);
+		free(results[i].error);
+	}
+
+	free(results);
+}
+
+static void *
+magic_pool_worker(void *data)
+{
+	int local_errno;
+	size_t index;
+	const char *cstring;
+	magic_pool_worker_t *worker = data;
+	magic_pool_batch_t *batch = worker->batch;
+	magic_pool_t *pool = batch->pool;
+	magic_pool_result_t *result;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->mutex);
+
+		index = *batch->next;
+		if (index < batch->count && !(batch->cancel && *batch->cancel))
+			(*batch->next)++;
+		else
+			index = batch->count;
+
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (index >= batch->count)
+			break;
+
+		result = &batch->results[index];
+
+		errno = 0;
+		cstring = magic_file_wrapper(worker->cookie,
+					     batch->paths[index],
+					     pool->flags);
+		local_errno = errno;
+
+		result->status = !cstring ? -1 : 0;
+		/*
+		 * See magic_file_internal() for why both the error code from
+		 * the Magic library and the saved errno value are consulted.
+		 */
+		if (magic_errno_wrapper(worker->cookie) || local_errno)
+			result->status = -1;
+
+		if (cstring)
+			result->result = strdup(cstring);
+
+		if (result->status < 0) {
+			cstring = magic_error_wrapper(worker->cookie);
+			if (cstring)
+				result->error = strdup(cstring);
+
+			result->magic_errno = magic_errno_wrapper(worker->cookie);
+		}
+	}
+
+	return NULL;
+}
+
+#if defined(__cplusplus)
+}
+#endif
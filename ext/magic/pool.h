@@ -0,0 +1,63 @@
+#if !defined(_POOL_H)
+#define _POOL_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+
+#include <pthread.h>
+
+typedef struct magic_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t available;
+	magic_t *cookies;
+	magic_t *free;
+	size_t size;
+	size_t count;
+	size_t users;
+	int flags;
+	unsigned int closed:1;
+} magic_pool_t;
+
+typedef struct magic_pool_result {
+	char *result;
+	char *error;
+	int magic_errno;
+	int status;
+} magic_pool_result_t;
+
+extern magic_pool_t *magic_pool_new(size_t size, int flags);
+extern void magic_pool_free(magic_pool_t *pool);
+extern void magic_pool_close(magic_pool_t *pool);
+extern int magic_pool_closed_p(magic_pool_t *pool);
+
+extern int magic_pool_load(magic_pool_t *pool, const char *magic_file);
+extern int magic_pool_load_buffers(magic_pool_t *pool, void **buffers,
+				   size_t *sizes, size_t count);
+extern int magic_pool_setparam(magic_pool_t *pool, int parameter,
+			       const void *value);
+
+extern int magic_pool_enter(magic_pool_t *pool);
+extern void magic_pool_leave(magic_pool_t *pool);
+
+extern magic_t magic_pool_checkout(magic_pool_t *pool,
+				   volatile int *cancel);
+extern void magic_pool_checkin(magic_pool_t *pool, magic_t cookie);
+
+extern void magic_pool_wakeup(magic_pool_t *pool);
+extern int magic_pool_drain(magic_pool_t *pool, volatile int *cancel);
+extern void magic_pool_atfork_child(magic_pool_t *pool);
+
+extern int magic_pool_files(magic_pool_t *pool, size_t threads,
+			    const char **paths, magic_pool_result_t *results,
+			    size_t count, size_t *next, volatile int *cancel);
+extern void magic_pool_results_free(magic_pool_result_t *results,
+				    size_t count);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _POOL_H */
@@ -0,0 +1,46 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "progressive.h"
+
+
+/*
+ * Returns the number of leading bytes to look at in the given attempt, or
+ * the limit, for the last attempt and for any that would look at more.
+ */
+size_t
+magic_progressive_size(int tier, size_t limit)
+{
+	size_t size = MAGIC_PROGRESSIVE_BYTES;
+
+	if (tier >= MAGIC_PROGRESSIVE_TIERS - 1)
+		return limit;
+
+	for (int i = 0; i < tier; i++)
+		size *= MAGIC_PROGRESSIVE_GROWTH;
+
+	return size < limit ? size : limit;
+}
+
+/*
+ * Returns whether the result could change by looking at more of the data.
+ * Besides "data" and "application/octet-stream", which looking further can
+ * make more specific, that is any result found by looking at the data as
+ * text, as the encoding, the length of the lines, and whether the data is
+ * text at all, such as "C source, ASCII text" or "text/x-c" for data that
+ * turns out to be binary further on, depend on all of the data.
+ */
+int
+magic_progressive_generic_p(const char *result, int flags)
+{
+	if (flags & MAGIC_MIME_TYPE)
+		return strncmp(result, "text/", 5) == 0 ||
+		       strcmp(result, "application/octet-stream") == 0;
+
+	return strcmp(result, "data") == 0 || strstr(result, "text") != NULL;
+}
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,36 @@
+#if !defined(_PROGRESSIVE_H)
+#define _PROGRESSIVE_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+
+/*
+ * The leading bytes looked at first, and how many times more each next
+ * attempt looks at, with the last one looking at as much as the Magic
+ * library would otherwise.
+ */
+#define MAGIC_PROGRESSIVE_BYTES 4096
+#define MAGIC_PROGRESSIVE_GROWTH 16
+#define MAGIC_PROGRESSIVE_TIERS 3
+
+/*
+ * Only a description or a MIME type tells whether the Magic library found
+ * anything more specific than that the data is binary or text, and a list
+ * of results can only be told apart as a whole. The encoding, on its own
+ * or as part of a MIME type, depends on all of the data.
+ */
+#define MAGIC_PROGRESSIVE_FLAGS_P(f) \
+	(!((f) & (MAGIC_CONTINUE | MAGIC_EXTENSION | MAGIC_APPLE | \
+		  MAGIC_MIME_ENCODING)))
+
+extern size_t magic_progressive_size(int tier, size_t limit);
+extern int magic_progressive_generic_p(const char *result, int flags);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _PROGRESSIVE_H */
@@ -7,11 +7,34 @@ extern "C" {
 static int rb_mgc_do_not_auto_load;
 static int rb_mgc_do_not_stop_on_error;
 static int rb_mgc_warning;
+static unsigned long rb_mgc_fork_generation;
+
+static const int rb_mgc_parameters[] = {
+	MAGIC_PARAM_INDIR_MAX,
+	MAGIC_PARAM_NAME_MAX,
+	MAGIC_PARAM_ELF_PHNUM_MAX,
+	MAGIC_PARAM_ELF_SHNUM_MAX,
+	MAGIC_PARAM_ELF_NOTES_MAX,
+	MAGIC_PARAM_REGEX_MAX,
+	MAGIC_PARAM_BYTES_MAX,
+};
+
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY)
+static rb_ractor_local_key_t rb_mgc_default_key;
+static rb_ractor_local_key_t rb_mgc_shared_key;
+#else
+static VALUE rb_mgc_default;
+static VALUE rb_mgc_shared;
+#endif /* HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY */
 
 static ID id_at_flags;
 static ID id_at_paths;
+static ID id_database;
 
 static VALUE rb_cMagic;
+static VALUE rb_cMagicPool;
+static VALUE rb_cMagicResult;
+static VALUE rb_cMagicDatabase;
 
 static VALUE rb_mgc_eError;
 static VALUE rb_mgc_eMagicError;
@@ -21,15 +44,48 @@ static VALUE rb_mgc_eParameterError;
 static VALUE rb_mgc_eFlagsError;
 
 static const rb_data_type_t rb_mgc_type;
+static const rb_data_type_t rb_mgc_pool_type;
+static const rb_data_type_t rb_mgc_result_type;
+static const rb_data_type_t rb_mgc_database_type;
 
 static VALUE magic_get_parameter_internal(void *data);
 static VALUE magic_set_parameter_internal(void *data);
+static VALUE magic_get_cache_size_internal(void *data);
+static VALUE magic_set_cache_size_internal(void *data);
+static VALUE magic_cache_stats_internal(void *data);
+
+static VALUE magic_get_cache_size(VALUE object, magic_cache_t **cache);
+static VALUE magic_set_cache_size(VALUE object, magic_cache_t **cache,
+				  VALUE value);
+static VALUE magic_cache_stats(VALUE object, magic_cache_t **cache);
+static size_t magic_buffer_digest(struct buffer *buffer);
+static size_t magic_database_digest(rb_mgc_object_t *mgc);
+static int magic_watched(rb_mgc_object_t *mgc, const char *path, int flags,
+			 unsigned long *version);
+
+static VALUE magic_watch_internal(void *data);
+static VALUE magic_watched_internal(void *data);
+static VALUE magic_unwatch_internal(void *data);
+
+static VALUE magic_get_shared_cache_internal(void *data);
+static VALUE magic_set_shared_cache_internal(void *data);
+static VALUE magic_shared_cache_stats_internal(void *data);
+
+static VALUE magic_progressive_internal(void *data);
+
+static VALUE magic_database_paths(void);
+static VALUE magic_database_buffers(VALUE arguments);
+static VALUE magic_database_default(void);
+static VALUE magic_load_default(VALUE object);
+static void magic_database_check(VALUE object, rb_mgc_object_t *mgc);
+static void magic_database_free(void *data);
 
 static VALUE magic_get_flags_internal(void *data);
 static VALUE magic_set_flags_internal(void *data);
 
 static VALUE magic_load_internal(void *data);
 static VALUE magic_load_buffers_internal(void *data);
+static VALUE magic_reload_internal(void *data);
 
 static VALUE magic_compile_internal(void *data);
 static VALUE magic_check_internal(void *data);
@@ -37,14 +93,63 @@ static VALUE magic_check_internal(void *data);
 static VALUE magic_file_internal(void *data);
 static VALUE magic_buffer_internal(void *data);
 static VALUE magic_descriptor_internal(void *data);
+static VALUE magic_preload_internal(void *data);
 
 static VALUE magic_close_internal(void *data);
 
 static void *nogvl_magic_load(void *data);
 static void *nogvl_magic_compile(void *data);
+static void *magic_compile_directory(void *data);
 static void *nogvl_magic_check(void *data);
 static void *nogvl_magic_file(void *data);
 static void *nogvl_magic_descriptor(void *data);
+static void *nogvl_magic_buffer(void *data);
+static void *nogvl_magic_load_buffers(void *data);
+static void *nogvl_magic_reload(void *data);
+static void *nogvl_magic_signature_file(void *data);
+static void *nogvl_magic_triage_file(void *data);
+static void *nogvl_magic_file_progressive(void *data);
+static void *nogvl_magic_buffer_progressive(void *data);
+static void *nogvl_magic_reload_drain(void *data);
+static void magic_reload_free(rb_mgc_reload_arguments_t *mra);
+static VALUE magic_reload_call(VALUE value);
+static VALUE magic_reload_release(VALUE value);
+
+static void *nogvl_magic_pool(void *data);
+static void *nogvl_magic_pool_load(void *data);
+static void *nogvl_magic_pool_drain(void *data);
+static void *nogvl_magic_pool_load_buffers(void *data);
+static void magic_pool_ubf(void *data);
+
+static VALUE magic_identify_call(VALUE value);
+static VALUE magic_identify_internal(void *data);
+static VALUE magic_identify_release(VALUE value);
+static void *nogvl_magic_read(void *data);
+
+static VALUE magic_files_call(VALUE value);
+static VALUE magic_files_internal(void *data);
+static VALUE magic_files_release(VALUE value);
+static void *nogvl_magic_files(void *data);
+static void magic_files_ubf(void *data);
+
+static void magic_offload(void *(*function)(void *), void *data);
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+static VALUE magic_offload_thread(void *data);
+static VALUE magic_offload_wait(VALUE thread);
+static VALUE magic_offload_join(VALUE thread);
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+static magic_pool_t *magic_workers_new(rb_mgc_files_arguments_t *mfa);
+static void magic_workers_free(rb_mgc_object_t *mgc);
+
+static magic_t magic_cookies_get(rb_mgc_object_t *mgc, int flags);
+static void magic_cookies_free(rb_mgc_object_t *mgc);
+
+static void magic_pool_object_atfork(rb_mgc_pool_object_t *mpo);
+static VALUE magic_pool_call(rb_mgc_pool_object_t *mpo,
+			     rb_mgc_pool_arguments_t *mpa);
+static VALUE magic_pool_internal(VALUE value);
+static VALUE magic_pool_release(VALUE value);
 
 static void *magic_library_open(void);
 static void magic_library_close(void *data);
@@ -53,27 +158,172 @@ static VALUE magic_allocate(VALUE klass);
 static void magic_mark(void *data);
 static void magic_free(void *data);
 static size_t magic_size(const void *data);
-#if defined(HAVE_RUBY_GC_COMPACT)
-static void magic_compact(void *data);
-#endif
 
 static VALUE magic_exception_wrapper(VALUE value);
 static VALUE magic_exception(void *data);
 
 static VALUE magic_library_error(VALUE klass, void *data);
+static VALUE magic_arguments_error(rb_mgc_arguments_t *mga);
 static VALUE magic_generic_error(VALUE klass, int magic_errno,
 				 const char *magic_error);
 
 static VALUE magic_lock(VALUE object, VALUE (*function)(ANYARGS),
 			void *data);
 static VALUE magic_unlock(VALUE object);
+static void magic_lock_wait(VALUE object, magic_lock_t *lock, VALUE fiber);
+static VALUE magic_lock_sleep(VALUE value);
+static void magic_lock_dequeue(magic_lock_t *lock, magic_lock_waiter_t *waiter);
+static void magic_lock_wakeup(VALUE object, magic_lock_t *lock);
+static void magic_lock_atfork_child(void);
 
 static VALUE magic_return(void *data);
+static inline VALUE magic_intern(const char *cstring, size_t length);
+static inline VALUE magic_intern_strip(const char *cstring, size_t length);
 
 static int magic_get_flags(VALUE object);
 static void magic_set_flags(VALUE object, int flags);
+static int magic_options(VALUE object, VALUE options, int *result);
 
 static VALUE magic_set_paths(VALUE object, VALUE value);
+static VALUE magic_default_paths(void);
+
+static VALUE magic_get_default(void);
+static void magic_set_default(VALUE value);
+static VALUE magic_get_shared(void);
+static void magic_set_shared(VALUE value);
+static VALUE magic_preload_object(VALUE database, VALUE flags);
+
+static VALUE magic_result_new(rb_mgc_arguments_t *mga, int flags);
+static size_t magic_result_first(rb_mgc_result_object_t *mro);
+static void magic_result_mark(void *data);
+static void magic_result_free(void *data);
+static size_t magic_result_size(const void *data);
+
+static VALUE magic_pool_allocate(VALUE klass);
+static void magic_pool_object_free(void *data);
+static size_t magic_pool_object_size(const void *data);
+
+/*
+ * call-seq:
+ *    Magic.default -> self
+ *
+ * Returns the default _Magic_ object of the current Ractor, creating a new
+ * one on first use, or when the previous one has been closed.
+ *
+ * Each Ractor gets a separate Magic object, and thus a separate underlying
+ * _Magic_ library handle, as these cannot be shared between Ractors.
+ *
+ * Example:
+ *
+ *    magic = Magic.default
+ *    magic.equal?(Magic.default)                     #=> true
+ *    magic.equal?(Ractor.new { Magic.default }.take) #=> false
+ *
+ * See also: Magic::new and Magic::parallel_map
+ */
+VALUE
+rb_mgc_get_default_global(RB_UNUSED_VAR(VALUE object))
+{
+	VALUE value;
+
+	value = magic_get_default();
+	if (NIL_P(value) || MAGIC_CLOSED_P(value)) {
+		value = rb_class_new_instance(0, 0, rb_cMagic);
+		magic_set_default(value);
+	}
+
+	return value;
+}
+
+/*
+ * call-seq:
+ *    Magic.preload!                                    -> self
+ *    Magic.preload!( integer, ... )                    -> self
+ *    Magic.preload!( integer, ..., database: database ) -> self
+ *
+ * Loads the database into a new default _Magic_ object of the current
+ * Ractor (see Magic::default), together with a separate underlying _Magic_
+ * library handle for each of the given flags, and returns it. The database
+ * is loaded even when Magic::do_not_auto_load is set. The same is done for
+ * the separate object that Magic::file, Magic::buffer and Magic::descriptor,
+ * and the File and String core extensions, use.
+ *
+ * Meant to be called in a parent process before forking workers, such as
+ * in the Puma or Unicorn master process, so that the workers use what the
+ * parent had loaded instead of loading it again, sharing the memory with
+ * the parent copy-on-write. The database is loaded from the default paths
+ * unless a Magic::Database is given, in which case the memory it is mapped
+ * into is shared with every other process that uses the same file.
+ *
+ * Locks and other per-process state are reset in a child process the first
+ * time a _Magic_ object is used there, thus nothing has to be done after
+ * forking.
+ *
+ * Example:
+ *
+ *    Magic.preload!(Magic::MIME_TYPE)  #=> #<Magic:0x00007f8e3b0a1b28 @flags=0, @paths=[...]>
+ *    fork { "...".type }               # Uses the database loaded above.
+ *
+ * See also: Magic::default, Magic::Database and Magic#file
+ */
+VALUE
+rb_mgc_preload_global(int argc, VALUE *argv, RB_UNUSED_VAR(VALUE klass))
+{
+	ID keywords[1];
+	VALUE values[1] = { Qundef };
+	VALUE flags, options, object;
+
+	rb_scan_args(argc, argv, "*:", &flags, &options);
+
+	for (long i = 0; i < RARRAY_LEN(flags); i++)
+		MAGIC_CHECK_INTEGER_TYPE(RARRAY_AREF(flags, i));
+
+	if (!NIL_P(options)) {
+		keywords[0] = rb_intern("database");
+		rb_get_kwargs(options, keywords, 0, 1, values);
+	}
+
+	if (values[0] == Qundef)
+		values[0] = Qnil;
+
+	if (!NIL_P(values[0]) && !DATABASE_P(values[0]))
+		MAGIC_ARGUMENT_TYPE_ERROR(values[0], "Magic::Database");
+
+	object = magic_preload_object(values[0], flags);
+	magic_set_shared(magic_preload_object(values[0], flags));
+	magic_set_default(object);
+
+	return object;
+}
+
+/*
+ * call-seq:
+ *    Magic.shared -> self
+ *
+ * Returns the _Magic_ object of the current Ractor that Magic::file,
+ * Magic::buffer and Magic::descriptor, and the File and String core
+ * extensions, use, creating a new one on first use. It is separate from
+ * Magic::default and never handed out, thus changing the default object,
+ * such as loading a different database into it or closing it, does not
+ * affect them. A new object is returned every time when
+ * Magic::do_not_auto_load is set, as nothing would be loaded into it.
+ */
+VALUE
+rb_mgc_get_shared_global(RB_UNUSED_VAR(VALUE object))
+{
+	VALUE value;
+
+	if (MAGIC_ATOMIC_LOAD(&rb_mgc_do_not_auto_load))
+		return rb_class_new_instance(0, 0, rb_cMagic);
+
+	value = magic_get_shared();
+	if (NIL_P(value) || MAGIC_CLOSED_P(value)) {
+		value = rb_class_new_instance(0, 0, rb_cMagic);
+		magic_set_shared(value);
+	}
+
+	return value;
+}
 
 /*
  * call-seq:
@@ -93,7 +343,7 @@ static VALUE magic_set_paths(VALUE object, VALUE value);
 VALUE
 rb_mgc_get_do_not_auto_load_global(RB_UNUSED_VAR(VALUE object))
 {
-	return CBOOL2RVAL(rb_mgc_do_not_auto_load);
+	return CBOOL2RVAL(MAGIC_ATOMIC_LOAD(&rb_mgc_do_not_auto_load));
 }
 
 /*
@@ -126,7 +376,7 @@ rb_mgc_get_do_not_auto_load_global(RB_UNUSED_VAR(VALUE object))
 VALUE
 rb_mgc_set_do_not_auto_load_global(RB_UNUSED_VAR(VALUE object), VALUE value)
 {
-	rb_mgc_do_not_auto_load = RVAL2CBOOL(value);
+	MAGIC_ATOMIC_STORE(&rb_mgc_do_not_auto_load, RVAL2CBOOL(value));
 
 	return value;
 }
@@ -149,7 +399,7 @@ rb_mgc_set_do_not_auto_load_global(RB_UNUSED_VAR(VALUE object), VALUE value)
 VALUE
 rb_mgc_get_do_not_stop_on_error_global(RB_UNUSED_VAR(VALUE object))
 {
-	return CBOOL2RVAL(rb_mgc_do_not_stop_on_error);
+	return CBOOL2RVAL(MAGIC_ATOMIC_LOAD(&rb_mgc_do_not_stop_on_error));
 }
 
 /*
@@ -167,7 +417,7 @@ rb_mgc_get_do_not_stop_on_error_global(RB_UNUSED_VAR(VALUE object))
 VALUE
 rb_mgc_set_do_not_stop_on_error_global(RB_UNUSED_VAR(VALUE object), VALUE value)
 {
-	rb_mgc_do_not_stop_on_error = RVAL2CBOOL(value);
+	MAGIC_ATOMIC_STORE(&rb_mgc_do_not_stop_on_error, RVAL2CBOOL(value));
 
 	return value;
 }
@@ -177,9 +427,13 @@ rb_mgc_set_do_not_stop_on_error_global(RB_UNUSED_VAR(VALUE object), VALUE value)
  *    Magic.new                -> self
  *    Magic.new( string, ... ) -> self
  *    Magic.new( array )       -> self
+ *    Magic.new( database )    -> self
  *
  * Opens the underlying _Magic_ database and returns a new _Magic_.
  *
+ * When given a Magic::Database, the new _Magic_ refers directly to the
+ * database mapped into memory, rather than loading it again.
+ *
  * Example:
  *
  *    magic = Magic.new
@@ -200,25 +454,22 @@ rb_mgc_initialize(VALUE object, VALUE arguments)
 		MAGIC_WARNING(0, "%s::new() does not take block; use %s::open() instead",
 				 klass, klass);
 
-	if (RTEST(rb_eval_string("ENV['MAGIC_DO_NOT_STOP_ON_ERROR']")))
-		rb_mgc_do_not_stop_on_error = 1;
+	if (getenv("MAGIC_DO_NOT_STOP_ON_ERROR"))
+		MAGIC_ATOMIC_STORE(&rb_mgc_do_not_stop_on_error, 1);
 
-	if (RTEST(rb_eval_string("ENV['MAGIC_DO_NOT_AUTOLOAD']")))
-		rb_mgc_do_not_auto_load = 1;
+	if (getenv("MAGIC_DO_NOT_AUTOLOAD"))
+		MAGIC_ATOMIC_STORE(&rb_mgc_do_not_auto_load, 1);
 
 	MAGIC_OBJECT(object, mgc);
 
 	mgc->stop_on_errors = 1;
-	if (rb_mgc_do_not_stop_on_error)
+	if (MAGIC_ATOMIC_LOAD(&rb_mgc_do_not_stop_on_error))
 		mgc->stop_on_errors = 0;
 
-	mgc->mutex = rb_class_new_instance(0, 0, rb_const_get(rb_cObject,
-					   rb_intern("Mutex")));
-
 	magic_set_flags(object, MAGIC_NONE);
 	magic_set_paths(object, RARRAY_EMPTY);
 
-	if (rb_mgc_do_not_auto_load) {
+	if (MAGIC_ATOMIC_LOAD(&rb_mgc_do_not_auto_load)) {
 		if (!RARRAY_EMPTY_P(arguments))
 			MAGIC_WARNING(1, "%s::do_not_auto_load is set; using %s#new() to load "
 					 "Magic database from a file will have no effect",
@@ -226,7 +477,12 @@ rb_mgc_initialize(VALUE object, VALUE arguments)
 		return object;
 	}
 
-	rb_mgc_load(object, arguments);
+	if (RARRAY_EMPTY_P(arguments))
+		magic_load_default(object);
+	else if (DATABASE_P(RARRAY_FIRST(arguments)))
+		rb_mgc_load_buffers(object, arguments);
+	else
+		rb_mgc_load(object, arguments);
 
 	return object;
 }
@@ -607,7 +863,7 @@ rb_mgc_load(VALUE object, VALUE arguments)
 	MAGIC_CHECK_OPEN(object);
 	MAGIC_OBJECT(object, mgc);
 
-	if (rb_mgc_do_not_auto_load) {
+	if (MAGIC_ATOMIC_LOAD(&rb_mgc_do_not_auto_load)) {
 		klass = "Magic";
 		if (!NIL_P(object))
 			klass = rb_obj_classname(object);
@@ -636,10 +892,14 @@ rb_mgc_load(VALUE object, VALUE arguments)
 	MAGIC_SYNCHRONIZED(magic_load_internal, &mga);
 	if (mga.status < 0) {
 		mgc->database_loaded = 0;
+		mgc->database_mapped = 0;
+		mgc->buffers = Qnil;
 		MAGIC_LIBRARY_ERROR(mgc);
 	}
 
 	mgc->database_loaded = 1;
+	mgc->database_mapped = 0;
+	mgc->buffers = Qnil;
 
 	value = magic_split(CSTR2RVAL(mga.file.path), CSTR2RVAL(":"));
 	RB_GC_GUARD(value);
@@ -651,10 +911,14 @@ rb_mgc_load(VALUE object, VALUE arguments)
 
 /*
  * call-seq:
- *    magic.load_buffers( string, ... ) -> nil
- *    magic.load_buffers( array )       -> nil
+ *    magic.load_buffers( string, ... )   -> nil
+ *    magic.load_buffers( array )         -> nil
+ *    magic.load_buffers( database, ... ) -> nil
+ *
+ * A Magic::Database is loaded without copying it, using the memory it is
+ * mapped into.
  *
- * See also: Magic#load and Magic::do_not_auto_load
+ * See also: Magic#load, Magic::Database and Magic::do_not_auto_load
  */
 VALUE
 rb_mgc_load_buffers(VALUE object, VALUE arguments)
@@ -666,6 +930,7 @@ rb_mgc_load_buffers(VALUE object, VALUE arguments)
 	void **pointers = NULL;
 	size_t *sizes = NULL;
 	VALUE value = Qundef;
+	VALUE buffers = Qundef;
 
 	count = (size_t)RARRAY_LEN(arguments);
 	MAGIC_CHECK_ARGUMENT_MISSING(count, 1);
@@ -676,11 +941,27 @@ rb_mgc_load_buffers(VALUE object, VALUE arguments)
 	}
 
 	MAGIC_CHECK_ARRAY_EMPTY(arguments);
+
+	arguments = magic_database_buffers(arguments);
 	MAGIC_CHECK_ARRAY_OF_STRINGS(arguments);
 
 	MAGIC_CHECK_OPEN(object);
 	MAGIC_OBJECT(object, mgc);
 
+	/*
+	 * The Magic library does not copy the buffers, and keeps referring to
+	 * them for as long as the database stays loaded. Thus, keep frozen
+	 * copies of the strings, which share contents with the originals, so
+	 * that the strings cannot change or go away underneath the library.
+	 */
+	buffers = rb_ary_new_capa((long)count);
+	for (size_t i = 0; i < count; i++) {
+		value = RARRAY_AREF(arguments, (long)i);
+		rb_ary_push(buffers, rb_str_new_frozen(value));
+	}
+
+	rb_obj_freeze(buffers);
+
 	pointers = ALLOC_N(void *, count);
 	if (!pointers) {
 		local_errno = ENOMEM;
@@ -695,7 +976,7 @@ rb_mgc_load_buffers(VALUE object, VALUE arguments)
 	}
 
 	for (size_t i = 0; i < count; i++) {
-		value = RARRAY_AREF(arguments, (long)i);
+		value = RARRAY_AREF(buffers, (long)i);
 		pointers[i] = (void *)RSTRING_PTR(value);
 		sizes[i] = (size_t)RSTRING_LEN(value);
 	}
@@ -721,6 +1002,14 @@ rb_mgc_load_buffers(VALUE object, VALUE arguments)
 	}
 
 	mgc->database_loaded = 1;
+	mgc->database_mapped = 0;
+	mgc->buffers = buffers;
+
+	for (size_t i = 0; i < count; i++) {
+		value = RARRAY_AREF(buffers, (long)i);
+		if (!NIL_P(rb_ivar_get(value, id_database)))
+			mgc->database_mapped = 1;
+	}
 
 	ruby_xfree(pointers);
 	ruby_xfree(sizes);
@@ -728,6 +1017,8 @@ rb_mgc_load_buffers(VALUE object, VALUE arguments)
 	return Qnil;
 error:
 	mgc->database_loaded = 0;
+	mgc->database_mapped = 0;
+	mgc->buffers = Qnil;
 
 	if (local_errno == ENOMEM)
 		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError,
@@ -737,6 +1028,72 @@ error:
 	MAGIC_LIBRARY_ERROR(mgc);
 }
 
+/*
+ * call-seq:
+ *    magic.reload                -> nil
+ *    magic.reload( string, ... ) -> nil
+ *    magic.reload( array )       -> nil
+ *
+ * Loads the Magic database from the given paths, or from the paths of the
+ * current database (see Magic#paths) if none are given, and then replaces
+ * the current database with it.
+ *
+ * Unlike Magic#load, which holds the lock of the _Magic_ object for as long
+ * as it takes to parse the database, the database is loaded into separate
+ * underlying _Magic_ library handles, thus other threads keep using the
+ * current database in the meantime, and only wait for the handles to be
+ * swapped. A call already in progress finishes using the current database,
+ * which is closed once it is done. Should the database fail to load, an
+ * exception is raised, and the current database is kept.
+ *
+ * Example:
+ *
+ *    magic = Magic.new('rules.mgc')
+ *    Thread.new { magic.reload('rules.mgc') }  # Calls are not held up meanwhile.
+ *
+ * See also: Magic#load and Magic#paths
+ */
+VALUE
+rb_mgc_reload(VALUE object, VALUE arguments)
+{
+	rb_mgc_object_t *mgc;
+	rb_mgc_reload_arguments_t mra;
+	VALUE paths = Qundef;
+
+	if (ARRAY_P(RARRAY_FIRST(arguments)))
+		arguments = magic_flatten(arguments);
+
+	MAGIC_CHECK_ARRAY_OF_STRINGS(arguments);
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	if (RARRAY_EMPTY_P(arguments))
+		arguments = rb_mgc_get_paths(object);
+
+	paths = magic_join(arguments, CSTR2RVAL(":"));
+
+	mra = (rb_mgc_reload_arguments_t) {
+		.object = object,
+		.magic_object = mgc,
+		.database = ruby_strdup(StringValueCStr(paths)),
+		.buffers = Qnil,
+		.flags = mgc->flags,
+	};
+
+	RB_GC_GUARD(paths);
+
+	/*
+	 * What has been loaded, or swapped out, is closed however the call
+	 * ends, including when interrupted while waiting for the lock.
+	 */
+	rb_ensure(magic_reload_call, (VALUE)&mra, magic_reload_release,
+		  (VALUE)&mra);
+	RB_GC_GUARD(mra.buffers);
+
+	return Qnil;
+}
+
 /*
  * call-seq:
  *    magic.loaded? -> true or false
@@ -771,34 +1128,79 @@ rb_mgc_load_p(VALUE object)
 
 /*
  * call-seq:
- *    magic.compile( string ) -> nil
- *    magic.compile( array )  -> nil
+ *    magic.compile( string )                    -> nil
+ *    magic.compile( array )                     -> nil
+ *    magic.compile( string, directory: string ) -> nil
+ *
+ * Compiles the _Magic_ database source at the given path. The _Magic_
+ * library writes the compiled database to the current working directory,
+ * named after the source with the ".mgc" suffix added.
+ *
+ * When a directory is given, the compiled database is written there
+ * instead, and a relative path to the source is looked up from there too.
+ * Where threads can have a working directory of their own, such as on
+ * Linux, the database is compiled by a separate thread that changes only
+ * its own working directory. Elsewhere, the working directory of the
+ * process is changed for as long as it takes, without letting any other
+ * thread of the Ractor run meanwhile.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.compile('/srv/rules', directory: '/srv/compiled')  #=> nil
+ *    File.exist?('/srv/compiled/rules.mgc')                   #=> true
  *
  * See also: Magic#check, Magic::check and Magic::compile
  */
 VALUE
-rb_mgc_compile(VALUE object, VALUE value)
+rb_mgc_compile(int argc, VALUE *argv, VALUE object)
 {
+	ID keywords[1];
 	rb_mgc_object_t *mgc;
 	rb_mgc_arguments_t mga;
+	VALUE value, options, directory = Qundef;
+
+	rb_scan_args(argc, argv, "1:", &value, &options);
+
+	if (!NIL_P(options)) {
+		keywords[0] = rb_intern("directory");
+		rb_get_kwargs(options, keywords, 0, 1, &directory);
+	}
 
 	MAGIC_CHECK_STRING_TYPE(value);
 
+	if (directory == Qundef)
+		directory = Qnil;
+
+	if (!NIL_P(directory)) {
+		directory = magic_path(directory);
+		MAGIC_CHECK_STRING_TYPE(directory);
+	}
+
 	MAGIC_CHECK_OPEN(object);
 	MAGIC_OBJECT(object, mgc);
 
 	mga = (rb_mgc_arguments_t) {
 		.magic_object = mgc,
-		.file = {
+		.compile = {
 			.path = RVAL2CSTR(value),
+			.directory = RVAL2CSTR(directory),
 		},
 		.flags = magic_get_flags(object),
 	};
 
 	MAGIC_SYNCHRONIZED(magic_compile_internal, &mga);
+
+	if (mga.status < 0 && mga.compile.local_errno) {
+		errno = mga.compile.local_errno;
+		rb_sys_fail(mga.compile.directory);
+	}
+
 	if (mga.status < 0)
 		MAGIC_LIBRARY_ERROR(mgc);
 
+	RB_GC_GUARD(directory);
+
 	return Qnil;
 }
 
@@ -835,29 +1237,62 @@ rb_mgc_check(VALUE object, VALUE value)
 
 /*
  * call-seq:
- *    magic.file( object ) -> string or array
- *    magic.file( string ) -> string or array
+ *    magic.file( object )                 -> string or array
+ *    magic.file( string )                 -> string or array
+ *    magic.file( string, flags: integer ) -> string or array
+ *    magic.file( string, result: true )   -> Magic::Result
+ *
+ * When flags are given, then these are used for this call only, in place
+ * of the flags set for the Magic object, which are left intact.
+ *
+ * Each set of flags a query runs with, including the Magic::ERROR flag
+ * added when the object stops on errors, and the Magic::RAW flag added
+ * together with Magic::CONTINUE, is served by a separate underlying _Magic_
+ * library handle, into which the database is loaded again the first time
+ * the flags are used. A compiled database is only mapped into memory, and
+ * costs little to load again, but a database of source files is parsed and
+ * compiled every time, which takes about 200 milliseconds for one of 20,000
+ * rules. Compile such a database first (see Magic#compile), load it from a
+ * Magic::Database, or load the handles upfront (see Magic::preload!).
+ *
+ * When +result+ is +true+, then a Magic::Result is returned in place of
+ * the string or array.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.file('/etc/passwd')                          #=> "ASCII text"
+ *    magic.file('/etc/passwd', flags: Magic::MIME_TYPE) #=> "text/plain"
+ *    magic.flags                                        #=> 0
  *
  * See also: Magic#buffer and Magic#descriptor
  */
 VALUE
-rb_mgc_file(VALUE object, VALUE value)
+rb_mgc_file(int argc, VALUE *argv, VALUE object)
 {
+	int flags;
+	int structured;
 	rb_mgc_object_t *mgc;
 	rb_mgc_arguments_t mga;
+	VALUE value, options;
 	const char *empty = "(null)";
 
 	UNUSED(empty);
 
+	rb_scan_args(argc, argv, "1:", &value, &options);
+
 	if (NIL_P(value))
 		goto error;
 
 	MAGIC_CHECK_OPEN(object);
 	MAGIC_CHECK_LOADED(object);
 	MAGIC_OBJECT(object, mgc);
+	magic_database_check(object, mgc);
 
 	if (rb_respond_to(value, rb_intern("to_io")))
-		return rb_mgc_descriptor(object, value);
+		return rb_mgc_descriptor(argc, argv, object);
+
+	flags = magic_options(object, options, &structured);
 
 	value = magic_path(value);
 	if (NIL_P(value))
@@ -868,7 +1303,7 @@ rb_mgc_file(VALUE object, VALUE value)
 		.file = {
 			.path = RVAL2CSTR(value),
 		},
-		.flags = magic_get_flags(object),
+		.flags = flags,
 	};
 
 	MAGIC_SYNCHRONIZED(magic_file_internal, &mga);
@@ -887,9 +1322,10 @@ rb_mgc_file(VALUE object, VALUE value)
 		 * the desired behavior as per the standards.
 		 */
 		if (mgc->stop_on_errors || (mga.flags & MAGIC_ERROR))
-			MAGIC_LIBRARY_ERROR(mgc);
+			rb_exc_raise(magic_arguments_error(&mga));
 
-		mga.result = magic_error_wrapper(mgc->cookie);
+		if (RTEST(mga.error))
+			mga.result = RSTRING_PTR(mga.error);
 	}
 	if (!mga.result)
 		MAGIC_GENERIC_ERROR(rb_mgc_eMagicError, EINVAL, E_UNKNOWN);
@@ -906,6 +1342,9 @@ rb_mgc_file(VALUE object, VALUE value)
 	assert(strncmp(mga.result, empty, strlen(empty)) != 0 &&
 		       "Empty or invalid result");
 
+	if (structured)
+		return magic_result_new(&mga, flags);
+
 	return magic_return(&mga);
 error:
 	MAGIC_ARGUMENT_TYPE_ERROR(value, "String or IO-like object");
@@ -913,56 +1352,225 @@ error:
 
 /*
  * call-seq:
- *    magic.buffer( string ) -> string or array
+ *    magic.files( array )                   -> array
+ *    magic.files( array, threads: integer ) -> array
+ *
+ * Returns the results for each of the paths in the array, in the same order,
+ * as if Magic#file was called for each of them. When the number of threads
+ * is not given, then the number of online processors is used.
+ *
+ * The paths are processed by a number of native threads, each using its own
+ * underlying _Magic_ database handle loaded from the same files and set to
+ * use the same flags and parameters, without holding the global interpreter
+ * lock (GVL). The handles are kept for subsequent calls.
+ *
+ * Errors are not raised. Instead, a Magic::MagicError is returned in place
+ * of the result for the path that caused it.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_TYPE | Magic::ERROR
+ *    magic.files(['/etc/passwd', '/nonexistent'], threads: 2) #=> ["text/plain", #<Magic::MagicError: cannot stat `/nonexistent' (No such file or directory)>]
+ *
+ * See also: Magic#file and Magic::Pool
+ */
+VALUE
+rb_mgc_files(int argc, VALUE *argv, VALUE object)
+{
+	long threads;
+	size_t count, length = 0;
+	char *cstring;
+	rb_mgc_object_t *mgc;
+	rb_mgc_files_arguments_t mfa;
+	VALUE paths, options, strings, value;
+	VALUE database = Qnil;
+	ID keywords[1];
+	VALUE values[1] = { Qundef };
+
+	rb_scan_args(argc, argv, "1:", &paths, &options);
+
+	MAGIC_CHECK_RUBY_TYPE(paths, T_ARRAY);
+
+	if (!NIL_P(options)) {
+		keywords[0] = rb_intern("threads");
+		rb_get_kwargs(options, keywords, 0, 1, values);
+	}
+
+	if (values[0] == Qundef || NIL_P(values[0])) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads < 1)
+			threads = 1;
+	} else {
+		MAGIC_CHECK_INTEGER_TYPE(values[0]);
+		threads = NUM2LONG(values[0]);
+	}
+
+	if (threads < 1)
+		rb_raise(rb_eArgError, "%s",
+			 MAGIC_ERRORS(E_THREADS_INVALID_NUMBER));
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_CHECK_LOADED(object);
+	MAGIC_OBJECT(object, mgc);
+	magic_database_check(object, mgc);
+
+	/*
+	 * Converting a path can run arbitrary code through to_path, which
+	 * could change the array while it is being walked.
+	 */
+	paths = rb_ary_dup(paths);
+
+	count = (size_t)RARRAY_LEN(paths);
+	if (count == 0)
+		return rb_ary_new();
+
+	strings = rb_ary_new_capa((long)count);
+	for (size_t i = 0; i < count; i++) {
+		value = RARRAY_AREF(paths, (long)i);
+		if (!NIL_P(value))
+			value = magic_path(value);
+		if (NIL_P(value))
+			MAGIC_ARGUMENT_TYPE_ERROR(value, "String or IO-like object");
+
+		StringValueCStr(value);
+		length += (size_t)RSTRING_LEN(value) + 1;
+		rb_ary_push(strings, value);
+	}
+
+	if (NIL_P(mgc->buffers))
+		database = magic_join(rb_ivar_get(object, id_at_paths),
+				      CSTR2RVAL(":"));
+
+	mfa = (rb_mgc_files_arguments_t) {
+		.object = object,
+		.magic_object = mgc,
+		.database = RVAL2CSTR(database),
+		.count = count,
+		.threads = (size_t)threads < count ? (size_t)threads : count,
+		.flags = magic_get_flags(object),
+	};
+
+	if (mgc->stop_on_errors)
+		mfa.flags |= MAGIC_ERROR;
+
+	if (mfa.flags & MAGIC_CONTINUE)
+		mfa.flags |= MAGIC_RAW;
+
+	/*
+	 * The paths are copied, as the strings could otherwise be moved by the
+	 * garbage collector while the worker threads are still using them.
+	 */
+	mfa.paths = ruby_xmalloc(count * sizeof(char *) + length);
+	cstring = (char *)(mfa.paths + count);
+	for (size_t i = 0; i < count; i++) {
+		value = RARRAY_AREF(strings, (long)i);
+		memcpy(cstring, RSTRING_PTR(value), (size_t)RSTRING_LEN(value));
+		cstring[RSTRING_LEN(value)] = '\0';
+		mfa.paths[i] = cstring;
+		cstring += RSTRING_LEN(value) + 1;
+	}
+
+	mfa.results = calloc(count, sizeof(magic_pool_result_t));
+	if (!mfa.results) {
+		ruby_xfree(mfa.paths);
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
+	}
+
+	RB_GC_GUARD(database);
+	RB_GC_GUARD(strings);
+
+	return rb_ensure(magic_files_call, (VALUE)&mfa,
+			 magic_files_release, (VALUE)&mfa);
+}
+
+/*
+ * call-seq:
+ *    magic.buffer( string )                 -> string or array
+ *    magic.buffer( string, flags: integer ) -> string or array
+ *    magic.buffer( string, result: true )   -> Magic::Result
+ *
+ * The _Magic_ library runs without holding the global interpreter lock (GVL),
+ * and reads from a frozen copy of the string that shares its contents, thus
+ * the string can be safely modified by other threads in the meantime.
+ *
+ * When flags are given, then these are used for this call only, and when
+ * +result+ is +true+, then a Magic::Result is returned.
  *
  * See also: Magic#file and Magic#descriptor
  */
 VALUE
-rb_mgc_buffer(VALUE object, VALUE value)
+rb_mgc_buffer(int argc, VALUE *argv, VALUE object)
 {
+	int flags;
+	int structured;
 	rb_mgc_object_t *mgc;
 	rb_mgc_arguments_t mga;
+	VALUE value, options, result;
+
+	rb_scan_args(argc, argv, "1:", &value, &options);
 
 	MAGIC_CHECK_STRING_TYPE(value);
 
 	MAGIC_CHECK_OPEN(object);
 	MAGIC_CHECK_LOADED(object);
 	MAGIC_OBJECT(object, mgc);
+	magic_database_check(object, mgc);
+
+	flags = magic_options(object, options, &structured);
 
 	StringValue(value);
+	value = rb_str_new_frozen(value);
 
 	mga = (rb_mgc_arguments_t) {
 		.magic_object = mgc,
-		.buffers = {
-			.pointers = (void **)RSTRING_PTR(value),
-			.sizes    = (size_t *)RSTRING_LEN(value),
+		.buffer = {
+			.pointer = RSTRING_PTR(value),
+			.size    = (size_t)RSTRING_LEN(value),
 		},
-		.flags = magic_get_flags(object),
+		.flags = flags,
 	};
 
 	MAGIC_SYNCHRONIZED(magic_buffer_internal, &mga);
 	if (mga.status < 0)
-		MAGIC_LIBRARY_ERROR(mgc);
+		rb_exc_raise(magic_arguments_error(&mga));
 
 	assert(mga.result != NULL &&
 	       "Must be a valid pointer to `const char' type");
 
-	return magic_return(&mga);
+	if (structured)
+		result = magic_result_new(&mga, flags);
+	else
+		result = magic_return(&mga);
+
+	RB_GC_GUARD(value);
+
+	return result;
 }
 
 /*
  * call-seq:
- *    magic.descriptor( object )  -> string or array
- *    magic.descriptor( integer ) -> string or array
+ *    magic.descriptor( object )                  -> string or array
+ *    magic.descriptor( integer )                 -> string or array
+ *    magic.descriptor( integer, flags: integer ) -> string or array
+ *    magic.descriptor( integer, result: true )   -> Magic::Result
+ *
+ * When flags are given, then these are used for this call only, and when
+ * +result+ is +true+, then a Magic::Result is returned.
  *
  * See also: Magic#file and Magic#buffer
  */
 VALUE
-rb_mgc_descriptor(VALUE object, VALUE value)
+rb_mgc_descriptor(int argc, VALUE *argv, VALUE object)
 {
-	int local_errno;
+	int flags;
+	int structured;
 	rb_mgc_object_t *mgc;
 	rb_mgc_arguments_t mga;
+	VALUE value, options;
+
+	rb_scan_args(argc, argv, "1:", &value, &options);
 
 	if (rb_respond_to(value, rb_intern("to_io")))
 		value = INT2NUM(magic_fileno(value));
@@ -972,628 +1580,4654 @@ rb_mgc_descriptor(VALUE object, VALUE value)
 	MAGIC_CHECK_OPEN(object);
 	MAGIC_CHECK_LOADED(object);
 	MAGIC_OBJECT(object, mgc);
+	magic_database_check(object, mgc);
+
+	flags = magic_options(object, options, &structured);
 
 	mga = (rb_mgc_arguments_t) {
 		.magic_object = mgc,
 		.file = {
 			.fd = NUM2INT(value),
 		},
-		.flags = magic_get_flags(object),
+		.flags = flags,
 	};
 
 	MAGIC_SYNCHRONIZED(magic_descriptor_internal, &mga);
-	local_errno = errno;
 
 	if (mga.status < 0) {
-		if (local_errno == EBADF)
+		if (mga.local_errno == EBADF)
 			rb_raise(rb_eIOError, "Bad file descriptor");
 
-		MAGIC_LIBRARY_ERROR(mgc);
+		rb_exc_raise(magic_arguments_error(&mga));
 	}
 
 	assert(mga.result != NULL &&
 	       "Must be a valid pointer to `const char' type");
 
+	if (structured)
+		return magic_result_new(&mga, flags);
+
 	return magic_return(&mga);
 }
 
 /*
  * call-seq:
- *    Magic.version -> integer
+ *    magic.identify( object ) -> hash
+ *    magic.identify( string ) -> hash
+ *
+ * Returns the description, the MIME type, the MIME encoding and the list of
+ * extensions of a file at once, as would be returned by Magic#file using
+ * the Magic::NONE, Magic::MIME_TYPE, Magic::MIME_ENCODING and
+ * Magic::EXTENSION flags respectively, combined with any other flags set
+ * for the Magic object.
+ *
+ * The beginning of a regular file, up to the number of bytes set by the
+ * Magic::PARAM_BYTES_MAX parameter, is read only once, and then classified
+ * from memory. Thus, details that the _Magic_ library would read from
+ * further into the file, such as from the sections of an ELF binary, can
+ * be missing from the description. Other kinds of files, such as e.g.,
+ * directories and devices, are passed to the _Magic_ library as-is.
  *
  * Example:
  *
- *    Magic.version #=> 517
+ *    magic = Magic.new
+ *    magic.identify('ruby.png') #=> {:description=>"PNG image data, 512 x 512, 8-bit/color RGBA, non-interlaced", :mime_type=>"image/png", :encoding=>"binary", :extensions=>["png"]}
  *
- * See also: Magic::version_to_a and Magic::version_to_s
+ * See also: Magic#file and Magic#descriptor
  */
 VALUE
-rb_mgc_version(RB_UNUSED_VAR(VALUE object))
+rb_mgc_identify(VALUE object, VALUE value)
 {
-	return INT2NUM(magic_version_wrapper());
-}
+	rb_mgc_object_t *mgc;
+	rb_mgc_identify_arguments_t mia;
 
-static inline void*
-nogvl_magic_load(void *data)
-{
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	if (NIL_P(value))
+		goto error;
 
-	mga->status = magic_load_wrapper(cookie,
-					 mga->file.path,
-					 mga->flags);
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_CHECK_LOADED(object);
+	MAGIC_OBJECT(object, mgc);
+	magic_database_check(object, mgc);
 
-	return NULL;
-}
+	mia = (rb_mgc_identify_arguments_t) {
+		.object = object,
+		.magic_object = mgc,
+		.flags = magic_get_flags(object),
+	};
 
-static inline void*
-nogvl_magic_compile(void *data)
-{
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	/*
+	 * Each of the views has its own flags, thus the flags that select
+	 * the kind of the result are ignored.
+	 */
+	mia.flags &= ~(MAGIC_MIME | MAGIC_EXTENSION | MAGIC_APPLE |
+		       MAGIC_CONTINUE);
+
+	if (rb_respond_to(value, rb_intern("to_io"))) {
+		mia.file.fd = magic_fileno(value);
+		mia.descriptor = 1;
+	} else {
+		value = magic_path(value);
+		if (NIL_P(value))
+			goto error;
+
+		mia.file.path = RVAL2CSTR(value);
+	}
 
-	mga->status = magic_compile_wrapper(cookie,
-					    mga->file.path,
-					    mga->flags);
+	value = rb_ensure(magic_identify_call, (VALUE)&mia,
+			  magic_identify_release, (VALUE)&mia);
+	RB_GC_GUARD(value);
 
-	return NULL;
-}
+	return value;
+error:
+	MAGIC_ARGUMENT_TYPE_ERROR(value, "String or IO-like object");
+}
+
+/*
+ * call-seq:
+ *    magic.cache_size -> integer
+ *
+ * Returns the maximum number of results kept in the cache of Magic#file,
+ * or 0 when results are not cached.
+ *
+ * See also: Magic#cache_size= and Magic#cache_stats
+ */
+VALUE
+rb_mgc_get_cache_size(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return magic_get_cache_size(object, &mgc->cache);
+}
+
+/*
+ * call-seq:
+ *    magic.cache_size= ( integer ) -> integer
+ *
+ * Sets the maximum number of results kept in the cache of Magic#file, and
+ * discards the results cached so far. Setting it to 0, which is the
+ * default, disables the cache.
+ *
+ * Results are cached per file, as identified by its device and inode
+ * numbers, size and modification time, and per flags. Loading a different
+ * database or changing a parameter makes the cached results stale. Only
+ * regular files are cached, and a cached result costs a single call to
+ * stat(2) instead of a scan of the file.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.cache_size = 1024
+ *    magic.file('/etc/passwd')  #=> "ASCII text"
+ *    magic.file('/etc/passwd')  #=> "ASCII text"
+ *    magic.cache_stats          #=> {:hits=>1, :misses=>1, :size=>1, :capacity=>1024}
+ *
+ * See also: Magic#cache_size and Magic#cache_stats
+ */
+VALUE
+rb_mgc_set_cache_size(VALUE object, VALUE value)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_INTEGER_TYPE(value);
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return magic_set_cache_size(object, &mgc->cache, value);
+}
+
+/*
+ * call-seq:
+ *    magic.cache_stats -> hash
+ *
+ * Returns the number of lookups in the cache of Magic#file that found a
+ * result (hits) and that did not (misses), along with the number of
+ * results currently cached and the maximum number of results the cache
+ * can hold.
+ *
+ * See also: Magic#cache_size=
+ */
+VALUE
+rb_mgc_cache_stats(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return magic_cache_stats(object, &mgc->cache);
+}
+
+/*
+ * call-seq:
+ *    magic.buffer_cache_size -> integer
+ *
+ * Returns the maximum number of results kept in the cache of Magic#buffer,
+ * or 0 when results are not cached.
+ *
+ * See also: Magic#buffer_cache_size= and Magic#buffer_cache_stats
+ */
+VALUE
+rb_mgc_get_buffer_cache_size(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return magic_get_cache_size(object, &mgc->buffer_cache);
+}
+
+/*
+ * call-seq:
+ *    magic.buffer_cache_size= ( integer ) -> integer
+ *
+ * Sets the maximum number of results kept in the cache of Magic#buffer,
+ * and discards the results cached so far. Setting it to 0, which is the
+ * default, disables the cache.
+ *
+ * Results are cached per contents of the buffer, as identified by its size
+ * and a hash of all of its bytes, and per flags. Loading a different
+ * database or changing a parameter makes the cached results stale.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.buffer_cache_size = 1024
+ *    magic.buffer("Hello, World!\n")  #=> "ASCII text"
+ *    magic.buffer("Hello, World!\n")  #=> "ASCII text"
+ *    magic.buffer_cache_stats         #=> {:hits=>1, :misses=>1, :size=>1, :capacity=>1024}
+ *
+ * See also: Magic#buffer_cache_size and Magic#buffer_cache_stats
+ */
+VALUE
+rb_mgc_set_buffer_cache_size(VALUE object, VALUE value)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_INTEGER_TYPE(value);
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return magic_set_cache_size(object, &mgc->buffer_cache, value);
+}
+
+/*
+ * call-seq:
+ *    magic.buffer_cache_stats -> hash
+ *
+ * Returns the number of hits and misses of the cache of Magic#buffer, along
+ * with the number of results currently cached and the maximum number of
+ * results the cache can hold.
+ *
+ * See also: Magic#buffer_cache_size= and Magic#cache_stats
+ */
+VALUE
+rb_mgc_buffer_cache_stats(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return magic_cache_stats(object, &mgc->buffer_cache);
+}
+
+/*
+ * call-seq:
+ *    magic.shared_cache -> string or nil
+ *
+ * Returns the path of the file holding the cache of Magic#file results
+ * shared between processes, or +nil+ when none is used.
+ *
+ * See also: Magic#shared_cache= and Magic#shared_cache_stats
+ */
+VALUE
+rb_mgc_get_shared_cache(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return MAGIC_SYNCHRONIZED(magic_get_shared_cache_internal, mgc);
+}
+
+/*
+ * call-seq:
+ *    magic.shared_cache= ( string ) -> string
+ *    magic.shared_cache= ( nil )    -> nil
+ *
+ * Uses the file at the given path as a cache of Magic#file results that
+ * is shared with every other process using the same file, or stops using
+ * it when +nil+ is given.
+ *
+ * The file is memory-mapped, thus processes share its pages rather than
+ * keeping copies of the results, and results stay cached across restarts.
+ * It is created when it does not exist, with room for 16384 results, and
+ * keeps that size from then on. Results are cached per file, as identified
+ * by its device and inode numbers, size and modification time, per flags,
+ * and per database, parameters and version of the Magic library in use.
+ * Only regular files are cached, and results longer than 191 bytes are
+ * not cached.
+ *
+ * When a cache set with Magic#cache_size= is used as well, then it is
+ * consulted first.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.shared_cache = '/var/cache/magic.cache'
+ *    magic.file('/etc/passwd')  #=> "ASCII text"
+ *
+ * See also: Magic#shared_cache and Magic#shared_cache_stats
+ */
+VALUE
+rb_mgc_set_shared_cache(VALUE object, VALUE value)
+{
+	int local_errno;
+	rb_mgc_object_t *mgc;
+	rb_mgc_arguments_t mga;
+	VALUE path = Qnil;
+
+	if (!NIL_P(value)) {
+		path = magic_path(value);
+		if (NIL_P(path))
+			MAGIC_ARGUMENT_TYPE_ERROR(value, "String or nil");
+	}
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	mga = (rb_mgc_arguments_t) {
+		.magic_object = mgc,
+		.file = {
+			.path = NIL_P(path) ? NULL : RVAL2CSTR(path),
+		},
+	};
+
+	MAGIC_SYNCHRONIZED(magic_set_shared_cache_internal, &mga);
+	local_errno = errno;
+
+	if (mga.status < 0) {
+		errno = local_errno;
+		rb_sys_fail(mga.file.path);
+	}
+
+	RB_GC_GUARD(path);
+
+	return value;
+}
+
+/*
+ * call-seq:
+ *    magic.shared_cache_stats -> hash
+ *
+ * Returns the number of hits and misses of the shared cache in the current
+ * process, along with the number of results cached by all the processes
+ * and the maximum number of results the cache can hold.
+ *
+ * See also: Magic#shared_cache=
+ */
+VALUE
+rb_mgc_shared_cache_stats(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return MAGIC_SYNCHRONIZED(magic_shared_cache_stats_internal, mgc);
+}
+
+/*
+ * call-seq:
+ *    magic.fast_path -> boolean
+ *
+ * Returns +true+ if Magic#file and Magic#buffer look up the MIME type of
+ * the most common formats in a table of signatures first, or +false+
+ * otherwise, which is the default.
+ *
+ * See also: Magic#fast_path= and Magic#fast_path_stats
+ */
+VALUE
+rb_mgc_get_fast_path(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return CBOOL2RVAL(mgc->fast_path);
+}
+
+/*
+ * call-seq:
+ *    magic.fast_path= ( boolean ) -> boolean
+ *
+ * Sets whether Magic#file and Magic#buffer answer the MIME type of PNG,
+ * JPEG, GIF, WebP, PDF, ZIP, gzip and MP4 data from a table of signatures
+ * of their leading bytes, without calling the _Magic_ library.
+ *
+ * Only a query for nothing but the MIME type, such as when the flags are
+ * set to Magic::MIME_TYPE, is answered this way. The MIME types are those
+ * that the _Magic_ library reports for these formats, whatever database
+ * is loaded, and data that could be of a format built on top of these,
+ * such as an Office document stored in a ZIP archive, is always passed to
+ * the _Magic_ library, as is anything that matches no signature in full,
+ * such as a PNG signature not followed by the header chunk, or data too
+ * short for the _Magic_ library to recognise the format. The answers were
+ * compared with those of the _Magic_ library 5.44 for truncated and
+ * corrupt data. Thus, the fast path should not be used with a database
+ * that changes the MIME type of any of these formats.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_TYPE
+ *    magic.fast_path = true
+ *    magic.file('ruby.png')  #=> "image/png"
+ *
+ * See also: Magic#fast_path and Magic#fast_path_stats
+ */
+VALUE
+rb_mgc_set_fast_path(VALUE object, VALUE value)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	mgc->fast_path = RVAL2CBOOL(value);
+
+	return value;
+}
+
+/*
+ * call-seq:
+ *    magic.fast_path_stats -> hash
+ *
+ * Returns the number of queries eligible for the fast path that were
+ * answered from the table of signatures (hits), and that were passed on
+ * to the _Magic_ library (misses).
+ *
+ * See also: Magic#fast_path=
+ */
+VALUE
+rb_mgc_fast_path_stats(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+	VALUE value;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	value = rb_hash_new();
+
+	rb_hash_aset(value, ID2SYM(rb_intern("hits")),
+		     SIZET2NUM(mgc->fast_path_hits));
+	rb_hash_aset(value, ID2SYM(rb_intern("misses")),
+		     SIZET2NUM(mgc->fast_path_misses));
+
+	return value;
+}
+
+/*
+ * call-seq:
+ *    magic.triage -> boolean
+ *
+ * Returns +true+ if Magic#file and Magic#buffer look at the data to tell
+ * binary data from text first, or +false+ otherwise, which is the default.
+ *
+ * See also: Magic#triage= and Magic#triage_stats
+ */
+VALUE
+rb_mgc_get_triage(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return CBOOL2RVAL(mgc->triage);
+}
+
+/*
+ * call-seq:
+ *    magic.triage= ( boolean ) -> boolean
+ *
+ * Sets whether Magic#file and Magic#buffer look at the leading bytes of the
+ * data to classify it as binary, ASCII text, UTF-8 text or anything else,
+ * and then skip the checks of the _Magic_ library that cannot change the
+ * result for data of that kind.
+ *
+ * The checks for text and its encoding are skipped for binary data, and
+ * when only the MIME encoding is asked for, such as when the flags are set
+ * to Magic::MIME_ENCODING, so are the soft magic tests for binary data and
+ * ASCII or UTF-8 text, as the encoding is decided by the checks for text.
+ * Anything else, and any query with the flags set to look inside compressed
+ * data or to continue past the first match, is classified by the _Magic_
+ * library as usual.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.flags = Magic::MIME_ENCODING
+ *    magic.triage = true
+ *    magic.file('README.md')  #=> "us-ascii"
+ *
+ * See also: Magic#triage and Magic#triage_stats
+ */
+VALUE
+rb_mgc_set_triage(VALUE object, VALUE value)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	mgc->triage = RVAL2CBOOL(value);
+
+	return value;
+}
+
+/*
+ * call-seq:
+ *    magic.triage_stats -> hash
+ *
+ * Returns the number of queries passed on to the _Magic_ library for which
+ * the data was classified as binary, ASCII text, UTF-8 text, or anything
+ * else, for which no checks were skipped.
+ *
+ * See also: Magic#triage=
+ */
+VALUE
+rb_mgc_triage_stats(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+	VALUE value;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	value = rb_hash_new();
+
+	rb_hash_aset(value, ID2SYM(rb_intern("binary")),
+		     SIZET2NUM(mgc->triage_counts[MAGIC_TRIAGE_BINARY]));
+	rb_hash_aset(value, ID2SYM(rb_intern("ascii")),
+		     SIZET2NUM(mgc->triage_counts[MAGIC_TRIAGE_ASCII]));
+	rb_hash_aset(value, ID2SYM(rb_intern("utf8")),
+		     SIZET2NUM(mgc->triage_counts[MAGIC_TRIAGE_UTF8]));
+	rb_hash_aset(value, ID2SYM(rb_intern("other")),
+		     SIZET2NUM(mgc->triage_counts[MAGIC_TRIAGE_OTHER]));
+
+	return value;
+}
+
+/*
+ * call-seq:
+ *    magic.progressive -> boolean
+ *
+ * Returns +true+ if Magic#file and Magic#buffer look at a small part of
+ * the data first, and at more of it only when the result is generic, or
+ * +false+ otherwise, which is the default.
+ *
+ * See also: Magic#progressive= and Magic#progressive_stats
+ */
+VALUE
+rb_mgc_get_progressive(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return CBOOL2RVAL(mgc->progressive);
+}
+
+/*
+ * call-seq:
+ *    magic.progressive= ( boolean ) -> boolean
+ *
+ * Sets whether Magic#file and Magic#buffer classify the first 4 KiB of the
+ * data first, and then, for as long as the result is generic, the first
+ * 64 KiB, and finally as much of the data as they would otherwise, which
+ * is the whole of a buffer, and as many bytes of a file as the
+ * Magic::PARAM_BYTES_MAX parameter allows.
+ *
+ * A result is generic when it is "data" or "application/octet-stream", or
+ * when it comes from looking at the data as text, which is any description
+ * mentioning text, such as "C source, ASCII text", and any "text/" MIME
+ * type, as whether the data is text at all, its encoding and the length of
+ * its lines depend on all of the data. Any other result is taken as it is,
+ * thus it can differ from the one found by looking at all of the data when
+ * a format is told apart from another one only further on, and can lack
+ * details that the description would otherwise include from further on,
+ * such as the names in a TrueType font. Queries for the MIME encoding,
+ * including Magic::MIME, the extensions or every match, which do not tell
+ * whether a result is generic, look at all of the data.
+ *
+ * Data that is recognised from its first few bytes is classified faster,
+ * particularly large files, whereas data for which the result stays
+ * generic is classified up to three times, thus slower.
+ *
+ * Results cached so far are discarded, and the results found are not
+ * stored in a shared cache (see Magic#shared_cache=).
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.progressive = true
+ *    magic.file('ruby.png')    #=> "PNG image data, 256 x 256, 8-bit/color RGBA, non-interlaced"
+ *    magic.progressive_stats  #=> {4096=>1, 65536=>0, :max=>0}
+ *
+ * See also: Magic#progressive and Magic#progressive_stats
+ */
+VALUE
+rb_mgc_set_progressive(VALUE object, VALUE value)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	if (mgc->progressive != RVAL2CBOOL(value))
+		MAGIC_SYNCHRONIZED(magic_progressive_internal, mgc);
+
+	return value;
+}
+
+/*
+ * call-seq:
+ *    magic.progressive_stats -> hash
+ *
+ * Returns the number of queries answered after looking at the first 4 KiB
+ * and 64 KiB of the data, keyed by the number of bytes, and after looking
+ * at as much of it as usual, keyed by +:max+.
+ *
+ * See also: Magic#progressive=
+ */
+VALUE
+rb_mgc_progressive_stats(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+	VALUE value;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	value = rb_hash_new();
+
+	for (int i = 0; i < MAGIC_PROGRESSIVE_TIERS - 1; i++)
+		rb_hash_aset(value, SIZET2NUM(magic_progressive_size(i, SIZE_MAX)),
+			     SIZET2NUM(mgc->progressive_counts[i]));
+
+	rb_hash_aset(value, ID2SYM(rb_intern("max")),
+		     SIZET2NUM(mgc->progressive_counts[MAGIC_PROGRESSIVE_TIERS - 1]));
+
+	return value;
+}
+
+/*
+ * call-seq:
+ *    magic.watch( string )                    -> array
+ *    magic.watch( string, recursive: false )  -> array
+ *
+ * Watches the directory at the given path, and every directory beneath it
+ * unless +recursive+ is +false+, for changes using inotify(7), and returns
+ * the paths of all the watched directories.
+ *
+ * Results of Magic#file for files in watched directories are kept in the
+ * cache set with Magic#cache_size= until something in the directory
+ * changes, thus a cached result is found without looking at the file at
+ * all. Any change to a directory invalidates the results of every file in
+ * it. Only absolute paths without any "." or ".." components, and without
+ * following symbolic links, are looked up this way, and other paths are
+ * checked using stat(2) as usual.
+ *
+ * Every such lookup reads the pending events first, so that a change made
+ * before the call is never missed, which costs one read(2) of the inotify(7)
+ * descriptor, and taking a mutex shared with the thread handling the
+ * events. This is still cheaper than the stat(2) of the file, which also
+ * resolves the path, and about 30% less time per cached call was measured
+ * using benchmark/watch.rb on Linux.
+ *
+ * A watched directory that is moved is no longer watched, unless moved
+ * within a directory that is watched recursively, in which case it is
+ * watched under its new path instead.
+ *
+ * Changes made using a hard link in a different directory, or through a
+ * shared memory mapping, are not reported by inotify(7).
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    magic.cache_size = 65536
+ *    magic.watch('/srv/uploads')  #=> ["/srv/uploads", "/srv/uploads/2024"]
+ *
+ * See also: Magic#unwatch and Magic#cache_size=
+ */
+VALUE
+rb_mgc_watch(int argc, VALUE *argv, VALUE object)
+{
+	int local_errno;
+	int recursive = 1;
+	ID keywords[1];
+	VALUE path, options, value = Qundef;
+	rb_mgc_object_t *mgc;
+	rb_mgc_arguments_t mga;
+
+	rb_scan_args(argc, argv, "1:", &path, &options);
+
+	if (!NIL_P(options)) {
+		keywords[0] = rb_intern("recursive");
+		rb_get_kwargs(options, keywords, 0, 1, &value);
+		if (value != Qundef)
+			recursive = RTEST(value);
+	}
+
+	path = magic_path(path);
+	MAGIC_CHECK_STRING_TYPE(path);
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	mga = (rb_mgc_arguments_t) {
+		.magic_object = mgc,
+		.file = {
+			.path = RVAL2CSTR(path),
+		},
+		.flags = recursive,
+	};
+
+	MAGIC_SYNCHRONIZED(magic_watch_internal, &mga);
+	local_errno = errno;
+
+	if (mga.status < 0) {
+		if (local_errno == ENOSYS)
+			MAGIC_GENERIC_ERROR(rb_mgc_eNotImplementedError, ENOSYS,
+					    E_NOT_IMPLEMENTED);
+
+		errno = local_errno;
+		rb_sys_fail(mga.file.path);
+	}
+
+	RB_GC_GUARD(path);
+
+	return rb_mgc_watched(object);
+}
+
+/*
+ * call-seq:
+ *    magic.watched -> array
+ *
+ * Returns the paths of the directories watched for changes.
+ *
+ * See also: Magic#watch
+ */
+VALUE
+rb_mgc_watched(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	return MAGIC_SYNCHRONIZED(magic_watched_internal, mgc);
+}
+
+/*
+ * call-seq:
+ *    magic.unwatch -> nil
+ *
+ * Stops watching directories for changes. Results cached for files in
+ * watched directories are not used afterwards, and Magic#file checks every
+ * file using stat(2) again.
+ *
+ * See also: Magic#watch
+ */
+VALUE
+rb_mgc_unwatch(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_CHECK_OPEN(object);
+	MAGIC_OBJECT(object, mgc);
+
+	MAGIC_SYNCHRONIZED(magic_unwatch_internal, mgc);
+
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *    Magic.version -> integer
+ *
+ * Example:
+ *
+ *    Magic.version #=> 517
+ *
+ * See also: Magic::version_to_a and Magic::version_to_s
+ */
+VALUE
+rb_mgc_version(RB_UNUSED_VAR(VALUE object))
+{
+	return INT2NUM(magic_version_wrapper());
+}
+
+/*
+ * call-seq:
+ *    Magic::Pool.new                                  -> self
+ *    Magic::Pool.new( integer )                       -> self
+ *    Magic::Pool.new( integer, integer )              -> self
+ *    Magic::Pool.new( integer, integer, string, ... ) -> self
+ *
+ * Opens a pool of the given size of the underlying _Magic_ database handles,
+ * all loaded from the same files and set to use the same flags, and returns
+ * a new _Magic::Pool_. When the size is not given, then the number of online
+ * processors is used.
+ *
+ * Each query checks out a free handle, runs the _Magic_ library without the
+ * global interpreter lock (GVL) and checks the handle back in, thus threads
+ * sharing a pool can run queries in parallel, blocking only when all of the
+ * handles are in use.
+ *
+ * Example:
+ *
+ *    pool = Magic::Pool.new(4, Magic::MIME)
+ *    pool.size                              #=> 4
+ *    pool.file('/etc/passwd')               #=> "text/plain; charset=us-ascii"
+ *
+ * See also: Magic::new, Magic::Pool#file and Magic::Pool#close
+ */
+VALUE
+rb_mgc_pool_initialize(int argc, VALUE *argv, VALUE object)
+{
+	long size;
+	int flags = MAGIC_NONE;
+	rb_mgc_pool_object_t *mpo;
+	rb_mgc_pool_arguments_t mpa;
+	magic_pool_t *pool;
+	VALUE size_value, flags_value, paths, value;
+	VALUE exception = Qundef;
+
+	rb_scan_args(argc, argv, "02*", &size_value, &flags_value, &paths);
+
+	if (NIL_P(size_value)) {
+		size = sysconf(_SC_NPROCESSORS_ONLN);
+		if (size < 1)
+			size = 1;
+	} else {
+		MAGIC_CHECK_INTEGER_TYPE(size_value);
+		size = NUM2LONG(size_value);
+	}
+
+	if (size < 1)
+		rb_raise(rb_eArgError, "%s", MAGIC_ERRORS(E_POOL_INVALID_SIZE));
+
+	if (!NIL_P(flags_value)) {
+		MAGIC_CHECK_INTEGER_TYPE(flags_value);
+		flags = NUM2INT(flags_value);
+	}
+
+	if (flags < 0)
+		MAGIC_GENERIC_ERROR(rb_mgc_eFlagsError, EINVAL,
+				    E_FLAG_INVALID_TYPE);
+
+	if (ARRAY_P(RARRAY_FIRST(paths)))
+		paths = magic_flatten(paths);
+
+	MAGIC_CHECK_ARRAY_OF_STRINGS(paths);
+
+	if (RARRAY_EMPTY_P(paths))
+		paths = magic_default_paths();
+
+	value = magic_join(paths, CSTR2RVAL(":"));
+	RB_GC_GUARD(value);
+
+	MAGIC_POOL_OBJECT(object, mpo);
+
+	/*
+	 * Other threads can be using the pool already, thus it cannot be
+	 * replaced with a new one.
+	 */
+	if (mpo->pool)
+		rb_raise(rb_eTypeError, "%s", MAGIC_ERRORS(E_POOL_INITIALIZED));
+
+	/*
+	 * Handles in the pool are never reconfigured, thus the flags that
+	 * Magic#file and friends set on their own for each query are set up
+	 * front here.
+	 */
+	mpa = (rb_mgc_pool_arguments_t) {
+		.file = {
+			.path = RVAL2CSTR(value),
+		},
+		.flags = flags,
+	};
+
+	if (!MAGIC_ATOMIC_LOAD(&rb_mgc_do_not_stop_on_error))
+		mpa.flags |= MAGIC_ERROR;
+
+	if (mpa.flags & MAGIC_CONTINUE)
+		mpa.flags |= MAGIC_RAW;
+
+	pool = magic_pool_new((size_t)size, mpa.flags);
+	if (!pool) {
+		if (errno == ENOMEM)
+			MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, errno,
+					    E_NOT_ENOUGH_MEMORY);
+
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, errno,
+				    E_MAGIC_LIBRARY_INITIALIZE);
+	}
+
+	mpa.pool = pool;
+
+	NOGVL(nogvl_magic_pool_load, &mpa);
+	if (mpa.status < 0) {
+		exception = magic_library_error(rb_mgc_eMagicError,
+						pool->cookies[0]);
+		magic_pool_free(pool);
+		rb_exc_raise(exception);
+	}
+
+	if (mpo->pool) {
+		magic_pool_free(pool);
+		rb_raise(rb_eTypeError, "%s", MAGIC_ERRORS(E_POOL_INITIALIZED));
+	}
+
+	mpo->pool = pool;
+	mpo->generation = MAGIC_ATOMIC_LOAD(&rb_mgc_fork_generation);
+
+	rb_ivar_set(object, id_at_flags, INT2NUM(flags));
+	rb_ivar_set(object, id_at_paths, magic_split(value, CSTR2RVAL(":")));
+
+	return object;
+}
+
+/*
+ * call-seq:
+ *    pool.close -> nil
+ *
+ * Closes the pool. Waits for queries that are currently in progress to
+ * finish, after which all of the underlying _Magic_ database handles are
+ * closed. Queries made afterwards, including any that had not yet started
+ * by the time the pool was closed, raise Magic::LibraryError.
+ *
+ * See also: Magic::Pool#closed? and Magic#close
+ */
+VALUE
+rb_mgc_pool_close(VALUE object)
+{
+	rb_mgc_pool_object_t *mpo;
+	rb_mgc_pool_arguments_t mpa;
+
+	MAGIC_POOL_OBJECT(object, mpo);
+
+	if (!mpo->pool)
+		return Qnil;
+
+	magic_pool_object_atfork(mpo);
+
+	if (magic_pool_enter(mpo->pool) < 0)
+		return Qnil;
+
+	mpa = (rb_mgc_pool_arguments_t) {
+		.pool = mpo->pool,
+	};
+
+	for (;;) {
+		mpa.cancel = 0;
+		NOGVL_UBF(nogvl_magic_pool_drain, &mpa, magic_pool_ubf, &mpa);
+		if (mpa.status >= 0)
+			break;
+
+		rb_thread_check_ints();
+	}
+
+	if (mpa.status > 0)
+		return Qnil;
+
+	/*
+	 * The pool itself is only released together with the object, as
+	 * threads about to make a query can still be holding on to it.
+	 */
+	magic_pool_close(mpo->pool);
+	magic_pool_leave(mpo->pool);
+
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *    pool.closed? -> true or false
+ *
+ * See also: Magic::Pool#close
+ */
+VALUE
+rb_mgc_pool_close_p(VALUE object)
+{
+	rb_mgc_pool_object_t *mpo;
+
+	MAGIC_POOL_OBJECT(object, mpo);
+
+	return CBOOL2RVAL(!mpo->pool || magic_pool_closed_p(mpo->pool));
+}
+
+/*
+ * call-seq:
+ *    pool.size -> integer
+ *
+ * Returns the number of _Magic_ database handles in the pool.
+ */
+VALUE
+rb_mgc_pool_get_size(VALUE object)
+{
+	rb_mgc_pool_object_t *mpo;
+
+	MAGIC_POOL_OBJECT(object, mpo);
+	MAGIC_POOL_CHECK_OPEN(mpo);
+
+	return SIZET2NUM(mpo->pool->size);
+}
+
+/*
+ * call-seq:
+ *    pool.file( object ) -> string or array
+ *    pool.file( string ) -> string or array
+ *
+ * See also: Magic#file, Magic::Pool#buffer and Magic::Pool#descriptor
+ */
+VALUE
+rb_mgc_pool_file(VALUE object, VALUE value)
+{
+	rb_mgc_pool_object_t *mpo;
+	rb_mgc_pool_arguments_t mpa;
+
+	if (NIL_P(value))
+		goto error;
+
+	MAGIC_POOL_OBJECT(object, mpo);
+
+	if (rb_respond_to(value, rb_intern("to_io")))
+		return rb_mgc_pool_descriptor(object, value);
+
+	value = magic_path(value);
+	if (NIL_P(value))
+		goto error;
+
+	StringValueCStr(value);
+	value = rb_str_new_frozen(value);
+
+	mpa = (rb_mgc_pool_arguments_t) {
+		.function = MAGIC_POOL_FILE,
+		.file = {
+			.path = RSTRING_PTR(value),
+		},
+	};
+
+	value = magic_pool_call(mpo, &mpa);
+	RB_GC_GUARD(value);
+
+	return value;
+error:
+	MAGIC_ARGUMENT_TYPE_ERROR(value, "String or IO-like object");
+}
+
+/*
+ * call-seq:
+ *    pool.buffer( string ) -> string or array
+ *
+ * The string is never read while it can change, as the query runs against
+ * a frozen copy of the string that shares its contents.
+ *
+ * See also: Magic#buffer, Magic::Pool#file and Magic::Pool#descriptor
+ */
+VALUE
+rb_mgc_pool_buffer(VALUE object, VALUE value)
+{
+	VALUE result;
+	rb_mgc_pool_object_t *mpo;
+	rb_mgc_pool_arguments_t mpa;
+
+	MAGIC_CHECK_STRING_TYPE(value);
+
+	MAGIC_POOL_OBJECT(object, mpo);
+
+	value = rb_str_new_frozen(value);
+
+	mpa = (rb_mgc_pool_arguments_t) {
+		.function = MAGIC_POOL_BUFFER,
+		.buffer = {
+			.pointer = RSTRING_PTR(value),
+			.size    = (size_t)RSTRING_LEN(value),
+		},
+	};
+
+	result = magic_pool_call(mpo, &mpa);
+	RB_GC_GUARD(value);
+
+	return result;
+}
+
+/*
+ * call-seq:
+ *    pool.descriptor( object )  -> string or array
+ *    pool.descriptor( integer ) -> string or array
+ *
+ * See also: Magic#descriptor, Magic::Pool#file and Magic::Pool#buffer
+ */
+VALUE
+rb_mgc_pool_descriptor(VALUE object, VALUE value)
+{
+	rb_mgc_pool_object_t *mpo;
+	rb_mgc_pool_arguments_t mpa;
+
+	if (rb_respond_to(value, rb_intern("to_io")))
+		value = INT2NUM(magic_fileno(value));
+
+	MAGIC_CHECK_INTEGER_TYPE(value);
+
+	MAGIC_POOL_OBJECT(object, mpo);
+
+	mpa = (rb_mgc_pool_arguments_t) {
+		.function = MAGIC_POOL_DESCRIPTOR,
+		.file = {
+			.fd = NUM2INT(value),
+		},
+	};
+
+	return magic_pool_call(mpo, &mpa);
+}
+
+/*
+ * call-seq:
+ *    result.to_s -> string
+ *
+ * Returns the result as given by the _Magic_ library.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    result = magic.file('/etc/passwd', flags: Magic::MIME, result: true)
+ *    result.to_s #=> "text/plain; charset=us-ascii"
+ */
+VALUE
+rb_mgc_result_to_s(VALUE object)
+{
+	rb_mgc_result_object_t *mro;
+
+	MAGIC_RESULT_OBJECT(object, mro);
+
+	if (mro->string == Qundef)
+		mro->string = magic_intern(mro->result, mro->length);
+
+	return mro->string;
+}
+
+/*
+ * call-seq:
+ *    result.flags -> integer
+ *
+ * Returns the flags that were used to obtain the result.
+ */
+VALUE
+rb_mgc_result_get_flags(VALUE object)
+{
+	rb_mgc_result_object_t *mro;
+
+	MAGIC_RESULT_OBJECT(object, mro);
+
+	return INT2NUM(mro->flags);
+}
+
+/*
+ * call-seq:
+ *    result.description -> string or nil
+ *
+ * Returns the description of the first match, or +nil+ if the result was
+ * obtained using flags that select a different kind of result, such as
+ * e.g., Magic::MIME_TYPE or Magic::EXTENSION.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    result = magic.file('/etc/passwd', result: true)
+ *    result.description #=> "ASCII text"
+ */
+VALUE
+rb_mgc_result_description(VALUE object)
+{
+	rb_mgc_result_object_t *mro;
+
+	MAGIC_RESULT_OBJECT(object, mro);
+
+	if (mro->description != Qundef)
+		return mro->description;
+
+	mro->description = Qnil;
+	if (!(mro->flags & (MAGIC_MIME | MAGIC_EXTENSION | MAGIC_APPLE)))
+		mro->description = magic_intern_strip(mro->result,
+						      magic_result_first(mro));
+
+	return mro->description;
+}
+
+/*
+ * call-seq:
+ *    result.mime_type -> string or nil
+ *
+ * Returns the MIME type of the first match, without any parameters, or
+ * +nil+ if the result was obtained without the Magic::MIME_TYPE flag set.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    result = magic.file('/etc/passwd', flags: Magic::MIME, result: true)
+ *    result.mime_type #=> "text/plain"
+ */
+VALUE
+rb_mgc_result_mime_type(VALUE object)
+{
+	size_t length;
+	const char *end;
+	rb_mgc_result_object_t *mro;
+
+	MAGIC_RESULT_OBJECT(object, mro);
+
+	if (mro->mime_type != Qundef)
+		return mro->mime_type;
+
+	mro->mime_type = Qnil;
+	if (mro->flags & MAGIC_MIME_TYPE) {
+		length = magic_result_first(mro);
+
+		end = memchr(mro->result, ';', length);
+		if (end)
+			length = (size_t)(end - mro->result);
+
+		mro->mime_type = magic_intern_strip(mro->result, length);
+	}
+
+	return mro->mime_type;
+}
+
+/*
+ * call-seq:
+ *    result.charset -> string or nil
+ *
+ * Returns the MIME encoding of the first match, or +nil+ if the result was
+ * obtained without the Magic::MIME_ENCODING flag set.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    result = magic.file('/etc/passwd', flags: Magic::MIME, result: true)
+ *    result.charset #=> "us-ascii"
+ */
+VALUE
+rb_mgc_result_charset(VALUE object)
+{
+	size_t length;
+	const char *cstring;
+	const char *start, *end;
+	const char *parameter = "charset=";
+	rb_mgc_result_object_t *mro;
+
+	MAGIC_RESULT_OBJECT(object, mro);
+
+	if (mro->charset != Qundef)
+		return mro->charset;
+
+	mro->charset = Qnil;
+	if (!(mro->flags & MAGIC_MIME_ENCODING))
+		return mro->charset;
+
+	cstring = mro->result;
+	length = magic_result_first(mro);
+
+	/*
+	 * When both flags are set, then the Magic library returns the MIME
+	 * encoding as a parameter of the MIME type.
+	 */
+	if (mro->flags & MAGIC_MIME_TYPE) {
+		start = NULL;
+		for (end = cstring; end < cstring + length; end++) {
+			if ((size_t)(cstring + length - end) < strlen(parameter))
+				break;
+
+			if (strncmp(end, parameter, strlen(parameter)) == 0) {
+				start = end + strlen(parameter);
+				break;
+			}
+		}
+
+		if (!start)
+			return mro->charset;
+
+		length -= (size_t)(start - cstring);
+		cstring = start;
+
+		end = memchr(cstring, ';', length);
+		if (end)
+			length = (size_t)(end - cstring);
+	}
+
+	mro->charset = magic_intern_strip(cstring, length);
+
+	return mro->charset;
+}
+
+/*
+ * call-seq:
+ *    result.extensions -> array or nil
+ *
+ * Returns the list of file extensions, which is empty when the _Magic_
+ * library does not know of any, or +nil+ if the result was obtained without
+ * the Magic::EXTENSION flag set.
+ *
+ * Example:
+ *
+ *    magic = Magic.new
+ *    result = magic.file('ruby.jpg', flags: Magic::EXTENSION, result: true)
+ *    result.extensions #=> ["jpeg", "jpg", "jpe", "jfif"]
+ */
+VALUE
+rb_mgc_result_extensions(VALUE object)
+{
+	rb_mgc_result_object_t *mro;
+	rb_mgc_arguments_t mga;
+	VALUE value;
+
+	MAGIC_RESULT_OBJECT(object, mro);
+
+	if (mro->extensions != Qundef)
+		return mro->extensions;
+
+	mro->extensions = Qnil;
+	if (!(mro->flags & MAGIC_EXTENSION))
+		return mro->extensions;
+
+	mga = (rb_mgc_arguments_t) {
+		.result = mro->result,
+		.flags = MAGIC_EXTENSION,
+	};
+
+	value = magic_return(&mga);
+	if (!ARRAY_P(value)) {
+		if (RSTRING_LEN(value) > 0)
+			value = rb_ary_new_from_args(1, value);
+		else
+			value = rb_ary_new();
+	}
+
+	mro->extensions = rb_obj_freeze(value);
+
+	return mro->extensions;
+}
+
+/*
+ * call-seq:
+ *    Magic::Database.open                -> database
+ *    Magic::Database.open( string )      -> database
+ *
+ * Maps the compiled _Magic_ database at the given path into memory, or the
+ * first compiled database found in the default paths (see Magic#paths) if
+ * no path is given, and returns it. Without a path, the database linked
+ * into the extension is returned instead when there is one (see
+ * Magic::Database::embedded).
+ *
+ * A database is mapped only once per process, and shared by every _Magic_
+ * object that loads it, thus a new _Magic_ object given the database does
+ * not read or parse it again, and the memory is shared. The file is mapped
+ * again only after it has changed, and a database is unmapped once neither
+ * the Magic::Database nor any _Magic_ object that loaded it is left.
+ *
+ * A _Magic_ object that loaded the database checks whether the file was
+ * changed in place, using fstat(2), before every call, and loads the file
+ * again if so. A file written in place while a call is in progress could
+ * still be read past its end, thus a database is best replaced by renaming
+ * a new file over it, which leaves the current mapping intact.
+ *
+ * Example:
+ *
+ *    database = Magic::Database.open  #=> #<Magic::Database:0x00007f8e3b0a1b28>
+ *    database.path                    #=> "/usr/share/misc/magic.mgc"
+ *
+ *    magic = Magic.new(database)
+ *    magic.file('/etc/passwd')        #=> "ASCII text"
+ *
+ * See also: Magic::new and Magic#load_buffers
+ */
+VALUE
+rb_mgc_database_open(int argc, VALUE *argv, VALUE klass)
+{
+	int local_errno = ENOENT;
+	magic_database_t *database = NULL;
+	VALUE path, paths, value;
+
+	rb_scan_args(argc, argv, "01", &path);
+
+	if (NIL_P(path)) {
+		value = magic_database_default();
+		if (!NIL_P(value))
+			return value;
+	}
+
+	if (!NIL_P(path)) {
+		path = magic_path(path);
+		MAGIC_CHECK_STRING_TYPE(path);
+		paths = rb_ary_new_from_args(1, path);
+	} else
+		paths = magic_database_paths();
+
+	for (long i = 0; i < RARRAY_LEN(paths) && !database; i++) {
+		value = RARRAY_AREF(paths, i);
+
+		database = magic_database_open(RVAL2CSTR(value));
+		local_errno = errno;
+	}
+
+	if (!database) {
+		errno = local_errno;
+		if (NIL_P(path))
+			rb_sys_fail("Magic::Database.open");
+
+		rb_sys_fail(RVAL2CSTR(path));
+	}
+
+	RB_GC_GUARD(paths);
+
+	return TypedData_Wrap_Struct(klass, &rb_mgc_database_type, database);
+}
+
+/*
+ * call-seq:
+ *    Magic::Database.embedded -> database or nil
+ *
+ * Returns the database linked into the extension as read-only data, or
+ * +nil+ if the extension was built without one. The database is embedded
+ * when the extension is built with the "--with-embedded-database" option,
+ * and is then loaded by default by every new _Magic_ object, unless the
+ * MAGIC environment variable is set, without reading any file.
+ *
+ * Example:
+ *
+ *    database = Magic::Database.embedded  #=> #<Magic::Database:0x00007f8e3b0a1b28>
+ *    database.path                        #=> nil
+ *
+ * See also: Magic::new and Magic::Database::open
+ */
+VALUE
+rb_mgc_database_embedded(RB_UNUSED_VAR(VALUE klass))
+{
+	magic_database_t *database;
+
+	database = magic_database_embedded();
+	if (!database)
+		return Qnil;
+
+	return TypedData_Wrap_Struct(rb_cMagicDatabase, &rb_mgc_database_type,
+				     database);
+}
+
+/*
+ * call-seq:
+ *    Magic::Database.count -> integer
+ *
+ * Returns the number of databases mapped into memory in this process.
+ *
+ * See also: Magic::Database::open
+ */
+VALUE
+rb_mgc_database_count(RB_UNUSED_VAR(VALUE klass))
+{
+	return SIZET2NUM(magic_database_count());
+}
+
+/*
+ * call-seq:
+ *    database.path -> string or nil
+ *
+ * Returns the absolute path of the mapped database file, or +nil+ for the
+ * database linked into the extension.
+ */
+VALUE
+rb_mgc_database_path(VALUE object)
+{
+	magic_database_t *database;
+
+	MAGIC_DATABASE_OBJECT(object, database);
+
+	if (!database->path)
+		return Qnil;
+
+	return rb_str_freeze(CSTR2RVAL(database->path));
+}
+
+/*
+ * call-seq:
+ *    database.size -> integer
+ *
+ * Returns the size of the mapped database in bytes.
+ */
+VALUE
+rb_mgc_database_size(VALUE object)
+{
+	magic_database_t *database;
+
+	MAGIC_DATABASE_OBJECT(object, database);
+
+	return SIZET2NUM(database->size);
+}
+
+/*
+ * call-seq:
+ *    database == other -> true or false
+ *
+ * Returns +true+ if both refer to the same mapping of a database.
+ */
+VALUE
+rb_mgc_database_equal(VALUE object, VALUE other)
+{
+	magic_database_t *database, *value;
+
+	if (!DATABASE_P(other))
+		return Qfalse;
+
+	MAGIC_DATABASE_OBJECT(object, database);
+	MAGIC_DATABASE_OBJECT(other, value);
+
+	return CBOOL2RVAL(database == value);
+}
+
+/*
+ * call-seq:
+ *    database.hash -> integer
+ */
+VALUE
+rb_mgc_database_hash(VALUE object)
+{
+	magic_database_t *database;
+
+	MAGIC_DATABASE_OBJECT(object, database);
+
+	return SIZET2NUM(database->digest);
+}
+
+static inline void*
+nogvl_magic_load(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->cookie;
+
+	mga->status = magic_load_wrapper(cookie,
+					 mga->file.path,
+					 mga->flags);
+
+	return NULL;
+}
+
+/*
+ * A handle that fails to load for other flags is dropped, and made again
+ * the first time the flags are used, as it is the main handle that matters.
+ */
+static inline void*
+nogvl_magic_reload(void *data)
+{
+	rb_mgc_reload_arguments_t *mra = data;
+
+	mra->status = magic_load_wrapper(mra->cookie, mra->database,
+					 mra->flags);
+	if (mra->status < 0)
+		return NULL;
+
+	for (magic_cookie_cache_t *entry = mra->cookies; entry; entry = entry->next) {
+		if (!entry->cookie)
+			continue;
+
+		if (magic_load_wrapper(entry->cookie, mra->database,
+				       entry->flags) < 0) {
+			magic_close_wrapper(entry->cookie);
+			entry->cookie = NULL;
+		}
+	}
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_reload_drain(void *data)
+{
+	rb_mgc_reload_arguments_t *mra = data;
+
+	if (mra->cookie)
+		magic_close_wrapper(mra->cookie);
+
+	for (magic_cookie_cache_t *entry = mra->cookies; entry; entry = entry->next) {
+		if (entry->cookie)
+			magic_close_wrapper(entry->cookie);
+	}
+
+	magic_pool_free(mra->workers);
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_compile(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->cookie;
+#if defined(MAGIC_COMPILE_UNSHARE)
+	int rv;
+	pthread_t thread;
+	sigset_t set, old;
+
+	/*
+	 * Signals are to be handled by the threads of the interpreter, not
+	 * by the thread compiling the database.
+	 */
+	if (mga->compile.directory) {
+		sigfillset(&set);
+		pthread_sigmask(SIG_SETMASK, &set, &old);
+
+		rv = pthread_create(&thread, NULL, magic_compile_directory, mga);
+		if (rv == 0) {
+			pthread_join(thread, NULL);
+		} else {
+			mga->status = -1;
+			mga->compile.local_errno = rv;
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+		return NULL;
+	}
+#endif
+
+	mga->status = magic_compile_wrapper(cookie,
+					    mga->compile.path,
+					    mga->flags);
+
+	return NULL;
+}
+
+/*
+ * Compiles the database with the working directory changed to the given
+ * one, where the Magic library writes the compiled database to. Runs on a
+ * thread of its own, which stops sharing its working directory with the
+ * rest of the process first, where possible, or otherwise changes it for
+ * the whole process and changes it back afterwards.
+ */
+static void *
+magic_compile_directory(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+#if !defined(MAGIC_COMPILE_UNSHARE)
+	int fd;
+	int flags = O_RDONLY;
+
+#if defined(HAVE_O_CLOEXEC)
+	flags |= O_CLOEXEC;
+#endif
+#endif
+
+	mga->status = -1;
+
+#if defined(MAGIC_COMPILE_UNSHARE)
+	if (unshare(CLONE_FS) < 0 || chdir(mga->compile.directory) < 0) {
+		mga->compile.local_errno = errno;
+		return NULL;
+	}
+
+	mga->status = magic_compile_wrapper(mga->cookie, mga->compile.path,
+					    mga->flags);
+#else
+	fd = open(".", flags);
+	if (fd < 0 || chdir(mga->compile.directory) < 0) {
+		mga->compile.local_errno = errno;
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	mga->status = magic_compile_wrapper(mga->cookie, mga->compile.path,
+					    mga->flags);
+
+	if (fchdir(fd) < 0)
+		mga->compile.local_errno = errno;
+
+	close(fd);
+#endif
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_check(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->cookie;
+
+	mga->status = magic_check_wrapper(cookie,
+					  mga->file.path,
+					  mga->flags);
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_file(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->cookie;
+
+	mga->result = magic_file_wrapper(cookie,
+					 mga->file.path,
+					 mga->flags);
+
+	mga->status = !mga->result ? -1 : 0;
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_signature_file(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+
+	mga->result = magic_signature_file(mga->file.path, mga->flags);
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_triage_file(void *data)
+{
+	rb_mgc_triage_arguments_t *mta = data;
+
+	mta->triage = magic_triage_file(mta->path, mta->flags, mta->size);
+
+	return NULL;
+}
+
+/*
+ * Classifies the file looking at more of it each time the result is
+ * generic, by lowering the number of bytes the Magic library reads for
+ * each attempt, until the last one, which reads as much as it otherwise
+ * would. A file that is not larger than what an attempt has already read
+ * is not read again.
+ */
+static inline void*
+nogvl_magic_file_progressive(void *data)
+{
+	size_t size;
+	int local_errno = errno;
+	struct stat st;
+	rb_mgc_progressive_arguments_t *mpa = data;
+	rb_mgc_arguments_t *mga = mpa->arguments;
+
+	mpa->length = SIZE_MAX;
+	if (stat(mga->file.path, &st) == 0)
+		mpa->length = (size_t)st.st_size;
+
+	errno = local_errno;
+
+	for (mpa->tier = 0;; mpa->tier++) {
+		size = magic_progressive_size(mpa->tier, mpa->limit);
+		if (size == mpa->limit)
+			mpa->tier = MAGIC_PROGRESSIVE_TIERS - 1;
+
+		magic_setparam_wrapper(mga->cookie, MAGIC_PARAM_BYTES_MAX, &size);
+
+		mga->result = magic_file_wrapper(mga->cookie,
+						 mga->file.path,
+						 mga->flags);
+
+		if (!mga->result || size >= mpa->length ||
+		    mpa->tier == MAGIC_PROGRESSIVE_TIERS - 1 ||
+		    !magic_progressive_generic_p(mga->result, mga->flags))
+			break;
+	}
+
+	magic_setparam_wrapper(mga->cookie, MAGIC_PARAM_BYTES_MAX, &mpa->limit);
+
+	mga->status = !mga->result ? -1 : 0;
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_buffer(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->cookie;
+
+	mga->result = magic_buffer_wrapper(cookie,
+					   mga->buffer.pointer,
+					   mga->buffer.size,
+					   mga->flags);
+
+	mga->status = !mga->result ? -1 : 0;
+
+	return NULL;
+}
+
+/*
+ * Classifies the buffer as nogvl_magic_file_progressive() classifies a
+ * file, passing a shorter buffer to the Magic library for each attempt,
+ * as it looks at the whole of a buffer, until the last one.
+ */
+static inline void*
+nogvl_magic_buffer_progressive(void *data)
+{
+	size_t size;
+	rb_mgc_progressive_arguments_t *mpa = data;
+	rb_mgc_arguments_t *mga = mpa->arguments;
+
+	mpa->length = mga->buffer.size;
+
+	for (mpa->tier = 0;; mpa->tier++) {
+		size = magic_progressive_size(mpa->tier, mpa->limit);
+		if (size == mpa->limit)
+			mpa->tier = MAGIC_PROGRESSIVE_TIERS - 1;
+
+		mga->result = magic_buffer_wrapper(mga->cookie,
+						   mga->buffer.pointer,
+						   size < mpa->length ? size : mpa->length,
+						   mga->flags);
+
+		if (!mga->result || size >= mpa->length ||
+		    mpa->tier == MAGIC_PROGRESSIVE_TIERS - 1 ||
+		    !magic_progressive_generic_p(mga->result, mga->flags))
+			break;
+	}
+
+	mga->status = !mga->result ? -1 : 0;
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_load_buffers(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->cookie;
+
+	mga->status = magic_load_buffers_wrapper(cookie,
+						 mga->buffers.pointers,
+						 mga->buffers.sizes,
+						 mga->buffers.count,
+						 mga->flags);
+
+	return NULL;
+}
+
+static inline void*
+nogvl_magic_descriptor(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->cookie;
+
+	mga->result = magic_descriptor_wrapper(cookie,
+					       mga->file.fd,
+					       mga->flags);
+
+	mga->status = !mga->result ? -1 : 0;
+
+	return NULL;
+}
+
+static void *
+nogvl_magic_pool(void *data)
+{
+	int local_errno;
+	const char *result = NULL;
+	rb_mgc_pool_arguments_t *mpa = data;
+	magic_pool_t *pool = mpa->pool;
+	magic_t cookie;
+
+	cookie = magic_pool_checkout(pool, &mpa->cancel);
+	if (!cookie) {
+		mpa->local_errno = errno;
+		mpa->status = -1;
+		return NULL;
+	}
+
+	mpa->checked_out = 1;
+
+	errno = 0;
+
+	switch (mpa->function) {
+	case MAGIC_POOL_FILE:
+		result = magic_file_wrapper(cookie, mpa->file.path,
+					    pool->flags);
+		break;
+	case MAGIC_POOL_BUFFER:
+		result = magic_buffer_wrapper(cookie, mpa->buffer.pointer,
+					      mpa->buffer.size, pool->flags);
+		break;
+	case MAGIC_POOL_DESCRIPTOR:
+		result = magic_descriptor_wrapper(cookie, mpa->file.fd,
+						  pool->flags);
+		break;
+	}
+
+	local_errno = errno;
+
+	mpa->status = !result ? -1 : 0;
+	/*
+	 * See magic_file_internal() for why both the error code from the
+	 * Magic library and the saved errno value are consulted.
+	 */
+	if (mpa->function == MAGIC_POOL_FILE &&
+	    (magic_errno_wrapper(cookie) || local_errno))
+		mpa->status = -1;
+
+	/*
+	 * Both the result and the error message are owned by the handle, and
+	 * would be overwritten by the next query from a different thread as
+	 * soon as the handle is checked back in.
+	 */
+	if (result)
+		mpa->result = strdup(result);
+	else if (local_errno != EBADF) {
+		result = magic_error_wrapper(cookie);
+		if (result)
+			mpa->error = strdup(result);
+
+		mpa->magic_errno = magic_errno_wrapper(cookie);
+	}
+
+	magic_pool_checkin(pool, cookie);
+
+	mpa->local_errno = local_errno;
+
+	return NULL;
+}
+
+static void *
+nogvl_magic_pool_load(void *data)
+{
+	rb_mgc_pool_arguments_t *mpa = data;
+
+	mpa->status = magic_pool_load(mpa->pool, mpa->file.path);
+
+	return NULL;
+}
+
+static void *
+nogvl_magic_pool_drain(void *data)
+{
+	rb_mgc_pool_arguments_t *mpa = data;
+
+	mpa->status = magic_pool_drain(mpa->pool, &mpa->cancel);
+
+	return NULL;
+}
+
+static void *
+nogvl_magic_pool_load_buffers(void *data)
+{
+	rb_mgc_pool_arguments_t *mpa = data;
+
+	mpa->status = magic_pool_load_buffers(mpa->pool,
+					      mpa->buffers.pointers,
+					      mpa->buffers.sizes,
+					      mpa->buffers.count);
+
+	return NULL;
+}
+
+static void *
+nogvl_magic_files(void *data)
+{
+	rb_mgc_files_arguments_t *mfa = data;
+
+	mfa->status = magic_pool_files(mfa->magic_object->workers,
+				       mfa->threads, mfa->paths, mfa->results,
+				       mfa->count, &mfa->next, &mfa->cancel);
+	mfa->local_errno = errno;
+
+	return NULL;
+}
+
+static void
+magic_files_ubf(void *data)
+{
+	rb_mgc_files_arguments_t *mfa = data;
+
+	mfa->cancel = 1;
+}
+
+static void
+magic_pool_ubf(void *data)
+{
+	rb_mgc_pool_arguments_t *mpa = data;
+
+	mpa->cancel = 1;
+	magic_pool_wakeup(mpa->pool);
+}
+
+static inline VALUE
+magic_get_parameter_internal(void *data)
+{
+	size_t value;
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	mga->status = magic_getparam_wrapper(cookie,
+					     mga->parameter.tag,
+					     &value);
+
+	mga->parameter.value = value;
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_set_parameter_internal(void *data)
+{
+	size_t value;
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	value = mga->parameter.value;
+
+	mga->status = magic_setparam_wrapper(cookie,
+					     mga->parameter.tag,
+					     &value);
+
+	magic_workers_free(mga->magic_object);
+	magic_cookies_free(mga->magic_object);
+
+	mga->magic_object->generation++;
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_get_flags_internal(void *data)
+{
+	int flags;
+	rb_mgc_arguments_t *mga = data;
+	magic_t cookie = mga->magic_object->cookie;
+
+	mga->status = 0;
+
+	flags = magic_getflags_wrapper(cookie);
+	if (flags < 0)
+		mga->status = -1;
+	else
+		mga->flags = flags;
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_set_flags_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+
+	mga->status = magic_setflags_wrapper(mgc->cookie, mga->flags);
+	if (mga->status >= 0)
+		mgc->flags = mga->flags;
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_close_internal(void *data)
+{
+	magic_library_close(data);
+
+	return Qnil;
+}
+
+static inline VALUE
+magic_load_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+
+	magic_workers_free(mgc);
+	magic_cookies_free(mgc);
+
+	mgc->generation++;
+
+	mga->cookie = mgc->cookie;
+	NOGVL(nogvl_magic_load, mga);
+
+	if (MAGIC_STATUS_CHECK(mga->status < 0))
+		magic_setflags_wrapper(mgc->cookie, mgc->flags);
+
+	ruby_xfree(mgc->database);
+	mgc->database = NULL;
+
+	if (mga->status >= 0)
+		mgc->database = ruby_strdup(mga->file.path);
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_load_buffers_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+
+	magic_workers_free(mgc);
+	magic_cookies_free(mgc);
+
+	mgc->generation++;
+
+	mga->cookie = mgc->cookie;
+	NOGVL(nogvl_magic_load_buffers, mga);
+
+	ruby_xfree(mgc->database);
+	mgc->database = NULL;
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_reload_internal(void *data)
+{
+	rb_mgc_reload_arguments_t *mra = data;
+	rb_mgc_object_t *mgc = mra->magic_object;
+	magic_cookie_cache_t *cookies = mgc->cookies;
+	magic_pool_t *workers = mgc->workers;
+	magic_t cookie = mgc->cookie;
+	char *database = mgc->database;
+	VALUE buffers = mgc->buffers;
+	size_t value;
+
+	/*
+	 * The flags and the parameters could have been changed while the
+	 * database was loading, thus these are only taken over now.
+	 */
+	magic_setflags_wrapper(mra->cookie, mgc->flags);
+
+	for (int i = 0; i < ARRAY_SIZE(rb_mgc_parameters); i++) {
+		if (magic_getparam_wrapper(cookie, rb_mgc_parameters[i],
+					   &value) < 0)
+			continue;
+
+		magic_setparam_wrapper(mra->cookie, rb_mgc_parameters[i],
+				       &value);
+		for (magic_cookie_cache_t *entry = mra->cookies; entry; entry = entry->next)
+			magic_setparam_wrapper(entry->cookie,
+					       rb_mgc_parameters[i], &value);
+	}
+
+	mgc->cookie = mra->cookie;
+	mgc->cookies = mra->cookies;
+	mgc->workers = NULL;
+	mgc->database = mra->database;
+	mgc->buffers = Qnil;
+	mgc->database_loaded = 1;
+	mgc->database_mapped = 0;
+
+	mgc->generation++;
+
+	mra->cookie = cookie;
+	mra->cookies = cookies;
+	mra->workers = workers;
+	mra->database = database;
+	mra->buffers = buffers;
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_compile_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+
+	mga->cookie = mgc->cookie;
+
+#if !defined(MAGIC_COMPILE_UNSHARE)
+	/*
+	 * The working directory of the process is changed, which no other
+	 * thread of the Ractor can see as long as the GVL is held.
+	 */
+	if (mga->compile.directory)
+		magic_compile_directory(mga);
+	else
+#endif
+		NOGVL(nogvl_magic_compile, mga);
+
+	if (MAGIC_STATUS_CHECK(mga->status < 0))
+		magic_setflags_wrapper(mgc->cookie, mgc->flags);
+
+	return (VALUE)NULL;
+}
+
+static inline VALUE
+magic_check_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+
+	mga->cookie = mgc->cookie;
+	NOGVL(nogvl_magic_check, mga);
+
+	if (MAGIC_STATUS_CHECK(mga->status < 0))
+		magic_setflags_wrapper(mgc->cookie, mgc->flags);
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_get_cache_size_internal(void *data)
+{
+	magic_cache_t **cache = data;
+
+	return SIZET2NUM(*cache ? (*cache)->capacity : 0);
+}
+
+/*
+ * Results found by looking at either more or less of the data than calls
+ * will look at from now on must not be returned from the caches.
+ */
+static VALUE
+magic_progressive_internal(void *data)
+{
+	rb_mgc_object_t *mgc = data;
+
+	mgc->progressive = !mgc->progressive;
+	mgc->generation++;
+
+	return Qnil;
+}
+
+static VALUE
+magic_set_cache_size_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	magic_cache_t **cache = mga->cache.cache;
+
+	magic_cache_free(*cache);
+	*cache = NULL;
+
+	if (mga->cache.size > 0) {
+		*cache = magic_cache_new(mga->cache.size);
+		if (!*cache)
+			mga->status = -1;
+	}
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_cache_stats_internal(void *data)
+{
+	VALUE value;
+	magic_cache_t *cache = *(magic_cache_t **)data;
+
+	value = rb_hash_new();
+
+	rb_hash_aset(value, ID2SYM(rb_intern("hits")),
+		     SIZET2NUM(cache ? cache->hits : 0));
+	rb_hash_aset(value, ID2SYM(rb_intern("misses")),
+		     SIZET2NUM(cache ? cache->misses : 0));
+	rb_hash_aset(value, ID2SYM(rb_intern("size")),
+		     SIZET2NUM(cache ? cache->count : 0));
+	rb_hash_aset(value, ID2SYM(rb_intern("capacity")),
+		     SIZET2NUM(cache ? cache->capacity : 0));
+
+	return value;
+}
+
+static VALUE
+magic_get_shared_cache_internal(void *data)
+{
+	rb_mgc_object_t *mgc = data;
+
+	if (!mgc->shared_cache)
+		return Qnil;
+
+	return CSTR2RVAL(mgc->shared_cache->path);
+}
+
+static VALUE
+magic_set_shared_cache_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+
+	magic_shared_cache_close(mgc->shared_cache);
+	mgc->shared_cache = NULL;
+
+	if (mga->file.path) {
+		mgc->shared_cache = magic_shared_cache_open(mga->file.path,
+							    MAGIC_SHARED_CACHE_SLOTS);
+		if (!mgc->shared_cache)
+			mga->status = -1;
+	}
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_shared_cache_stats_internal(void *data)
+{
+	VALUE value;
+	rb_mgc_object_t *mgc = data;
+	magic_shared_cache_t *cache = mgc->shared_cache;
+
+	value = rb_hash_new();
+
+	rb_hash_aset(value, ID2SYM(rb_intern("hits")),
+		     SIZET2NUM(cache ? cache->hits : 0));
+	rb_hash_aset(value, ID2SYM(rb_intern("misses")),
+		     SIZET2NUM(cache ? cache->misses : 0));
+	rb_hash_aset(value, ID2SYM(rb_intern("size")),
+		     SIZET2NUM(cache ? magic_shared_cache_used(cache) : 0));
+	rb_hash_aset(value, ID2SYM(rb_intern("capacity")),
+		     SIZET2NUM(cache ? cache->count : 0));
+
+	return value;
+}
+
+static VALUE
+magic_watch_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+	unsigned long generation;
+
+	/*
+	 * Start afresh in a child process, as the thread reading the events
+	 * belongs to the parent.
+	 */
+	generation = MAGIC_ATOMIC_LOAD(&rb_mgc_fork_generation);
+	if (mgc->watch && mgc->watch_generation != generation) {
+		magic_watch_free(mgc->watch);
+		mgc->watch = NULL;
+	}
+
+	if (!mgc->watch) {
+		mgc->watch = magic_watch_new();
+		if (!mgc->watch) {
+			mga->status = -1;
+			return (VALUE)NULL;
+		}
+		mgc->watch_generation = generation;
+	}
+
+	mga->status = magic_watch_add(mgc->watch, mga->file.path, mga->flags);
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_watched_internal(void *data)
+{
+	char **paths;
+	size_t count;
+	VALUE value;
+	rb_mgc_object_t *mgc = data;
+
+	value = rb_ary_new();
+
+	if (!mgc->watch ||
+	    mgc->watch_generation != MAGIC_ATOMIC_LOAD(&rb_mgc_fork_generation))
+		return value;
+
+	paths = magic_watch_paths(mgc->watch, &count);
+	if (!paths)
+		return value;
+
+	for (size_t i = 0; i < count; i++) {
+		rb_ary_push(value, CSTR2RVAL(paths[i]));
+		free(paths[i]);
+	}
+	free(paths);
+
+	return rb_ary_sort_bang(value);
+}
+
+static VALUE
+magic_unwatch_internal(void *data)
+{
+	rb_mgc_object_t *mgc = data;
+
+	magic_watch_free(mgc->watch);
+	mgc->watch = NULL;
+
+	return (VALUE)NULL;
+}
+
+/*
+ * Returns the number of leading bytes to classify (see magic_triage_buffer),
+ * which is no more than the Magic library looks at when checking for text,
+ * thus any NUL byte found in them is one that the Magic library finds too.
+ */
+static size_t
+magic_triage_size(rb_mgc_object_t *mgc)
+{
+	size_t value;
+	size_t size = MAGIC_TRIAGE_BYTES;
+
+	if (magic_getparam_wrapper(mgc->cookie, MAGIC_PARAM_BYTES_MAX,
+				   &value) == 0 && value < size)
+		size = value;
+
+#if defined(MAGIC_PARAM_ENCODING_MAX)
+	if (magic_getparam_wrapper(mgc->cookie, MAGIC_PARAM_ENCODING_MAX,
+				   &value) == 0 && value < size)
+		size = value;
+#endif /* MAGIC_PARAM_ENCODING_MAX */
+
+	return size;
+}
+
+/*
+ * Copies the result, and the error and errno when the query failed, while
+ * the lock is still held, as the result is owned by the cache, which can
+ * evict it, and both are owned by the Magic library, which can overwrite
+ * them or be closed by Magic#reload, as soon as another thread or fiber
+ * takes the lock, and releasing the lock can switch to one.
+ */
+static inline VALUE
+magic_result_copy(rb_mgc_arguments_t *mga)
+{
+	size_t length;
+	const char *message;
+
+	mga->local_errno = errno;
+
+	if (mga->status < 0 && mga->cookie) {
+		message = magic_error_wrapper(mga->cookie);
+		if (message) {
+			mga->error = rb_str_new_cstr(message);
+			mga->magic_errno = magic_errno_wrapper(mga->cookie);
+		}
+	}
+
+	if (!mga->result || mga->result == mga->copy)
+		return (VALUE)NULL;
+
+	length = strlen(mga->result);
+	if (length < sizeof(mga->copy)) {
+		memcpy(mga->copy, mga->result, length + 1);
+		mga->result = mga->copy;
+	} else {
+		mga->value = rb_str_new(mga->result, (long)length);
+		mga->result = RSTRING_PTR(mga->value);
+	}
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_file_internal(void *data)
+{
+	int flags;
+	int local_errno;
+	unsigned long version;
+	enum magic_cached cached = MAGIC_CACHED_NONE;
+	magic_cache_key_t key, shared;
+	rb_mgc_triage_arguments_t mta;
+	rb_mgc_progressive_arguments_t mpa;
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+
+	if (mgc->stop_on_errors)
+		mga->flags |= MAGIC_ERROR;
+
+	if (mga->flags & MAGIC_CONTINUE)
+		mga->flags |= MAGIC_RAW;
+
+	flags = mga->flags;
+
+	if (mgc->cache && magic_watched(mgc, mga->file.path, mga->flags,
+					&version)) {
+		cached = MAGIC_CACHED_WATCH;
+		magic_cache_key_path(&key, mga->file.path, version, mga->flags,
+				     mgc->generation);
+
+		mga->result = magic_cache_lookup(mgc->cache, &key);
+		if (mga->result)
+			return magic_result_copy(mga);
+	} else if (mgc->cache || mgc->shared_cache) {
+		if (magic_cache_key(&key, mga->file.path, mga->flags,
+				    mgc->generation) == 0)
+			cached = MAGIC_CACHED_STAT;
+
+		if (cached && mgc->cache) {
+			mga->result = magic_cache_lookup(mgc->cache, &key);
+			if (mga->result)
+				return magic_result_copy(mga);
+		}
+
+		/*
+		 * The generation is meaningless to other processes, thus the
+		 * shared cache is keyed by the digest of the database.
+		 */
+		if (cached && mgc->shared_cache) {
+			shared = key;
+			shared.digest = magic_database_digest(mgc);
+
+			mga->result = magic_shared_cache_lookup(mgc->shared_cache,
+								&shared);
+			if (mga->result) {
+				if (mgc->cache)
+					magic_cache_store(mgc->cache, &key,
+							  mga->result);
+				return magic_result_copy(mga);
+			}
+		}
+	}
+
+	if (mgc->fast_path && MAGIC_SIGNATURE_FLAGS_P(mga->flags)) {
+		magic_offload(nogvl_magic_signature_file, mga);
+		if (mga->result) {
+			mgc->fast_path_hits++;
+			mga->status = 0;
+			return magic_result_copy(mga);
+		}
+
+		mgc->fast_path_misses++;
+	}
+
+	if (mgc->triage && MAGIC_TRIAGE_FLAGS_P(mga->flags)) {
+		mta = (rb_mgc_triage_arguments_t) {
+			.path  = mga->file.path,
+			.size  = magic_triage_size(mgc),
+			.flags = mga->flags,
+		};
+
+		magic_offload(nogvl_magic_triage_file, &mta);
+		mgc->triage_counts[mta.triage]++;
+
+		flags = magic_triage_flags(mta.triage, flags);
+	}
+
+	mga->cookie = magic_cookies_get(mgc, flags);
+
+	if (mgc->progressive && MAGIC_PROGRESSIVE_FLAGS_P(mga->flags) &&
+	    magic_getparam_wrapper(mga->cookie, MAGIC_PARAM_BYTES_MAX,
+				   &mpa.limit) == 0) {
+		mpa.arguments = mga;
+
+		magic_offload(nogvl_magic_file_progressive, &mpa);
+		mgc->progressive_counts[mpa.tier]++;
+	} else {
+		magic_offload(nogvl_magic_file, mga);
+	}
+
+	local_errno = errno;
+	/*
+	 * The Magic library often does not correctly report errors,
+	 * especially when certain flags (such as e.g., MAGIC_EXTENSION,
+	 * etc.) are set. Attempt to obtain an error code first from the
+	 * Magic library itself, and if that does not work, then from
+	 * the saved errno value.
+	 */
+	if (magic_errno_wrapper(mga->cookie) || local_errno)
+		mga->status = -1;
+
+	/*
+	 * Only the errors reported by the Magic library itself prevent the
+	 * result from being cached, as errno is often left set even when
+	 * the file has been classified successfully. A result found by
+	 * looking at less of the file is not shared with other processes,
+	 * which expect one found by looking at as much as usual.
+	 */
+	if (cached && mga->result && !magic_errno_wrapper(mga->cookie)) {
+		if (mgc->cache)
+			magic_cache_store(mgc->cache, &key, mga->result);
+		if (cached == MAGIC_CACHED_STAT && mgc->shared_cache &&
+		    !mgc->progressive)
+			magic_shared_cache_store(mgc->shared_cache, &shared,
+						 mga->result);
+	}
+
+	return magic_result_copy(mga);
+}
+
+static VALUE
+magic_buffer_internal(void *data)
+{
+	int flags;
+	size_t size;
+	magic_triage_t triage;
+	magic_cache_key_t key;
+	rb_mgc_progressive_arguments_t mpa;
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+
+	if (mga->flags & MAGIC_CONTINUE)
+		mga->flags |= MAGIC_RAW;
+
+	flags = mga->flags;
+
+	/*
+	 * Matching the signatures costs less than hashing the buffer, thus
+	 * these are looked at before the cache.
+	 */
+	if (mgc->fast_path && MAGIC_SIGNATURE_FLAGS_P(mga->flags)) {
+		mga->result = magic_signature_buffer(mga->buffer.pointer,
+						     mga->buffer.size);
+		if (mga->result) {
+			mgc->fast_path_hits++;
+			mga->status = 0;
+			return magic_result_copy(mga);
+		}
+
+		mgc->fast_path_misses++;
+	}
+
+	if (mgc->buffer_cache) {
+		magic_cache_key_buffer(&key, magic_buffer_digest(&mga->buffer),
+				       mga->buffer.size, mga->flags,
+				       mgc->generation);
+
+		mga->result = magic_cache_lookup(mgc->buffer_cache, &key);
+		if (mga->result) {
+			mga->status = 0;
+			return magic_result_copy(mga);
+		}
+	}
+
+	if (mgc->triage && MAGIC_TRIAGE_FLAGS_P(mga->flags)) {
+		size = magic_triage_size(mgc);
+		if (size > mga->buffer.size)
+			size = mga->buffer.size;
+
+		triage = magic_triage_buffer(mga->buffer.pointer, size);
+		mgc->triage_counts[triage]++;
+
+		flags = magic_triage_flags(triage, flags);
+	}
+
+	mga->cookie = magic_cookies_get(mgc, flags);
+
+	if (mgc->progressive && MAGIC_PROGRESSIVE_FLAGS_P(mga->flags)) {
+		mpa = (rb_mgc_progressive_arguments_t) {
+			.arguments = mga,
+			.limit     = SIZE_MAX,
+		};
+
+		magic_offload(nogvl_magic_buffer_progressive, &mpa);
+		mgc->progressive_counts[mpa.tier]++;
+	} else {
+		magic_offload(nogvl_magic_buffer, mga);
+	}
+
+	if (mgc->buffer_cache && mga->status >= 0)
+		magic_cache_store(mgc->buffer_cache, &key, mga->result);
+
+	return magic_result_copy(mga);
+}
+
+/*
+ * Opens the handles Magic#file and Magic#buffer would use for the flags,
+ * which differ when the object stops on errors (see magic_file_internal).
+ */
+static VALUE
+magic_preload_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+	rb_mgc_object_t *mgc = mga->magic_object;
+
+	if (mga->flags & MAGIC_CONTINUE)
+		mga->flags |= MAGIC_RAW;
+
+	magic_cookies_get(mgc, mga->flags);
+
+	if (mgc->stop_on_errors)
+		magic_cookies_get(mgc, mga->flags | MAGIC_ERROR);
+
+	return Qnil;
+}
+
+static VALUE
+magic_descriptor_internal(void *data)
+{
+	rb_mgc_arguments_t *mga = data;
+
+	if (mga->flags & MAGIC_CONTINUE)
+		mga->flags |= MAGIC_RAW;
+
+	mga->cookie = magic_cookies_get(mga->magic_object, mga->flags);
+
+	magic_offload(nogvl_magic_descriptor, mga);
+
+	return magic_result_copy(mga);
+}
+
+/*
+ * Runs the function without holding the GVL. When the current fiber is
+ * non-blocking and a fiber scheduler is set, then the function runs in a
+ * separate thread instead, and the fiber waits for the thread to finish
+ * through the scheduler, which can run other fibers in the meantime.
+ *
+ * A new thread is created for every call, which adds the cost of creating
+ * and joining it, from about 40 to 100 microseconds per call as measured
+ * using benchmark/scheduler.rb, thus a call that is cheaper than that is
+ * better made from a blocking fiber.
+ */
+static void
+magic_offload(void *(*function)(void *), void *data)
+{
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+	rb_mgc_offload_t mgo;
+	VALUE thread;
+
+	if (!NIL_P(rb_fiber_scheduler_current())) {
+		mgo = (rb_mgc_offload_t) {
+			.function = function,
+			.data     = data,
+		};
+
+		thread = rb_thread_create(magic_offload_thread, &mgo);
+		rb_ensure(magic_offload_wait, thread, magic_offload_join, thread);
+		RB_GC_GUARD(thread);
+
+		errno = mgo.local_errno;
+		return;
+	}
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+	NOGVL(function, data);
+}
+
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+static VALUE
+magic_offload_thread(void *data)
+{
+	rb_mgc_offload_t *mgo = data;
+
+	errno = 0;
+	NOGVL(mgo->function, mgo->data);
+	mgo->local_errno = errno;
+
+	return Qnil;
+}
+
+static VALUE
+magic_offload_wait(VALUE thread)
+{
+	return rb_funcall(thread, rb_intern("join"), 0);
+}
+
+/*
+ * The thread refers to memory owned by the waiting fiber, and to the Magic
+ * library handle protected by the lock the fiber holds, thus the fiber must
+ * not move on until the thread is done, even when the wait was interrupted.
+ * The exception that interrupted a wait is dropped, and the one that ended
+ * the call, if any, is restored by rb_ensure once the thread is done.
+ */
+static VALUE
+magic_offload_join(VALUE thread)
+{
+	int exception;
+
+	while (RTEST(rb_funcall(thread, rb_intern("alive?"), 0))) {
+		rb_protect(magic_offload_wait, thread, &exception);
+		if (exception)
+			rb_set_errinfo(Qnil);
+	}
+
+	return Qnil;
+}
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+static inline void*
+magic_library_open(void)
+{
+	magic_t cookie;
+
+	cookie = magic_open_wrapper(MAGIC_NONE);
+	if (!cookie) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return cookie;
+}
+
+static inline void
+magic_library_close(void *data)
+{
+	rb_mgc_object_t *mgc = data;
+
+	assert(mgc != NULL &&
+	       "Must be a valid pointer to `rb_mgc_object_t' type");
+
+	if (mgc->cookie)
+		magic_close_wrapper(mgc->cookie);
+
+	magic_workers_free(mgc);
+	magic_cookies_free(mgc);
+
+	magic_cache_free(mgc->cache);
+	magic_cache_free(mgc->buffer_cache);
+	magic_shared_cache_close(mgc->shared_cache);
+	magic_watch_free(mgc->watch);
+
+	mgc->cache = NULL;
+	mgc->buffer_cache = NULL;
+	mgc->shared_cache = NULL;
+	mgc->watch = NULL;
+
+	ruby_xfree(mgc->database);
+	mgc->database = NULL;
+
+	mgc->cookie = NULL;
+}
+
+static VALUE
+magic_allocate(VALUE klass)
+{
+	int local_errno;
+	rb_mgc_object_t *mgc;
+
+	mgc = RB_ALLOC(rb_mgc_object_t);
+	local_errno = ENOMEM;
+
+	if (!mgc) {
+		errno = local_errno;
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError,
+				    local_errno,
+				    E_NOT_ENOUGH_MEMORY);
+	}
+
+	assert(mgc != NULL &&
+	       "Must be a valid pointer to `rb_mgc_object_t' type");
+
+	mgc->cookie = NULL;
+	mgc->lock = (magic_lock_t) {
+		.owner      = Qfalse,
+		.generation = MAGIC_ATOMIC_LOAD(&rb_mgc_fork_generation),
+	};
+	mgc->buffers = Qnil;
+	mgc->database = NULL;
+	mgc->cookies = NULL;
+	mgc->workers = NULL;
+	mgc->cache = NULL;
+	mgc->buffer_cache = NULL;
+	mgc->shared_cache = NULL;
+	mgc->watch = NULL;
+	mgc->watch_generation = 0;
+	mgc->generation = 0;
+	mgc->digest_generation = 0;
+	mgc->digest = 0;
+	mgc->flags = MAGIC_NONE;
+	mgc->fast_path_hits = 0;
+	mgc->fast_path_misses = 0;
+	mgc->database_loaded = 0;
+	mgc->database_mapped = 0;
+	mgc->stop_on_errors = 0;
+	mgc->fast_path = 0;
+	mgc->triage = 0;
+	mgc->progressive = 0;
+
+	for (int i = 0; i < MAGIC_TRIAGE_MAX; i++)
+		mgc->triage_counts[i] = 0;
+
+	for (int i = 0; i < MAGIC_PROGRESSIVE_TIERS; i++)
+		mgc->progressive_counts[i] = 0;
+
+	mgc->cookie = magic_library_open();
+	local_errno = errno;
+
+	if (!mgc->cookie) {
+		ruby_xfree(mgc);
+		mgc = NULL;
+		errno = local_errno;
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError,
+				    local_errno,
+				    E_MAGIC_LIBRARY_INITIALIZE);
+	}
+
+	return TypedData_Wrap_Struct(klass, &rb_mgc_type, mgc);
+}
+
+static VALUE
+magic_reload_call(VALUE value)
+{
+	rb_mgc_reload_arguments_t *mra = (rb_mgc_reload_arguments_t *)value;
+	rb_mgc_object_t *mgc = mra->magic_object;
+	magic_cookie_cache_t *entry, **link;
+	VALUE object = mra->object;
+
+	/*
+	 * A new handle is made for each of the flags that already have one,
+	 * so that calls using these do not have to load the database again
+	 * after the swap either.
+	 */
+	link = &mra->cookies;
+	for (magic_cookie_cache_t *cached = mgc->cookies; cached; cached = cached->next) {
+		entry = ALLOC(magic_cookie_cache_t);
+		*entry = (magic_cookie_cache_t) {
+			.cookie = magic_open_wrapper(cached->flags),
+			.flags  = cached->flags,
+		};
+
+		*link = entry;
+		link = &entry->next;
+	}
+
+	mra->cookie = magic_open_wrapper(mra->flags);
+	if (!mra->cookie)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
+
+	NOGVL(nogvl_magic_reload, mra);
+	if (mra->status < 0)
+		rb_exc_raise(magic_library_error(rb_mgc_eMagicError,
+						 mra->cookie));
+
+	for (link = &mra->cookies; (entry = *link);) {
+		if (entry->cookie) {
+			link = &entry->next;
+			continue;
+		}
+
+		*link = entry->next;
+		ruby_xfree(entry);
+	}
+
+	/*
+	 * The object could have been closed while the database was loading,
+	 * in which case there is nothing to swap the handles into.
+	 */
+	MAGIC_CHECK_OPEN(object);
+
+	MAGIC_SYNCHRONIZED(magic_reload_internal, mra);
+
+	magic_set_paths(object, magic_split(CSTR2RVAL(mgc->database),
+					    CSTR2RVAL(":")));
+
+	return Qnil;
+}
+
+/*
+ * What has been swapped out is closed once the lock is released, as no
+ * call can be using it any longer.
+ */
+static VALUE
+magic_reload_release(VALUE value)
+{
+	magic_reload_free((rb_mgc_reload_arguments_t *)value);
+
+	return Qnil;
+}
+
+/*
+ * Closes the handles, which can take a while for a large database, thus is
+ * done without the GVL, and releases everything else.
+ */
+static void
+magic_reload_free(rb_mgc_reload_arguments_t *mra)
+{
+	magic_cookie_cache_t *entry;
+
+	NOGVL(nogvl_magic_reload_drain, mra);
+
+	while ((entry = mra->cookies)) {
+		mra->cookies = entry->next;
+		ruby_xfree(entry);
+	}
+
+	ruby_xfree(mra->database);
+
+	mra->cookie = NULL;
+	mra->workers = NULL;
+	mra->database = NULL;
+}
+
+static inline void
+magic_mark(void *data)
+{
+	rb_mgc_object_t *mgc = data;
+
+	assert(mgc != NULL &&
+	       "Must be a valid pointer to `rb_mgc_object_t' type");
+
+	/*
+	 * The Magic library refers directly to the contents of the buffers
+	 * loaded using Magic#load_buffers, thus these strings have to be pinned
+	 * so that the garbage collector never moves them.
+	 */
+	if (!NIL_P(mgc->buffers)) {
+		rb_gc_mark(mgc->buffers);
+		for (long i = 0; i < RARRAY_LEN(mgc->buffers); i++)
+			rb_gc_mark(RARRAY_AREF(mgc->buffers, i));
+	}
+}
+
+static inline void
+magic_free(void *data)
+{
+	rb_mgc_object_t *mgc = data;
+
+	assert(mgc != NULL &&
+	       "Must be a valid pointer to `rb_mgc_object_t' type");
+
+	if (mgc->cookie)
+		magic_library_close(data);
+
+	mgc->cookie = NULL;
+	mgc->buffers = Qnil;
+
+	ruby_xfree(mgc);
+}
+
+static inline size_t
+magic_size(const void *data)
+{
+	const rb_mgc_object_t *mgc = data;
+
+	assert(mgc != NULL &&
+	       "Must be a valid pointer to `rb_mgc_object_t' type");
+
+	return sizeof(*mgc);
+}
+
+static inline VALUE
+magic_exception_wrapper(VALUE value)
+{
+	rb_mgc_error_t *mge = (rb_mgc_error_t *)value;
+
+	return rb_exc_new2(mge->klass, mge->magic_error);
+}
+
+static VALUE
+magic_exception(void *data)
+{
+	int exception = 0;
+	rb_mgc_error_t *mge = data;
+	VALUE object = Qundef;
+
+	assert(mge != NULL &&
+	       "Must be a valid pointer to `rb_mgc_error_t' type");
+
+	object = rb_protect(magic_exception_wrapper, (VALUE)mge, &exception);
+
+	if (exception)
+		rb_jump_tag(exception);
+
+	rb_iv_set(object, "@errno", INT2NUM(mge->magic_errno));
+	RB_GC_GUARD(object);
+
+	return object;
+}
+
+static inline VALUE
+magic_generic_error(VALUE klass, int magic_errno, const char *magic_error)
+{
+	rb_mgc_error_t mge;
+
+	mge = (rb_mgc_error_t) {
+		.klass       = klass,
+		.magic_errno = magic_errno,
+		.magic_error = magic_error,
+	};
+
+	return magic_exception(&mge);
+}
+
+/*
+ * Returns the error copied by magic_result_copy, as the error can no longer
+ * be read from the Magic library once the lock has been released.
+ */
+static VALUE
+magic_arguments_error(rb_mgc_arguments_t *mga)
+{
+	if (!RTEST(mga->error))
+		return magic_generic_error(rb_mgc_eMagicError, -1,
+					   MAGIC_ERRORS(E_UNKNOWN));
+
+	return magic_generic_error(rb_mgc_eMagicError, mga->magic_errno,
+				   RSTRING_PTR(mga->error));
+}
+
+static VALUE
+magic_library_error(VALUE klass, void *data)
+{
+	rb_mgc_error_t mge;
+	const char *message = NULL;
+	const char *empty = "(null)";
+	magic_t cookie = data;
+
+	UNUSED(empty);
+
+	assert(cookie != NULL &&
+	       "Must be a valid pointer to `magic_t' type");
+
+	mge = (rb_mgc_error_t) {
+		.klass       = klass,
+		.magic_errno = -1,
+		.magic_error = MAGIC_ERRORS(E_UNKNOWN),
+	};
+
+	message = magic_error_wrapper(cookie);
+	if (message) {
+		mge.magic_errno = magic_errno_wrapper(cookie);
+		mge.magic_error = message;
+	}
+
+	assert(strncmp(mge.magic_error, empty, strlen(empty)) != 0 &&
+		       "Empty or invalid error message");
+
+	return magic_exception(&mge);
+}
+
+/*
+ * The lock is only ever taken and released while holding the GVL, which
+ * already serialises access to it, thus taking a free lock is a plain check
+ * and store. Otherwise, the caller queues up and waits until woken up by the
+ * owner releasing the lock, either through the fiber scheduler, if one is
+ * set for the current non-blocking fiber, or by putting the thread to sleep.
+ *
+ * The owner hands the lock over to the first waiter in line when releasing
+ * it, as otherwise a thread calling in a loop would take the lock again
+ * before the waiter gets to run, and keep everyone else waiting forever.
+ */
+VALUE
+magic_lock(VALUE object, VALUE(*function)(ANYARGS), void *data)
+{
+	rb_mgc_object_t *mgc;
+	magic_lock_t *lock;
+	unsigned long generation;
+	VALUE fiber;
+
+	MAGIC_OBJECT(object, mgc);
+	lock = &mgc->lock;
+
+	/*
+	 * Only the thread that called fork(2) is left in the child process,
+	 * thus the lock cannot be owned or waited for by anyone else.
+	 */
+	generation = MAGIC_ATOMIC_LOAD(&rb_mgc_fork_generation);
+	if (lock->generation != generation) {
+		lock->owner = Qfalse;
+		lock->head = lock->tail = NULL;
+		lock->generation = generation;
+
+		if (mgc->workers)
+			magic_pool_atfork_child(mgc->workers);
+	}
+
+	fiber = rb_fiber_current();
+
+	if (lock->owner == fiber)
+		rb_raise(rb_eThreadError, "deadlock; recursive locking");
+
+	if (lock->owner != Qfalse)
+		magic_lock_wait(object, lock, fiber);
+
+	lock->owner = fiber;
 
-static inline void*
-nogvl_magic_check(void *data)
+	return rb_ensure(function, (VALUE)data, magic_unlock, object);
+}
+
+VALUE
+magic_unlock(VALUE object)
+{
+	rb_mgc_object_t *mgc;
+
+	MAGIC_OBJECT(object, mgc);
+
+	mgc->lock.owner = Qfalse;
+
+	if (mgc->lock.head)
+		magic_lock_wakeup(object, &mgc->lock);
+
+	return Qnil;
+}
+
+static void
+magic_lock_wait(VALUE object, magic_lock_t *lock, VALUE fiber)
+{
+	int exception = 0;
+	magic_lock_waiter_t waiter;
+	rb_mgc_lock_arguments_t mla;
+
+	waiter = (magic_lock_waiter_t) {
+		.fiber     = fiber,
+		.thread    = rb_thread_current(),
+		.scheduler = Qnil,
+	};
+
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+	waiter.scheduler = rb_fiber_scheduler_current();
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+	mla = (rb_mgc_lock_arguments_t) {
+		.object = object,
+		.lock   = lock,
+		.waiter = &waiter,
+	};
+
+	while (lock->owner != fiber) {
+		rb_protect(magic_lock_sleep, (VALUE)&mla, &exception);
+		magic_lock_dequeue(lock, &waiter);
+
+		if (exception) {
+			/*
+			 * Pass on the lock that might have been handed over to
+			 * this waiter, so that the others do not wait forever.
+			 */
+			if (lock->owner == fiber) {
+				lock->owner = Qfalse;
+				if (lock->head)
+					magic_lock_wakeup(object, lock);
+			}
+
+			rb_jump_tag(exception);
+		}
+	}
+
+	RB_GC_GUARD(waiter.fiber);
+	RB_GC_GUARD(waiter.thread);
+	RB_GC_GUARD(waiter.scheduler);
+}
+
+static VALUE
+magic_lock_sleep(VALUE value)
+{
+	rb_mgc_lock_arguments_t *mla = (rb_mgc_lock_arguments_t *)value;
+	magic_lock_t *lock = mla->lock;
+	magic_lock_waiter_t *waiter = mla->waiter;
+
+	waiter->next = NULL;
+	waiter->queued = 1;
+
+	if (lock->tail)
+		lock->tail->next = waiter;
+	else
+		lock->head = waiter;
+
+	lock->tail = waiter;
+
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+	if (!NIL_P(waiter->scheduler)) {
+		rb_fiber_scheduler_block(waiter->scheduler, mla->object, Qnil);
+		return Qnil;
+	}
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+	rb_thread_sleep_forever();
+
+	return Qnil;
+}
+
+static void
+magic_lock_dequeue(magic_lock_t *lock, magic_lock_waiter_t *waiter)
+{
+	magic_lock_waiter_t **entry = &lock->head;
+	magic_lock_waiter_t *previous = NULL;
+
+	if (!waiter->queued)
+		return;
+
+	while (*entry && *entry != waiter) {
+		previous = *entry;
+		entry = &(*entry)->next;
+	}
+
+	if (*entry) {
+		*entry = waiter->next;
+		if (lock->tail == waiter)
+			lock->tail = previous;
+	}
+
+	waiter->next = NULL;
+	waiter->queued = 0;
+}
+
+static void
+magic_lock_wakeup(VALUE object, magic_lock_t *lock)
+{
+	magic_lock_waiter_t *waiter = lock->head;
+
+	magic_lock_dequeue(lock, waiter);
+	lock->owner = waiter->fiber;
+
+#if defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+	if (!NIL_P(waiter->scheduler)) {
+		rb_fiber_scheduler_unblock(waiter->scheduler, object,
+					   waiter->fiber);
+		return;
+	}
+#endif /* HAVE_RB_FIBER_SCHEDULER_CURRENT */
+
+	UNUSED(object);
+
+	rb_thread_wakeup_alive(waiter->thread);
+}
+
+static void
+magic_lock_atfork_child(void)
+{
+	MAGIC_ATOMIC_STORE(&rb_mgc_fork_generation,
+			   MAGIC_ATOMIC_LOAD(&rb_mgc_fork_generation) + 1);
+}
+
+/*
+ * Returns a frozen string for the result. The strings are deduplicated
+ * by Ruby, thus results that were seen before, such as the same MIME type
+ * returned over and over again, do not allocate new objects.
+ */
+static inline VALUE
+magic_intern(const char *cstring, size_t length)
+{
+#if defined(HAVE_RB_ENC_INTERNED_STR)
+	return rb_enc_interned_str(cstring, (long)length,
+				   rb_ascii8bit_encoding());
+#else
+	return rb_obj_freeze(rb_str_new(cstring, (long)length));
+#endif /* HAVE_RB_ENC_INTERNED_STR */
+}
+
+/*
+ * Same as magic_intern(), but strips leading and trailing whitespace and
+ * null bytes, as String#strip does.
+ */
+static VALUE
+magic_intern_strip(const char *cstring, size_t length)
+{
+	while (length > 0 && (ISSPACE(*cstring) || *cstring == '\0')) {
+		cstring++;
+		length--;
+	}
+
+	while (length > 0 && (ISSPACE(cstring[length - 1]) ||
+			      cstring[length - 1] == '\0'))
+		length--;
+
+	return magic_intern(cstring, length);
+}
+
+/*
+ * Builds the result from the string returned by the Magic library without
+ * calling into Ruby. When the CONTINUE or the EXTENSION flag is set, then
+ * the string is split into fields the way String#split would, and an array
+ * of the non-empty fields is returned when there is more than one field.
+ */
+static VALUE
+magic_return(void *data)
 {
 	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	const char *unknown = "???";
+	const char *separator = NULL;
+	const char *cstring, *end, *next;
+	size_t length, separator_length;
+	size_t fields = 0, count = 0;
+	VALUE array;
+
+	if (!mga->result)
+		return Qnil;
 
-	mga->status = magic_check_wrapper(cookie,
-					  mga->file.path,
-					  mga->flags);
+	length = strlen(mga->result);
+
+	/*
+	 * The value below is a field separator that can be used to split results
+	 * when the CONTINUE flag is set causing all valid matches found by the
+	 * Magic library to be returned.
+	 */
+	if (mga->flags & MAGIC_CONTINUE)
+		separator = MAGIC_CONTINUE_SEPARATOR;
+
+	if (mga->flags & MAGIC_EXTENSION) {
+		/*
+		 * A possible I/O-related error has occurred, and there is very
+		 * little sense processing the results, so return string as-is.
+		 */
+		if (mga->status < 0)
+			return magic_intern(mga->result, length);
+		/*
+		 * A number of Magic flags that support primarily files e.g.,
+		 * MAGIC_EXTENSION, etc., would not return a meaningful value for
+		 * directories and special files, and such. Thus, it's better to
+		 * return an empty string, to indicate lack of results, rather
+		 * than a confusing string consisting of three questions marks.
+		 */
+		if (strncmp(mga->result, unknown, strlen(unknown)) == 0)
+			return magic_intern("", 0);
+
+		separator = MAGIC_EXTENSION_SEPARATOR;
+	}
+
+	if (!separator)
+		return magic_intern_strip(mga->result, length);
+
+	separator_length = strlen(separator);
+
+	/*
+	 * Trailing empty fields are dropped, as String#split does, thus count
+	 * the fields up to the last non-empty one first.
+	 */
+	for (cstring = mga->result; cstring; cstring = next) {
+		end = strstr(cstring, separator);
+		next = end ? end + separator_length : NULL;
+		if (!end)
+			end = mga->result + length;
+
+		count++;
+		if (end > cstring)
+			fields = count;
+	}
+
+	if (fields == 0)
+		return Qnil;
+
+	if (fields == 1) {
+		end = strstr(mga->result, separator);
+		if (!end)
+			end = mga->result + length;
+
+		return magic_intern_strip(mga->result,
+					  (size_t)(end - mga->result));
+	}
+
+	array = rb_ary_new_capa((long)fields);
+
+	cstring = mga->result;
+	for (size_t i = 0; i < fields; i++) {
+		end = strstr(cstring, separator);
+		next = end ? end + separator_length : NULL;
+		if (!end)
+			end = mga->result + length;
+
+		if (end > cstring)
+			rb_ary_push(array,
+				    magic_intern_strip(cstring,
+						       (size_t)(end - cstring)));
+		cstring = next;
+	}
+
+	return array;
+}
+
+/*
+ * Threads that were using the pool when the process forked are gone in the
+ * child, together with the cookies they had checked out, thus the pool is
+ * reset the first time it is used in the child.
+ */
+static void
+magic_pool_object_atfork(rb_mgc_pool_object_t *mpo)
+{
+	unsigned long generation;
+
+	generation = MAGIC_ATOMIC_LOAD(&rb_mgc_fork_generation);
+	if (!mpo->pool || mpo->generation == generation)
+		return;
+
+	magic_pool_atfork_child(mpo->pool);
+	mpo->generation = generation;
+}
+
+/*
+ * Enters the pool and runs the query. Must be called once the arguments
+ * are converted, as converting them can run Ruby code, such as #to_path,
+ * which can close the pool. Whether the pool is closed is only checked when
+ * entering it, at once, and a pool that has been entered cannot be closed
+ * until it is left.
+ */
+static VALUE
+magic_pool_call(rb_mgc_pool_object_t *mpo, rb_mgc_pool_arguments_t *mpa)
+{
+	if (!mpo->pool)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, EFAULT,
+				    E_MAGIC_LIBRARY_CLOSED);
+
+	magic_pool_object_atfork(mpo);
+
+	mpa->pool = mpo->pool;
+	mpa->flags = mpo->pool->flags;
+
+	if (magic_pool_enter(mpa->pool) < 0)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, EFAULT,
+				    E_MAGIC_LIBRARY_CLOSED);
+
+	return rb_ensure(magic_pool_internal, (VALUE)mpa,
+			 magic_pool_release, (VALUE)mpa);
+}
+
+static VALUE
+magic_pool_internal(VALUE value)
+{
+	rb_mgc_arguments_t mga;
+	rb_mgc_pool_arguments_t *mpa = (rb_mgc_pool_arguments_t *)value;
+	VALUE exception = Qundef;
+
+	for (;;) {
+		mpa->cancel = 0;
+		NOGVL_UBF(nogvl_magic_pool, mpa, magic_pool_ubf, mpa);
+		if (mpa->checked_out || mpa->local_errno != EINTR)
+			break;
+
+		rb_thread_check_ints();
+	}
+
+	if (!mpa->checked_out)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, EFAULT,
+				    E_MAGIC_LIBRARY_CLOSED);
+
+	if (mpa->status < 0 && !mpa->result) {
+		if (mpa->function == MAGIC_POOL_DESCRIPTOR &&
+		    mpa->local_errno == EBADF)
+			rb_raise(rb_eIOError, "Bad file descriptor");
+
+		if (mpa->function != MAGIC_POOL_FILE ||
+		    (mpa->flags & MAGIC_ERROR)) {
+			exception = magic_generic_error(rb_mgc_eMagicError, -1,
+							MAGIC_ERRORS(E_UNKNOWN));
+			if (mpa->error)
+				exception = magic_generic_error(rb_mgc_eMagicError,
+								mpa->magic_errno,
+								mpa->error);
+			rb_exc_raise(exception);
+		}
+
+		mpa->result = mpa->error;
+		mpa->error = NULL;
+	}
+
+	if (!mpa->result)
+		MAGIC_GENERIC_ERROR(rb_mgc_eMagicError, EINVAL, E_UNKNOWN);
+
+	mga = (rb_mgc_arguments_t) {
+		.result = mpa->result,
+		.status = mpa->status,
+		.flags  = mpa->flags,
+	};
+
+	return magic_return(&mga);
+}
+
+static VALUE
+magic_pool_release(VALUE value)
+{
+	rb_mgc_pool_arguments_t *mpa = (rb_mgc_pool_arguments_t *)value;
+
+	free(mpa->result);
+	free(mpa->error);
+
+	mpa->result = NULL;
+	mpa->error = NULL;
+
+	magic_pool_leave(mpa->pool);
+
+	return Qnil;
+}
+
+static VALUE
+magic_files_call(VALUE value)
+{
+	rb_mgc_files_arguments_t *mfa = (rb_mgc_files_arguments_t *)value;
+	rb_mgc_arguments_t mga;
+	magic_pool_result_t *result;
+	VALUE array, exception;
+
+	magic_lock(mfa->object, magic_files_internal, mfa);
+
+	array = rb_ary_new_capa((long)mfa->count);
+
+	for (size_t i = 0; i < mfa->count; i++) {
+		result = &mfa->results[i];
+
+		if (result->status < 0 && !result->result) {
+			/*
+			 * See rb_mgc_file() for why the error message is used
+			 * as the result when the "ERROR" flag is not set.
+			 */
+			if (!(mfa->flags & MAGIC_ERROR) && result->error) {
+				result->result = result->error;
+				result->error = NULL;
+			} else {
+				exception = magic_generic_error(rb_mgc_eMagicError, -1,
+								MAGIC_ERRORS(E_UNKNOWN));
+				if (result->error)
+					exception = magic_generic_error(rb_mgc_eMagicError,
+									result->magic_errno,
+									result->error);
+				rb_ary_push(array, exception);
+				continue;
+			}
+		}
+
+		mga = (rb_mgc_arguments_t) {
+			.result = result->result,
+			.status = result->status,
+			.flags  = mfa->flags,
+		};
+
+		rb_ary_push(array, magic_return(&mga));
+	}
+
+	return array;
+}
+
+static VALUE
+magic_files_internal(void *data)
+{
+	rb_mgc_files_arguments_t *mfa = data;
+	rb_mgc_object_t *mgc = mfa->magic_object;
+	magic_pool_t *workers = mgc->workers;
+
+	if (workers && (workers->size < mfa->threads ||
+			workers->flags != mfa->flags))
+		magic_workers_free(mgc);
+
+	if (!mgc->workers)
+		mgc->workers = magic_workers_new(mfa);
+
+	for (;;) {
+		mfa->cancel = 0;
+		NOGVL_UBF(nogvl_magic_files, mfa, magic_files_ubf, mfa);
+		if (mfa->status == 0 || mfa->local_errno != EINTR)
+			break;
+
+		rb_thread_check_ints();
+	}
+
+	if (mfa->status < 0)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, mfa->local_errno,
+				    E_NOT_ENOUGH_MEMORY);
+
+	return (VALUE)NULL;
+}
+
+static VALUE
+magic_files_release(VALUE value)
+{
+	rb_mgc_files_arguments_t *mfa = (rb_mgc_files_arguments_t *)value;
+
+	magic_pool_results_free(mfa->results, mfa->count);
+	ruby_xfree(mfa->paths);
+
+	mfa->results = NULL;
+	mfa->paths = NULL;
+
+	return Qnil;
+}
+
+static VALUE
+magic_identify_call(VALUE value)
+{
+	rb_mgc_identify_arguments_t *mia = (rb_mgc_identify_arguments_t *)value;
+
+	return magic_lock(mia->object, magic_identify_internal, mia);
+}
+
+static VALUE
+magic_identify_internal(void *data)
+{
+	static const int views[MAGIC_VIEWS] = {
+		[MAGIC_VIEW_DESCRIPTION]   = MAGIC_NONE,
+		[MAGIC_VIEW_MIME_TYPE]     = MAGIC_MIME_TYPE,
+		[MAGIC_VIEW_MIME_ENCODING] = MAGIC_MIME_ENCODING,
+		[MAGIC_VIEW_EXTENSION]     = MAGIC_EXTENSION,
+	};
+	size_t value;
+	rb_mgc_identify_arguments_t *mia = data;
+	rb_mgc_object_t *mgc = mia->magic_object;
+	rb_mgc_arguments_t *mga;
+	VALUE hash, extensions;
+
+	mia->limit = 0;
+	if (magic_getparam_wrapper(mgc->cookie, MAGIC_PARAM_BYTES_MAX,
+				   &value) == 0)
+		mia->limit = value;
+
+	magic_offload(nogvl_magic_read, mia);
+
+	for (int i = 0; i < MAGIC_VIEWS; i++) {
+		mga = &mia->views[i];
+
+		*mga = (rb_mgc_arguments_t) {
+			.magic_object = mgc,
+			.flags = mia->flags | views[i],
+		};
+
+		if (mia->status == 0) {
+			mga->buffer = (struct buffer) {
+				.pointer = mia->contents,
+				.size    = mia->size,
+			};
+			magic_buffer_internal(mga);
+		} else if (mia->descriptor) {
+			mga->file.fd = mia->file.fd;
+			magic_descriptor_internal(mga);
+		} else {
+			mga->file.path = mia->file.path;
+			magic_file_internal(mga);
+		}
+
+		/*
+		 * Directories and special files, or files that could not be
+		 * read, have no extensions.
+		 */
+		if (i == MAGIC_VIEW_EXTENSION && mga->status < 0) {
+			mga->result = "???";
+			mga->status = 0;
+			continue;
+		}
+
+		if (mga->status < 0 && mia->status == 0)
+			rb_exc_raise(magic_arguments_error(mga));
+
+		if (mga->status < 0 && mia->descriptor) {
+			if (mga->local_errno == EBADF)
+				rb_raise(rb_eIOError, "Bad file descriptor");
+
+			rb_exc_raise(magic_arguments_error(mga));
+		}
+
+		/*
+		 * See rb_mgc_file() for why the error message is used as the
+		 * result when the "ERROR" flag is not set.
+		 */
+		if (mga->status < 0 && !mga->result) {
+			if (mgc->stop_on_errors || (mga->flags & MAGIC_ERROR))
+				rb_exc_raise(magic_arguments_error(mga));
+
+			if (RTEST(mga->error))
+				mga->result = RSTRING_PTR(mga->error);
+		}
+
+		if (!mga->result)
+			MAGIC_GENERIC_ERROR(rb_mgc_eMagicError, EINVAL,
+					    E_UNKNOWN);
+	}
+
+	extensions = magic_return(&mia->views[MAGIC_VIEW_EXTENSION]);
+	if (!ARRAY_P(extensions)) {
+		if (RSTRING_LEN(extensions) > 0)
+			extensions = rb_ary_new_from_args(1, extensions);
+		else
+			extensions = rb_ary_new();
+	}
+
+	hash = rb_hash_new();
+
+	rb_hash_aset(hash, ID2SYM(rb_intern("description")),
+		     magic_return(&mia->views[MAGIC_VIEW_DESCRIPTION]));
+	rb_hash_aset(hash, ID2SYM(rb_intern("mime_type")),
+		     magic_return(&mia->views[MAGIC_VIEW_MIME_TYPE]));
+	rb_hash_aset(hash, ID2SYM(rb_intern("encoding")),
+		     magic_return(&mia->views[MAGIC_VIEW_MIME_ENCODING]));
+	rb_hash_aset(hash, ID2SYM(rb_intern("extensions")), extensions);
+
+	return hash;
+}
+
+static VALUE
+magic_identify_release(VALUE value)
+{
+	rb_mgc_identify_arguments_t *mia = (rb_mgc_identify_arguments_t *)value;
+
+	free(mia->contents);
+	mia->contents = NULL;
+
+	return Qnil;
+}
+
+/*
+ * Reads the beginning of a regular file, or what is available from a pipe
+ * or a socket, into memory, so that it can be classified more than once
+ * without having to read it again. Sets the status to a positive value
+ * when the file has to be handed to the Magic library instead, including
+ * when it could not be opened or read, so that the library can report it,
+ * and when the path is not that of a regular file, such as a symbolic link,
+ * a named pipe or a device.
+ *
+ * The Magic library reads ELF binaries past their beginning, which it can
+ * only do given a file, thus these are handed to the library as well.
+ */
+static void *
+nogvl_magic_read(void *data)
+{
+	int fd = -1;
+	int flags = O_RDONLY | O_NONBLOCK;
+	ssize_t length;
+	off_t offset = 0;
+	size_t size = 0;
+	size_t limit;
+	char *pointer = NULL;
+	struct stat status;
+	rb_mgc_identify_arguments_t *mia = data;
+
+#if defined(HAVE_O_CLOEXEC)
+	flags |= O_CLOEXEC;
+#endif
+
+	mia->status = 1;
+	limit = mia->limit;
+
+	/*
+	 * The Magic library reports a symbolic link itself rather than what
+	 * it points to, unless told to follow it.
+	 */
+	if (!mia->descriptor && !(mia->flags & MAGIC_SYMLINK)) {
+#if defined(O_NOFOLLOW)
+		flags |= O_NOFOLLOW;
+#else
+		return NULL;
+#endif
+	}
 
-	return NULL;
-}
+	if (mia->descriptor)
+		fd = mia->file.fd;
+	else
+		fd = open(mia->file.path, flags);
 
-static inline void*
-nogvl_magic_file(void *data)
-{
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	if (fd < 0 || fstat(fd, &status) < 0)
+		goto out;
 
-	mga->result = magic_file_wrapper(cookie,
-					 mga->file.path,
-					 mga->flags);
+	if (S_ISREG(status.st_mode)) {
+		if (mia->descriptor) {
+			offset = lseek(fd, 0, SEEK_CUR);
+			if (offset < 0)
+				goto out;
+		}
 
-	mga->status = !mga->result ? -1 : 0;
+		/*
+		 * The Magic library reports empty files differently from an
+		 * empty buffer.
+		 */
+		if (status.st_size <= offset)
+			goto out;
+
+		if ((size_t)(status.st_size - offset) < limit)
+			limit = (size_t)(status.st_size - offset);
+	} else if (!mia->descriptor ||
+		   !(S_ISFIFO(status.st_mode) || S_ISSOCK(status.st_mode))) {
+		goto out;
+	}
 
-	return NULL;
-}
+	pointer = malloc(limit ? limit : 1);
+	if (!pointer)
+		goto out;
 
-static inline void*
-nogvl_magic_descriptor(void *data)
-{
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	while (size < limit) {
+		if (S_ISREG(status.st_mode))
+			length = pread(fd, pointer + size, limit - size,
+				       offset + (off_t)size);
+		else
+			length = read(fd, pointer + size, limit - size);
 
-	mga->result = magic_descriptor_wrapper(cookie,
-					       mga->file.fd,
-					       mga->flags);
+		if (length < 0 && errno == EINTR)
+			continue;
 
-	mga->status = !mga->result ? -1 : 0;
+		if (length < 0) {
+			free(pointer);
+			goto out;
+		}
 
-	return NULL;
-}
+		if (length == 0)
+			break;
 
-static inline VALUE
-magic_get_parameter_internal(void *data)
-{
-	size_t value;
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+		size += (size_t)length;
+	}
 
-	mga->status = magic_getparam_wrapper(cookie,
-					     mga->parameter.tag,
-					     &value);
+	if (S_ISREG(status.st_mode) && size >= 4 &&
+	    memcmp(pointer, "\177ELF", 4) == 0) {
+		free(pointer);
+		goto out;
+	}
 
-	mga->parameter.value = value;
+	mia->contents = pointer;
+	mia->size = size;
+	mia->status = 0;
+out:
+	if (!mia->descriptor && fd >= 0)
+		close(fd);
 
-	return (VALUE)NULL;
+	return NULL;
 }
 
-static inline VALUE
-magic_set_parameter_internal(void *data)
+static magic_pool_t *
+magic_workers_new(rb_mgc_files_arguments_t *mfa)
 {
 	size_t value;
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	size_t count;
+	rb_mgc_object_t *mgc = mfa->magic_object;
+	rb_mgc_pool_arguments_t mpa;
+	magic_pool_t *pool;
+	VALUE exception = Qundef;
+
+	pool = magic_pool_new(mfa->threads, mfa->flags);
+	if (!pool) {
+		if (errno == ENOMEM)
+			MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, errno,
+					    E_NOT_ENOUGH_MEMORY);
+
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, errno,
+				    E_MAGIC_LIBRARY_INITIALIZE);
+	}
 
-	value = mga->parameter.value;
+	for (int i = 0; i < ARRAY_SIZE(rb_mgc_parameters); i++) {
+		if (magic_getparam_wrapper(mgc->cookie, rb_mgc_parameters[i],
+					   &value) < 0)
+			continue;
 
-	mga->status = magic_setparam_wrapper(cookie,
-					     mga->parameter.tag,
-					     &value);
+		magic_pool_setparam(pool, rb_mgc_parameters[i], &value);
+	}
 
-	return (VALUE)NULL;
-}
+	mpa = (rb_mgc_pool_arguments_t) {
+		.pool = pool,
+	};
 
-static inline VALUE
-magic_get_flags_internal(void *data)
-{
-	int flags;
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	if (!NIL_P(mgc->buffers)) {
+		count = (size_t)RARRAY_LEN(mgc->buffers);
 
-	mga->status = 0;
+		mpa.buffers = (struct buffers) {
+			.count    = count,
+			.pointers = ALLOCA_N(void *, count),
+			.sizes    = ALLOCA_N(size_t, count),
+		};
+
+		for (size_t i = 0; i < count; i++) {
+			VALUE buffer = RARRAY_AREF(mgc->buffers, (long)i);
+			mpa.buffers.pointers[i] = (void *)RSTRING_PTR(buffer);
+			mpa.buffers.sizes[i] = (size_t)RSTRING_LEN(buffer);
+		}
 
-	flags = magic_getflags_wrapper(cookie);
-	if (flags < 0)
-		mga->status = -1;
-	else
-		mga->flags = flags;
+		NOGVL(nogvl_magic_pool_load_buffers, &mpa);
+	} else {
+		mpa.file.path = mfa->database;
+		NOGVL(nogvl_magic_pool_load, &mpa);
+	}
 
-	return (VALUE)NULL;
+	if (mpa.status < 0) {
+		exception = magic_library_error(rb_mgc_eMagicError,
+						pool->cookies[0]);
+		magic_pool_free(pool);
+		rb_exc_raise(exception);
+	}
+
+	return pool;
 }
 
-static inline VALUE
-magic_set_flags_internal(void *data)
+static inline void
+magic_workers_free(rb_mgc_object_t *mgc)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-
-	mga->status = magic_setflags_wrapper(cookie, mga->flags);
-
-	return (VALUE)NULL;
+	magic_pool_free(mgc->workers);
+	mgc->workers = NULL;
 }
 
-static inline VALUE
-magic_close_internal(void *data)
+/*
+ * Returns the Magic library handle to use for the given flags, so that
+ * queries never have to change the flags of a handle back and forth. The
+ * main handle is used when the flags match its own, otherwise a separate
+ * handle is opened the first time the flags are used, and the database of
+ * the main handle is loaded into it. Compiled databases are mapped into
+ * memory by the library, thus the pages are shared between handles, but
+ * source files are parsed and compiled again for every handle, which can
+ * take hundreds of milliseconds for a large database.
+ *
+ * The most recently used handles are kept, up to MAGIC_COOKIES_MAX of them.
+ * Must be called with the lock held.
+ */
+static VALUE
+magic_get_cache_size(VALUE object, magic_cache_t **cache)
 {
-	magic_library_close(data);
-
-	return Qnil;
+	return MAGIC_SYNCHRONIZED(magic_get_cache_size_internal, cache);
 }
 
-static inline VALUE
-magic_load_internal(void *data)
+static VALUE
+magic_set_cache_size(VALUE object, magic_cache_t **cache, VALUE value)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-	int old_flags = mga->flags;
-
-	NOGVL(nogvl_magic_load, mga);
+	long size;
+	rb_mgc_object_t *mgc;
+	rb_mgc_arguments_t mga;
 
-	if (MAGIC_STATUS_CHECK(mga->status < 0))
-		magic_setflags_wrapper(cookie, old_flags);
+	size = NUM2LONG(value);
+	if (size < 0)
+		rb_raise(rb_eArgError, "%s", MAGIC_ERRORS(E_CACHE_INVALID_SIZE));
 
-	return (VALUE)NULL;
-}
+	MAGIC_OBJECT(object, mgc);
 
-static inline VALUE
-magic_load_buffers_internal(void *data)
-{
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
+	mga = (rb_mgc_arguments_t) {
+		.magic_object = mgc,
+		.cache = {
+			.cache = cache,
+			.size  = (size_t)size,
+		},
+	};
 
-	mga->status = magic_load_buffers_wrapper(cookie,
-						 mga->buffers.pointers,
-						 mga->buffers.sizes,
-						 mga->buffers.count,
-						 mga->flags);
+	MAGIC_SYNCHRONIZED(magic_set_cache_size_internal, &mga);
+	if (mga.status < 0)
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
 
-	return (VALUE)NULL;
+	return value;
 }
 
-static inline VALUE
-magic_compile_internal(void *data)
+static VALUE
+magic_cache_stats(VALUE object, magic_cache_t **cache)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-	int old_flags = mga->flags;
-
-	NOGVL(nogvl_magic_compile, mga);
-
-	if (MAGIC_STATUS_CHECK(mga->status < 0))
-		magic_setflags_wrapper(cookie, old_flags);
+	return MAGIC_SYNCHRONIZED(magic_cache_stats_internal, cache);
+}
 
-	return (VALUE)NULL;
+/*
+ * Returns a hash of the whole buffer, as the Magic library does not limit
+ * itself to any part of a buffer, and rules at large offsets, such as the
+ * one for ISO 9660 images at 32769, can look anywhere in it. The hash is
+ * seeded randomly for each process, the same as String#hash, so that
+ * colliding contents cannot be crafted to poison the cache.
+ */
+static size_t
+magic_buffer_digest(struct buffer *buffer)
+{
+	return (size_t)rb_memhash(buffer->pointer, (long)buffer->size);
 }
 
-static inline VALUE
-magic_check_internal(void *data)
+/*
+ * Returns a digest identifying the database, the parameters and the version
+ * of the Magic library, which is the same in every process that has loaded
+ * the same database, so that results can be shared between processes. The
+ * database files are identified by their metadata, including the compiled
+ * files that the Magic library prefers when present.
+ */
+static size_t
+magic_database_digest(rb_mgc_object_t *mgc)
 {
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-	int old_flags = mga->flags;
+	int version;
+	size_t value;
+	size_t digest;
+	struct stat st;
+	char name[PATH_MAX];
+	char *paths, *path, *state;
+	magic_database_t *database;
+	VALUE buffers;
+
+	if (mgc->digest_generation == mgc->generation && mgc->digest)
+		return mgc->digest;
+
+	version = magic_version_wrapper();
+	digest = magic_cache_digest(MAGIC_CACHE_DIGEST_INIT, &version,
+				    sizeof(version));
+
+	for (int i = 0; i < ARRAY_SIZE(rb_mgc_parameters); i++) {
+		value = 0;
+		magic_getparam_wrapper(mgc->cookie, rb_mgc_parameters[i], &value);
+		digest = magic_cache_digest(digest, &value, sizeof(value));
+	}
 
-	NOGVL(nogvl_magic_check, mga);
+	if (mgc->database) {
+		digest = magic_cache_digest(digest, mgc->database,
+					    strlen(mgc->database));
+
+		paths = strdup(mgc->database);
+		for (path = paths ? strtok_r(paths, ":", &state) : NULL; path;
+		     path = strtok_r(NULL, ":", &state)) {
+			for (int compiled = 0; compiled < 2; compiled++) {
+				if (snprintf(name, sizeof(name), "%s%s", path,
+					     compiled ? ".mgc" : "") >= (int)sizeof(name))
+					continue;
+
+				if (stat(name, &st) < 0)
+					continue;
+
+				digest = magic_cache_digest(digest, &st.st_dev,
+							    sizeof(st.st_dev));
+				digest = magic_cache_digest(digest, &st.st_ino,
+							    sizeof(st.st_ino));
+				digest = magic_cache_digest(digest, &st.st_size,
+							    sizeof(st.st_size));
+				digest = magic_cache_digest(digest, &st.st_mtime,
+							    sizeof(st.st_mtime));
+			}
+		}
+		free(paths);
+	} else if (!NIL_P(mgc->buffers)) {
+		buffers = mgc->buffers;
+		for (long i = 0; i < RARRAY_LEN(buffers); i++) {
+			VALUE buffer = RARRAY_AREF(buffers, i);
+
+			/*
+			 * A mapped database is identified by its file, rather
+			 * than by reading all of its contents.
+			 */
+			database = magic_database_find(RSTRING_PTR(buffer),
+						       (size_t)RSTRING_LEN(buffer));
+			if (database) {
+				digest = magic_cache_digest(digest,
+							    &database->digest,
+							    sizeof(database->digest));
+				continue;
+			}
+
+			digest = magic_cache_digest(digest, RSTRING_PTR(buffer),
+						    (size_t)RSTRING_LEN(buffer));
+		}
+	}
 
-	if (MAGIC_STATUS_CHECK(mga->status < 0))
-		magic_setflags_wrapper(cookie, old_flags);
+	mgc->digest = digest;
+	mgc->digest_generation = mgc->generation;
 
-	return (VALUE)NULL;
+	return digest;
 }
 
+/*
+ * Returns the paths to look for a compiled database at by default, which
+ * are the default paths of the Magic library, each followed by the same
+ * path with the ".mgc" suffix added, as the Magic library would.
+ */
 static VALUE
-magic_file_internal(void *data)
+magic_database_paths(void)
 {
-	int local_errno;
-	int restore_flags = 0;
-	rb_mgc_arguments_t *mga = data;
-	rb_mgc_object_t *mgc = mga->magic_object;
-	magic_t cookie = mgc->cookie;
-	int old_flags = mga->flags;
+	VALUE value, paths, suffix = CSTR2RVAL(".mgc");
 
-	if (mgc->stop_on_errors)
-		mga->flags |= MAGIC_ERROR;
+	value = rb_funcall(rb_cMagic, rb_intern("default_paths"), 0);
+	if (getenv("MAGIC") || NIL_P(value))
+		value = magic_split(CSTR2RVAL(magic_getpath_wrapper()),
+				    CSTR2RVAL(":"));
 
-	if (mga->flags & MAGIC_CONTINUE)
-		mga->flags |= MAGIC_RAW;
+	paths = rb_ary_new_capa(RARRAY_LEN(value) * 2);
+	for (long i = 0; i < RARRAY_LEN(value); i++) {
+		VALUE path = RARRAY_AREF(value, i);
+		long length = RSTRING_LEN(path);
 
-	if (old_flags != mga->flags)
-		restore_flags = 1;
+		if (length < RSTRING_LEN(suffix) ||
+		    memcmp(RSTRING_PTR(path) + length - RSTRING_LEN(suffix),
+			   RSTRING_PTR(suffix), (size_t)RSTRING_LEN(suffix)) != 0)
+			rb_ary_push(paths, rb_str_plus(path, suffix));
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, mga->flags);
+		rb_ary_push(paths, path);
+	}
 
-	NOGVL(nogvl_magic_file, mga);
-	local_errno = errno;
-	/*
-	 * The Magic library often does not correctly report errors,
-	 * especially when certain flags (such as e.g., MAGIC_EXTENSION,
-	 * etc.) are set. Attempt to obtain an error code first from the
-	 * Magic library itself, and if that does not work, then from
-	 * the saved errno value.
-	 */
-	if (magic_errno_wrapper(cookie) || local_errno)
-		mga->status = -1;
+	RB_GC_GUARD(suffix);
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, old_flags);
+	return paths;
+}
 
-	return (VALUE)NULL;
+/*
+ * Returns the database linked into the extension, unless the MAGIC
+ * environment variable is set, in which case the database it points to
+ * is meant to be used instead, or +nil+ if there is none.
+ */
+static VALUE
+magic_database_default(void)
+{
+	if (getenv("MAGIC"))
+		return Qnil;
+
+	return rb_mgc_database_embedded(rb_cMagicDatabase);
 }
 
+/*
+ * Loads the database linked into the extension, without copying it, if
+ * there is one, or the database at the default paths otherwise.
+ */
 static VALUE
-magic_buffer_internal(void *data)
+magic_load_default(VALUE object)
 {
-	int restore_flags = 0;
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-	int old_flags = mga->flags;
+	VALUE database;
 
-	if (mga->flags & MAGIC_CONTINUE)
-		mga->flags |= MAGIC_RAW;
+	database = magic_database_default();
+	if (NIL_P(database))
+		return rb_mgc_load(object, rb_ary_new());
 
-	if (old_flags != mga->flags)
-		restore_flags = 1;
+	return rb_mgc_load_buffers(object, rb_ary_new_from_args(1, database));
+}
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, mga->flags);
+/*
+ * Replaces every Magic::Database in the list with a frozen string referring
+ * to the memory the database is mapped into, thus the database is loaded
+ * without copying it. The string refers back to the Magic::Database, so
+ * that the mapping is kept for as long as the string is.
+ */
+static VALUE
+magic_database_buffers(VALUE arguments)
+{
+	magic_database_t *database;
+	VALUE value, string, buffers = Qundef;
 
-	mga->result = magic_buffer_wrapper(cookie,
-					   (const void *)mga->buffers.pointers,
-					   (size_t)mga->buffers.sizes,
-					   mga->flags);
+	for (long i = 0; i < RARRAY_LEN(arguments); i++) {
+		value = RARRAY_AREF(arguments, i);
+		if (!DATABASE_P(value))
+			continue;
 
-	mga->status = !mga->result ? -1 : 0;
+		if (buffers == Qundef)
+			buffers = rb_ary_dup(arguments);
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, old_flags);
+		MAGIC_DATABASE_OBJECT(value, database);
 
-	return (VALUE)NULL;
+		string = rb_str_new_static(database->base, (long)database->size);
+		if (database->path)
+			rb_ivar_set(string, id_database, value);
+
+		rb_ary_store(buffers, i, rb_obj_freeze(string));
+	}
+
+	return buffers == Qundef ? arguments : buffers;
 }
 
-static VALUE
-magic_descriptor_internal(void *data)
+/*
+ * Loads the databases mapped from files again when any of the files has
+ * been changed in place since, rather than reading pages that might be
+ * past the end of the file by now.
+ */
+static void
+magic_database_check(VALUE object, rb_mgc_object_t *mgc)
 {
-	int restore_flags = 0;
-	rb_mgc_arguments_t *mga = data;
-	magic_t cookie = mga->magic_object->cookie;
-	int old_flags = mga->flags;
+	magic_database_t *database;
+	VALUE value, path, buffers = Qundef;
 
-	if (mga->flags & MAGIC_CONTINUE)
-		mga->flags |= MAGIC_RAW;
+	if (!mgc->database_mapped)
+		return;
 
-	if (old_flags != mga->flags)
-		restore_flags = 1;
+	for (long i = 0; i < RARRAY_LEN(mgc->buffers); i++) {
+		value = rb_ivar_get(RARRAY_AREF(mgc->buffers, i), id_database);
+		if (NIL_P(value))
+			continue;
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, mga->flags);
+		MAGIC_DATABASE_OBJECT(value, database);
+		if (!magic_database_changed(database))
+			continue;
 
-	NOGVL(nogvl_magic_descriptor, mga);
+		if (buffers == Qundef)
+			buffers = rb_ary_dup(mgc->buffers);
 
-	if (restore_flags)
-		magic_setflags_wrapper(cookie, old_flags);
+		path = CSTR2RVAL(database->path);
+		rb_ary_store(buffers, i,
+			     rb_mgc_database_open(1, &path, rb_cMagicDatabase));
+	}
 
-	return (VALUE)NULL;
+	if (buffers != Qundef)
+		rb_mgc_load_buffers(object, buffers);
 }
 
-static inline void*
-magic_library_open(void)
+/*
+ * Returns whether the directory holding the file at the given path is
+ * watched for changes, in which case the file does not need to be looked
+ * at to know whether a cached result is still valid. Symbolic links are
+ * followed to files that might be anywhere, thus are never considered
+ * watched. Neither are files in a child process, where the thread that
+ * reads the events does not exist.
+ */
+static int
+magic_watched(rb_mgc_object_t *mgc, const char *path, int flags,
+	      unsigned long *version)
 {
-	magic_t cookie;
+	if (!mgc->watch || (flags & MAGIC_SYMLINK))
+		return 0;
 
-	cookie = magic_open_wrapper(MAGIC_NONE);
-	if (!cookie) {
-		errno = ENOMEM;
-		return NULL;
-	}
+	if (mgc->watch_generation != MAGIC_ATOMIC_LOAD(&rb_mgc_fork_generation))
+		return 0;
 
-	return cookie;
+	return magic_watch_version(mgc->watch, path, version) == 0;
 }
 
-static inline void
-magic_library_close(void *data)
+static magic_t
+magic_cookies_get(rb_mgc_object_t *mgc, int flags)
 {
-	rb_mgc_object_t *mgc = data;
+	size_t value;
+	size_t count = 0;
+	magic_cookie_cache_t *entry;
+	magic_cookie_cache_t **link;
+	rb_mgc_arguments_t mga;
+	magic_t cookie;
+	VALUE buffer = Qundef;
+	VALUE exception = Qundef;
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+	if (flags == mgc->flags)
+		return mgc->cookie;
 
-	if (mgc->cookie)
-		magic_close_wrapper(mgc->cookie);
+	for (link = &mgc->cookies; *link; link = &(*link)->next, count++) {
+		entry = *link;
+		if (entry->flags != flags)
+			continue;
 
-	mgc->cookie = NULL;
-}
+		*link = entry->next;
+		entry->next = mgc->cookies;
+		mgc->cookies = entry;
 
-static VALUE
-magic_allocate(VALUE klass)
-{
-	int local_errno;
-	rb_mgc_object_t *mgc;
+		return entry->cookie;
+	}
+
+	entry = ALLOC(magic_cookie_cache_t);
+
+	cookie = magic_open_wrapper(flags);
+	if (!cookie) {
+		ruby_xfree(entry);
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(rb_mgc_parameters); i++) {
+		if (magic_getparam_wrapper(mgc->cookie, rb_mgc_parameters[i],
+					   &value) < 0)
+			continue;
+
+		magic_setparam_wrapper(cookie, rb_mgc_parameters[i], &value);
+	}
+
+	mga = (rb_mgc_arguments_t) {
+		.magic_object = mgc,
+		.cookie = cookie,
+		.flags = flags,
+	};
 
-	mgc = RB_ALLOC(rb_mgc_object_t);
-	local_errno = ENOMEM;
+	if (!NIL_P(mgc->buffers)) {
+		count = (size_t)RARRAY_LEN(mgc->buffers);
 
-	if (!mgc) {
-		errno = local_errno;
-		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError,
-				    local_errno,
-				    E_NOT_ENOUGH_MEMORY);
+		mga.buffers = (struct buffers) {
+			.count    = count,
+			.pointers = ALLOCA_N(void *, count),
+			.sizes    = ALLOCA_N(size_t, count),
+		};
+
+		for (size_t i = 0; i < count; i++) {
+			buffer = RARRAY_AREF(mgc->buffers, (long)i);
+			mga.buffers.pointers[i] = (void *)RSTRING_PTR(buffer);
+			mga.buffers.sizes[i] = (size_t)RSTRING_LEN(buffer);
+		}
+
+		NOGVL(nogvl_magic_load_buffers, &mga);
+	} else {
+		mga.file.path = mgc->database;
+		NOGVL(nogvl_magic_load, &mga);
 	}
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+	if (mga.status < 0) {
+		exception = magic_library_error(rb_mgc_eMagicError, cookie);
+		magic_close_wrapper(cookie);
+		ruby_xfree(entry);
+		rb_exc_raise(exception);
+	}
 
-	mgc->cookie = NULL;
-	mgc->mutex = Qundef;
-	mgc->database_loaded = 0;
-	mgc->stop_on_errors = 0;
+	*entry = (magic_cookie_cache_t) {
+		.next   = mgc->cookies,
+		.cookie = cookie,
+		.flags  = flags,
+	};
 
-	mgc->cookie = magic_library_open();
-	local_errno = errno;
+	mgc->cookies = entry;
 
-	if (!mgc->cookie) {
-		ruby_xfree(mgc);
-		mgc = NULL;
-		errno = local_errno;
-		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError,
-				    local_errno,
-				    E_MAGIC_LIBRARY_INITIALIZE);
+	for (link = &mgc->cookies, count = 0; *link; link = &(*link)->next) {
+		if (++count <= MAGIC_COOKIES_MAX)
+			continue;
+
+		entry = *link;
+		*link = NULL;
+
+		magic_close_wrapper(entry->cookie);
+		ruby_xfree(entry);
+		break;
 	}
 
-	return TypedData_Wrap_Struct(klass, &rb_mgc_type, mgc);
+	return cookie;
 }
 
-static inline void
-magic_mark(void *data)
+static void
+magic_cookies_free(rb_mgc_object_t *mgc)
 {
-	rb_mgc_object_t *mgc = data;
+	magic_cookie_cache_t *entry;
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+	while ((entry = mgc->cookies)) {
+		mgc->cookies = entry->next;
+		magic_close_wrapper(entry->cookie);
+		ruby_xfree(entry);
+	}
+}
 
-	MAGIC_GC_MARK(mgc->mutex);
+static inline int
+magic_get_flags(VALUE object)
+{
+	return NUM2INT(rb_ivar_get(object, id_at_flags));
 }
 
 static inline void
-magic_free(void *data)
+magic_set_flags(VALUE object, int flags)
 {
-	rb_mgc_object_t *mgc = data;
+	rb_ivar_set(object, id_at_flags, INT2NUM(flags));
+}
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+/*
+ * Returns the flags given using the "flags" keyword argument, or the flags
+ * set for the Magic object when there are none. Flags given per call never
+ * change the flags of the object (see magic_cookies_get). Also sets whether
+ * a Magic::Result is to be returned, as per the "result" keyword argument.
+ */
+static int
+magic_options(VALUE object, VALUE options, int *result)
+{
+	int flags;
+	ID keywords[2];
+	VALUE values[2] = { Qundef, Qundef };
 
-	if (mgc->cookie)
-		magic_library_close(data);
+	*result = 0;
 
-	mgc->cookie = NULL;
-	mgc->mutex = Qundef;
+	if (NIL_P(options))
+		return magic_get_flags(object);
 
-	ruby_xfree(mgc);
-}
+	keywords[0] = rb_intern("flags");
+	keywords[1] = rb_intern("result");
+	rb_get_kwargs(options, keywords, 0, 2, values);
 
-static inline size_t
-magic_size(const void *data)
-{
-	const rb_mgc_object_t *mgc = data;
+	if (values[1] != Qundef)
+		*result = RTEST(values[1]);
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+	if (values[0] == Qundef || NIL_P(values[0]))
+		return magic_get_flags(object);
 
-	return sizeof(*mgc);
-}
+	MAGIC_CHECK_INTEGER_TYPE(values[0]);
 
-#if defined(HAVE_RUBY_GC_COMPACT)
-static inline void
-magic_compact(void *data)
-{
-	rb_mgc_object_t *mgc = data;
+	flags = NUM2INT(values[0]);
+	if (flags < 0 || flags > 0xfffffff)
+		MAGIC_GENERIC_ERROR(rb_mgc_eFlagsError, EINVAL,
+				    E_FLAG_INVALID_TYPE);
 
-	assert(mgc != NULL &&
-	       "Must be a valid pointer to `rb_mgc_object_t' type");
+#if !defined(HAVE_UTIME) && !defined(HAVE_UTIMES)
+	if (flags & MAGIC_PRESERVE_ATIME)
+		MAGIC_GENERIC_ERROR(rb_mgc_eNotImplementedError, ENOSYS,
+				    E_FLAG_NOT_IMPLEMENTED);
+#endif
 
-	mgc->mutex = rb_gc_location(mgc->mutex);
+	return flags;
 }
-#endif /* HAVE_RUBY_GC_COMPACT */
 
 static inline VALUE
-magic_exception_wrapper(VALUE value)
+magic_set_paths(VALUE object, VALUE value)
 {
-	rb_mgc_error_t *mge = (rb_mgc_error_t *)value;
-
-	return rb_exc_new2(mge->klass, mge->magic_error);
+	return rb_ivar_set(object, id_at_paths, value);
 }
 
-static VALUE
-magic_exception(void *data)
+static inline VALUE
+magic_default_paths(void)
 {
-	int exception = 0;
-	rb_mgc_error_t *mge = data;
-	VALUE object = Qundef;
+	VALUE value;
 
-	assert(mge != NULL &&
-	       "Must be a valid pointer to `rb_mgc_error_t' type");
+	value = rb_funcall(rb_cMagic, rb_intern("default_paths"), 0);
+	if (getenv("MAGIC") || NIL_P(value))
+		value = magic_split(CSTR2RVAL(magic_getpath_wrapper()),
+				    CSTR2RVAL(":"));
 
-	object = rb_protect(magic_exception_wrapper, (VALUE)mge, &exception);
+	return value;
+}
 
-	if (exception)
-		rb_jump_tag(exception);
+static inline VALUE
+magic_get_default(void)
+{
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY)
+	VALUE value;
 
-	rb_iv_set(object, "@errno", INT2NUM(mge->magic_errno));
-	RB_GC_GUARD(object);
+	if (!rb_ractor_local_storage_value_lookup(rb_mgc_default_key, &value))
+		return Qnil;
 
-	return object;
+	return value;
+#else
+	return rb_mgc_default;
+#endif /* HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY */
+}
+
+static inline void
+magic_set_default(VALUE value)
+{
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY)
+	rb_ractor_local_storage_value_set(rb_mgc_default_key, value);
+#else
+	rb_mgc_default = value;
+#endif /* HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY */
 }
 
 static inline VALUE
-magic_generic_error(VALUE klass, int magic_errno, const char *magic_error)
+magic_get_shared(void)
 {
-	rb_mgc_error_t mge;
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY)
+	VALUE value;
 
-	mge = (rb_mgc_error_t) {
-		.klass       = klass,
-		.magic_errno = magic_errno,
-		.magic_error = magic_error,
-	};
+	if (!rb_ractor_local_storage_value_lookup(rb_mgc_shared_key, &value))
+		return Qnil;
 
-	return magic_exception(&mge);
+	return value;
+#else
+	return rb_mgc_shared;
+#endif /* HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY */
 }
 
-static VALUE
-magic_library_error(VALUE klass, void *data)
+static inline void
+magic_set_shared(VALUE value)
 {
-	rb_mgc_error_t mge;
-	const char *message = NULL;
-	const char *empty = "(null)";
-	magic_t cookie = data;
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY)
+	rb_ractor_local_storage_value_set(rb_mgc_shared_key, value);
+#else
+	rb_mgc_shared = value;
+#endif /* HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY */
+}
 
-	UNUSED(empty);
+/*
+ * Returns a new Magic object with the given database, or the default one
+ * when +nil+, loaded into it, together with a separate underlying _Magic_
+ * library handle for each of the given flags.
+ */
+static VALUE
+magic_preload_object(VALUE database, VALUE flags)
+{
+	rb_mgc_object_t *mgc;
+	rb_mgc_arguments_t mga;
+	VALUE object;
+
+	if (NIL_P(database)) {
+		object = rb_class_new_instance(0, 0, rb_cMagic);
+		if (!MAGIC_LOADED_P(object))
+			magic_load_default(object);
+	} else {
+		object = rb_class_new_instance(1, &database, rb_cMagic);
+		if (!MAGIC_LOADED_P(object))
+			rb_mgc_load_buffers(object, rb_ary_new_from_args(1, database));
+	}
 
-	assert(cookie != NULL &&
-	       "Must be a valid pointer to `magic_t' type");
+	MAGIC_OBJECT(object, mgc);
 
-	mge = (rb_mgc_error_t) {
-		.klass       = klass,
-		.magic_errno = -1,
-		.magic_error = MAGIC_ERRORS(E_UNKNOWN),
-	};
+	for (long i = 0; i < RARRAY_LEN(flags); i++) {
+		mga = (rb_mgc_arguments_t) {
+			.magic_object = mgc,
+			.flags = NUM2INT(RARRAY_AREF(flags, i)),
+		};
 
-	message = magic_error_wrapper(cookie);
-	if (message) {
-		mge.magic_errno = magic_errno_wrapper(cookie);
-		mge.magic_error = message;
+		MAGIC_SYNCHRONIZED(magic_preload_internal, &mga);
 	}
 
-	assert(strncmp(mge.magic_error, empty, strlen(empty)) != 0 &&
-		       "Empty or invalid error message");
+	return object;
+}
 
-	return magic_exception(&mge);
+static void
+magic_database_free(void *data)
+{
+	magic_database_release(data);
 }
 
-VALUE
-magic_lock(VALUE object, VALUE(*function)(ANYARGS), void *data)
+static VALUE
+magic_result_new(rb_mgc_arguments_t *mga, int flags)
 {
-	rb_mgc_object_t *mgc;
+	rb_mgc_result_object_t *mro;
+	VALUE object;
 
-	MAGIC_OBJECT(object, mgc);
+	object = TypedData_Make_Struct(rb_cMagicResult, rb_mgc_result_object_t,
+				       &rb_mgc_result_type, mro);
 
-	rb_funcall(mgc->mutex, rb_intern("lock"), 0);
+	mro->string = Qundef;
+	mro->description = Qundef;
+	mro->mime_type = Qundef;
+	mro->charset = Qundef;
+	mro->extensions = Qundef;
 
-	return rb_ensure(function, (VALUE)data, magic_unlock, object);
+	mro->flags = flags;
+	mro->length = strlen(mga->result);
+	mro->result = ALLOC_N(char, mro->length + 1);
+	memcpy(mro->result, mga->result, mro->length + 1);
+
+	return object;
 }
 
-VALUE
-magic_unlock(VALUE object)
+/*
+ * Returns the length of the first match, as all the matches are returned
+ * when the CONTINUE flag is set.
+ */
+static size_t
+magic_result_first(rb_mgc_result_object_t *mro)
 {
-	rb_mgc_object_t *mgc;
+	const char *end;
 
-	MAGIC_OBJECT(object, mgc);
+	if (!(mro->flags & MAGIC_CONTINUE))
+		return mro->length;
 
-	rb_funcall(mgc->mutex, rb_intern("unlock"), 0);
+	end = strstr(mro->result, MAGIC_CONTINUE_SEPARATOR);
+	if (!end)
+		return mro->length;
 
-	return Qnil;
+	return (size_t)(end - mro->result);
 }
 
-static VALUE
-magic_return(void *data)
+static void
+magic_result_mark(void *data)
 {
-	rb_mgc_arguments_t *mga = data;
-	const char *unknown = NULL;
-	VALUE separator = Qundef;
-	VALUE array, string;
-
-	string = CSTR2RVAL(mga->result);
-	RB_GC_GUARD(string);
+	rb_mgc_result_object_t *mro = data;
 
-	/*
-	 * The value below is a field separator that can be used to split results
-	 * when the CONTINUE flag is set causing all valid matches found by the
-	 * Magic library to be returned.
-	 */
-	if (mga->flags & MAGIC_CONTINUE)
-		separator = CSTR2RVAL(MAGIC_CONTINUE_SEPARATOR);
+	rb_gc_mark(mro->string);
+	rb_gc_mark(mro->description);
+	rb_gc_mark(mro->mime_type);
+	rb_gc_mark(mro->charset);
+	rb_gc_mark(mro->extensions);
+}
 
-	if (mga->flags & MAGIC_EXTENSION) {
-		/*
-		 * A possible I/O-related error has occurred, and there is very
-		 * little sense processing the results, so return string as-is.
-		 */
-		if (mga->status < 0)
-			return string;
-		/*
-		 * A number of Magic flags that support primarily files e.g.,
-		 * MAGIC_EXTENSION, etc., would not return a meaningful value for
-		 * directories and special files, and such. Thus, it's better to
-		 * return an empty string, to indicate lack of results, rather
-		 * than a confusing string consisting of three questions marks.
-		 */
-		unknown = "???";
-		if (strncmp(mga->result, unknown, strlen(unknown)) == 0)
-			return CSTR2RVAL("");
+static void
+magic_result_free(void *data)
+{
+	rb_mgc_result_object_t *mro = data;
 
-		separator = CSTR2RVAL(MAGIC_EXTENSION_SEPARATOR);
-	}
+	ruby_xfree(mro->result);
+	ruby_xfree(mro);
+}
 
-	RB_GC_GUARD(separator);
+static size_t
+magic_result_size(const void *data)
+{
+	const rb_mgc_result_object_t *mro = data;
 
-	if (mga->flags & (MAGIC_CONTINUE | MAGIC_EXTENSION)) {
-		array = magic_split(string, separator);
-		RB_GC_GUARD(array);
+	return sizeof(*mro) + mro->length + 1;
+}
 
-		if (RARRAY_LEN(array) > 1)
-			return magic_strip_array(array);
+static VALUE
+magic_pool_allocate(VALUE klass)
+{
+	rb_mgc_pool_object_t *mpo;
 
-		string = magic_shift(array);
+	mpo = RB_ALLOC(rb_mgc_pool_object_t);
+	if (!mpo) {
+		errno = ENOMEM;
+		MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError,
+				    ENOMEM,
+				    E_NOT_ENOUGH_MEMORY);
 	}
 
-	return magic_strip(string);
-}
+	mpo->pool = NULL;
 
-static inline int
-magic_get_flags(VALUE object)
-{
-	return NUM2INT(rb_ivar_get(object, id_at_flags));
+	return TypedData_Wrap_Struct(klass, &rb_mgc_pool_type, mpo);
 }
 
 static inline void
-magic_set_flags(VALUE object, int flags)
+magic_pool_object_free(void *data)
 {
-	rb_ivar_set(object, id_at_flags, INT2NUM(flags));
+	rb_mgc_pool_object_t *mpo = data;
+
+	assert(mpo != NULL &&
+	       "Must be a valid pointer to `rb_mgc_pool_object_t' type");
+
+	/*
+	 * The object is no longer reachable, thus no thread can be running
+	 * a query using the pool at this point.
+	 */
+	if (mpo->pool)
+		magic_pool_free(mpo->pool);
+
+	mpo->pool = NULL;
+
+	ruby_xfree(mpo);
 }
 
-static inline VALUE
-magic_set_paths(VALUE object, VALUE value)
+static inline size_t
+magic_pool_object_size(const void *data)
 {
-	return rb_ivar_set(object, id_at_paths, value);
+	const rb_mgc_pool_object_t *mpo = data;
+	size_t size = sizeof(*mpo);
+
+	assert(mpo != NULL &&
+	       "Must be a valid pointer to `rb_mgc_pool_object_t' type");
+
+	if (mpo->pool)
+		size += sizeof(*mpo->pool) + 2 * mpo->pool->size * sizeof(magic_t);
+
+	return size;
 }
 
 static const rb_data_type_t rb_mgc_type = {
@@ -1602,9 +6236,39 @@ static const rb_data_type_t rb_mgc_type = {
 		.dmark	  = magic_mark,
 		.dfree	  = magic_free,
 		.dsize	  = magic_size,
-#if defined(HAVE_RUBY_GC_COMPACT)
-		.dcompact = magic_compact,
-#endif /* HAVE_RUBY_GC_COMPACT */
+	},
+#if defined(RUBY_TYPED_FREE_IMMEDIATELY)
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif /* RUBY_TYPED_FREE_IMMEDIATELY */
+};
+
+static const rb_data_type_t rb_mgc_pool_type = {
+	.wrap_struct_name = "magic_pool",
+	.function = {
+		.dfree	  = magic_pool_object_free,
+		.dsize	  = magic_pool_object_size,
+	},
+#if defined(RUBY_TYPED_FREE_IMMEDIATELY)
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif /* RUBY_TYPED_FREE_IMMEDIATELY */
+};
+
+static const rb_data_type_t rb_mgc_result_type = {
+	.wrap_struct_name = "magic_result",
+	.function = {
+		.dmark	  = magic_result_mark,
+		.dfree	  = magic_result_free,
+		.dsize	  = magic_result_size,
+	},
+#if defined(RUBY_TYPED_FREE_IMMEDIATELY)
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+#endif /* RUBY_TYPED_FREE_IMMEDIATELY */
+};
+
+static const rb_data_type_t rb_mgc_database_type = {
+	.wrap_struct_name = "magic_database",
+	.function = {
+		.dfree	  = magic_database_free,
 	},
 #if defined(RUBY_TYPED_FREE_IMMEDIATELY)
 	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
@@ -1614,8 +6278,27 @@ static const rb_data_type_t rb_mgc_type = {
 void
 Init_magic(void)
 {
+#if defined(HAVE_RB_EXT_RACTOR_SAFE)
+	rb_ext_ractor_safe(true);
+#endif /* HAVE_RB_EXT_RACTOR_SAFE */
+
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY)
+	rb_mgc_default_key = rb_ractor_local_storage_value_newkey();
+	rb_mgc_shared_key = rb_ractor_local_storage_value_newkey();
+#else
+	rb_mgc_default = Qnil;
+	rb_global_variable(&rb_mgc_default);
+	rb_mgc_shared = Qnil;
+	rb_global_variable(&rb_mgc_shared);
+#endif /* HAVE_RB_RACTOR_LOCAL_STORAGE_VALUE_NEWKEY */
+
+	pthread_atfork(NULL, NULL, magic_lock_atfork_child);
+	pthread_atfork(NULL, NULL, magic_error_output_atfork_child);
+	pthread_atfork(NULL, NULL, magic_database_atfork_child);
+
 	id_at_paths = rb_intern("@paths");
 	id_at_flags = rb_intern("@flags");
+	id_database = rb_intern("database");
 
 	rb_cMagic = rb_define_class("Magic", rb_cObject);
 	rb_define_alloc_func(rb_cMagic, magic_allocate);
@@ -1648,6 +6331,10 @@ Init_magic(void)
 	 */
 	rb_mgc_eNotImplementedError = rb_define_class_under(rb_cMagic, "NotImplementedError", rb_mgc_eError);
 
+	rb_define_singleton_method(rb_cMagic, "default", RUBY_METHOD_FUNC(rb_mgc_get_default_global), 0);
+	rb_define_singleton_method(rb_cMagic, "preload!", RUBY_METHOD_FUNC(rb_mgc_preload_global), -1);
+	rb_define_private_method(rb_singleton_class(rb_cMagic), "shared", RUBY_METHOD_FUNC(rb_mgc_get_shared_global), 0);
+
 	rb_define_singleton_method(rb_cMagic, "do_not_auto_load", RUBY_METHOD_FUNC(rb_mgc_get_do_not_auto_load_global), 0);
 	rb_define_singleton_method(rb_cMagic, "do_not_auto_load=", RUBY_METHOD_FUNC(rb_mgc_set_do_not_auto_load_global), 1);
 
@@ -1673,23 +6360,94 @@ Init_magic(void)
 	rb_define_method(rb_cMagic, "flags", RUBY_METHOD_FUNC(rb_mgc_get_flags), 0);
 	rb_define_method(rb_cMagic, "flags=", RUBY_METHOD_FUNC(rb_mgc_set_flags), 1);
 
-	rb_define_method(rb_cMagic, "file", RUBY_METHOD_FUNC(rb_mgc_file), 1);
-	rb_define_method(rb_cMagic, "buffer", RUBY_METHOD_FUNC(rb_mgc_buffer), 1);
-	rb_define_method(rb_cMagic, "descriptor", RUBY_METHOD_FUNC(rb_mgc_descriptor), 1);
+	rb_define_method(rb_cMagic, "file", RUBY_METHOD_FUNC(rb_mgc_file), -1);
+	rb_define_method(rb_cMagic, "files", RUBY_METHOD_FUNC(rb_mgc_files), -1);
+	rb_define_method(rb_cMagic, "buffer", RUBY_METHOD_FUNC(rb_mgc_buffer), -1);
+	rb_define_method(rb_cMagic, "descriptor", RUBY_METHOD_FUNC(rb_mgc_descriptor), -1);
+	rb_define_method(rb_cMagic, "identify", RUBY_METHOD_FUNC(rb_mgc_identify), 1);
+
+	rb_define_method(rb_cMagic, "cache_size", RUBY_METHOD_FUNC(rb_mgc_get_cache_size), 0);
+	rb_define_method(rb_cMagic, "cache_size=", RUBY_METHOD_FUNC(rb_mgc_set_cache_size), 1);
+	rb_define_method(rb_cMagic, "cache_stats", RUBY_METHOD_FUNC(rb_mgc_cache_stats), 0);
+	rb_define_method(rb_cMagic, "buffer_cache_size", RUBY_METHOD_FUNC(rb_mgc_get_buffer_cache_size), 0);
+	rb_define_method(rb_cMagic, "buffer_cache_size=", RUBY_METHOD_FUNC(rb_mgc_set_buffer_cache_size), 1);
+	rb_define_method(rb_cMagic, "buffer_cache_stats", RUBY_METHOD_FUNC(rb_mgc_buffer_cache_stats), 0);
+	rb_define_method(rb_cMagic, "shared_cache", RUBY_METHOD_FUNC(rb_mgc_get_shared_cache), 0);
+	rb_define_method(rb_cMagic, "shared_cache=", RUBY_METHOD_FUNC(rb_mgc_set_shared_cache), 1);
+	rb_define_method(rb_cMagic, "shared_cache_stats", RUBY_METHOD_FUNC(rb_mgc_shared_cache_stats), 0);
+
+	rb_define_method(rb_cMagic, "fast_path", RUBY_METHOD_FUNC(rb_mgc_get_fast_path), 0);
+	rb_define_method(rb_cMagic, "fast_path=", RUBY_METHOD_FUNC(rb_mgc_set_fast_path), 1);
+	rb_define_method(rb_cMagic, "fast_path_stats", RUBY_METHOD_FUNC(rb_mgc_fast_path_stats), 0);
+	rb_define_method(rb_cMagic, "triage", RUBY_METHOD_FUNC(rb_mgc_get_triage), 0);
+	rb_define_method(rb_cMagic, "triage=", RUBY_METHOD_FUNC(rb_mgc_set_triage), 1);
+	rb_define_method(rb_cMagic, "triage_stats", RUBY_METHOD_FUNC(rb_mgc_triage_stats), 0);
+	rb_define_method(rb_cMagic, "progressive", RUBY_METHOD_FUNC(rb_mgc_get_progressive), 0);
+	rb_define_method(rb_cMagic, "progressive=", RUBY_METHOD_FUNC(rb_mgc_set_progressive), 1);
+	rb_define_method(rb_cMagic, "progressive_stats", RUBY_METHOD_FUNC(rb_mgc_progressive_stats), 0);
+
+	rb_define_method(rb_cMagic, "watch", RUBY_METHOD_FUNC(rb_mgc_watch), -1);
+	rb_define_method(rb_cMagic, "watched", RUBY_METHOD_FUNC(rb_mgc_watched), 0);
+	rb_define_method(rb_cMagic, "unwatch", RUBY_METHOD_FUNC(rb_mgc_unwatch), 0);
 
 	rb_alias(rb_cMagic, rb_intern("fd"), rb_intern("descriptor"));
 
 	rb_define_method(rb_cMagic, "load", RUBY_METHOD_FUNC(rb_mgc_load), -2);
 	rb_define_method(rb_cMagic, "load_buffers", RUBY_METHOD_FUNC(rb_mgc_load_buffers), -2);
+	rb_define_method(rb_cMagic, "reload", RUBY_METHOD_FUNC(rb_mgc_reload), -2);
 	rb_define_method(rb_cMagic, "loaded?", RUBY_METHOD_FUNC(rb_mgc_load_p), 0);
 
 	rb_alias(rb_cMagic, rb_intern("load_files"), rb_intern("load"));
 
-	rb_define_method(rb_cMagic, "compile", RUBY_METHOD_FUNC(rb_mgc_compile), 1);
+	rb_define_method(rb_cMagic, "compile", RUBY_METHOD_FUNC(rb_mgc_compile), -1);
 	rb_define_method(rb_cMagic, "check", RUBY_METHOD_FUNC(rb_mgc_check), 1);
 
 	rb_alias(rb_cMagic, rb_intern("valid?"), rb_intern("check"));
 
+	rb_cMagicPool = rb_define_class_under(rb_cMagic, "Pool", rb_cObject);
+	rb_define_alloc_func(rb_cMagicPool, magic_pool_allocate);
+
+	rb_define_attr(rb_cMagicPool, "flags", 1, 0);
+	rb_define_attr(rb_cMagicPool, "paths", 1, 0);
+
+	rb_define_method(rb_cMagicPool, "initialize", RUBY_METHOD_FUNC(rb_mgc_pool_initialize), -1);
+
+	rb_define_method(rb_cMagicPool, "close", RUBY_METHOD_FUNC(rb_mgc_pool_close), 0);
+	rb_define_method(rb_cMagicPool, "closed?", RUBY_METHOD_FUNC(rb_mgc_pool_close_p), 0);
+
+	rb_define_method(rb_cMagicPool, "size", RUBY_METHOD_FUNC(rb_mgc_pool_get_size), 0);
+
+	rb_define_method(rb_cMagicPool, "file", RUBY_METHOD_FUNC(rb_mgc_pool_file), 1);
+	rb_define_method(rb_cMagicPool, "buffer", RUBY_METHOD_FUNC(rb_mgc_pool_buffer), 1);
+	rb_define_method(rb_cMagicPool, "descriptor", RUBY_METHOD_FUNC(rb_mgc_pool_descriptor), 1);
+
+	rb_alias(rb_cMagicPool, rb_intern("fd"), rb_intern("descriptor"));
+
+	rb_cMagicResult = rb_define_class_under(rb_cMagic, "Result", rb_cObject);
+	rb_undef_alloc_func(rb_cMagicResult);
+
+	rb_define_method(rb_cMagicResult, "to_s", RUBY_METHOD_FUNC(rb_mgc_result_to_s), 0);
+	rb_define_method(rb_cMagicResult, "flags", RUBY_METHOD_FUNC(rb_mgc_result_get_flags), 0);
+
+	rb_define_method(rb_cMagicResult, "description", RUBY_METHOD_FUNC(rb_mgc_result_description), 0);
+	rb_define_method(rb_cMagicResult, "mime_type", RUBY_METHOD_FUNC(rb_mgc_result_mime_type), 0);
+	rb_define_method(rb_cMagicResult, "charset", RUBY_METHOD_FUNC(rb_mgc_result_charset), 0);
+	rb_define_method(rb_cMagicResult, "extensions", RUBY_METHOD_FUNC(rb_mgc_result_extensions), 0);
+
+	rb_cMagicDatabase = rb_define_class_under(rb_cMagic, "Database", rb_cObject);
+	rb_undef_alloc_func(rb_cMagicDatabase);
+
+	rb_define_singleton_method(rb_cMagicDatabase, "open", RUBY_METHOD_FUNC(rb_mgc_database_open), -1);
+	rb_define_singleton_method(rb_cMagicDatabase, "embedded", RUBY_METHOD_FUNC(rb_mgc_database_embedded), 0);
+	rb_define_singleton_method(rb_cMagicDatabase, "count", RUBY_METHOD_FUNC(rb_mgc_database_count), 0);
+
+	rb_define_method(rb_cMagicDatabase, "path", RUBY_METHOD_FUNC(rb_mgc_database_path), 0);
+	rb_define_method(rb_cMagicDatabase, "size", RUBY_METHOD_FUNC(rb_mgc_database_size), 0);
+	rb_define_method(rb_cMagicDatabase, "==", RUBY_METHOD_FUNC(rb_mgc_database_equal), 1);
+	rb_define_method(rb_cMagicDatabase, "hash", RUBY_METHOD_FUNC(rb_mgc_database_hash), 0);
+
+	rb_alias(rb_cMagicDatabase, rb_intern("eql?"), rb_intern("=="));
+
 	/*
 	 * Controls how many levels of recursion will be followed for
 	 * indirect magic entries.
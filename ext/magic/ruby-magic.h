@@ -7,21 +7,52 @@ extern "C" {
 
 #include "common.h"
 #include "functions.h"
+#include "pool.h"
+#include "cache.h"
+#include "watch.h"
+#include "database.h"
+#include "signature.h"
+#include "triage.h"
+#include "progressive.h"
+
+#if defined(HAVE_UNSHARE)
+# include <sched.h>
+# include <signal.h>
+#endif
+
+/*
+ * A thread can have a working directory of its own only where it can stop
+ * sharing it with the rest of the process.
+ */
+#if defined(HAVE_UNSHARE) && defined(CLONE_FS)
+# define MAGIC_COMPILE_UNSHARE 1
+#endif
 
 #define MAGIC_SYNCHRONIZED(f, d) magic_lock(object, (f), (d))
 
 #define MAGIC_OBJECT(o, t) \
 	TypedData_Get_Struct((o), rb_mgc_object_t, &rb_mgc_type, (t))
 
+#define MAGIC_POOL_OBJECT(o, t) \
+	TypedData_Get_Struct((o), rb_mgc_pool_object_t, &rb_mgc_pool_type, (t))
+
+#define MAGIC_RESULT_OBJECT(o, t) \
+	TypedData_Get_Struct((o), rb_mgc_result_object_t, &rb_mgc_result_type, (t))
+
+#define MAGIC_DATABASE_OBJECT(o, t) \
+	TypedData_Get_Struct((o), magic_database_t, &rb_mgc_database_type, (t))
+
+#define DATABASE_P(o) (rb_typeddata_is_kind_of((o), &rb_mgc_database_type))
+
 #define MAGIC_CLOSED_P(o) RTEST(rb_mgc_close_p((o)))
 #define MAGIC_LOADED_P(o) RTEST(rb_mgc_load_p((o)))
 
-#define MAGIC_WARNING(i, ...)				  \
-	do {						  \
-		if (!(i) || !(rb_mgc_warning & BIT(i))) { \
-			rb_mgc_warning |= BIT(i);	  \
-			rb_warn(__VA_ARGS__);		  \
-		}					  \
+#define MAGIC_WARNING(i, ...)						\
+	do {								\
+		if (!(i) ||						\
+		    !(MAGIC_ATOMIC_FETCH_OR(&rb_mgc_warning, BIT(i)) &	\
+		      BIT(i)))						\
+			rb_warn(__VA_ARGS__);				\
 	} while (0)
 
 #define MAGIC_ERRORS(t) ruby_magic_errors[(t)]
@@ -68,6 +99,21 @@ extern "C" {
 					    E_MAGIC_LIBRARY_NOT_LOADED); \
 	} while (0)
 
+#define MAGIC_POOL_CHECK_OPEN(o)					  \
+	do {								  \
+		if (!(o)->pool || magic_pool_closed_p((o)->pool))	  \
+			MAGIC_GENERIC_ERROR(rb_mgc_eLibraryError, EFAULT, \
+					    E_MAGIC_LIBRARY_CLOSED);	  \
+	} while (0)
+
+#define MAGIC_COOKIES_MAX 8
+
+/*
+ * Results up to this length are copied onto the stack of the caller, and
+ * only longer ones into a newly allocated Ruby string.
+ */
+#define MAGIC_RESULT_SIZE 256
+
 #define MAGIC_STRINGIFY(s) #s
 
 #define MAGIC_DEFINE_FLAG(c) \
@@ -87,10 +133,15 @@ enum ruby_magic_error {
 	E_MAGIC_LIBRARY_INITIALIZE,
 	E_MAGIC_LIBRARY_CLOSED,
 	E_MAGIC_LIBRARY_NOT_LOADED,
+	E_POOL_INVALID_SIZE,
+	E_POOL_INITIALIZED,
+	E_CACHE_INVALID_SIZE,
+	E_THREADS_INVALID_NUMBER,
 	E_PARAM_INVALID_TYPE,
 	E_PARAM_INVALID_VALUE,
 	E_FLAG_NOT_IMPLEMENTED,
-	E_FLAG_INVALID_TYPE
+	E_FLAG_INVALID_TYPE,
+	E_NOT_IMPLEMENTED
 };
 
 struct parameter {
@@ -103,31 +154,218 @@ union file {
 	int fd;
 };
 
+struct buffer {
+	const void *pointer;
+	size_t size;
+};
+
 struct buffers {
 	size_t count;
 	size_t *sizes;
 	void **pointers;
 };
 
+struct compile {
+	const char *path;
+	const char *directory;
+	int local_errno;
+};
+
+struct cache {
+	magic_cache_t **cache;
+	size_t size;
+};
+
+typedef struct magic_lock_waiter {
+	VALUE fiber;
+	VALUE thread;
+	VALUE scheduler;
+	struct magic_lock_waiter *next;
+	unsigned int queued:1;
+} magic_lock_waiter_t;
+
+typedef struct magic_lock {
+	VALUE owner;
+	magic_lock_waiter_t *head;
+	magic_lock_waiter_t *tail;
+	unsigned long generation;
+} magic_lock_t;
+
+typedef struct magic_cookie_cache {
+	struct magic_cookie_cache *next;
+	magic_t cookie;
+	int flags;
+} magic_cookie_cache_t;
+
 typedef struct magic_object {
 	magic_t cookie;
-	VALUE mutex;
+	magic_lock_t lock;
+	VALUE buffers;
+	char *database;
+	magic_cookie_cache_t *cookies;
+	magic_pool_t *workers;
+	magic_cache_t *cache;
+	magic_cache_t *buffer_cache;
+	magic_shared_cache_t *shared_cache;
+	magic_watch_t *watch;
+	unsigned long watch_generation;
+	unsigned long generation;
+	unsigned long digest_generation;
+	size_t digest;
+	size_t fast_path_hits;
+	size_t fast_path_misses;
+	size_t triage_counts[MAGIC_TRIAGE_MAX];
+	size_t progressive_counts[MAGIC_PROGRESSIVE_TIERS];
+	int flags;
 	unsigned int database_loaded:1;
+	unsigned int database_mapped:1;
 	unsigned int stop_on_errors:1;
+	unsigned int fast_path:1;
+	unsigned int triage:1;
+	unsigned int progressive:1;
 } rb_mgc_object_t;
 
 typedef struct magic_arguments {
 	rb_mgc_object_t *magic_object;
+	magic_t cookie;
 	union {
 		struct parameter parameter;
 		union file file;
+		struct buffer buffer;
 		struct buffers buffers;
+		struct cache cache;
+		struct compile compile;
 	};
 	const char *result;
+	char copy[MAGIC_RESULT_SIZE];
+	VALUE value;
+	VALUE error;
+	int magic_errno;
+	int local_errno;
 	int status;
 	int flags;
 } rb_mgc_arguments_t;
 
+enum magic_cached {
+	MAGIC_CACHED_NONE = 0,
+	MAGIC_CACHED_STAT,
+	MAGIC_CACHED_WATCH
+};
+
+enum magic_pool_function {
+	MAGIC_POOL_FILE = 0,
+	MAGIC_POOL_BUFFER,
+	MAGIC_POOL_DESCRIPTOR
+};
+
+typedef struct magic_pool_object {
+	magic_pool_t *pool;
+	unsigned long generation;
+} rb_mgc_pool_object_t;
+
+typedef struct magic_pool_arguments {
+	magic_pool_t *pool;
+	union {
+		union file file;
+		struct buffer buffer;
+		struct buffers buffers;
+	};
+	char *result;
+	char *error;
+	enum magic_pool_function function;
+	int magic_errno;
+	int local_errno;
+	int status;
+	int flags;
+	unsigned int checked_out:1;
+	volatile int cancel;
+} rb_mgc_pool_arguments_t;
+
+typedef struct magic_reload_arguments {
+	VALUE object;
+	rb_mgc_object_t *magic_object;
+	magic_t cookie;
+	magic_cookie_cache_t *cookies;
+	magic_pool_t *workers;
+	char *database;
+	VALUE buffers;
+	int status;
+	int flags;
+} rb_mgc_reload_arguments_t;
+
+typedef struct magic_triage_arguments {
+	const char *path;
+	size_t size;
+	magic_triage_t triage;
+	int flags;
+} rb_mgc_triage_arguments_t;
+
+typedef struct magic_progressive_arguments {
+	rb_mgc_arguments_t *arguments;
+	size_t limit;
+	size_t length;
+	int tier;
+} rb_mgc_progressive_arguments_t;
+
+typedef struct magic_files_arguments {
+	VALUE object;
+	rb_mgc_object_t *magic_object;
+	const char *database;
+	const char **paths;
+	magic_pool_result_t *results;
+	size_t count;
+	size_t next;
+	size_t threads;
+	int local_errno;
+	int status;
+	int flags;
+	volatile int cancel;
+} rb_mgc_files_arguments_t;
+
+typedef struct magic_result_object {
+	char *result;
+	size_t length;
+	int flags;
+	VALUE string;
+	VALUE description;
+	VALUE mime_type;
+	VALUE charset;
+	VALUE extensions;
+} rb_mgc_result_object_t;
+
+enum magic_view {
+	MAGIC_VIEW_DESCRIPTION = 0,
+	MAGIC_VIEW_MIME_TYPE,
+	MAGIC_VIEW_MIME_ENCODING,
+	MAGIC_VIEW_EXTENSION,
+	MAGIC_VIEWS
+};
+
+typedef struct magic_identify_arguments {
+	VALUE object;
+	rb_mgc_object_t *magic_object;
+	rb_mgc_arguments_t views[MAGIC_VIEWS];
+	union file file;
+	char *contents;
+	size_t size;
+	size_t limit;
+	int status;
+	int flags;
+	unsigned int descriptor:1;
+} rb_mgc_identify_arguments_t;
+
+typedef struct magic_lock_arguments {
+	VALUE object;
+	magic_lock_t *lock;
+	magic_lock_waiter_t *waiter;
+} rb_mgc_lock_arguments_t;
+
+typedef struct magic_offload {
+	void *(*function)(void *);
+	void *data;
+	int local_errno;
+} rb_mgc_offload_t;
+
 typedef struct magic_error {
 	const char *magic_error;
 	VALUE klass;
@@ -145,10 +383,15 @@ static const char * const ruby_magic_errors[] = {
 	[E_MAGIC_LIBRARY_INITIALIZE]	= "failed to initialize Magic library",
 	[E_MAGIC_LIBRARY_CLOSED]	= "Magic library is not open",
 	[E_MAGIC_LIBRARY_NOT_LOADED]	= "Magic library not loaded",
+	[E_POOL_INVALID_SIZE]		= "pool size must be greater than zero",
+	[E_POOL_INITIALIZED]		= "pool is already initialized",
+	[E_CACHE_INVALID_SIZE]		= "cache size cannot be negative",
+	[E_THREADS_INVALID_NUMBER]	= "number of threads must be greater than zero",
 	[E_PARAM_INVALID_TYPE]		= "unknown or invalid parameter specified",
 	[E_PARAM_INVALID_VALUE]		= "invalid parameter value specified",
 	[E_FLAG_NOT_IMPLEMENTED]	= "flag is not implemented",
 	[E_FLAG_INVALID_TYPE]		= "unknown or invalid flag specified",
+	[E_NOT_IMPLEMENTED]		= "function is not implemented",
 	NULL
 };
 
@@ -241,22 +484,6 @@ error:
 }
 #endif /* MAGIC_CUSTOM_CHECK_TYPE */
 
-static inline VALUE
-magic_strip(VALUE v)
-{
-	return (ARRAY_P(v) || STRING_P(v)) ?
-		rb_funcall(v, rb_intern("strip"), 0) :
-		Qnil;
-}
-
-static inline VALUE
-magic_shift(VALUE v)
-{
-	return ARRAY_P(v) ?
-		rb_funcall(v, rb_intern("shift"), 0) :
-		Qnil;
-}
-
 static inline VALUE
 magic_split(VALUE a, VALUE b)
 {
@@ -281,29 +508,6 @@ magic_flatten(VALUE v)
 		Qnil;
 }
 
-static inline VALUE
-magic_strip_array(VALUE value) {
-	VALUE entry;
-	VALUE array = rb_ary_new();
-
-	for (int i = 0; i < RARRAY_LEN(value); i++) {
-		entry = rb_ary_entry(value, i);
-		if (NIL_P(entry))
-			continue;
-
-		if (STRING_P(entry)) {
-			if (RSTRING_EMPTY_P(entry))
-				continue;
-
-			entry = magic_strip(entry);
-		}
-
-		rb_ary_push(array, entry);
-	}
-
-	return array;
-}
-
 static int
 magic_fileno(VALUE object)
 {
@@ -373,6 +577,10 @@ magic_check_type_array_of_strings(VALUE object)
 
 void Init_magic(void);
 
+VALUE rb_mgc_get_default_global(VALUE object);
+VALUE rb_mgc_preload_global(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_get_shared_global(VALUE object);
+
 VALUE rb_mgc_get_do_not_auto_load_global(VALUE object);
 VALUE rb_mgc_set_do_not_auto_load_global(VALUE object, VALUE value);
 VALUE rb_mgc_get_do_not_stop_on_error_global(VALUE object);
@@ -397,17 +605,70 @@ VALUE rb_mgc_set_flags(VALUE object, VALUE value);
 
 VALUE rb_mgc_load(VALUE object, VALUE arguments);
 VALUE rb_mgc_load_buffers(VALUE object, VALUE arguments);
+VALUE rb_mgc_reload(VALUE object, VALUE arguments);
 VALUE rb_mgc_load_p(VALUE object);
 
-VALUE rb_mgc_compile(VALUE object, VALUE arguments);
+VALUE rb_mgc_compile(int argc, VALUE *argv, VALUE object);
 VALUE rb_mgc_check(VALUE object, VALUE arguments);
 
-VALUE rb_mgc_file(VALUE object, VALUE value);
-VALUE rb_mgc_buffer(VALUE object, VALUE value);
-VALUE rb_mgc_descriptor(VALUE object, VALUE value);
+VALUE rb_mgc_file(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_files(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_buffer(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_descriptor(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_identify(VALUE object, VALUE value);
+
+VALUE rb_mgc_get_cache_size(VALUE object);
+VALUE rb_mgc_set_cache_size(VALUE object, VALUE value);
+VALUE rb_mgc_cache_stats(VALUE object);
+VALUE rb_mgc_get_buffer_cache_size(VALUE object);
+VALUE rb_mgc_set_buffer_cache_size(VALUE object, VALUE value);
+VALUE rb_mgc_buffer_cache_stats(VALUE object);
+VALUE rb_mgc_get_shared_cache(VALUE object);
+VALUE rb_mgc_set_shared_cache(VALUE object, VALUE value);
+VALUE rb_mgc_shared_cache_stats(VALUE object);
+
+VALUE rb_mgc_get_fast_path(VALUE object);
+VALUE rb_mgc_set_fast_path(VALUE object, VALUE value);
+VALUE rb_mgc_fast_path_stats(VALUE object);
+VALUE rb_mgc_get_triage(VALUE object);
+VALUE rb_mgc_set_triage(VALUE object, VALUE value);
+VALUE rb_mgc_triage_stats(VALUE object);
+VALUE rb_mgc_get_progressive(VALUE object);
+VALUE rb_mgc_set_progressive(VALUE object, VALUE value);
+VALUE rb_mgc_progressive_stats(VALUE object);
+
+VALUE rb_mgc_watch(int argc, VALUE *argv, VALUE object);
+VALUE rb_mgc_watched(VALUE object);
+VALUE rb_mgc_unwatch(VALUE object);
 
 VALUE rb_mgc_version(VALUE object);
 
+VALUE rb_mgc_pool_initialize(int argc, VALUE *argv, VALUE object);
+
+VALUE rb_mgc_pool_close(VALUE object);
+VALUE rb_mgc_pool_close_p(VALUE object);
+
+VALUE rb_mgc_pool_get_size(VALUE object);
+
+VALUE rb_mgc_pool_file(VALUE object, VALUE value);
+VALUE rb_mgc_pool_buffer(VALUE object, VALUE value);
+VALUE rb_mgc_pool_descriptor(VALUE object, VALUE value);
+
+VALUE rb_mgc_result_to_s(VALUE object);
+VALUE rb_mgc_result_get_flags(VALUE object);
+VALUE rb_mgc_result_description(VALUE object);
+VALUE rb_mgc_result_mime_type(VALUE object);
+VALUE rb_mgc_result_charset(VALUE object);
+VALUE rb_mgc_result_extensions(VALUE object);
+
+VALUE rb_mgc_database_open(int argc, VALUE *argv, VALUE klass);
+VALUE rb_mgc_database_embedded(VALUE klass);
+VALUE rb_mgc_database_count(VALUE klass);
+VALUE rb_mgc_database_path(VALUE object);
+VALUE rb_mgc_database_size(VALUE object);
+VALUE rb_mgc_database_equal(VALUE object, VALUE other);
+VALUE rb_mgc_database_hash(VALUE object);
+
 #if defined(__cplusplus)
 }
 #endif
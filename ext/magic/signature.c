@@ -0,0 +1,191 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "signature.h"
+
+static int magic_signature_riff(const unsigned char *buffer, size_t size);
+static int magic_signature_zip(const unsigned char *buffer, size_t size);
+static int magic_signature_mp4(const unsigned char *buffer, size_t size);
+
+/*
+ * The formats below are recognised by their leading bytes alone, and are
+ * given the same MIME type as the Magic library would, for data of at
+ * least the given size, as the Magic library does not recognise shorter
+ * data as the format. Any format that the Magic library tells apart by
+ * looking further, such as the many formats stored in a ZIP archive, is
+ * left for it to classify, as is anything that does not match in full,
+ * such as a PNG signature not followed by the IHDR chunk.
+ */
+static const magic_signature_t magic_signatures[] = {
+	{ "\x89PNG\r\n\x1a\n\0\0\0\rIHDR", 0, 16, 16, "image/png",        NULL                 },
+	{ "\xff\xd8\xff",                  0,  3,  4, "image/jpeg",       NULL                 },
+	{ "GIF87a",                        0,  6,  6, "image/gif",        NULL                 },
+	{ "GIF89a",                        0,  6,  6, "image/gif",        NULL                 },
+	{ "WEBPVP8",                       8,  7, 15, "image/webp",       magic_signature_riff },
+	{ "%PDF-",                         0,  5,  5, "application/pdf",  NULL                 },
+	{ "PK\x03\x04",                    0,  4, 50, "application/zip",  magic_signature_zip  },
+	{ "\x1f\x8b",                      0,  2,  4, "application/gzip", NULL                 },
+	{ "ftyp",                          4,  4, 12, "video/mp4",        magic_signature_mp4  },
+};
+
+/*
+ * Names of the first entry of a ZIP archive that the Magic library looks
+ * for to recognise the formats built on top of it.
+ */
+static const char *magic_signature_zip_names[] = {
+	"[Content_Types].xml",
+	"_rels/",
+	"word/",
+	"xl/",
+	"ppt/",
+	"visio/",
+	"mimetype",
+	"META-INF/",
+	"AndroidManifest.xml",
+	"classes.dex",
+	"resources.arsc",
+	"Payload/",
+	"doc.kml",
+};
+
+/*
+ * Major brands of the ISO base media file format that the Magic library
+ * reports as "video/mp4". Others, such as HEIF images, QuickTime movies or
+ * M4A audio, are reported differently.
+ */
+static const char *magic_signature_mp4_brands[] = {
+	"isom", "iso2", "iso4", "iso5", "iso6",
+	"mp41", "mp42", "avc1", "dash", "mmp4",
+	"NDSC", "M4P ",
+};
+
+static int
+magic_signature_riff(const unsigned char *buffer, size_t size)
+{
+	return size >= 4 && memcmp(buffer, "RIFF", 4) == 0;
+}
+
+static int
+magic_signature_zip(const unsigned char *buffer, size_t size)
+{
+	size_t length, prefix;
+
+	/*
+	 * The Magic library only reports a ZIP archive once it can also read
+	 * two bytes past the name of the first entry, and reports the data as
+	 * "application/octet-stream" otherwise.
+	 */
+	length = (size_t)buffer[26] | (size_t)buffer[27] << 8;
+	if (length == 0 || size < 30 + length + 2)
+		return 0;
+
+	for (size_t i = 0; i < ARRAY_SIZE(magic_signature_zip_names); i++) {
+		prefix = strlen(magic_signature_zip_names[i]);
+		if (length >= prefix &&
+		    memcmp(buffer + 30, magic_signature_zip_names[i], prefix) == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * The size of the box comes first, and one of 16 MiB or more is unheard
+ * of for the "ftyp" box, whereas the Magic library can recognise such data
+ * as another format from its first byte, such as a PCX image.
+ */
+static int
+magic_signature_mp4(const unsigned char *buffer, size_t size)
+{
+	if (size < 12 || buffer[0] != 0)
+		return 0;
+
+	for (size_t i = 0; i < ARRAY_SIZE(magic_signature_mp4_brands); i++) {
+		if (memcmp(buffer + 8, magic_signature_mp4_brands[i], 4) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the MIME type of the data, or NULL if none of the signatures
+ * match, in which case the data has to be classified by the Magic library.
+ */
+const char *
+magic_signature_buffer(const void *buffer, size_t size)
+{
+	const unsigned char *bytes = buffer;
+	const magic_signature_t *signature;
+
+	for (size_t i = 0; i < ARRAY_SIZE(magic_signatures); i++) {
+		signature = &magic_signatures[i];
+
+		if (size < signature->offset + signature->length ||
+		    size < signature->size)
+			continue;
+
+		if (memcmp(bytes + signature->offset, signature->bytes,
+			   signature->length) != 0)
+			continue;
+
+		if (signature->check && !signature->check(bytes, size))
+			return NULL;
+
+		return signature->mime_type;
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the MIME type of the regular file at the given path from its
+ * leading bytes, or NULL otherwise, including when the file cannot be read,
+ * leaving it to the Magic library to classify or report. A symbolic link
+ * is not followed, unless the MAGIC_SYMLINK flag is set, as the Magic
+ * library would report the link itself. The errno is left unchanged.
+ */
+const char *
+magic_signature_file(const char *path, int flags)
+{
+	int fd;
+	int local_errno = errno;
+	int open_flags = O_RDONLY | O_NONBLOCK;
+	ssize_t length;
+	struct stat st;
+	const char *mime_type = NULL;
+	unsigned char buffer[MAGIC_SIGNATURE_BYTES];
+
+#if defined(HAVE_O_CLOEXEC)
+	open_flags |= O_CLOEXEC;
+#endif
+
+	if (!(flags & MAGIC_SYMLINK)) {
+#if defined(O_NOFOLLOW)
+		open_flags |= O_NOFOLLOW;
+#else
+		return NULL;
+#endif
+	}
+
+	fd = open(path, open_flags);
+	if (fd < 0)
+		goto out;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		length = pread(fd, buffer, sizeof(buffer), 0);
+		if (length > 0)
+			mime_type = magic_signature_buffer(buffer, (size_t)length);
+	}
+
+	close(fd);
+out:
+	errno = local_errno;
+
+	return mime_type;
+}
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,36 @@
+#if !defined(_SIGNATURE_H)
+#define _SIGNATURE_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+
+#define MAGIC_SIGNATURE_BYTES 256
+
+/*
+ * Only the MIME type is answered from the signatures, thus the flags must
+ * not ask for anything else, while the flags that make no difference to
+ * the MIME type of a regular file are allowed.
+ */
+#define MAGIC_SIGNATURE_FLAGS_P(f) \
+	(((f) & ~(MAGIC_ERROR | MAGIC_RAW | MAGIC_SYMLINK)) == MAGIC_MIME_TYPE)
+
+typedef struct magic_signature {
+	const char *bytes;
+	size_t offset;
+	size_t length;
+	size_t size;
+	const char *mime_type;
+	int (*check)(const unsigned char *buffer, size_t size);
+} magic_signature_t;
+
+extern const char *magic_signature_buffer(const void *buffer, size_t size);
+extern const char *magic_signature_file(const char *path, int flags);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _SIGNATURE_H */
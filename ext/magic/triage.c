@@ -0,0 +1,317 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "triage.h"
+
+#if defined(__SSE2__) || defined(HAVE_AVX2)
+# include <immintrin.h>
+#endif
+
+/*
+ * A byte is text, as the Magic library sees it, if it is a printable ASCII
+ * character, or one of the control characters commonly found in text: BEL,
+ * BS, HT, LF, VT, FF, CR and ESC.
+ */
+static inline int
+magic_triage_text_p(unsigned char c)
+{
+	return (c >= 0x20 && c < 0x7f) || (c >= 0x07 && c <= 0x0d) || c == 0x1b;
+}
+
+static size_t
+magic_triage_text_scalar(const unsigned char *bytes, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (!magic_triage_text_p(bytes[i]))
+			break;
+	}
+
+	return i;
+}
+
+#if defined(__SSE2__)
+static size_t
+magic_triage_text_sse2(const unsigned char *bytes, size_t size)
+{
+	const __m128i space = _mm_set1_epi8(0x1f);
+	const __m128i bell = _mm_set1_epi8(0x07);
+	const __m128i span = _mm_set1_epi8(0x0d - 0x07);
+	const __m128i escape = _mm_set1_epi8(0x1b);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	__m128i x, d, control, allowed, other;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + sizeof(x) <= size; i += sizeof(x)) {
+		x = _mm_loadu_si128((const __m128i *)(const void *)(bytes + i));
+
+		control = _mm_cmpeq_epi8(_mm_min_epu8(x, space), x);
+		d = _mm_sub_epi8(x, bell);
+		allowed = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(d, span), d),
+				       _mm_cmpeq_epi8(x, escape));
+		other = _mm_or_si128(_mm_andnot_si128(allowed, control),
+				     _mm_cmpeq_epi8(x, del));
+
+		/*
+		 * The most significant bit of a byte marks it as either not
+		 * text, or as not ASCII.
+		 */
+		mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(other, x));
+		if (mask)
+			return i + (size_t)__builtin_ctz(mask);
+	}
+
+	return i + magic_triage_text_scalar(bytes + i, size - i);
+}
+#endif /* __SSE2__ */
+
+#if defined(HAVE_AVX2)
+__attribute__((target("avx2")))
+static size_t
+magic_triage_text_avx2(const unsigned char *bytes, size_t size)
+{
+	const __m256i space = _mm256_set1_epi8(0x1f);
+	const __m256i bell = _mm256_set1_epi8(0x07);
+	const __m256i span = _mm256_set1_epi8(0x0d - 0x07);
+	const __m256i escape = _mm256_set1_epi8(0x1b);
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	__m256i x, d, control, allowed, other;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + sizeof(x) <= size; i += sizeof(x)) {
+		x = _mm256_loadu_si256((const __m256i *)(const void *)(bytes + i));
+
+		control = _mm256_cmpeq_epi8(_mm256_min_epu8(x, space), x);
+		d = _mm256_sub_epi8(x, bell);
+		allowed = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(d, span), d),
+					  _mm256_cmpeq_epi8(x, escape));
+		other = _mm256_or_si256(_mm256_andnot_si256(allowed, control),
+					_mm256_cmpeq_epi8(x, del));
+
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(other, x));
+		if (mask)
+			return i + (size_t)__builtin_ctz(mask);
+	}
+
+	return i + magic_triage_text_scalar(bytes + i, size - i);
+}
+#endif /* HAVE_AVX2 */
+
+/*
+ * Returns the number of leading bytes that are ASCII text.
+ */
+static size_t
+magic_triage_text(const unsigned char *bytes, size_t size)
+{
+#if defined(HAVE_AVX2)
+	if (__builtin_cpu_supports("avx2"))
+		return magic_triage_text_avx2(bytes, size);
+#endif /* HAVE_AVX2 */
+
+#if defined(__SSE2__)
+	return magic_triage_text_sse2(bytes, size);
+#else
+	return magic_triage_text_scalar(bytes, size);
+#endif /* __SSE2__ */
+}
+
+/*
+ * Returns the length of the UTF-8 sequence at the start of the bytes, or 0
+ * if it is not a valid one, such as an overlong form or a surrogate. A
+ * sequence cut short by the end of the bytes is taken as valid, as only
+ * a prefix of the data is looked at.
+ */
+static size_t
+magic_triage_utf8(const unsigned char *bytes, size_t size)
+{
+	size_t length;
+	unsigned char low = 0x80, high = 0xbf;
+
+	if (bytes[0] >= 0xc2 && bytes[0] <= 0xdf) {
+		length = 2;
+	} else if (bytes[0] >= 0xe0 && bytes[0] <= 0xef) {
+		length = 3;
+		if (bytes[0] == 0xe0)
+			low = 0xa0;
+		else if (bytes[0] == 0xed)
+			high = 0x9f;
+	} else if (bytes[0] >= 0xf0 && bytes[0] <= 0xf4) {
+		length = 4;
+		if (bytes[0] == 0xf0)
+			low = 0x90;
+		else if (bytes[0] == 0xf4)
+			high = 0x8f;
+	} else {
+		return 0;
+	}
+
+	if (length > size)
+		length = size;
+
+	for (size_t i = 1; i < length; i++) {
+		if (bytes[i] < low || bytes[i] > high)
+			return 0;
+
+		low = 0x80;
+		high = 0xbf;
+	}
+
+	return length;
+}
+
+/*
+ * The Magic library takes the data for binary when there is a NUL byte in
+ * it, other than in the trailing NUL bytes that it ignores, as it is not
+ * text in any of the encodings it knows of, except for UTF-16 and UTF-32,
+ * which it only recognises by their byte order mark.
+ */
+static int
+magic_triage_binary(const unsigned char *bytes, size_t size)
+{
+	const unsigned char *nul;
+	size_t end = size;
+
+	if (size >= 2 && ((bytes[0] == 0xfe && bytes[1] == 0xff) ||
+			  (bytes[0] == 0xff && bytes[1] == 0xfe)))
+		return 0;
+
+	if (size >= 4 && memcmp(bytes, "\0\0\xfe\xff", 4) == 0)
+		return 0;
+
+	nul = memchr(bytes, 0, size);
+	if (!nul)
+		return 0;
+
+	while (end > 0 && bytes[end - 1] == 0)
+		end--;
+
+	return (size_t)(nul - bytes) < end;
+}
+
+/*
+ * Classifies the data as binary, ASCII text, UTF-8 text or anything else,
+ * which includes text in any of the other encodings that the Magic library
+ * knows of, from its leading bytes.
+ */
+magic_triage_t
+magic_triage_buffer(const void *buffer, size_t size)
+{
+	size_t i = 0, length;
+	const unsigned char *bytes = buffer;
+	magic_triage_t triage = MAGIC_TRIAGE_ASCII;
+
+	if (size == 0)
+		return MAGIC_TRIAGE_OTHER;
+
+	if (magic_triage_binary(bytes, size))
+		return MAGIC_TRIAGE_BINARY;
+
+	for (;;) {
+		i += magic_triage_text(bytes + i, size - i);
+		if (i == size)
+			break;
+
+		if (bytes[i] < 0x80)
+			return MAGIC_TRIAGE_OTHER;
+
+		length = magic_triage_utf8(bytes + i, size - i);
+		if (!length)
+			return MAGIC_TRIAGE_OTHER;
+
+		triage = MAGIC_TRIAGE_UTF8;
+		i += length;
+	}
+
+	return triage;
+}
+
+/*
+ * Classifies the regular file at the given path from at most the given
+ * number of its leading bytes, or returns MAGIC_TRIAGE_OTHER otherwise,
+ * including when the file cannot be read, leaving it to the Magic library
+ * to classify or report. A symbolic link is not followed, unless the
+ * MAGIC_SYMLINK flag is set. The errno is left unchanged.
+ */
+magic_triage_t
+magic_triage_file(const char *path, int flags, size_t size)
+{
+	int fd;
+	int local_errno = errno;
+	int open_flags = O_RDONLY | O_NONBLOCK;
+	ssize_t length;
+	struct stat st;
+	unsigned char *buffer;
+	magic_triage_t triage = MAGIC_TRIAGE_OTHER;
+
+#if defined(HAVE_O_CLOEXEC)
+	open_flags |= O_CLOEXEC;
+#endif
+
+	if (!(flags & MAGIC_SYMLINK)) {
+#if defined(O_NOFOLLOW)
+		open_flags |= O_NOFOLLOW;
+#else
+		return MAGIC_TRIAGE_OTHER;
+#endif
+	}
+
+	fd = open(path, open_flags);
+	if (fd < 0)
+		goto out;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		goto close;
+
+	if ((size_t)st.st_size < size)
+		size = (size_t)st.st_size;
+
+	buffer = malloc(size ? size : 1);
+	if (!buffer)
+		goto close;
+
+	length = pread(fd, buffer, size, 0);
+	if (length > 0)
+		triage = magic_triage_buffer(buffer, (size_t)length);
+
+	free(buffer);
+close:
+	close(fd);
+out:
+	errno = local_errno;
+
+	return triage;
+}
+
+/*
+ * Returns the flags with the checks added that the Magic library does not
+ * need to run to classify data of the given kind, as they cannot change
+ * the result: the checks for text and its encoding for binary data, and,
+ * when only the MIME encoding is asked for, the soft magic tests for both
+ * binary data and text, as the encoding comes from the checks for text.
+ */
+int
+magic_triage_flags(magic_triage_t triage, int flags)
+{
+	switch (triage) {
+	case MAGIC_TRIAGE_BINARY:
+		flags |= MAGIC_NO_CHECK_ENCODING | MAGIC_NO_CHECK_TEXT;
+		/* fall through */
+	case MAGIC_TRIAGE_ASCII:
+	case MAGIC_TRIAGE_UTF8:
+		if (MAGIC_TRIAGE_ENCODING_P(flags))
+			flags |= MAGIC_NO_CHECK_SOFT;
+		break;
+	default:
+		break;
+	}
+
+	return flags;
+}
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,56 @@
+#if !defined(_TRIAGE_H)
+#define _TRIAGE_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+
+/*
+ * The Magic library looks at no more than this many leading bytes when it
+ * checks whether the data is text, unless told otherwise.
+ */
+#define MAGIC_TRIAGE_BYTES 65536
+
+#if defined(MAGIC_COMPRESS_TRANSP)
+# define MAGIC_TRIAGE_COMPRESS (MAGIC_COMPRESS | MAGIC_COMPRESS_TRANSP)
+#else
+# define MAGIC_TRIAGE_COMPRESS MAGIC_COMPRESS
+#endif
+
+/*
+ * The contents of compressed data are classified using the same flags,
+ * thus the flags chosen for the compressed data must not be used for them,
+ * and every match is reported when continuing, including that of binary
+ * data found by the checks for text.
+ */
+#define MAGIC_TRIAGE_FLAGS_P(f) \
+	(!((f) & (MAGIC_TRIAGE_COMPRESS | MAGIC_CONTINUE)))
+
+/*
+ * Only the MIME encoding is asked for, which the Magic library decides on
+ * from its own checks of the text, whatever the soft magic tests find.
+ */
+#define MAGIC_TRIAGE_ENCODING_P(f) \
+	(((f) & (MAGIC_MIME | MAGIC_EXTENSION | MAGIC_APPLE)) == \
+	 MAGIC_MIME_ENCODING)
+
+typedef enum magic_triage {
+	MAGIC_TRIAGE_OTHER = 0,
+	MAGIC_TRIAGE_BINARY,
+	MAGIC_TRIAGE_ASCII,
+	MAGIC_TRIAGE_UTF8,
+	MAGIC_TRIAGE_MAX
+} magic_triage_t;
+
+extern magic_triage_t magic_triage_buffer(const void *buffer, size_t size);
+extern magic_triage_t magic_triage_file(const char *path, int flags,
+					size_t size);
+extern int magic_triage_flags(magic_triage_t triage, int flags);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _TRIAGE_H */
@@ -0,0 +1,594 @@
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "watch.h"
+#include "cache.h"
+
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT1)
+#include <poll.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+#define MAGIC_WATCH_EVENTS \
+	(IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+	 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+	 IN_ONLYDIR)
+
+static int magic_watch_add_locked(magic_watch_t *watch, const char *path,
+				  int recursive);
+static int magic_watch_add_children(magic_watch_t *watch, const char *path);
+static void magic_watch_remove_locked(magic_watch_t *watch,
+				      magic_watch_directory_t *directory);
+static magic_watch_directory_t *magic_watch_lookup(magic_watch_t *watch,
+						   const char *path,
+						   size_t length);
+static void magic_watch_events(magic_watch_t *watch, const char *buffer,
+			       ssize_t length);
+static void magic_watch_drain_locked(magic_watch_t *watch);
+static void *magic_watch_thread(void *data);
+
+/*
+ * Versions are unique within the process, and across a fork as long as a
+ * child process watches directories anew, so that a result cached while a
+ * directory was watched before can never be mistaken as current.
+ */
+static unsigned long magic_watch_versions;
+
+#define MAGIC_WATCH_VERSION() \
+	(MAGIC_ATOMIC_FETCH_ADD(&magic_watch_versions, 1) + 1)
+
+magic_watch_t *
+magic_watch_new(void)
+{
+	magic_watch_t *watch;
+
+	watch = calloc(1, sizeof(*watch));
+	if (!watch) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0)
+		goto error;
+
+	if (pipe(watch->wakeup) < 0) {
+		close(watch->fd);
+		goto error;
+	}
+
+	fcntl(watch->wakeup[0], F_SETFD, FD_CLOEXEC);
+	fcntl(watch->wakeup[1], F_SETFD, FD_CLOEXEC);
+
+	pthread_mutex_init(&watch->mutex, NULL);
+	watch->pid = getpid();
+
+	return watch;
+error:
+	free(watch);
+	return NULL;
+}
+
+/*
+ * Stops the thread reading the events, unless called in a child process,
+ * where the thread does not exist, and the mutex might have been left
+ * locked by it at the time of the fork.
+ */
+void
+magic_watch_free(magic_watch_t *watch)
+{
+	int forked;
+	magic_watch_directory_t *directory;
+
+	if (!watch)
+		return;
+
+	forked = watch->pid != getpid();
+
+	if (watch->started && !forked) {
+		while (write(watch->wakeup[1], "", 1) < 0 && errno == EINTR)
+			;
+		pthread_join(watch->thread, NULL);
+	}
+
+	close(watch->fd);
+	close(watch->wakeup[0]);
+	close(watch->wakeup[1]);
+
+	for (size_t i = 0; i < MAGIC_WATCH_BUCKETS; i++) {
+		while ((directory = watch->buckets[i])) {
+			watch->buckets[i] = directory->chain;
+			free(directory->path);
+			free(directory);
+		}
+	}
+
+	if (!forked)
+		pthread_mutex_destroy(&watch->mutex);
+
+	free(watch->descriptors);
+	free(watch);
+}
+
+/*
+ * Starts watching the directory at the given path, and each directory
+ * beneath it when recursive, including the ones created later on.
+ */
+int
+magic_watch_add(magic_watch_t *watch, const char *path, int recursive)
+{
+	int rv;
+	sigset_t set, old;
+	char resolved[PATH_MAX];
+
+	if (!realpath(path, resolved))
+		return -1;
+
+	pthread_mutex_lock(&watch->mutex);
+	rv = magic_watch_add_locked(watch, resolved, recursive);
+	pthread_mutex_unlock(&watch->mutex);
+
+	if (rv < 0 || watch->started)
+		return rv;
+
+	/*
+	 * Signals are to be handled by the threads of the interpreter, not
+	 * by the thread reading the events.
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+
+	if (pthread_create(&watch->thread, NULL, magic_watch_thread,
+			   watch) == 0)
+		watch->started = 1;
+	else
+		rv = -1;
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return rv;
+}
+
+/*
+ * Sets the version of the directory that holds the file at the given path,
+ * which changes whenever anything in the directory changes. Returns -1 when
+ * the directory is not watched, in which case the file has to be checked
+ * some other way. The path has to be absolute and normalized, the same as
+ * the paths that were given to magic_watch_add after resolving them.
+ *
+ * Pending events are handled first, thus a change made before the call is
+ * always reflected in the version, even when the thread reading the events
+ * has not got to it yet. With nothing pending, this costs a single read(2)
+ * failing with EAGAIN.
+ */
+int
+magic_watch_version(magic_watch_t *watch, const char *path,
+		    unsigned long *version)
+{
+	int rv = -1;
+	const char *separator;
+	magic_watch_directory_t *directory;
+
+	if (path[0] != '/')
+		return -1;
+
+	separator = strrchr(path, '/');
+	if (separator == path || separator[1] == '\0')
+		return -1;
+
+	pthread_mutex_lock(&watch->mutex);
+	magic_watch_drain_locked(watch);
+
+	directory = magic_watch_lookup(watch, path, (size_t)(separator - path));
+	if (directory) {
+		*version = directory->version;
+		rv = 0;
+	}
+
+	pthread_mutex_unlock(&watch->mutex);
+
+	return rv;
+}
+
+/*
+ * Returns the paths of the watched directories, which have to be released
+ * by the caller along with the array.
+ */
+char **
+magic_watch_paths(magic_watch_t *watch, size_t *count)
+{
+	size_t i = 0;
+	char **paths;
+	magic_watch_directory_t *directory;
+
+	pthread_mutex_lock(&watch->mutex);
+	magic_watch_drain_locked(watch);
+
+	paths = calloc(watch->count + 1, sizeof(char *));
+	if (!paths)
+		goto out;
+
+	for (size_t j = 0; j < MAGIC_WATCH_BUCKETS; j++) {
+		for (directory = watch->buckets[j]; directory;
+		     directory = directory->chain) {
+			if (directory->removed)
+				continue;
+
+			paths[i] = strdup(directory->path);
+			if (paths[i])
+				i++;
+		}
+	}
+out:
+	pthread_mutex_unlock(&watch->mutex);
+
+	*count = i;
+	return paths;
+}
+
+static int
+magic_watch_add_locked(magic_watch_t *watch, const char *path, int recursive)
+{
+	int wd;
+	size_t length;
+	size_t bucket;
+	magic_watch_directory_t *directory;
+	magic_watch_directory_t **descriptors;
+
+	wd = inotify_add_watch(watch->fd, path, MAGIC_WATCH_EVENTS);
+	if (wd < 0)
+		return -1;
+
+	length = strlen(path);
+
+	directory = magic_watch_lookup(watch, path, length);
+	if (directory && directory->wd == wd) {
+		directory->recursive |= !!recursive;
+		goto children;
+	}
+
+	/*
+	 * The directory is already watched under a different path, which it
+	 * is no longer at, such as after it was moved into a watched one from
+	 * elsewhere, thus it is watched anew under the given path only.
+	 */
+	if ((size_t)wd < watch->descriptors_count && watch->descriptors[wd]) {
+		magic_watch_remove_locked(watch, watch->descriptors[wd]);
+
+		wd = inotify_add_watch(watch->fd, path, MAGIC_WATCH_EVENTS);
+		if (wd < 0)
+			return -1;
+	}
+
+	if ((size_t)wd >= watch->descriptors_count) {
+		size_t count = watch->descriptors_count ? watch->descriptors_count : 64;
+
+		while (count <= (size_t)wd)
+			count <<= 1;
+
+		descriptors = realloc(watch->descriptors,
+				      count * sizeof(*descriptors));
+		if (!descriptors)
+			goto error;
+
+		memset(descriptors + watch->descriptors_count, 0,
+		       (count - watch->descriptors_count) * sizeof(*descriptors));
+
+		watch->descriptors = descriptors;
+		watch->descriptors_count = count;
+	}
+
+	directory = calloc(1, sizeof(*directory));
+	if (!directory)
+		goto error;
+
+	directory->path = strdup(path);
+	if (!directory->path) {
+		free(directory);
+		goto error;
+	}
+
+	directory->length = length;
+	directory->hash = magic_cache_digest(MAGIC_CACHE_DIGEST_INIT, path,
+					     length);
+	directory->wd = wd;
+	directory->version = MAGIC_WATCH_VERSION();
+	directory->recursive = !!recursive;
+
+	/*
+	 * The most recently added directory shadows a removed one that had
+	 * the same path, as it is found first.
+	 */
+	bucket = directory->hash % MAGIC_WATCH_BUCKETS;
+	directory->chain = watch->buckets[bucket];
+	watch->buckets[bucket] = directory;
+
+	watch->descriptors[wd] = directory;
+	watch->count++;
+children:
+	if (recursive)
+		return magic_watch_add_children(watch, path);
+
+	return 0;
+error:
+	inotify_rm_watch(watch->fd, wd);
+	errno = ENOMEM;
+	return -1;
+}
+
+static int
+magic_watch_add_children(magic_watch_t *watch, const char *path)
+{
+	int rv = 0;
+	DIR *handle;
+	struct stat st;
+	struct dirent *entry;
+	char child[PATH_MAX];
+
+	handle = opendir(path);
+	if (!handle)
+		return -1;
+
+	while ((entry = readdir(handle))) {
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		if (snprintf(child, sizeof(child), "%s/%s", path,
+			     entry->d_name) >= (int)sizeof(child))
+			continue;
+
+		/*
+		 * Symbolic links are not followed, as the directories they
+		 * point to would be watched under a different path.
+		 */
+		if (entry->d_type != DT_DIR) {
+			if (entry->d_type != DT_UNKNOWN ||
+			    lstat(child, &st) < 0 || !S_ISDIR(st.st_mode))
+				continue;
+		}
+
+		rv = magic_watch_add_locked(watch, child, 1);
+		if (rv < 0 && errno != ENOENT && errno != EACCES)
+			break;
+
+		rv = 0;
+	}
+
+	closedir(handle);
+
+	return rv;
+}
+
+/*
+ * Stops watching the directory, and every watched directory beneath it, as
+ * these are no longer at the paths they were watched under once moved.
+ */
+static void
+magic_watch_remove_locked(magic_watch_t *watch,
+			  magic_watch_directory_t *directory)
+{
+	size_t length = directory->length;
+	magic_watch_directory_t *child;
+
+	for (size_t i = 0; i < watch->descriptors_count; i++) {
+		child = watch->descriptors[i];
+		if (!child)
+			continue;
+
+		if (child != directory &&
+		    (child->length <= length ||
+		     memcmp(child->path, directory->path, length) != 0 ||
+		     (length > 1 && child->path[length] != '/')))
+			continue;
+
+		inotify_rm_watch(watch->fd, child->wd);
+
+		child->version = MAGIC_WATCH_VERSION();
+		child->removed = 1;
+		watch->descriptors[i] = NULL;
+		watch->count--;
+	}
+}
+
+static magic_watch_directory_t *
+magic_watch_lookup(magic_watch_t *watch, const char *path, size_t length)
+{
+	size_t hash;
+	magic_watch_directory_t *directory;
+
+	hash = magic_cache_digest(MAGIC_CACHE_DIGEST_INIT, path, length);
+
+	directory = watch->buckets[hash % MAGIC_WATCH_BUCKETS];
+	for (; directory; directory = directory->chain) {
+		if (directory->hash == hash && directory->length == length &&
+		    memcmp(directory->path, path, length) == 0)
+			break;
+	}
+
+	if (directory && directory->removed)
+		return NULL;
+
+	return directory;
+}
+
+/*
+ * Any change to a directory invalidates the results for all the files in
+ * it, which is coarser than necessary, but needs no bookkeeping of which
+ * files were looked at.
+ */
+static void
+magic_watch_events(magic_watch_t *watch, const char *buffer, ssize_t length)
+{
+	char child[PATH_MAX];
+	const struct inotify_event *event;
+	magic_watch_directory_t *directory;
+
+	for (const char *p = buffer; p < buffer + length;
+	     p += sizeof(*event) + event->len) {
+		event = (const struct inotify_event *)p;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			for (size_t i = 0; i < watch->descriptors_count; i++) {
+				if (watch->descriptors[i])
+					watch->descriptors[i]->version = MAGIC_WATCH_VERSION();
+			}
+			continue;
+		}
+
+		if (event->wd < 0 || (size_t)event->wd >= watch->descriptors_count)
+			continue;
+
+		directory = watch->descriptors[event->wd];
+		if (!directory)
+			continue;
+
+		directory->version = MAGIC_WATCH_VERSION();
+
+		if (event->mask & IN_IGNORED) {
+			directory->removed = 1;
+			watch->descriptors[event->wd] = NULL;
+			watch->count--;
+			continue;
+		}
+
+		/*
+		 * A directory moved elsewhere would otherwise still be looked
+		 * up under its old path, while the changes reported are those
+		 * made at its new one. A directory moved within a recursively
+		 * watched one is watched again under its new path below, and
+		 * the event for the directory itself, which comes last, finds
+		 * the descriptor it was watched with already removed.
+		 */
+		if (event->mask & IN_MOVE_SELF) {
+			magic_watch_remove_locked(watch, directory);
+			continue;
+		}
+
+		if (event->len > 0 && (event->mask & IN_ISDIR) &&
+		    (event->mask & IN_MOVED_FROM)) {
+			if (snprintf(child, sizeof(child), "%s/%s",
+				     directory->path, event->name) < (int)sizeof(child) &&
+			    (directory = magic_watch_lookup(watch, child,
+							    strlen(child))))
+				magic_watch_remove_locked(watch, directory);
+			continue;
+		}
+
+		if (directory->recursive && event->len > 0 &&
+		    (event->mask & IN_ISDIR) &&
+		    (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+			if (snprintf(child, sizeof(child), "%s/%s",
+				     directory->path, event->name) < (int)sizeof(child))
+				magic_watch_add_locked(watch, child, 1);
+		}
+	}
+}
+
+/*
+ * Reads and handles the pending events, without waiting for more. Called
+ * with the mutex held, also by the thread reading the events, thus no
+ * event can have been read without having been handled already.
+ */
+static void
+magic_watch_drain_locked(magic_watch_t *watch)
+{
+	ssize_t length;
+	int local_errno = errno;
+	char buffer[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		length = read(watch->fd, buffer, sizeof(buffer));
+		if (length < 0 && errno == EINTR)
+			continue;
+
+		if (length <= 0)
+			break;
+
+		magic_watch_events(watch, buffer, length);
+	}
+
+	errno = local_errno;
+}
+
+static void *
+magic_watch_thread(void *data)
+{
+	magic_watch_t *watch = data;
+	struct pollfd fds[2] = {
+		{ .fd = watch->fd,        .events = POLLIN },
+		{ .fd = watch->wakeup[0], .events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		if (fds[0].revents & (POLLERR | POLLNVAL))
+			break;
+
+		pthread_mutex_lock(&watch->mutex);
+		magic_watch_drain_locked(watch);
+		pthread_mutex_unlock(&watch->mutex);
+	}
+
+	return NULL;
+}
+#else
+magic_watch_t *
+magic_watch_new(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+magic_watch_free(magic_watch_t *watch)
+{
+	UNUSED(watch);
+}
+
+int
+magic_watch_add(magic_watch_t *watch, const char *path, int recursive)
+{
+	UNUSED(watch);
+	UNUSED(path);
+	UNUSED(recursive);
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+magic_watch_version(magic_watch_t *watch, const char *path,
+		    unsigned long *version)
+{
+	UNUSED(watch);
+	UNUSED(path);
+	UNUSED(version);
+
+	return -1;
+}
+
+char **
+magic_watch_paths(magic_watch_t *watch, size_t *count)
+{
+	UNUSED(watch);
+
+	*count = 0;
+	return NULL;
+}
+#endif /* HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT1 */
+
+#if defined(__cplusplus)
+}
+#endif
@@ -0,0 +1,51 @@
+#if !defined(_WATCH_H)
+#define _WATCH_H 1
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "common.h"
+
+#include <pthread.h>
+
+#define MAGIC_WATCH_BUCKETS 1024
+
+typedef struct magic_watch_directory {
+	struct magic_watch_directory *chain;
+	char *path;
+	size_t length;
+	size_t hash;
+	unsigned long version;
+	int wd;
+	unsigned int recursive:1;
+	unsigned int removed:1;
+} magic_watch_directory_t;
+
+typedef struct magic_watch {
+	pthread_mutex_t mutex;
+	pthread_t thread;
+	magic_watch_directory_t *buckets[MAGIC_WATCH_BUCKETS];
+	magic_watch_directory_t **descriptors;
+	size_t descriptors_count;
+	size_t count;
+	pid_t pid;
+	int fd;
+	int wakeup[2];
+	unsigned int started:1;
+} magic_watch_t;
+
+extern magic_watch_t *magic_watch_new(void);
+extern void magic_watch_free(magic_watch_t *watch);
+
+extern int magic_watch_add(magic_watch_t *watch, const char *path,
+			   int recursive);
+extern int magic_watch_version(magic_watch_t *watch, const char *path,
+			       unsigned long *version);
+extern char **magic_watch_paths(magic_watch_t *watch, size_t *count);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _WATCH_H */
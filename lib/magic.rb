@@ -11,6 +11,7 @@
 end
 
 require_relative 'magic/version'
+require_relative 'magic/subset'
 require_relative 'magic/core/file'
 require_relative 'magic/core/string'
 
@@ -48,12 +49,12 @@ def flags_list(names = false)
     n, i = 0, @flags
     flags = []
 
-    @@flags_map ||= flags_as_map if names
+    flags_map = flags_as_map if names
 
     while i > 0
       n = 2 ** (Math.log(i) / Math.log(2)).to_i
       i = i - n
-      flags.insert(0, names ? @@flags_map[n] : n)
+      flags.insert(0, names ? flags_map[n] : n)
     end
 
     flags
@@ -150,16 +151,76 @@ def check(*paths)
       open {|m| m.check(paths) }
     end
 
+    #
+    # call-seq:
+    #    Magic.compile_subset( string, mime_types: array, output: string )         -> string
+    #    Magic.compile_subset( array, mime_types: array, output: string )          -> string
+    #
+    # Compiles a database from the given _Magic_ database source files, or
+    # directories of them, keeping only the entries that can produce any of
+    # the given MIME types, together with the named entries they use, and
+    # returns the path of the compiled database, to which the ".mgc" suffix
+    # is added when missing, as the _Magic_ library would otherwise load it
+    # as a source file. A MIME type ending with "/*", such as "image/*",
+    # matches every subtype.
+    #
+    # A database of fewer rules is both faster to classify files against and
+    # uses less memory. Files that match none of the rules are still
+    # classified by the checks built into the _Magic_ library, such as
+    # "text/plain" for text, and "application/octet-stream" otherwise.
+    #
+    # The database is compiled in a temporary directory created next to the
+    # output, and then renamed to it, thus anything using the database at
+    # that path, such as a Magic::Database, never sees it partly written.
+    # The current working directory is left as it is.
+    #
+    # Example:
+    #
+    #    Magic.compile_subset('/usr/share/file/magic', mime_types: ['image/*', 'application/pdf'], output: 'accepted.mgc') #=> "/srv/accepted.mgc"
+    #
+    #    magic = Magic.new('accepted.mgc')
+    #    magic.file('document.pdf', flags: Magic::MIME_TYPE)  #=> "application/pdf"
+    #
+    # See also: Magic#compile, Magic::compile and Magic::Database
+    #
+    def compile_subset(sources, mime_types:, output:)
+      require 'tmpdir'
+
+      raise ArgumentError, 'MIME types list cannot be empty' if Array(mime_types).empty?
+
+      subset = Subset.new(Array(sources))
+      entries = subset.select(Array(mime_types))
+
+      output = File.expand_path(File.path(output))
+      output += '.mgc' unless output.end_with?('.mgc')
+      name = File.basename(output, '.mgc')
+
+      Dir.mktmpdir('magic', File.dirname(output)) do |directory|
+        subset.write(File.join(directory, name), entries)
+        open {|magic| magic.compile(name, directory: directory) }
+
+        File.rename(File.join(directory, "#{name}.mgc"), output)
+      end
+
+      output
+    end
+
     #
     # call-seq:
     #    Magic.file( object )          -> string or array
     #    Magic.file( string )          -> string or array
     #    Magic.file( string, integer ) -> string or array
     #
-    # See also:
+    # Uses a _Magic_ object of the current Ractor kept for the class-level
+    # methods and the core extensions, thus the database is loaded only once
+    # rather than on every call. It is separate from Magic::default, thus
+    # changes made to the default object do not affect it. Nothing is loaded
+    # when Magic::do_not_auto_load is set.
+    #
+    # See also: Magic::preload!, Magic::buffer and Magic::descriptor
     #
     def file(path, flags = Magic::MIME)
-      open(flags).file(path)
+      shared.file(path, flags: flags)
     end
 
     #
@@ -167,10 +228,10 @@ def file(path, flags = Magic::MIME)
     #    Magic.buffer( string )          -> string or array
     #    Magic.buffer( string, integer ) -> string or array
     #
-    # See also:
+    # See also: Magic::preload!, Magic::file and Magic::descriptor
     #
     def buffer(buffer, flags = Magic::MIME)
-      open(flags).buffer(buffer)
+      shared.buffer(buffer, flags: flags)
     end
 
     #
@@ -179,14 +240,67 @@ def buffer(buffer, flags = Magic::MIME)
     #    Magic.descriptor( integer )          -> string or array
     #    Magic.descriptor( integer, integer ) -> string or array
     #
-    # See also:
+    # See also: Magic::preload!, Magic::file and Magic::buffer
     #
     def descriptor(fd, flags = Magic::MIME)
-      open(flags).descriptor(fd)
+      shared.descriptor(fd, flags: flags)
     end
 
     alias_method :fd, :descriptor
 
+    #
+    # call-seq:
+    #    Magic.parallel_map( array )                                 -> array
+    #    Magic.parallel_map( array, flags: integer )                 -> array
+    #    Magic.parallel_map( array, flags: integer, ractors: integer ) -> array
+    #
+    # Returns the results of Magic#file for every path in the array, in
+    # the same order. The paths are split into contiguous slices, and each
+    # slice is processed by a separate Ractor with its own Magic object, so
+    # that large batches can use every available processor.
+    #
+    # The number of Ractors defaults to the number of available processors,
+    # and the paths are processed in the current Ractor when only one would
+    # be used, or when Ractors are not supported.
+    #
+    # Example:
+    #
+    #    Magic.parallel_map(Dir['*.png'], flags: Magic::MIME_TYPE) #=> ["image/png", ...]
+    #
+    # See also: Magic::default and Magic::Pool
+    #
+    def parallel_map(paths, flags: Magic::NONE, ractors: nil)
+      paths = paths.map {|path| File.path(path) }
+
+      unless ractors
+        require 'etc'
+        ractors = Etc.nprocessors
+      end
+
+      ractors = [ractors.to_i, paths.size].min
+
+      if ractors <= 1 || !defined?(::Ractor)
+        return open(flags) {|magic| paths.map {|path| magic.file(path) } }
+      end
+
+      size = (paths.size + ractors - 1) / ractors
+
+      workers = paths.each_slice(size).map do |slice|
+        ::Ractor.new(slice, flags) do |slice, flags|
+          Magic.open(flags) {|magic| slice.map {|path| magic.file(path) } }
+        rescue => error
+          error
+        end
+      end
+
+      workers.flat_map do |worker|
+        results = worker.respond_to?(:value) ? worker.value : worker.take
+        raise results if results.is_a?(Exception)
+
+        results
+      end
+    end
+
     private
 
     def default_paths
@@ -7,10 +7,10 @@ class << self
     #    File.magic( object ) -> string or array
     #    File.magic( string ) -> string or array
     #
-    # See also: File::mime and File::type
+    # See also: File::mime, File::type and Magic::file
     #
     def magic(path, flags = Magic::NONE)
-      Magic.open(flags) {|mgc| mgc.file(path) }
+      Magic.file(path, flags)
     end
 
     #
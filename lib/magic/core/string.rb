@@ -5,10 +5,10 @@ class String
   # call-seq:
   #    string.magic -> string or array
   #
-  # See also: String#mime and String#type
+  # See also: String#mime, String#type and Magic::buffer
   #
   def magic(flags = Magic::NONE)
-    Magic.open(flags) {|mgc| mgc.buffer(self) }
+    Magic.buffer(self, flags)
   end
 
   #
@@ -0,0 +1,98 @@
+# frozen_string_literal: true
+
+class Magic
+  #
+  # Selects the entries of _Magic_ database source files that can produce
+  # any of the given MIME types, together with the named entries they use.
+  #
+  # An entry is a top-level rule with all of the rules nested beneath it,
+  # and is either kept or dropped as a whole, thus the rules that remain
+  # behave exactly as they did in the complete database.
+  #
+  class Subset # :nodoc:
+    Entry = Struct.new(:lines, :mime_types, :name, :uses)
+
+    def initialize(sources)
+      @entries = sources.flat_map {|source| files(source) }.flat_map {|path| parse(path) }
+      @names = @entries.each_with_object({}) {|entry, names| names[entry.name] ||= entry if entry.name }
+    end
+
+    def select(mime_types)
+      patterns = mime_types.map {|type| type.to_s.end_with?('/*') ? type.to_s.chomp('*') : type.to_s }
+      matches = ->(type) { patterns.any? {|pattern| pattern.end_with?('/') ? type.start_with?(pattern) : type == pattern } }
+
+      selected = @entries.reject(&:name).select {|entry| produces(entry).any?(&matches) }
+
+      required = {}
+      pending = selected.flat_map(&:uses)
+      until pending.empty?
+        name = pending.shift
+        next if required.key?(name) || !@names.key?(name)
+
+        required[name] = true
+        pending.concat(@names[name].uses)
+      end
+
+      kept = selected.each_with_object({}.compare_by_identity) {|entry, hash| hash[entry] = true }
+      @entries.select {|entry| kept.key?(entry) || @names[entry.name].equal?(entry) && required.key?(entry.name) }
+    end
+
+    def write(path, entries)
+      File.open(path, 'w') do |file|
+        entries.each {|entry| file.puts(entry.lines, '') }
+      end
+    end
+
+    private
+
+    # Returns the MIME types an entry can produce, including those of the
+    # named entries it uses, which in turn can use other named entries.
+    def produces(entry, seen = {})
+      entry.uses.each_with_object(entry.mime_types.dup) do |name, types|
+        next if seen.key?(name) || !@names.key?(name)
+
+        seen[name] = true
+        types.concat(produces(@names[name], seen))
+      end
+    end
+
+    # The Magic library loads every file of a directory, in sorted order.
+    def files(source)
+      source = File.path(source)
+      return [source] unless File.directory?(source)
+
+      Dir.children(source).sort.map {|name| File.join(source, name) }.select {|path| File.file?(path) }
+    end
+
+    def parse(path)
+      entries = []
+
+      File.foreach(path, mode: 'rb') do |line|
+        line = line.chomp
+        next if line.strip.empty? || line.start_with?('#')
+
+        if line.start_with?('!:')
+          key, value = line[2..].split(/\s+/, 2)
+          entries.last.mime_types << value.strip if entries.last && key == 'mime' && value
+          entries.last&.lines&.push(line)
+          next
+        end
+
+        level = line[/\A>*/].size
+        _, type, test = line.sub(/\A>*/, '').split(/\s+/, 4)
+
+        if level.zero?
+          entries << Entry.new([], [], nil, [])
+          entries.last.name = test if type == 'name'
+        end
+
+        next unless entries.last
+
+        entries.last.uses << test.sub(/\A\\\^/, '') if type == 'use' && test
+        entries.last.lines << line
+      end
+
+      entries
+    end
+  end
+end
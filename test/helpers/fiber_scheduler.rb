@@ -0,0 +1,113 @@
+# frozen_string_literal: true
+
+#
+# A minimal Fiber scheduler, enough to run non-blocking fibers that wait
+# for threads, sleep and do simple I/O.
+#
+class MagicTestFiberScheduler
+  def initialize
+    @readable = {}
+    @writable = {}
+    @waiting = {}
+    @blocked = 0
+    @unblocked = []
+    @lock = Thread::Mutex.new
+    @urgent = IO.pipe
+  end
+
+  def run
+    until @readable.empty? && @writable.empty? && @waiting.empty? && @blocked.zero?
+      readable, writable = IO.select(@readable.keys + [@urgent.first], @writable.keys, [], timeout)
+
+      selected = {}
+
+      readable&.each do |io|
+        if io == @urgent.first
+          io.read_nonblock(1024, exception: false)
+        elsif (fiber = @readable.delete(io))
+          selected[fiber] = IO::READABLE
+        end
+      end
+
+      writable&.each do |io|
+        if (fiber = @writable.delete(io))
+          selected[fiber] = (selected[fiber] || 0) | IO::WRITABLE
+        end
+      end
+
+      selected.each {|fiber, events| fiber.resume(events) }
+
+      now = clock
+      @waiting.select {|_, deadline| deadline <= now }.each_key do |fiber|
+        fiber.resume if fiber.alive?
+      end
+
+      unblocked = @lock.synchronize { @unblocked.slice!(0..-1) }
+      unblocked.each {|fiber| fiber.resume if fiber.alive? }
+    end
+  end
+
+  def close
+    run
+  ensure
+    @urgent.each(&:close)
+  end
+
+  def fiber(&block)
+    fiber = Fiber.new(blocking: false, &block)
+    fiber.resume
+    fiber
+  end
+
+  def io_wait(io, events, _timeout)
+    fiber = Fiber.current
+
+    @readable[io] = fiber if events & IO::READABLE != 0
+    @writable[io] = fiber if events & IO::WRITABLE != 0
+
+    Fiber.yield
+  ensure
+    @readable.delete(io)
+    @writable.delete(io)
+  end
+
+  def kernel_sleep(duration = nil)
+    block(:sleep, duration)
+  end
+
+  def block(_blocker, timeout = nil)
+    fiber = Fiber.current
+
+    if timeout
+      @waiting[fiber] = clock + timeout
+      begin
+        Fiber.yield
+      ensure
+        @waiting.delete(fiber)
+      end
+    else
+      @blocked += 1
+      begin
+        Fiber.yield
+      ensure
+        @blocked -= 1
+      end
+    end
+  end
+
+  def unblock(_blocker, fiber)
+    @lock.synchronize { @unblocked << fiber }
+    @urgent.last.write_nonblock('.', exception: false)
+  end
+
+  private
+
+  def timeout
+    deadline = @waiting.values.min
+    deadline && [deadline - clock, 0].max
+  end
+
+  def clock
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+end
@@ -45,6 +45,46 @@ def with_fixtures(fixtures: 'fixtures', &block)
     end
   end
 
+  def count_allocations
+    GC.disable
+    before = GC.stat(:total_allocated_objects)
+    yield
+    GC.stat(:total_allocated_objects) - before
+  ensure
+    GC.enable
+  end
+
+  # Runs the block in a child process, where available, and returns its
+  # value, or raises the exception it raised. Ractors leave threads behind
+  # that a later fork can wait on forever in the child with Ruby 3.3.0,
+  # thus tests using them must not run in the process that runs the rest.
+  def in_child_process
+    return yield unless Process.respond_to?(:fork)
+
+    IO.pipe do |reader, writer|
+      pid = fork do
+        reader.close
+        result = begin
+          [:value, yield]
+        rescue Exception => error
+          [:error, error]
+        end
+        writer.write(Marshal.dump(result))
+        writer.close
+        exit!(0)
+      end
+
+      writer.close
+      result = reader.read
+      Process.wait(pid)
+
+      kind, value = Marshal.load(result)
+      raise value if kind == :error
+
+      value
+    end
+  end
+
   def with_env(env, &blk)
     before = ENV.to_h.dup
     env.each { |k, v| ENV[k] = v }
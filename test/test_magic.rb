@@ -4,6 +4,7 @@
 require 'magic'
 
 require_relative 'helpers/magic_test_helper'
+require_relative 'helpers/fiber_scheduler'
 
 class MagicTest < Test::Unit::TestCase
   include MagicTestHelpers
@@ -22,10 +23,14 @@ def test_magic_singleton_methods
       :encoding,
       :compile,
       :check,
+      :compile_subset,
       :file,
       :buffer,
       :descriptor,
       :fd,
+      :default,
+      :preload!,
+      :parallel_map,
       :version,
       :version_array,
       :version_string,
@@ -97,12 +102,36 @@ def test_magic_instance_methods
       :flags_names,
       :flags_to_a,
       :file,
+      :files,
       :buffer,
       :descriptor,
       :fd,
+      :identify,
+      :cache_size,
+      :cache_size=,
+      :cache_stats,
+      :buffer_cache_size,
+      :buffer_cache_size=,
+      :buffer_cache_stats,
+      :shared_cache,
+      :shared_cache=,
+      :shared_cache_stats,
+      :fast_path,
+      :fast_path=,
+      :fast_path_stats,
+      :triage,
+      :triage=,
+      :triage_stats,
+      :progressive,
+      :progressive=,
+      :progressive_stats,
+      :watch,
+      :watched,
+      :unwatch,
       :load,
       :load_files,
       :load_buffers,
+      :reload,
       :loaded?,
       :compile,
       :check,
@@ -515,40 +544,1083 @@ def test_magic_file_with_MAGIC_CONTINUE_flag
   def test_magic_file_with_EXTENSION_flag
   end
 
+  def test_magic_file_with_flags_changing
+    flags = [
+      Magic::NONE, Magic::MIME_TYPE, Magic::MIME_ENCODING, Magic::MIME,
+      Magic::EXTENSION, Magic::APPLE, Magic::CONTINUE, Magic::RAW,
+      Magic::NO_CHECK_COMPRESS, Magic::NO_CHECK_ELF
+    ]
+
+    with_fixtures do
+      expected = flags.map do |flag|
+        @magic.flags = flag
+        @magic.file('ruby.png')
+      end
+
+      # Using more sets of flags than handles are kept for, twice.
+      2.times do
+        obtained = flags.map do |flag|
+          @magic.flags = flag
+          [@magic.file('ruby.png'), @magic.flags]
+        end
+
+        assert_equal(expected.zip(flags), obtained)
+      end
+    end
+  end
+
+  def test_magic_file_with_flags_argument
+    with_fixtures do
+      @magic.flags = Magic::MIME_TYPE
+
+      assert_equal('image/png', @magic.file('ruby.png'))
+      assert_match(%r{^PNG image data}, @magic.file('ruby.png', flags: Magic::NONE))
+      assert_equal('png', @magic.file('ruby.png', flags: Magic::EXTENSION))
+      assert_equal('image/png', @magic.file('ruby.png', flags: nil))
+
+      File.open('ruby.png') do |file|
+        assert_equal('binary', @magic.file(file, flags: Magic::MIME_ENCODING))
+      end
+
+      assert_equal(Magic::MIME_TYPE, @magic.flags)
+      assert_equal('image/png', @magic.file('ruby.png'))
+    end
+  end
+
+  def test_magic_file_with_flags_argument_invalid
+    error = assert_raise Magic::FlagsError do
+      @magic.file('ruby.png', flags: -1)
+    end
+
+    assert_equal('unknown or invalid flag specified', error.message)
+
+    assert_raise TypeError do
+      @magic.file('ruby.png', flags: 'MIME')
+    end
+
+    assert_raise ArgumentError do
+      @magic.file('ruby.png', mime: true)
+    end
+  end
+
+  def test_magic_file_with_flags_argument_and_threads
+    with_fixtures do
+      expected = {
+        Magic::MIME_TYPE => 'image/png',
+        Magic::MIME_ENCODING => 'binary',
+        Magic::EXTENSION => 'png'
+      }
+
+      obtained = expected.keys.map do |flags|
+        Thread.new do
+          Array.new(20) { @magic.file('ruby.png', flags: flags) }.uniq
+        end
+      end.map(&:value)
+
+      assert_equal(expected.values.map {|v| [v] }, obtained)
+      assert_equal(Magic::NONE, @magic.flags)
+    end
+  end
+
+  def test_magic_file_with_fiber_scheduler
+    omit_unless(Fiber.respond_to?(:set_scheduler), "Platform does not support Fiber scheduler")
+
+    with_fixtures do
+      @magic.flags = Magic::MIME_TYPE
+
+      results = []
+      Thread.new do
+        Fiber.set_scheduler(MagicTestFiberScheduler.new)
+
+        Fiber.schedule { results << @magic.file('ruby.png') }
+        Fiber.schedule { results << @magic.buffer(File.binread('ruby.jpg')) }
+      end.join
+
+      assert_equal(['image/png', 'image/jpeg'].sort, results.sort)
+    end
+  end
+
+  def test_magic_descriptor_with_fiber_scheduler
+    omit_unless(Fiber.respond_to?(:set_scheduler), "Platform does not support Fiber scheduler")
+
+    with_fixtures do
+      @magic.flags = Magic::MIME_TYPE
+
+      require 'io/nonblock'
+
+      result = nil
+      reader, writer = IO.pipe
+      reader.nonblock = false
+      buffer = File.binread('ruby.png', 4096)
+
+      # The reading fiber would block the scheduler forever, never letting
+      # the writing fiber run, should the read not be moved off the thread.
+      thread = Thread.new do
+        Fiber.set_scheduler(MagicTestFiberScheduler.new)
+
+        Fiber.schedule { result = @magic.descriptor(reader.fileno) }
+        Fiber.schedule do
+          writer.write(buffer)
+          writer.close
+        end
+      end
+
+      unless thread.join(10)
+        writer.close unless writer.closed?
+        thread.join
+      end
+
+      reader.close
+
+      assert_equal('image/png', result)
+    end
+  end
+
+  def test_magic_lock_with_threads
+    with_fixtures do
+      @magic.flags = Magic::MIME_TYPE
+
+      threads = 8.times.map do |i|
+        Thread.new do
+          50.times.map do |n|
+            @magic.get_parameter(Magic::PARAM_BYTES_MAX)
+            @magic.file((i + n).even? ? 'ruby.png' : 'ruby.jpg')
+          end
+        end
+      end
+
+      threads.each_with_index do |thread, i|
+        expected = 50.times.map {|n| (i + n).even? ? 'image/png' : 'image/jpeg' }
+        assert_equal(expected, thread.value)
+      end
+    end
+  end
+
+  def test_magic_lock_with_fiber_scheduler
+    omit_unless(Fiber.respond_to?(:set_scheduler), "Platform does not support Fiber scheduler")
+
+    require 'io/nonblock'
+
+    with_fixtures do
+      @magic.flags = Magic::MIME_TYPE
+
+      results = []
+      pipes = 2.times.map { IO.pipe }
+      pipes.each {|reader, _| reader.nonblock = false }
+      buffer = File.binread('ruby.png', 4096)
+
+      # The second fiber has to wait for the lock held by the first one,
+      # and must not block the thread while doing so, as otherwise the
+      # last fiber would never get to write the data both are waiting for.
+      thread = Thread.new do
+        Fiber.set_scheduler(MagicTestFiberScheduler.new)
+
+        pipes.each do |reader, _|
+          Fiber.schedule { results << @magic.descriptor(reader.fileno) }
+        end
+
+        Fiber.schedule do
+          pipes.each do |_, writer|
+            writer.write(buffer)
+            writer.close
+          end
+        end
+      end
+
+      unless thread.join(10)
+        pipes.each {|_, writer| writer.close unless writer.closed? }
+        thread.join
+      end
+
+      pipes.each {|reader, _| reader.close }
+
+      assert_equal(['image/png', 'image/png'], results)
+    end
+  end
+
+  def test_magic_descriptor_with_fiber_scheduler_interrupted
+    omit_unless(Fiber.respond_to?(:set_scheduler), "Platform does not support Fiber scheduler")
+
+    require 'io/nonblock'
+
+    with_fixtures do
+      @magic.flags = Magic::MIME_TYPE
+
+      results = []
+      reader, writer = IO.pipe
+      reader.nonblock = false
+      buffer = File.binread('ruby.png', 4096)
+
+      # The interrupted fiber still waits for the thread reading the pipe
+      # to finish, also when interrupted again meanwhile, and only then
+      # raises the first exception, leaving the object usable.
+      thread = Thread.new do
+        Fiber.set_scheduler(MagicTestFiberScheduler.new)
+
+        fiber = Fiber.schedule do
+          begin
+            @magic.descriptor(reader.fileno)
+          rescue RuntimeError => error
+            results << error.message
+          end
+
+          results << $!
+          results << @magic.buffer(buffer)
+        end
+
+        Fiber.schedule do
+          fiber.raise(RuntimeError, 'interrupted')
+          fiber.raise(RuntimeError, 'interrupted again')
+          writer.write(buffer)
+          writer.close
+        end
+      end
+
+      unless thread.join(10)
+        writer.close unless writer.closed?
+        thread.join
+      end
+
+      reader.close
+
+      assert_equal(['interrupted', nil, 'image/png'], results)
+    end
+  end
+
+  def test_magic_lock_after_fork
+    omit_unless(Process.respond_to?(:fork), "Platform does not support fork")
+
+    require 'io/nonblock'
+
+    with_fixtures do
+      @magic.flags = Magic::MIME_TYPE
+
+      reader, writer = IO.pipe
+      reader.nonblock = false
+
+      # Hold the lock in a different thread, which does not exist in the
+      # child process, and thus could never release it there.
+      thread = Thread.new { @magic.descriptor(reader.fileno) }
+      Thread.pass until thread.status == 'sleep' || !thread.alive?
+
+      pid = fork do
+        exit!(@magic.file('ruby.png') == 'image/png' ? 0 : 1)
+      end
+
+      status = nil
+      100.times do
+        break if (status = Process.wait2(pid, Process::WNOHANG))
+
+        sleep 0.1
+      end
+
+      unless status
+        Process.kill(:KILL, pid)
+        Process.wait(pid)
+      end
+
+      writer.close
+      thread.join
+      reader.close
+
+      assert_true(status && status.last.success?)
+    end
+  end
+
+  def test_magic_error_output_with_threads
+    require 'io/nonblock'
+
+    reader, writer = IO.pipe
+    reader.nonblock = false
+
+    output = capture_stderr(children: true) do
+      # Keep a query running without the GVL, while a different thread
+      # writes to the standard error.
+      thread = Thread.new { @magic.descriptor(reader.fileno) }
+      Thread.pass until thread.status == 'sleep' || !thread.alive?
+      sleep 0.1
+
+      $stderr.syswrite("written while querying\n")
+
+      writer.close
+      thread.join
+    end
+
+    reader.close
+
+    assert_equal("written while querying\n", output)
+  end
+
+  def test_magic_files
+    with_fixtures do
+      @magic.load('png-fake.magic')
+
+      paths = ['ruby.png', 'ruby.jpg'] * 8
+      expected = paths.map {|path| @magic.file(path) }
+
+      [1, 2, 4].each do |threads|
+        assert_equal(expected, @magic.files(paths, threads: threads))
+      end
+
+      assert_equal(expected, @magic.files(paths))
+    end
+  end
+
+  def test_magic_files_with_path_like_arguments
+    require 'pathname'
+
+    with_fixtures do
+      @magic.flags = Magic::MIME_TYPE
+
+      results = File.open('ruby.jpg') do |file|
+        @magic.files([Pathname.new('ruby.png'), file])
+      end
+
+      assert_equal(['image/png', 'image/jpeg'], results)
+    end
+  end
+
+  def test_magic_files_with_array_changed_by_to_path
+    with_fixtures do
+      @magic.flags = Magic::MIME_TYPE
+
+      paths = ['ruby.png'] * 64
+      path = Object.new
+      path.define_singleton_method(:to_path) do
+        paths.fill(nil).pop(32)
+        'ruby.jpg'
+      end
+      paths[0] = path
+
+      assert_equal(['image/jpeg'] + ['image/png'] * 63, @magic.files(paths))
+      assert_equal([nil] * 32, paths)
+    end
+  end
+
+  def test_magic_files_with_errors
+    with_fixtures do
+      @magic.flags = Magic::MIME_TYPE
+
+      results = @magic.files(['ruby.png', 'does/not/exist'], threads: 2)
+
+      assert_equal('image/png', results.first)
+      assert_kind_of(Magic::MagicError, results.last)
+      assert_match(%r{^cannot stat `does/not/exist'}, results.last.message)
+    end
+  end
+
+  def test_magic_files_with_MAGIC_CONTINUE_flag
+    with_fixtures do
+      @magic.load('png-fake.magic', 'png.magic')
+      @magic.flags = Magic::CONTINUE
+
+      expected = @magic.file('ruby.png')
+
+      assert_kind_of(Array, expected)
+      assert_equal([expected, expected], @magic.files(['ruby.png'] * 2, threads: 2))
+    end
+  end
+
+  def test_magic_files_with_invalid_arguments
+    assert_equal([], @magic.files([]))
+
+    error = assert_raise ArgumentError do
+      @magic.files(['ruby.png'], threads: 0)
+    end
+
+    assert_equal('number of threads must be greater than zero', error.message)
+
+    assert_raise TypeError do
+      @magic.files([nil])
+    end
+  end
+
   def test_magic_buffer
   end
 
-  def test_magic_buffer_with_magic_library_not_loaded
+  def test_magic_buffer_result_frozen
+    with_fixtures do
+      buffer = File.binread('ruby.png')
+
+      @magic.flags = Magic::MIME_TYPE
+      obtained = @magic.buffer(buffer)
+
+      assert_equal('image/png', obtained)
+      assert_true(obtained.frozen?)
+      assert_same(obtained, @magic.buffer(buffer))
+    end
+  end
+
+  def test_magic_buffer_allocations
+    omit_unless(RUBY_VERSION >= '3.0', 'Platform does not support interned strings')
+
+    with_fixtures do
+      buffer = File.binread('ruby.png').freeze
+
+      @magic.flags = Magic::MIME_TYPE
+      @magic.buffer(buffer)
+
+      # Far fewer allocations than calls, thus none per call.
+      assert_operator(count_allocations { 1000.times { @magic.buffer(buffer) } }, :<, 10)
+
+      # Only the array holding all the matches is allocated.
+      @magic.flags = Magic::MIME_TYPE | Magic::CONTINUE
+      @magic.buffer(buffer)
+
+      assert_operator(count_allocations { 1000.times { @magic.buffer(buffer) } }, :<, 1010)
+    end
+  end
+
+  def test_magic_file_allocations_with_EXTENSION_flag
+    omit_unless(RUBY_VERSION >= '3.0', 'Platform does not support interned strings')
+
+    with_fixtures do
+      @magic.flags = Magic::EXTENSION
+
+      expected = @magic.file('ruby.jpg')
+      assert_equal(%w[jpeg jpg jpe jfif], expected)
+      assert_true(expected.all?(&:frozen?))
+
+      # Only the array holding the extensions is allocated.
+      assert_operator(count_allocations { 1000.times { @magic.file('ruby.jpg') } }, :<, 1010)
+    end
+  end
+
+  def test_magic_file_with_long_result
+    require 'tmpdir'
+
+    # Each description is limited in length, thus it takes several.
+    lines = ["0\tstring\t\\x89PNG\tRuby Gem image"]
+    lines += Array.new(8) {|i| ">0\tbyte\tx\t#{i.to_s * 60}" }
+    description = (['Ruby Gem image'] + Array.new(8) {|i| i.to_s * 60 }).join(' ')
+
+    Dir.mktmpdir do |directory|
+      source = File.join(directory, 'long.magic')
+      File.write(source, lines.join("\n") + "\n")
+
+      magic = Magic.new(source)
+      magic.cache_size = 8
+      magic.buffer_cache_size = 8
+
+      with_fixtures do
+        2.times do
+          assert_equal(description, magic.file('ruby.png'))
+          assert_equal(description, magic.buffer(File.binread('ruby.png')))
+        end
+      end
+    end
+  end
+
+  def test_magic_buffer_with_flags_argument
+    with_fixtures do
+      buffer = File.binread('ruby.png')
+
+      assert_equal('image/png', @magic.buffer(buffer, flags: Magic::MIME_TYPE))
+      assert_match(%r{^PNG image data}, @magic.buffer(buffer))
+      assert_equal(Magic::NONE, @magic.flags)
+    end
+  end
+
+  def test_magic_buffer_with_magic_library_not_loaded
+  end
+
+  def test_magic_buffer_with_nil_argument
+    error = assert_raise TypeError do
+      @magic.buffer nil
+    end
+
+    assert_equal('wrong argument type nil (expected String)', error.message)
+  end
+
+  def test_magic_buffer_argument_with_NULL
+    assert_nothing_raised do
+      @magic.buffer "string\0value"
+    end
+  end
+
+  def test_magic_buffer_with_MAGIC_CONTINUE_flag
+  end
+
+  def test_magic_buffer_with_EXTENSION_flag
+  end
+
+  def test_magic_buffer_with_threads
+    with_fixtures do
+      @magic.load('png-fake.magic')
+
+      buffer = File.binread('ruby.png')
+      threads = 4.times.map do
+        Thread.new { 8.times.map { @magic.buffer(buffer) } }
+      end
+
+      threads.map(&:value).flatten.each do |result|
+        assert_match(%r{^Ruby Gem image}, result)
+      end
+    end
+  end
+
+  def test_magic_buffer_with_modified_string
+    with_fixtures do
+      @magic.load('png-fake.magic')
+
+      buffer = File.binread('ruby.png')
+      assert_match(%r{^Ruby Gem image}, @magic.buffer(buffer))
+
+      buffer.replace('Ruby')
+      assert_not_match(%r{^Ruby Gem image}, @magic.buffer(buffer))
+    end
+  end
+
+  def test_magic_descriptor
+    with_fixtures do
+      @magic.load('png-fake.magic')
+
+      File.open('ruby.png') do |file|
+        assert_match(%r{^Ruby Gem image}, @magic.descriptor(file.fileno))
+        assert_false(file.closed?)
+      end
+    end
+  end
+
+  def test_magic_descriptor_with_flags_argument
+    with_fixtures do
+      File.open('ruby.png') do |file|
+        assert_equal('image/png', @magic.descriptor(file.fileno, flags: Magic::MIME_TYPE))
+        assert_equal(Magic::NONE, @magic.flags)
+      end
+    end
+  end
+
+  def test_magic_identify
+    with_fixtures do
+      @magic.flags = Magic::MIME
+
+      obtained = @magic.identify('ruby.jpg')
+
+      assert_equal({
+        description: @magic.file('ruby.jpg', flags: Magic::NONE),
+        mime_type: 'image/jpeg',
+        encoding: 'binary',
+        extensions: %w[jpeg jpg jpe jfif]
+      }, obtained)
+
+      assert_equal(Magic::MIME, @magic.flags)
+    end
+  end
+
+  def test_magic_identify_with_IO_like_argument
+    with_fixtures do
+      File.open('ruby.png') do |file|
+        file.read(1)
+        file.rewind
+
+        obtained = @magic.identify(file)
+
+        assert_equal('image/png', obtained[:mime_type])
+        assert_equal(%w[png], obtained[:extensions])
+        assert_equal(0, file.pos)
+      end
+    end
+  end
+
+  def test_magic_identify_with_pipe
+    require 'io/nonblock'
+
+    with_fixtures do
+      IO.pipe do |reader, writer|
+        reader.nonblock = false
+        writer.write(File.binread('ruby.png', 4096))
+        writer.close
+
+        assert_equal('image/png', @magic.identify(reader)[:mime_type])
+      end
+    end
+  end
+
+  def test_magic_identify_with_special_files
+    with_fixtures do |path|
+      expected = {
+        description: 'directory',
+        mime_type: 'inode/directory',
+        encoding: 'binary',
+        extensions: []
+      }
+
+      assert_equal(expected, @magic.identify(path))
+    end
+  end
+
+  def test_magic_identify_with_symbolic_link
+    require 'tmpdir'
+
+    with_fixtures do |fixtures|
+      Dir.mktmpdir do |directory|
+        path = File.join(directory, 'ruby.png')
+        File.symlink(File.join(fixtures, 'ruby.png'), path)
+
+        obtained = @magic.identify(path)
+
+        assert_equal(@magic.file(path, flags: Magic::NONE), obtained[:description])
+        assert_equal('inode/symlink', obtained[:mime_type])
+        assert_match(%r{^symbolic link to}, obtained[:description])
+
+        @magic.flags = Magic::SYMLINK
+
+        assert_equal('image/png', @magic.identify(path)[:mime_type])
+      end
+    end
+  end
+
+  def test_magic_identify_with_missing_file
+    error = assert_raise Magic::MagicError do
+      @magic.identify('does/not/exist')
+    end
+
+    assert_match(%r{does/not/exist}, error.message)
+  end
+
+  def test_magic_cache_size
+    assert_equal(0, @magic.cache_size)
+
+    @magic.cache_size = 16
+    assert_equal(16, @magic.cache_size)
+    assert_equal({ hits: 0, misses: 0, size: 0, capacity: 16 }, @magic.cache_stats)
+
+    @magic.cache_size = 0
+    assert_equal(0, @magic.cache_size)
+
+    assert_raise ArgumentError do
+      @magic.cache_size = -1
+    end
+
+    assert_raise TypeError do
+      @magic.cache_size = '16'
+    end
+  end
+
+  def test_magic_file_with_cache
+    with_fixtures do
+      expected = @magic.file('ruby.png')
+
+      @magic.cache_size = 16
+      3.times { assert_equal(expected, @magic.file('ruby.png')) }
+      assert_equal('image/png', @magic.file('ruby.png', flags: Magic::MIME_TYPE))
+
+      assert_equal({ hits: 2, misses: 2, size: 2, capacity: 16 }, @magic.cache_stats)
+    end
+  end
+
+  def test_magic_file_with_cache_and_modified_file
+    require 'tmpdir'
+
+    @magic.cache_size = 16
+
+    Dir.mktmpdir do |directory|
+      path = File.join(directory, 'file')
+
+      File.binwrite(path, File.binread(File.join('test', 'fixtures', 'ruby.png')))
+      assert_match(%r{^PNG image data}, @magic.file(path))
+
+      File.binwrite(path, "#!/bin/sh\necho 'Hello, World!'\n")
+      assert_match(%r{shell script}, @magic.file(path))
+    end
+
+    assert_equal(0, @magic.cache_stats[:hits])
+  end
+
+  def test_magic_file_with_cache_and_database_loaded
+    with_fixtures do
+      @magic.cache_size = 16
+
+      assert_match(%r{^PNG image data}, @magic.file('ruby.png'))
+
+      @magic.load('png-fake.magic')
+      assert_match(%r{^Ruby Gem image}, @magic.file('ruby.png'))
+    end
+  end
+
+  def test_magic_file_with_cache_full
+    with_fixtures do
+      @magic.cache_size = 1
+
+      @magic.file('ruby.png')
+      @magic.file('ruby.jpg')
+      @magic.file('ruby.png')
+
+      assert_equal({ hits: 0, misses: 3, size: 1, capacity: 1 }, @magic.cache_stats)
+    end
+  end
+
+  def test_magic_buffer_with_cache
+    with_fixtures do
+      buffer = File.binread('ruby.png')
+      expected = @magic.buffer(buffer)
+
+      @magic.buffer_cache_size = 16
+      assert_equal(16, @magic.buffer_cache_size)
+
+      3.times { assert_equal(expected, @magic.buffer(buffer.dup)) }
+      assert_equal('image/png', @magic.buffer(buffer, flags: Magic::MIME_TYPE))
+      assert_match(%r{^ASCII text}, @magic.buffer("Hello, World!\n"))
+
+      assert_equal({ hits: 2, misses: 3, size: 3, capacity: 16 }, @magic.buffer_cache_stats)
+      assert_equal(0, @magic.cache_stats[:misses])
+
+      @magic.load('png-fake.magic')
+      assert_match(%r{^Ruby Gem image}, @magic.buffer(buffer))
+
+      @magic.buffer_cache_size = 0
+      assert_equal({ hits: 0, misses: 0, size: 0, capacity: 0 }, @magic.buffer_cache_stats)
+    end
+  end
+
+  def test_magic_buffer_with_cache_and_differing_middle
+    # Both buffers are the same at either end, past the bytes examined of
+    # files, but the Magic library looks at the whole buffer.
+    empty = "\x00".b * 40_000
+    image = empty.dup
+    image[32_769, 5] = 'CD001'
+
+    @magic.set_parameter(Magic::PARAM_BYTES_MAX, 4096)
+    @magic.buffer_cache_size = 16
+
+    assert_equal('data', @magic.buffer(empty))
+    assert_match(%r{^ISO 9660 CD-ROM filesystem data}, @magic.buffer(image))
+    assert_equal(0, @magic.buffer_cache_stats[:hits])
+  end
+
+  def test_magic_file_with_shared_cache
+    omit_unless(Process.respond_to?(:fork), "Platform does not support fork")
+
+    require 'tmpdir'
+
+    with_fixtures do
+      Dir.mktmpdir do |directory|
+        path = File.join(directory, 'magic.cache')
+        expected = @magic.file('ruby.png')
+
+        pid = fork do
+          magic = Magic.new
+          magic.shared_cache = path
+          exit!(magic.file('ruby.png') == expected ? 0 : 1)
+        end
+        Process.wait(pid)
+        assert_true($?.success?)
+
+        @magic.shared_cache = path
+        assert_equal(path, @magic.shared_cache)
+
+        assert_equal(expected, @magic.file('ruby.png'))
+        assert_equal({ hits: 1, misses: 0, size: 1, capacity: 16_384 }, @magic.shared_cache_stats)
+
+        # A different database never shares results.
+        @magic.load('png-fake.magic')
+        assert_match(%r{^Ruby Gem image}, @magic.file('ruby.png'))
+        assert_equal(2, @magic.shared_cache_stats[:size])
+
+        @magic.shared_cache = nil
+        assert_nil(@magic.shared_cache)
+      end
+    end
+  end
+
+  def test_magic_file_with_watch
+    omit_unless(RUBY_PLATFORM.include?('linux'), "Platform does not support inotify")
+
+    require 'tmpdir'
+
+    @magic.cache_size = 16
+
+    Dir.mktmpdir do |directory|
+      directory = File.realpath(directory)
+      path = File.join(directory, 'file')
+
+      File.binwrite(path, File.binread(File.join('test', 'fixtures', 'ruby.png')))
+
+      assert_equal([directory], @magic.watch(directory))
+      assert_equal([directory], @magic.watched)
+
+      2.times { assert_match(%r{^PNG image data}, @magic.file(path)) }
+      assert_equal(1, @magic.cache_stats[:hits])
+
+      # Changes made before a call are always seen by it.
+      20.times do
+        File.binwrite(path, "#!/bin/sh\necho 'Hello, World!'\n")
+        assert_match(%r{shell script}, @magic.file(path))
+
+        File.binwrite(path, File.binread(File.join('test', 'fixtures', 'ruby.png')))
+        assert_match(%r{^PNG image data}, @magic.file(path))
+      end
+
+      File.binwrite(path, "#!/bin/sh\necho 'Hello, World!'\n")
+
+      # New directories are watched as they are created.
+      Dir.mkdir(File.join(directory, 'other'))
+      assert_equal([directory, File.join(directory, 'other')], @magic.watched.sort)
+
+      # Moved directories are watched under their new path, if any.
+      File.rename(File.join(directory, 'other'), File.join(directory, 'moved'))
+      assert_equal([directory, File.join(directory, 'moved')], @magic.watched.sort)
+
+      Dir.mktmpdir do |elsewhere|
+        File.rename(File.join(directory, 'moved'), File.join(elsewhere, 'moved'))
+        assert_equal([directory], @magic.watched)
+      end
+
+      assert_nil(@magic.unwatch)
+      assert_equal([], @magic.watched)
+      assert_match(%r{shell script}, @magic.file(path))
+    end
+  end
+
+  def test_magic_shared_cache_with_invalid_file
+    require 'tmpdir'
+
+    Dir.mktmpdir do |directory|
+      path = File.join(directory, 'magic.cache')
+      File.write(path, 'Hello, World!')
+
+      assert_raise Errno::EINVAL do
+        @magic.shared_cache = path
+      end
+
+      assert_raise Errno::ENOENT do
+        @magic.shared_cache = File.join(directory, 'does/not/exist')
+      end
+    end
+  end
+
+  def test_magic_fast_path
+    assert_false(@magic.fast_path)
+
+    @magic.fast_path = true
+    assert_true(@magic.fast_path)
+
+    with_fixtures do
+      assert_match(%r{^PNG image data}, @magic.file('ruby.png'))
+      assert_equal({hits: 0, misses: 0}, @magic.fast_path_stats)
+
+      assert_equal('image/png', @magic.file('ruby.png', flags: Magic::MIME_TYPE))
+      assert_equal('image/jpeg', @magic.buffer(File.binread('ruby.jpg'), flags: Magic::MIME_TYPE))
+      assert_equal('text/plain', @magic.file('png.magic', flags: Magic::MIME_TYPE))
+      assert_equal({hits: 2, misses: 1}, @magic.fast_path_stats)
+    end
   end
 
-  def test_magic_buffer_with_nil_argument
-    error = assert_raise TypeError do
-      @magic.buffer nil
+  def test_magic_fast_path_matches_magic_library
+    zip = ->(name) { "PK\x03\x04\x14\x00\x00\x00\x08\x00".b + "\x00".b * 16 + [name.size, 0].pack('vv') + name }
+    ftyp = ->(brand) { [24].pack('N') + 'ftyp' + brand + "\x00".b * 4 + 'isommp41' }
+
+    buffers = [
+      "\x89PNG\r\n\x1a\n\x00\x00\x00\x0dIHDR".b,
+      "\xff\xd8\xff\xe0\x00\x10JFIF\x00".b,
+      'GIF89a',
+      "RIFF\x24\x00\x00\x00WEBPVP8L".b,
+      "%PDF-1.7\n",
+      zip.call('README.txt'),
+      zip.call('[Content_Types].xml'),
+      zip.call('mimetype') + 'application/epub+zip',
+      zip.call('doc.kml'),
+      "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03".b,
+      ftyp.call('isom'),
+      ftyp.call('heic'),
+      ftyp.call('qt  '),
+      "#!/bin/sh\necho\n"
+    ].map {|buffer| buffer.b + "\x00".b * 64 }
+
+    # Archives cut short, just past the name of the first entry.
+    buffers += [zip.call('README.txt'), zip.call('doc.kml') + "\x00".b * 4, zip.call('a' * 20) + "\x00".b]
+
+    expected = buffers.map {|buffer| @magic.buffer(buffer, flags: Magic::MIME_TYPE) }
+
+    @magic.fast_path = true
+    assert_equal(expected, buffers.map {|buffer| @magic.buffer(buffer, flags: Magic::MIME_TYPE) })
+    assert_equal({hits: 8, misses: 9}, @magic.fast_path_stats)
+  end
+
+  def test_magic_fast_path_with_truncated_and_corrupt_data
+    headers = [
+      "\x89PNG\r\n\x1a\n\x00\x00\x00\x0dIHDR\x00\x00\x01\x00".b,
+      "\xff\xd8\xff\xe0\x00\x10JFIF\x00".b,
+      "GIF89a\x10\x00\x10\x00".b,
+      "RIFF\x24\x00\x00\x00WEBPVP8L".b,
+      "\x1f\x8b\x08\x00\x00\x00\x00\x00".b,
+      [24].pack('N') + 'ftypisom' + "\x00".b * 4
+    ]
+
+    # Every header cut short, and with each of its leading bytes changed.
+    buffers = headers.flat_map do |header|
+      truncated = (1..header.size).map {|size| header[0, size] }
+      corrupt = (0...16).map do |i|
+        buffer = header + "\x00".b * 16
+        buffer.setbyte(i, buffer.getbyte(i) ^ 0x0a)
+        buffer
+      end
+
+      truncated + corrupt
     end
 
-    assert_equal('wrong argument type nil (expected String)', error.message)
+    expected = buffers.map {|buffer| @magic.buffer(buffer, flags: Magic::MIME_TYPE) }
+
+    @magic.fast_path = true
+    assert_equal(expected, buffers.map {|buffer| @magic.buffer(buffer, flags: Magic::MIME_TYPE) })
+    assert_equal('application/octet-stream', @magic.buffer("\x89PNG\r\n\x1a\n".b + "\x00".b * 26, flags: Magic::MIME_TYPE))
   end
 
-  def test_magic_buffer_argument_with_NULL
-    assert_nothing_raised do
-      @magic.buffer "string\0value"
+  def test_magic_triage
+    assert_false(@magic.triage)
+
+    @magic.triage = true
+    assert_true(@magic.triage)
+
+    with_fixtures do
+      assert_match(%r{^PNG image data}, @magic.file('ruby.png'))
+      assert_equal('us-ascii', @magic.file('png.magic', flags: Magic::MIME_ENCODING))
+      assert_equal('utf-8', @magic.buffer("caf\u00e9\n", flags: Magic::MIME_ENCODING))
+      assert_equal('iso-8859-1', @magic.buffer("caf\xe9\n".b, flags: Magic::MIME_ENCODING))
+      assert_equal({binary: 1, ascii: 1, utf8: 1, other: 1}, @magic.triage_stats)
+
+      @magic.file('ruby.png', flags: Magic::CONTINUE)
+      assert_equal({binary: 1, ascii: 1, utf8: 1, other: 1}, @magic.triage_stats)
     end
   end
 
-  def test_magic_buffer_with_MAGIC_CONTINUE_flag
+  def test_magic_triage_matches_magic_library
+    buffers = [
+      "\x7fELF\x02\x01\x01\x00".b + "\x00".b * 8 + "\x02\x00\x3e\x00".b + "\x00".b * 44,
+      "\x89PNG\r\n\x1a\n\x00\x00\x00\x0dIHDR".b,
+      "#!/bin/sh\necho\n",
+      "<!DOCTYPE html>\n<html></html>\n",
+      "{\"key\": \"value\"}\n",
+      "caf\u00e9 cr\u00e8me br\u00fbl\u00e9e\n",
+      "text followed by padding\n".b + "\x00".b * 16,
+      "\xff\xfeh\x00i\x00\n\x00".b,
+      "caf\xe9\n".b
+    ]
+
+    flags = [Magic::NONE, Magic::MIME, Magic::MIME_TYPE, Magic::MIME_ENCODING, Magic::EXTENSION]
+    expected = flags.map {|f| buffers.map {|buffer| @magic.buffer(buffer, flags: f) } }
+
+    @magic.triage = true
+    assert_equal(expected, flags.map {|f| buffers.map {|buffer| @magic.buffer(buffer, flags: f) } })
+    assert_equal({binary: 10, ascii: 15, utf8: 5, other: 15}, @magic.triage_stats)
   end
 
-  def test_magic_buffer_with_EXTENSION_flag
+  def test_magic_progressive
+    assert_false(@magic.progressive)
+
+    @magic.progressive = true
+    assert_true(@magic.progressive)
+
+    limit = @magic.get_parameter(Magic::PARAM_BYTES_MAX)
+
+    with_fixtures do
+      assert_match(%r{^PNG image data}, @magic.file('ruby.png'))
+      assert_equal('us-ascii', @magic.file('png.magic', flags: Magic::MIME_ENCODING))
+    end
+
+    assert_equal('ISO 9660 CD-ROM filesystem data', @magic.buffer("\x00".b * 32_769 + 'CD001'))
+    assert_equal('data', @magic.buffer(Random.new(1).bytes(80_000)))
+    assert_equal({4096 => 1, 65_536 => 1, max: 1}, @magic.progressive_stats)
+    assert_equal(limit, @magic.get_parameter(Magic::PARAM_BYTES_MAX))
   end
 
-  def test_magic_descriptor
+  def test_magic_progressive_with_generic_result
+    require 'tmpdir'
+
+    Dir.mktmpdir do |directory|
+      path = File.join(directory, 'iso')
+      File.binwrite(path, "\x00".b * 32_769 + 'CD001' + "\x00".b * 4096)
+
+      expected = @magic.file(path, flags: Magic::MIME_TYPE)
+
+      @magic.progressive = true
+      assert_equal(expected, @magic.file(path, flags: Magic::MIME_TYPE))
+      assert_equal({4096 => 0, 65_536 => 1, max: 0}, @magic.progressive_stats)
+    end
+  end
+
+  def test_magic_progressive_with_text
+    buffers = [
+      # Non-ASCII text past the first 4 KiB.
+      "<?xml version=\"1.0\"?>\n" + "<a>text</a>\n" * 400 + "<a>caf\u00e9</a>\n",
+      # Lines getting very long past the first 4 KiB.
+      "#include <stdio.h>\n" * 300 + 'x' * 400 + "\n",
+      # Text turning out to be binary past the first 4 KiB.
+      "#include <stdio.h>\n" * 300 + "\x00\x01\x02\xff".b * 16
+    ].map(&:b)
+
+    flags = [Magic::NONE, Magic::MIME, Magic::MIME_TYPE]
+    expected = flags.map {|f| buffers.map {|buffer| @magic.buffer(buffer, flags: f) } }
+
+    @magic.progressive = true
+    assert_equal(expected, flags.map {|f| buffers.map {|buffer| @magic.buffer(buffer, flags: f) } })
+  end
+
+  def test_magic_result
     with_fixtures do
-      @magic.load('png-fake.magic')
+      result = @magic.file('ruby.png', result: true)
+
+      assert_kind_of(Magic::Result, result)
+      assert_equal(@magic.file('ruby.png'), result.to_s)
+      assert_match(%r{^PNG image data}, result.description)
+      assert_equal(Magic::NONE, result.flags)
+      assert_nil(result.mime_type)
+      assert_nil(result.charset)
+      assert_nil(result.extensions)
+    end
+  end
 
+  def test_magic_result_with_MIME_flag
+    with_fixtures do
       File.open('ruby.png') do |file|
-        assert_match(%r{^Ruby Gem image}, @magic.descriptor(file.fileno))
-        assert_false(file.closed?)
+        result = @magic.descriptor(file.fileno, flags: Magic::MIME, result: true)
+
+        assert_equal('image/png; charset=binary', result.to_s)
+        assert_equal('image/png', result.mime_type)
+        assert_equal('binary', result.charset)
+        assert_nil(result.description)
       end
+
+      result = @magic.buffer("Hello, World!\n", flags: Magic::MIME_ENCODING, result: true)
+      assert_equal('us-ascii', result.charset)
+      assert_nil(result.mime_type)
+    end
+  end
+
+  def test_magic_result_with_CONTINUE_flag
+    with_fixtures do
+      @magic.load('png-fake.magic')
+
+      result = @magic.file('ruby.png', flags: Magic::CONTINUE, result: true)
+      assert_match(%r{^Ruby Gem image}, result.description)
+      assert_not_match(%r{\n}, result.description)
+    end
+  end
+
+  def test_magic_result_with_EXTENSION_flag
+    with_fixtures do
+      result = @magic.buffer(File.binread('ruby.jpg'), flags: Magic::EXTENSION, result: true)
+
+      assert_equal(%w[jpeg jpg jpe jfif], result.extensions)
+      assert_true(result.extensions.frozen?)
+      assert_equal([], @magic.buffer('', flags: Magic::EXTENSION, result: true).extensions)
+    end
+  end
+
+  def test_magic_result_memoized
+    with_fixtures do
+      result = @magic.file('ruby.png', flags: Magic::MIME, result: true)
+      result.mime_type
+
+      assert_same(result.mime_type, result.mime_type)
+      assert_operator(count_allocations { 1000.times { result.mime_type } }, :<, 10)
+    end
+  end
+
+  def test_magic_result_new
+    assert_raise TypeError do
+      Magic::Result.new
     end
   end
 
@@ -667,6 +1739,252 @@ def test_magic_load_buffers_with_array_argument
   def test_magic_load_buffers_with_DEBUG_flag
   end
 
+  def test_magic_load_buffers_with_modified_string
+    require 'tmpdir'
+    require 'fileutils'
+
+    with_fixtures do
+      buffer = Dir.mktmpdir do |directory|
+        FileUtils.cp('png-fake.magic', directory)
+        Dir.chdir(directory) do
+          @magic.compile('png-fake.magic')
+          File.binread('png-fake.magic.mgc')
+        end
+      end
+
+      @magic.load_buffers(buffer)
+
+      buffer.replace("\0" * buffer.bytesize)
+      GC.start
+      GC.compact if GC.respond_to?(:compact)
+
+      assert_match(%r{^Ruby Gem image}, @magic.file('ruby.png'))
+    end
+  end
+
+  def test_magic_load_buffers_with_database
+    require 'tmpdir'
+    require 'fileutils'
+
+    with_fixtures do
+      Dir.mktmpdir do |directory|
+        FileUtils.cp('png-fake.magic', directory)
+        Dir.chdir(directory) { @magic.compile('png-fake.magic') }
+
+        path = File.join(File.realpath(directory), 'png-fake.magic.mgc')
+        database = Magic::Database.open(path)
+
+        assert_equal(path, database.path)
+        assert_equal(File.size(path), database.size)
+
+        count = Magic::Database.count
+        assert_equal(database, Magic::Database.open(path))
+        assert_equal(count, Magic::Database.count)
+
+        magic = Magic.new(database)
+        assert_true(magic.loaded?)
+        assert_match(%r{^Ruby Gem image}, magic.file('ruby.png'))
+
+        @magic.load_buffers(database)
+        assert_match(%r{^Ruby Gem image}, @magic.file('ruby.png'))
+
+        # A replaced file is mapped again.
+        FileUtils.cp(path, "#{path}.new")
+        File.utime(0, 0, "#{path}.new")
+        File.rename("#{path}.new", path)
+
+        assert_not_equal(database, Magic::Database.open(path))
+        assert_equal(count + 1, Magic::Database.count)
+      end
+    end
+  end
+
+  def test_magic_database_unmapped_when_released
+    require 'tmpdir'
+    require 'fileutils'
+
+    with_fixtures do
+      Dir.mktmpdir do |directory|
+        FileUtils.cp('png-fake.magic', directory)
+        Dir.chdir(directory) { @magic.compile('png-fake.magic') }
+
+        path = File.join(directory, 'png-fake.magic.mgc')
+
+        GC.start
+        count = Magic::Database.count
+
+        magic = Magic.new(Magic::Database.open(path))
+        assert_match(%r{^Ruby Gem image}, magic.file('ruby.png'))
+
+        GC.start
+        assert_equal(count + 1, Magic::Database.count)
+
+        magic.close
+        magic = nil
+
+        GC.start
+        assert_equal(count, Magic::Database.count)
+      end
+    end
+  end
+
+  def test_magic_database_changed_in_place
+    require 'tmpdir'
+    require 'fileutils'
+
+    with_fixtures do
+      Dir.mktmpdir do |directory|
+        File.write(File.join(directory, 'small.magic'),
+                   "0\tstring\t\\x89PNG\\x0d\\x0a\\x1a\\x0a\tRewritten image\n")
+
+        FileUtils.cp('png-fake.magic', directory)
+        Dir.chdir(directory) do
+          @magic.compile('png-fake.magic')
+          @magic.compile('small.magic')
+        end
+
+        path = File.join(directory, 'png-fake.magic.mgc')
+        small = File.binread(File.join(directory, 'small.magic.mgc'))
+        assert_operator(small.bytesize, :<, File.size(path))
+
+        magic = Magic.new(Magic::Database.open(path))
+        assert_match(%r{^Ruby Gem image}, magic.file('ruby.png'))
+
+        # Written in place, thus the file is truncated under the mapping.
+        File.binwrite(path, small)
+        File.utime(0, 0, path)
+
+        assert_equal('Rewritten image', magic.file('ruby.png'))
+        assert_equal('Rewritten image', magic.buffer(File.binread('ruby.png')))
+
+        File.binwrite(path, 'not a database')
+
+        assert_raise Errno::EINVAL do
+          magic.file('ruby.png')
+        end
+      end
+    end
+  end
+
+  def test_magic_database_open_with_invalid_file
+    with_fixtures do
+      assert_raise Errno::EINVAL do
+        Magic::Database.open('ruby.png')
+      end
+
+      assert_raise Errno::ENOENT do
+        Magic::Database.open('does/not/exist')
+      end
+    end
+  end
+
+  def test_magic_database_embedded
+    database = Magic::Database.embedded
+    omit_unless(database, 'Built without an embedded database')
+
+    assert_nil(database.path)
+    assert_equal(database, Magic::Database.embedded)
+    assert_equal(database, Magic::Database.open)
+
+    count = Magic::Database.count
+    magic = Magic.new
+
+    assert_true(magic.loaded?)
+    assert_equal(count, Magic::Database.count)
+    with_fixtures do
+      assert_equal(Magic.new(database).file('ruby.png'), magic.file('ruby.png'))
+    end
+  end
+
+  def test_magic_reload
+    with_fixtures do
+      magic = Magic.new('png-fake.magic')
+
+      assert_match(%r{^Ruby Gem image}, magic.file('ruby.png'))
+      assert_equal('image/x-ruby-gem', magic.file('ruby.png', flags: Magic::MIME_TYPE))
+
+      magic.reload('png.magic')
+
+      assert_equal(['png.magic'], magic.paths)
+      assert_match(%r{^PNG image data}, magic.file('ruby.png'))
+      assert_equal('image/png', magic.file('ruby.png', flags: Magic::MIME_TYPE))
+
+      magic.reload
+      assert_match(%r{^PNG image data}, magic.file('ruby.png'))
+    end
+  end
+
+  def test_magic_reload_with_invalid_file
+    with_fixtures do
+      magic = Magic.new('png-fake.magic')
+
+      capture_stderr do
+        assert_raise Magic::MagicError do
+          magic.reload('invalid.magic')
+        end
+      end
+
+      assert_equal(['png-fake.magic'], magic.paths)
+      assert_match(%r{^Ruby Gem image}, magic.file('ruby.png'))
+    end
+  end
+
+  def test_magic_reload_with_concurrent_calls
+    with_fixtures do
+      magic = Magic.new('png-fake.magic')
+      done = false
+
+      threads = Array.new(4) do
+        Thread.new do
+          results = []
+          results << magic.file('ruby.png') until done
+          results
+        end
+      end
+
+      10.times {|i| magic.reload(i.even? ? 'png.magic' : 'png-fake.magic') }
+      done = true
+
+      threads.flat_map(&:value).each do |result|
+        assert_match(%r{^(PNG image data|Ruby Gem image), 995 x 996}, result)
+      end
+    end
+  end
+
+  def test_magic_reload_with_changes_while_loading
+    require 'io/nonblock'
+
+    with_fixtures do
+      magic = Magic.new('png-fake.magic')
+
+      reader, writer = IO.pipe
+      reader.nonblock = false
+
+      # Hold the lock, so that the flags and the parameter are changed
+      # after the database has been loaded, but before it is swapped in.
+      holder = Thread.new { magic.descriptor(reader.fileno) }
+      Thread.pass until holder.status == 'sleep'
+
+      changers = [
+        -> { magic.flags = Magic::MIME_TYPE },
+        -> { magic.set_parameter(Magic::PARAM_BYTES_MAX, 4096) }
+      ].map do |change|
+        Thread.new(&change).tap {|thread| Thread.pass until thread.status == 'sleep' }
+      end
+
+      reloader = Thread.new { magic.reload('png.magic') }
+      Thread.pass until reloader.status == 'sleep'
+
+      writer.close
+      [holder, *changers, reloader].each(&:join)
+      reader.close
+
+      assert_equal(Magic::MIME_TYPE, magic.flags)
+      assert_equal(4096, magic.get_parameter(Magic::PARAM_BYTES_MAX))
+      assert_equal('image/png', magic.file('ruby.png'))
+    end
+  end
+
   def test_magic_loaded?
   end
 
@@ -679,6 +1997,33 @@ def test_magic_compile
   def test_magic_compile_with_DEBUG_flag
   end
 
+  def test_magic_compile_with_directory
+    require 'tmpdir'
+
+    with_fixtures do
+      Dir.mktmpdir do |directory|
+        source = File.expand_path('shell.magic')
+        current = Dir.pwd
+
+        assert_nil(@magic.compile(source, directory: directory))
+        assert_true(File.file?(File.join(directory, 'shell.magic.mgc')))
+        assert_false(File.exist?('shell.magic.mgc'))
+
+        File.write(File.join(directory, 'script.magic'), File.read(source))
+        assert_nil(@magic.compile('script.magic', directory: directory))
+        assert_true(File.file?(File.join(directory, 'script.magic.mgc')))
+
+        assert_equal(current, Dir.pwd)
+
+        error = assert_raise(Errno::ENOENT) do
+          @magic.compile(source, directory: File.join(directory, 'missing'))
+        end
+
+        assert_match(/missing/, error.message)
+      end
+    end
+  end
+
   def test_magic_check
   end
 
@@ -865,13 +2210,206 @@ def test_magic_singleton_compile
   def test_magic_singleton_check
   end
 
+  def test_magic_singleton_compile_subset
+    require 'tmpdir'
+
+    with_fixtures do
+      Dir.mktmpdir do |directory|
+        source = File.join(directory, 'named.magic')
+        File.write(source, <<~'EOS')
+          0	name	png-size
+          >16	belong	x	\b, %d x
+          >20	belong	x	%d
+          !:mime	image/png
+
+          0	string	\x89PNG\x0d\x0a\x1a\x0a	PNG image data
+          >0	use	png-size
+        EOS
+
+        output = File.join(directory, 'subset')
+        path = Magic.compile_subset([source, 'shell.magic'], mime_types: ['image/*'], output: output)
+        assert_equal("#{output}.mgc", path)
+
+        magic = Magic.new(path)
+        assert_equal('PNG image data, 995 x 996', magic.file('ruby.png'))
+        assert_equal('image/png', magic.file('ruby.png', flags: Magic::MIME_TYPE))
+
+        script = File.join(directory, 'script')
+        File.write(script, "#!/bin/bash\necho 'Hello, World!'\n")
+        assert_equal('text/plain', magic.file(script, flags: Magic::MIME_TYPE))
+
+        # The database is replaced by a new file rather than rewritten.
+        inode = File.stat(path).ino
+
+        path = Magic.compile_subset('shell.magic', mime_types: ['text/x-shellscript'], output: output)
+        assert_equal('text/x-shellscript', Magic.new(path).file(script, flags: Magic::MIME_TYPE))
+
+        assert_not_equal(inode, File.stat(path).ino)
+        assert_equal(%w[named.magic script subset.mgc], Dir.children(directory).sort)
+
+        # Calls made at the same time are serialized.
+        outputs = Array.new(4) {|i| File.join(directory, "subset-#{i}") }.map do |path|
+          Thread.new { Magic.compile_subset('shell.magic', mime_types: ['text/*'], output: path) }
+        end.map(&:value)
+        assert_true(outputs.all? {|path| File.file?(path) })
+
+        assert_raise ArgumentError do
+          Magic.compile_subset('shell.magic', mime_types: [], output: output)
+        end
+      end
+    end
+  end
+
   def test_magic_singleton_file
+    with_fixtures do
+      magic = Magic.default
+
+      assert_equal('image/png; charset=binary', Magic.file('ruby.png'))
+      assert_equal('image/png', Magic.file('ruby.png', Magic::MIME_TYPE))
+
+      assert_same(magic, Magic.default)
+      assert_equal(Magic::NONE, magic.flags)
+    end
   end
 
   def test_magic_singleton_buffer
+    with_fixtures do
+      buffer = File.binread('ruby.png')
+
+      assert_equal('image/png; charset=binary', Magic.buffer(buffer))
+      assert_match(%r{^PNG image data}, Magic.buffer(buffer, Magic::NONE))
+    end
   end
 
   def test_magic_singleton_descriptor
+    with_fixtures do
+      File.open('ruby.png') do |file|
+        assert_equal('image/png', Magic.descriptor(file, Magic::MIME_TYPE))
+      end
+    end
+  end
+
+  def test_magic_core_extensions
+    with_fixtures do
+      buffer = File.binread('ruby.png')
+
+      assert_match(%r{^PNG image data}, File.magic('ruby.png'))
+      assert_equal('image/png', File.type('ruby.png'))
+      File.open('ruby.png') {|file| assert_equal('image/png; charset=binary', file.mime) }
+
+      assert_match(%r{^PNG image data}, buffer.magic)
+      assert_equal('image/png', buffer.type)
+      assert_equal('image/png; charset=binary', buffer.mime)
+
+      assert_operator(count_allocations { 100.times { buffer.type } }, :<, 500)
+    end
+  end
+
+  def test_magic_core_extensions_with_default_changed
+    with_fixtures do
+      buffer = File.binread('ruby.png')
+
+      Magic.default.do_not_stop_on_error = true
+      Magic.default.flags = Magic::MIME_TYPE
+      Magic.default.close
+
+      assert_equal('image/png', buffer.type)
+      assert_equal('image/png', Magic.file('ruby.png', Magic::MIME_TYPE))
+      assert_not_include(Magic.singleton_class.public_instance_methods, :shared)
+    end
+  end
+
+  def test_magic_singleton_default
+    magic = Magic.default
+
+    assert_kind_of(Magic, magic)
+    assert_same(magic, Magic.default)
+
+    magic.close
+
+    assert_not_same(magic, Magic.default)
+    assert_true(Magic.default.open?)
+  end
+
+  def test_magic_singleton_preload
+    omit_unless(Process.respond_to?(:fork), "Platform does not support fork")
+
+    magic = Magic.preload!(Magic::MIME_TYPE)
+
+    assert_same(magic, Magic.default)
+    assert_true(magic.loaded?)
+
+    with_fixtures do
+      reader, writer = IO.pipe
+
+      pid = fork do
+        reader.close
+        writer.write([Magic.default.equal?(magic), Magic.file('ruby.png', Magic::MIME_TYPE)].join(' '))
+        exit!(0)
+      end
+
+      writer.close
+      Process.wait(pid)
+
+      assert_equal('true image/png', reader.read)
+      reader.close
+    end
+
+    assert_raise TypeError do
+      Magic.preload!(database: 'magic.mgc')
+    end
+  end
+
+  def test_magic_singleton_default_with_ractors
+    omit_unless(defined?(Ractor), "Platform does not support Ractors")
+
+    results, ractors = in_child_process do
+      results = nil
+      capture_stderr do
+        results = 2.times.map do
+          Ractor.new do
+            magic = Magic.default
+            [magic.object_id, magic.equal?(Magic.default)]
+          end
+        end.map(&:take)
+      end
+
+      [results, results.map(&:first) << Magic.default.object_id]
+    end
+
+    assert_equal([true, true], results.map(&:last))
+    assert_equal(3, ractors.uniq.size)
+  end
+
+  def test_magic_singleton_parallel_map
+    paths = Dir[File.join('test', 'fixtures', '*')].sort
+    expected = Magic.open(Magic::MIME_TYPE) {|magic| paths.map {|path| magic.file(path) } }
+
+    [1, 2, paths.size + 1].each do |ractors|
+      results = in_child_process do
+        results = nil
+        capture_stderr do
+          results = Magic.parallel_map(paths, flags: Magic::MIME_TYPE, ractors: ractors)
+        end
+        results
+      end
+
+      assert_equal(expected, results)
+    end
+  end
+
+  def test_magic_singleton_parallel_map_with_error
+    omit_unless(defined?(Ractor), "Platform does not support Ractors")
+
+    error = assert_raise Magic::MagicError do
+      in_child_process do
+        capture_stderr do
+          Magic.parallel_map(%w[does/not/exist also/does/not/exist], ractors: 2)
+        end
+      end
+    end
+
+    assert_match(%r{^cannot stat `does/not/exist'}, error.message)
   end
 
   def test_magic_magic_error
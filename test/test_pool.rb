@@ -0,0 +1,181 @@
+# frozen_string_literal: true
+
+require 'test/unit'
+require 'magic'
+
+require_relative 'helpers/magic_test_helper'
+
+class MagicPoolTest < Test::Unit::TestCase
+  include MagicTestHelpers
+
+  def setup
+    @pool = Magic::Pool.new(2, Magic::MIME_TYPE)
+  end
+
+  def teardown
+    @pool.close
+  end
+
+  def test_pool_instance_methods
+    [
+      :close,
+      :closed?,
+      :size,
+      :flags,
+      :paths,
+      :file,
+      :buffer,
+      :descriptor,
+      :fd
+    ].each do |i|
+      assert_respond_to(@pool, i)
+    end
+  end
+
+  def test_pool_new_instance
+    assert_equal(2, @pool.size)
+    assert_equal(Magic::MIME_TYPE, @pool.flags)
+    assert_not_equal(0, @pool.paths.size)
+  end
+
+  def test_pool_new_default_size
+    pool = Magic::Pool.new
+    assert(pool.size > 0)
+  ensure
+    pool&.close
+  end
+
+  def test_pool_new_invalid_size
+    error = assert_raise ArgumentError do
+      Magic::Pool.new(0)
+    end
+
+    assert_equal('pool size must be greater than zero', error.message)
+  end
+
+  def test_pool_new_with_custom_Magic_file_path
+    with_fixtures do
+      pool = Magic::Pool.new(1, Magic::NONE, 'png-fake.magic')
+
+      assert_equal(['png-fake.magic'], pool.paths)
+      assert_match(%r{^Ruby Gem image}, pool.file('ruby.png'))
+    ensure
+      pool&.close
+    end
+  end
+
+  def test_pool_file
+    require 'pathname'
+
+    with_fixtures do
+      assert_equal('image/png', @pool.file('ruby.png'))
+      assert_equal('image/jpeg', @pool.file(Pathname.new('ruby.jpg')))
+    end
+  end
+
+  def test_pool_file_with_ERROR_flag
+    error = assert_raise Magic::MagicError do
+      @pool.file('/nonexistent')
+    end
+
+    assert_match(%r{No such file or directory}, error.message)
+  end
+
+  def test_pool_buffer
+    with_fixtures do
+      assert_equal('image/png', @pool.buffer(File.binread('ruby.png')))
+    end
+  end
+
+  def test_pool_descriptor
+    with_fixtures do
+      File.open('ruby.jpg') do |file|
+        assert_equal('image/jpeg', @pool.descriptor(file))
+        assert_equal('image/jpeg', @pool.fd(file.fileno))
+        assert_false(file.closed?)
+      end
+    end
+  end
+
+  def test_pool_descriptor_with_invalid_descriptor
+    error = assert_raise IOError do
+      @pool.descriptor(-1)
+    end
+
+    assert_equal('Bad file descriptor', error.message)
+  end
+
+  def test_pool_file_from_many_threads
+    expected = Magic.open(Magic::MIME_TYPE) { |m| m.file('test/fixtures/ruby.png') }
+
+    results = Array.new(8) do
+      Thread.new do
+        Array.new(50) { @pool.file('test/fixtures/ruby.png') }
+      end
+    end.flat_map(&:value)
+
+    assert_equal([expected], results.uniq)
+  end
+
+  def test_pool_after_fork
+    omit_unless(Process.respond_to?(:fork), "Platform does not support fork")
+
+    reader, writer = IO.pipe
+
+    # Both handles are checked out by threads that do not exist in the child.
+    threads = Array.new(2) { Thread.new { @pool.descriptor(reader) } }
+    Thread.pass until threads.all? {|thread| thread.status == 'sleep' }
+
+    pid = fork do
+      require 'timeout'
+      result = Timeout.timeout(5) { @pool.buffer("Hello, World!\n") }
+      exit!(result == 'text/plain' ? 0 : 1)
+    end
+    Process.wait(pid)
+
+    writer.close
+    threads.each(&:join)
+    reader.close
+
+    assert_true($?.success?)
+  end
+
+  def test_pool_close
+    @pool.close
+
+    assert_true(@pool.closed?)
+    assert_nil(@pool.close)
+
+    error = assert_raise Magic::LibraryError do
+      @pool.file('test/fixtures/ruby.png')
+    end
+
+    assert_equal('Magic library is not open', error.message)
+    assert_raise(Magic::LibraryError) { @pool.size }
+  end
+
+  def test_pool_close_while_converting_path
+    pool = @pool
+    path = Object.new
+    path.define_singleton_method(:to_path) do
+      Thread.new { pool.close }.join
+      'test/fixtures/ruby.png'
+    end
+
+    error = assert_raise Magic::LibraryError do
+      @pool.file(path)
+    end
+
+    assert_equal('Magic library is not open', error.message)
+    assert_true(@pool.closed?)
+  end
+
+  def test_pool_initialize_twice
+    error = assert_raise TypeError do
+      @pool.send(:initialize, 1)
+    end
+
+    assert_equal('pool is already initialized', error.message)
+    assert_equal('image/png', @pool.file('test/fixtures/ruby.png'))
+  end
+end